@@ -0,0 +1,444 @@
+/*
+ * NT Flash Tool - Package loading microbenchmarks (make bench)
+ *
+ * Copyright (c) 2024
+ *
+ * Generates synthetic disting NT packages with miniz's writer and times each
+ * step that runs before any USB traffic: loadFile, extractFileFromZip,
+ * parseManifest and saveToTempFile, and tinfl against inflateBuffer() on the
+ * firmware entry. Linked with the allocator hook, so heap allocations are
+ * counted per step.
+ *
+ * --check instead runs inflateBuffer() against tinfl on streams deflated
+ * every way miniz can, and on corrupted copies of them, and fails on any
+ * disagreement.
+ */
+
+#include <algorithm>
+
+#include "nt_flash.h"
+
+#include "miniz.h"
+#include "miniz_zip.h"
+
+//------------------------------------------------------------------------------
+// Synthetic Packages
+//------------------------------------------------------------------------------
+
+static const char* const MANIFEST_NAME = "MANIFEST.json";
+static const char* const FLASHLOADER_NAME = "bootable_images/unsigned_MIMXRT1060_flashloader.bin";
+static const char* const FIRMWARE_NAME = "bootable_images/disting_NT.bin";
+
+struct PackageSpec {
+    uint32_t firmwareSize;
+    uint32_t flashloaderSize;
+    int level;                // 0 = stored, 1..10 deflate
+    bool manifestLast;        // Entry order: manifest after the images
+
+    PackageSpec() : firmwareSize(0x300000), flashloaderSize(BENCH_FLASHLOADER_SIZE), level(6), manifestLast(false) {}
+};
+
+static bool addEntry(mz_zip_archive& zip, const char* name, const void* data, size_t size, int level) {
+    if (!mz_zip_writer_add_mem_ex(&zip, name, data, size, nullptr, 0, (mz_uint)level, 0, 0)) {
+        logError("Failed to add %s to package", name);
+        return false;
+    }
+    return true;
+}
+
+static bool writeSyntheticPackage(const std::string& path, const PackageSpec& spec) {
+    std::vector<uint8_t> flashloader;
+    std::vector<uint8_t> firmware;
+    syntheticImage(flashloader, spec.flashloaderSize, 0x10AD);
+    syntheticImage(firmware, spec.firmwareSize, 0xF1A5);
+    std::string manifest = std::string("{\"processor\":\"MIMXRT1060\",\"app_firmware\":\"") + FIRMWARE_NAME + "\"}";
+
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+    if (!mz_zip_writer_init_heap(&zip, 0, spec.firmwareSize + spec.flashloaderSize)) {
+        logError("Failed to create ZIP archive");
+        return false;
+    }
+    bool ok = true;
+    if (!spec.manifestLast) {
+        ok = addEntry(zip, MANIFEST_NAME, manifest.data(), manifest.size(), spec.level);
+    }
+    ok = ok && addEntry(zip, FLASHLOADER_NAME, flashloader.data(), flashloader.size(), spec.level);
+    ok = ok && addEntry(zip, FIRMWARE_NAME, firmware.data(), firmware.size(), spec.level);
+    if (spec.manifestLast) {
+        ok = ok && addEntry(zip, MANIFEST_NAME, manifest.data(), manifest.size(), spec.level);
+    }
+
+    void* archive = nullptr;
+    size_t archiveSize = 0;
+    ok = ok && mz_zip_writer_finalize_heap_archive(&zip, &archive, &archiveSize);
+    if (ok) {
+        FILE* f = fopen(path.c_str(), "wb");
+        ok = f && fwrite(archive, 1, archiveSize, f) == archiveSize;
+        if (f) ok = fclose(f) == 0 && ok;
+        if (!ok) logError("Failed to write package: %s", path.c_str());
+    }
+    mz_free(archive);
+    mz_zip_writer_end(&zip);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Microbenchmarks
+//------------------------------------------------------------------------------
+
+// One step, repeated: the median time is reported, and the allocations of
+// the first repetition, which like a real load starts with empty buffers
+struct StepResult {
+    double seconds;
+    uint64_t bytes;           // Bytes the step processes (for MB/s)
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+};
+
+template <typename Step>
+static StepResult timeStep(uint32_t iterations, uint64_t bytes, Step step) {
+    std::vector<double> times;
+    StepResult result = { 0, bytes, 0, 0 };
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint64_t allocations = g_threadAllocations;
+        uint64_t allocatedBytes = g_threadAllocatedBytes;
+        double start = nowSeconds();
+        step();
+        times.push_back(nowSeconds() - start);
+        if (i == 0) {
+            result.allocations = g_threadAllocations - allocations;
+            result.allocatedBytes = g_threadAllocatedBytes - allocatedBytes;
+        }
+    }
+    std::sort(times.begin(), times.end());
+    result.seconds = times[times.size() / 2];
+    return result;
+}
+
+static void printStep(const std::string& package, const char* name, const StepResult& result) {
+    double mb = result.bytes / (1024.0 * 1024.0);
+    printf("%-28s %-22s %9.3f %9.1f %8llu %9.2f\n", package.c_str(), name, result.seconds * 1000,
+           result.seconds > 0 ? mb / result.seconds : 0, (unsigned long long)result.allocations,
+           result.allocatedBytes / (1024.0 * 1024.0));
+}
+
+// Compressed bytes of a deflated entry, for timing the inflaters alone
+static bool deflatedEntry(const std::vector<uint8_t>& zipData, const char* name, std::vector<uint8_t>& compressed) {
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+    if (!mz_zip_reader_init_mem(&zip, zipData.data(), zipData.size(), 0)) {
+        return false;
+    }
+    mz_zip_archive_file_stat stat;
+    int index = mz_zip_reader_locate_file(&zip, name, nullptr, 0);
+    bool ok = index >= 0 && mz_zip_reader_file_stat(&zip, (mz_uint)index, &stat) && stat.m_method == MZ_DEFLATED;
+    mz_zip_reader_end(&zip);
+    if (!ok) {
+        return false;
+    }
+    const uint8_t* header = zipData.data() + stat.m_local_header_ofs;
+    size_t offset = (size_t)stat.m_local_header_ofs + 30 + (header[26] | header[27] << 8) + (header[28] | header[29] << 8);
+    compressed.assign(zipData.begin() + offset, zipData.begin() + offset + (size_t)stat.m_comp_size);
+    return true;
+}
+
+static bool benchPackage(const PackageSpec& spec, uint32_t iterations) {
+    std::string path = getTempDir() + "nt_flash_bench.zip";
+    if (!writeSyntheticPackage(path, spec)) {
+        return false;
+    }
+
+    char label[64];
+    snprintf(label, sizeof(label), "%uK L%d %s", spec.firmwareSize / 1024, spec.level,
+             spec.manifestLast ? "manifest-last" : "manifest-first");
+
+    std::vector<uint8_t> zipData;
+    StepResult load = timeStep(iterations, 0, [&] { loadFile(path.c_str(), zipData); });
+    load.bytes = zipData.size();
+    printStep(label, "loadFile", load);
+
+    std::vector<uint8_t> manifest;
+    StepResult extractManifest = timeStep(iterations, 0, [&] { extractFileFromZip(zipData, MANIFEST_NAME, manifest); });
+    extractManifest.bytes = manifest.size();
+    printStep(label, "extract MANIFEST.json", extractManifest);
+
+    std::string firmwarePath;
+    FlashScript script;
+    printStep(label, "parseManifest",
+              timeStep(iterations, manifest.size(), [&] { parseManifest(manifest, firmwarePath, script); }));
+
+    std::vector<uint8_t> flashloader;
+    printStep(label, "extract flashloader", timeStep(iterations, spec.flashloaderSize, [&] {
+        extractFileFromZip(zipData, FLASHLOADER_NAME, flashloader);
+    }));
+
+    std::vector<uint8_t> firmware;
+    printStep(label, "extract firmware", timeStep(iterations, spec.firmwareSize, [&] {
+        extractFileFromZip(zipData, firmwarePath.c_str(), firmware);
+    }));
+
+    // The same firmware entry through tinfl and through the whole-buffer inflater
+    std::vector<uint8_t> compressed;
+    if (deflatedEntry(zipData, firmwarePath.c_str(), compressed)) {
+        std::vector<uint8_t> image(spec.firmwareSize);
+        printStep(label, "inflate (tinfl)", timeStep(iterations, spec.firmwareSize, [&] {
+            tinfl_decompress_mem_to_mem(image.data(), image.size(), compressed.data(), compressed.size(), 0);
+        }));
+        printStep(label, "inflate (fast)", timeStep(iterations, spec.firmwareSize, [&] {
+            inflateBuffer(compressed.data(), compressed.size(), image.data(), image.size());
+        }));
+    }
+
+    printStep(label, "saveToTempFile", timeStep(iterations, flashloader.size(), [&] {
+        std::string temp = saveToTempFile(flashloader, ".bin");
+        remove(temp.c_str());
+    }));
+
+    remove(path.c_str());
+    return firmware.size() == spec.firmwareSize;
+}
+
+//------------------------------------------------------------------------------
+// Differential Check
+//------------------------------------------------------------------------------
+
+// xorshift32, so a failing case is reproduced by its seed
+struct CheckRandom {
+    uint32_t x;
+
+    explicit CheckRandom(uint32_t seed) : x(seed ? seed : 1) {}
+
+    uint32_t next() {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+    }
+
+    uint32_t below(uint32_t n) { return n ? next() % n : 0; }
+};
+
+// Inputs that reach every decoder path: literals only, long and overlapping
+// matches, short periods (copies that overlap their source), text-like data
+static void checkInput(std::vector<uint8_t>& data, int kind, uint32_t size, CheckRandom& random) {
+    data.resize(size);
+    switch (kind) {
+        case 0:
+            syntheticImage(data, size, random.next());
+            break;
+        case 1:
+            std::fill(data.begin(), data.end(), (uint8_t)random.next());
+            break;
+        case 2: {
+            uint32_t period = 1 + random.below(24);
+            for (uint32_t i = 0; i < size; i++) {
+                data[i] = i < period ? (uint8_t)random.next() : data[i - period];
+            }
+            break;
+        }
+        case 3: {
+            static const char* const WORDS[] = { "flash ", "sector ", "erase ", "write ", "0x6000", "\n", "disting ",
+                                                 "NT ", "bootloader ", "{\"", "\":", "," };
+            for (uint32_t i = 0; i < size;) {
+                const char* word = WORDS[random.below(sizeof(WORDS) / sizeof(WORDS[0]))];
+                for (; *word && i < size; word++) data[i++] = (uint8_t)*word;
+            }
+            break;
+        }
+        default:  // Random runs broken by repeats from far back
+            for (uint32_t i = 0; i < size; i++) {
+                bool repeat = i > 40000 && random.below(4) == 0;
+                data[i] = repeat ? data[i - 1 - random.below(32768)] : (uint8_t)random.next();
+            }
+            break;
+    }
+}
+
+// Both decoders on one stream. inflateBuffer() may reject what tinfl accepts
+// when the stream is corrupt (extraction then falls back to miniz), but must
+// never accept anything tinfl does not decode to the same bytes.
+static bool checkStream(const std::vector<uint8_t>& compressed, size_t size, const std::vector<uint8_t>* original,
+                        uint32_t& fallbacks) {
+    std::vector<uint8_t> fast(size + 1);
+    std::vector<uint8_t> reference(size + 1);
+    bool fastOk = inflateBuffer(compressed.data(), compressed.size(), fast.data(), size);
+    size_t referenceSize = tinfl_decompress_mem_to_mem(reference.data(), size, compressed.data(),
+                                                       compressed.size(), 0);
+    bool referenceOk = referenceSize == size;
+
+    if (original) {
+        return fastOk && referenceOk &&
+               (size == 0 || (memcmp(fast.data(), original->data(), size) == 0 &&
+                              memcmp(reference.data(), original->data(), size) == 0));
+    }
+    if (!fastOk) {
+        if (referenceOk) fallbacks++;
+        return true;
+    }
+    return referenceOk && memcmp(fast.data(), reference.data(), size) == 0;
+}
+
+static bool runCheck(uint32_t seed, uint32_t corruptions) {
+    static const uint32_t SIZES[] = { 0, 1, 2, 3, 7, 64, 258, 259, 1000, 4095, 32768, 32769, 65537, 300000, 1048576 };
+    static const int KINDS = 5;
+    static const mz_uint EXTRA_FLAGS[] = { 0, TDEFL_FORCE_ALL_STATIC_BLOCKS, TDEFL_FORCE_ALL_RAW_BLOCKS,
+                                           TDEFL_GREEDY_PARSING_FLAG, TDEFL_FILTER_MATCHES, TDEFL_RLE_MATCHES };
+    CheckRandom random(seed);
+    uint32_t streams = 0;
+    uint32_t corrupted = 0;
+    uint32_t fallbacks = 0;
+    uint32_t failures = 0;
+
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++) {
+        for (int kind = 0; kind < KINDS; kind++) {
+            std::vector<uint8_t> data;
+            checkInput(data, kind, SIZES[s], random);
+            for (int level = 0; level <= 10; level++) {
+                for (size_t f = 0; f < sizeof(EXTRA_FLAGS) / sizeof(EXTRA_FLAGS[0]); f++) {
+                    if (f != 0 && level != 6) {
+                        continue;   // Block and parsing variants at the default level only
+                    }
+                    mz_uint flags = tdefl_create_comp_flags_from_zip_params(level, -MZ_DEFAULT_WINDOW_BITS,
+                                                                            MZ_DEFAULT_STRATEGY) | EXTRA_FLAGS[f];
+                    size_t compressedSize = 0;
+                    void* deflated = tdefl_compress_mem_to_heap(data.data(), data.size(), &compressedSize, (int)flags);
+                    if (!deflated) {
+                        logError("Check: deflate failed (size %u, input %d, level %d)", SIZES[s], kind, level);
+                        return false;
+                    }
+                    std::vector<uint8_t> compressed((uint8_t*)deflated, (uint8_t*)deflated + compressedSize);
+                    mz_free(deflated);
+
+                    streams++;
+                    if (!checkStream(compressed, data.size(), &data, fallbacks)) {
+                        logError("Check: mismatch on a valid stream (size %u, input %d, level %d, flags 0x%X)",
+                                 SIZES[s], kind, level, flags);
+                        failures++;
+                    }
+
+                    // Flipped bits, overwritten bytes and truncation, as a damaged download would have
+                    for (uint32_t c = 0; c < corruptions && !compressed.empty() && data.size() <= 65537; c++) {
+                        std::vector<uint8_t> damaged = compressed;
+                        uint32_t damage = random.below(3);
+                        if (damage == 0) {
+                            damaged[random.below((uint32_t)damaged.size())] ^= (uint8_t)(1 << random.below(8));
+                        } else if (damage == 1) {
+                            damaged[random.below((uint32_t)damaged.size())] = (uint8_t)random.next();
+                        } else {
+                            damaged.resize(random.below((uint32_t)damaged.size()));
+                        }
+                        corrupted++;
+                        if (!checkStream(damaged, data.size(), nullptr, fallbacks)) {
+                            logError("Check: inflateBuffer accepted a corrupt stream tinfl decodes differently "
+                                     "(size %u, input %d, level %d, corruption %u)", SIZES[s], kind, level, c);
+                            failures++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("Checked %u streams and %u corrupted copies against tinfl (seed %u): %u mismatch(es), "
+           "%u corrupt stream(s) left to miniz\n", streams, corrupted, seed, failures, fallbacks);
+    return failures == 0;
+}
+
+static std::vector<uint32_t> parseList(const char* text) {
+    std::vector<uint32_t> values;
+    for (;;) {
+        char* end;
+        uint32_t value = (uint32_t)strtoul(text, &end, 0);
+        if (end == text) break;
+        values.push_back(value);
+        if (*end != ',') break;
+        text = end + 1;
+    }
+    return values;
+}
+
+static void printUsage() {
+    printf("Usage: nt-flash-bench [options]\n");
+    printf("  --sizes <KiB,...>      Firmware sizes (default: 1024,3072,8000)\n");
+    printf("  --levels <n,...>       Compression levels, 0 = stored (default: 0,1,6,9)\n");
+    printf("  --order <order>        manifest-first, manifest-last or both (default: both)\n");
+    printf("  --iterations <n>       Repetitions per step, median reported (default: 5)\n");
+    printf("  --generate <file>      Write one package with the first size, level and order, then exit\n");
+    printf("  --check                Check inflateBuffer() against tinfl instead of timing, then exit\n");
+    printf("  --seed <n>             Seed for --check inputs and corruptions (default: 1)\n");
+    printf("  --corruptions <n>      Corrupted copies per stream for --check (default: 20)\n");
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<uint32_t> sizes = parseList("1024,3072,8000");
+    std::vector<uint32_t> levels = parseList("0,1,6,9");
+    std::vector<bool> orders;
+    orders.push_back(false);
+    orders.push_back(true);
+    uint32_t iterations = 5;
+    std::string generatePath;
+    bool check = false;
+    uint32_t seed = 1;
+    uint32_t corruptions = 20;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--sizes" && i + 1 < argc) {
+            sizes = parseList(argv[++i]);
+        } else if (arg == "--levels" && i + 1 < argc) {
+            levels = parseList(argv[++i]);
+        } else if (arg == "--order" && i + 1 < argc) {
+            std::string order = argv[++i];
+            orders.clear();
+            if (order != "manifest-last") orders.push_back(false);
+            if (order != "manifest-first") orders.push_back(true);
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            iterations = std::max((uint32_t)strtoul(argv[++i], nullptr, 0), 1u);
+        } else if (arg == "--generate" && i + 1 < argc) {
+            generatePath = argv[++i];
+        } else if (arg == "--check") {
+            check = true;
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--corruptions" && i + 1 < argc) {
+            corruptions = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        } else {
+            printUsage();
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+    if (sizes.empty() || levels.empty()) {
+        printUsage();
+        return 1;
+    }
+
+    if (check) {
+        return runCheck(seed, corruptions) ? 0 : 1;
+    }
+    if (!generatePath.empty()) {
+        PackageSpec spec;
+        spec.firmwareSize = sizes[0] * 1024;
+        spec.level = (int)levels[0];
+        spec.manifestLast = orders.front();
+        return writeSyntheticPackage(generatePath, spec) ? 0 : 1;
+    }
+
+    printf("%-28s %-22s %9s %9s %8s %9s\n", "Package", "Step", "ms", "MB/s", "Allocs", "Alloc MB");
+    bool ok = true;
+    for (size_t s = 0; s < sizes.size(); s++) {
+        for (size_t l = 0; l < levels.size(); l++) {
+            for (size_t o = 0; o < orders.size(); o++) {
+                PackageSpec spec;
+                spec.firmwareSize = sizes[s] * 1024;
+                spec.level = (int)levels[l];
+                spec.manifestLast = orders[o];
+                ok = benchPackage(spec, iterations) && ok;
+            }
+        }
+    }
+    if (!g_allocHookInstalled) {
+        printf("\nAllocator hook not linked: allocation counts are zero\n");
+    }
+    return ok ? 0 : 1;
+}
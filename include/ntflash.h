@@ -0,0 +1,119 @@
+/*
+ * libntflash - disting NT firmware flashing library
+ *
+ * Copyright (c) 2024
+ *
+ * C interface to the engine behind nt-flash. A package is loaded once and
+ * can be flashed to any number of devices; each flash runs on its own thread
+ * and reports progress through a callback and/or a pollable event queue.
+ *
+ *   ntf_package* pkg = ntf_package_open("distingNT_1.12.0.zip");
+ *   ntf_flash_options opts = { 0 };
+ *   opts.port = "1-2.3";
+ *   ntf_job* job = ntf_flash_start(pkg, &opts);
+ *   ntf_event ev;
+ *   while (ntf_job_wait(job, 100) == NTF_RUNNING)
+ *       while (ntf_job_poll(job, &ev)) ...;
+ *   ntf_job_free(job);
+ *   ntf_package_close(pkg);
+ */
+
+#ifndef NTFLASH_H
+#define NTFLASH_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ntf_package ntf_package;
+typedef struct ntf_job ntf_job;
+
+// Job states returned by ntf_job_wait() / ntf_job_state()
+enum {
+    NTF_RUNNING = 0,
+    NTF_SUCCEEDED = 1,
+    NTF_FAILED = 2
+};
+
+typedef enum {
+    NTF_EVENT_STATUS,     // A new stage started (same stages as --machine STATUS)
+    NTF_EVENT_PROGRESS,   // Progress within a stage
+    NTF_EVENT_ERROR,      // An error message; the job will fail
+    NTF_EVENT_DONE,       // The job finished; percent is 100 on success
+    NTF_EVENT_WARNING     // A finding about the run (stage names it, e.g. LINK_BOTTLENECK); the stage is unchanged
+} ntf_event_type;
+
+typedef struct {
+    ntf_event_type type;
+    const char* stage;    // e.g. "WRITE" (empty for errors and DONE)
+    int percent;
+    const char* message;
+    const char* port;     // USB port of the job's device ("" if not addressed)
+} ntf_event;
+
+// Called on the job's thread. Strings are only valid during the call.
+typedef void (*ntf_event_callback)(const ntf_event* event, void* user);
+
+typedef struct {
+    char port[64];        // USB port path, stable across SDP/flashloader switch on Linux
+    char path[256];       // HID path
+    int flashloader;      // 1 if running the flashloader, 0 if in SDP ROM mode
+} ntf_device;
+
+typedef struct {
+    const char* port;            // Device to flash (NULL/"" = first device found;
+                                 // such a job cannot run beside other jobs)
+    int skip_sdp;                // Device is already running the flashloader
+    ntf_event_callback callback; // Optional
+    void* user;                  // Passed to callback
+} ntf_flash_options;
+
+const char* ntf_version(void);
+
+// Process-wide settings (same as the CLI's --dry-run, --verbose, --boot-timeout
+// and --stream)
+void ntf_set_dry_run(int enabled);
+void ntf_set_verbose(int enabled);
+// After reset, wait up to this long for the new firmware to enumerate (0 = don't)
+void ntf_set_boot_timeout(unsigned seconds);
+// Packages opened afterwards inflate the firmware while writing it instead of
+// holding it in memory; the ZIP must stay in place until they are closed
+void ntf_set_streaming(int enabled);
+
+// Message for the last failed call on this thread
+const char* ntf_last_error(void);
+
+// Load a firmware package ZIP. Returns NULL on failure.
+ntf_package* ntf_package_open(const char* zip_path);
+void ntf_package_close(ntf_package* pkg);
+size_t ntf_package_firmware_size(const ntf_package* pkg);
+
+// Fill up to max devices; returns the number connected (may exceed max)
+int ntf_enumerate_devices(ntf_device* devices, int max);
+
+// Start flashing in the background. The package must stay open until the
+// job has been freed. Returns NULL on failure, which includes starting a job
+// without a port while other jobs run, or any job while one without a port runs.
+ntf_job* ntf_flash_start(ntf_package* pkg, const ntf_flash_options* options);
+
+// Take the next queued event. Returns 1 if one was copied to *event; its
+// strings stay valid until the next poll or ntf_job_free().
+int ntf_job_poll(ntf_job* job, ntf_event* event);
+
+// Wait up to timeout_ms (-1 = forever) for the job to finish; returns its state
+int ntf_job_wait(ntf_job* job, int timeout_ms);
+int ntf_job_state(ntf_job* job);
+
+// Ask the job to stop at the next step boundary; it then fails
+void ntf_job_cancel(ntf_job* job);
+
+// Wait for the job to finish and release it
+void ntf_job_free(ntf_job* job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NTFLASH_H
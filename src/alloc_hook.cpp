@@ -0,0 +1,103 @@
+/*
+ * NT Flash Tool - Counting replacement for the global operator new/delete
+ *
+ * Copyright (c) 2024
+ *
+ * Linked into the nt-flash executable only: a library must not replace the
+ * allocator of the program that loads it.
+ */
+
+#include <new>
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// Allocator Hook
+//------------------------------------------------------------------------------
+
+// Each block carries its size in a header, so frees can be counted too.
+// The header keeps the alignment malloc guarantees.
+static const size_t ALLOC_HEADER = 16;
+
+namespace {
+
+struct HookInstaller {
+    HookInstaller() { g_allocHookInstalled = true; }
+};
+
+HookInstaller g_hookInstaller;
+
+void* countedAlloc(size_t size) {
+    unsigned char* block = (unsigned char*)malloc(size + ALLOC_HEADER);
+    if (!block) {
+        return nullptr;
+    }
+    *(size_t*)block = size;
+
+    g_heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    g_heapAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    int64_t live = g_heapLiveBytes.fetch_add((int64_t)size, std::memory_order_relaxed) + (int64_t)size;
+    int64_t peak = g_heapPeakBytes.load(std::memory_order_relaxed);
+    while (live > peak && !g_heapPeakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    g_threadAllocations++;
+    g_threadAllocatedBytes += size;
+    return block + ALLOC_HEADER;
+}
+
+void countedFree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    unsigned char* block = (unsigned char*)ptr - ALLOC_HEADER;
+    g_heapLiveBytes.fetch_sub((int64_t)*(size_t*)block, std::memory_order_relaxed);
+    free(block);
+}
+
+void* allocOrThrow(size_t size) {
+    for (;;) {
+        void* ptr = countedAlloc(size ? size : 1);
+        if (ptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+    return allocOrThrow(size);
+}
+
+void* operator new[](size_t size) {
+    return allocOrThrow(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size ? size : 1);
+}
+
+void operator delete(void* ptr) noexcept {
+    countedFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    countedFree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    countedFree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    countedFree(ptr);
+}
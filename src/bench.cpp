@@ -0,0 +1,504 @@
+/*
+ * NT Flash Tool - Flash benchmarks: repeat (--bench), soak (--soak) and scaling (--scale)
+ *
+ * Copyright (c) 2024
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// Bench
+//------------------------------------------------------------------------------
+
+// Each run flashes one unit through the engine, the same flow station,
+// simulation and agents use. The result file holds every figure the report
+// prints, so a later run can be judged against it:
+// {"device":"simulated","package":"1.12.0","runs":10,"write_bytes":1503232,
+//  "total":{"p50":6.4,"p95":6.41,"max":6.42},"stages":{"FIND":{...},...},
+//  "write_mb_per_s":1.0,"cpu_seconds_per_mb":0.002}
+
+namespace {
+
+struct Spread {
+    double p50;
+    double p95;
+    double max;
+
+    Spread() : p50(0), p95(0), max(0) {}
+};
+
+// Nearest-rank percentiles
+Spread spreadOf(std::vector<double> values) {
+    Spread spread;
+    if (values.empty()) {
+        return spread;
+    }
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    spread.p50 = values[(size_t)ceil(0.50 * n) - 1];
+    spread.p95 = values[(size_t)ceil(0.95 * n) - 1];
+    spread.max = values[n - 1];
+    return spread;
+}
+
+cJSON* spreadJson(const Spread& spread) {
+    cJSON* item = cJSON_CreateObject();
+    cJSON_AddNumberToObject(item, "p50", spread.p50);
+    cJSON_AddNumberToObject(item, "p95", spread.p95);
+    cJSON_AddNumberToObject(item, "max", spread.max);
+    return item;
+}
+
+// A soak table cell: "-" when nothing was measured, which 0.000s would
+// pass off as instant
+std::string secondsCell(const std::vector<double>& values, double seconds) {
+    if (values.empty()) {
+        return "-";
+    }
+    char cell[32];
+    snprintf(cell, sizeof(cell), "%.3fs", seconds);
+    return cell;
+}
+
+double jsonNumber(cJSON* object, const char* name) {
+    cJSON* item = cJSON_GetObjectItem(object, name);
+    return cJSON_IsNumber(item) ? item->valuedouble : 0;
+}
+
+// A real unit resets into its firmware after each run; the operator puts it
+// back in bootloader mode for the next
+bool waitForRearm(const std::string& port, uint32_t run, uint32_t runs) {
+    logInfo("Put the unit on %s back in bootloader mode for run %u of %u...", port.c_str(), run, runs);
+    machineStatus("BENCH_REARM", 0, "Waiting for the unit to re-enter bootloader mode");
+    for (uint32_t waited = 0; waited < BENCH_REARM_TIMEOUT_MS; waited += 500) {
+        UsbDevice dev;
+        if (findDeviceOnPort(port, dev)) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    logError("No unit in bootloader mode on USB port %s", port.c_str());
+    return false;
+}
+
+class BaselineCheck {
+public:
+    explicit BaselineCheck(double threshold) : m_threshold(threshold), m_regressions(0) {}
+
+    // Times and CPU: higher is worse
+    void higher(const std::string& name, double baseline, double current) {
+        if (baseline < BENCH_NOISE_FLOOR) {
+            return;
+        }
+        judge(name, baseline, current, (current - baseline) / baseline * 100);
+    }
+
+    // Throughput: lower is worse
+    void lower(const std::string& name, double baseline, double current) {
+        if (baseline <= 0) {
+            return;
+        }
+        judge(name, baseline, current, (baseline - current) / baseline * 100);
+    }
+
+    uint32_t regressions() const { return m_regressions; }
+
+private:
+    void judge(const std::string& name, double baseline, double current, double worse) {
+        bool regressed = worse > m_threshold;
+        logVerbose("  %-24s %10.3f -> %10.3f  %+6.1f%%", name.c_str(), baseline, current, worse);
+        if (regressed) {
+            char message[160];
+            snprintf(message, sizeof(message), "%s %.3f vs %.3f baseline (%.1f%% worse)", name.c_str(),
+                     current, baseline, worse);
+            logInfo("REGRESSION: %s", message);
+            machineStatus("BENCH_REGRESSION", 100, message);
+            m_regressions++;
+        }
+    }
+
+    double m_threshold;
+    uint32_t m_regressions;
+};
+
+bool compareBaseline(const std::string& path, double threshold, cJSON* result) {
+    std::vector<uint8_t> data;
+    if (!loadFile(path.c_str(), data)) {
+        return false;
+    }
+    std::string text(data.begin(), data.end());
+    cJSON* baseline = cJSON_Parse(text.c_str());
+    if (!cJSON_IsObject(baseline)) {
+        logError("Invalid bench baseline: %s", path.c_str());
+        cJSON_Delete(baseline);
+        return false;
+    }
+
+    logInfo("\nBaseline %s (threshold %g%%):", path.c_str(), threshold);
+    BaselineCheck check(threshold);
+    const char* figures[] = { "p50", "p95" };
+    cJSON* total = cJSON_GetObjectItem(result, "total");
+    cJSON* baseTotal = cJSON_GetObjectItem(baseline, "total");
+    for (int f = 0; f < 2; f++) {
+        check.higher(std::string("total ") + figures[f], jsonNumber(baseTotal, figures[f]),
+                     jsonNumber(total, figures[f]));
+    }
+    cJSON* stages = cJSON_GetObjectItem(result, "stages");
+    cJSON* baseStages = cJSON_GetObjectItem(baseline, "stages");
+    cJSON* stage;
+    cJSON_ArrayForEach(stage, stages) {
+        cJSON* baseStage = cJSON_GetObjectItem(baseStages, stage->string);
+        for (int f = 0; f < 2 && baseStage; f++) {
+            check.higher(std::string(stage->string) + " " + figures[f], jsonNumber(baseStage, figures[f]),
+                         jsonNumber(stage, figures[f]));
+        }
+    }
+    check.lower("write MB/s", jsonNumber(baseline, "write_mb_per_s"), jsonNumber(result, "write_mb_per_s"));
+    check.higher("CPU s/MB", jsonNumber(baseline, "cpu_seconds_per_mb"), jsonNumber(result, "cpu_seconds_per_mb"));
+    cJSON_Delete(baseline);
+
+    if (check.regressions()) {
+        logError("%u regression(s) against baseline", check.regressions());
+        return false;
+    }
+    logInfo("No regressions against baseline");
+    return true;
+}
+
+} // namespace
+
+bool runBench(FirmwarePackage* pkg, const BenchOptions& options) {
+    if (!pkg || !pkg->valid) {
+        logError("Invalid firmware package");
+        return false;
+    }
+    if (!options.port.empty() && pkg->flashloaderPath.empty()) {
+        logError("Benchmarking a real unit needs a firmware package, not a synthetic one");
+        return false;
+    }
+    uint32_t runs = std::max(options.runs, 1u);
+    std::string port = options.port.empty() ? "sim1-1.1" : options.port;
+    logInfo("=== Benchmarking %u run(s) on %s ===", runs, options.port.empty() ? "a simulated unit" : port.c_str());
+
+    SimProfile profile;
+    if (!simulatedProfile(pkg, profile)) {
+        return false;
+    }
+
+    std::vector<double> totals;
+    std::vector<double> writeRates;
+    std::map<std::string, std::vector<double> > stages;
+    std::vector<std::string> stageOrder;
+    double cpuSeconds = 0;
+    uint64_t bytes = 0;
+
+    for (uint32_t run = 1; run <= runs; run++) {
+        if (run > 1 && !options.port.empty() && !g_dryRun && !waitForRearm(port, run, runs)) {
+            return false;
+        }
+
+        FlashEngine engine(pkg);
+        if (options.port.empty()) {
+            engine.addDevice(port, new SimulatedTransport(profile));
+        } else {
+            engine.addDevice(port, new UsbTransport(pkg, port));
+        }
+        double user;
+        double system;
+        processCpuTimes(user, system);
+        double cpuStart = user + system;
+        double start = nowSeconds();
+        size_t succeeded = engine.run();
+        double seconds = nowSeconds() - start;
+        processCpuTimes(user, system);
+        if (!succeeded) {
+            logError("Bench run %u failed", run);
+            return false;
+        }
+
+        // A stage entered more than once in a run counts once, with its total
+        const DeviceStats& stats = engine.stats(0);
+        std::map<std::string, double> perStage;
+        const std::vector<std::pair<std::string, double> >& times = engine.stageTimes(0);
+        for (size_t i = 0; i < times.size(); i++) {
+            if (!stages.count(times[i].first)) {
+                stageOrder.push_back(times[i].first);
+                stages[times[i].first];
+            }
+            perStage[times[i].first] += times[i].second;
+        }
+        for (std::map<std::string, double>::const_iterator it = perStage.begin(); it != perStage.end(); ++it) {
+            stages[it->first].push_back(it->second);
+        }
+        totals.push_back(seconds);
+        if (stats.writeSeconds > 0) {
+            writeRates.push_back(stats.writeBytes / stats.writeSeconds / (1024.0 * 1024.0));
+        }
+        cpuSeconds += user + system - cpuStart;
+        bytes += stats.writeBytes;
+        logInfo("Run %u/%u: %.2fs", run, runs, seconds);
+    }
+
+    Spread total = spreadOf(totals);
+    double writeRate = spreadOf(writeRates).p50;
+    double megabytes = bytes / (1024.0 * 1024.0);
+    double cpuPerMb = megabytes > 0 ? cpuSeconds / megabytes : 0;
+
+    logInfo("\n%-16s %9s %9s %9s", "Stage", "p50", "p95", "max");
+    cJSON* result = cJSON_CreateObject();
+    cJSON_AddStringToObject(result, "device", options.port.empty() ? "simulated" : port.c_str());
+    cJSON_AddStringToObject(result, "package", pkg->version.c_str());
+    cJSON_AddStringToObject(result, "sha256", pkg->firmwareHash.c_str());
+    cJSON_AddNumberToObject(result, "runs", runs);
+    cJSON_AddNumberToObject(result, "write_bytes", (double)pkg->program.writeBytes);
+    cJSON* stageItems = cJSON_AddObjectToObject(result, "stages");
+    for (size_t i = 0; i < stageOrder.size(); i++) {
+        Spread spread = spreadOf(stages[stageOrder[i]]);
+        logInfo("%-16s %8.3fs %8.3fs %8.3fs", stageOrder[i].c_str(), spread.p50, spread.p95, spread.max);
+        cJSON_AddItemToObject(stageItems, stageOrder[i].c_str(), spreadJson(spread));
+    }
+    logInfo("%-16s %8.3fs %8.3fs %8.3fs", "TOTAL", total.p50, total.p95, total.max);
+    logInfo("\nWrite throughput: %.2f MB/s (median)", writeRate);
+    logInfo("Host CPU:         %.4fs per MB written", cpuPerMb);
+    cJSON_AddItemToObject(result, "total", spreadJson(total));
+    cJSON_AddNumberToObject(result, "write_mb_per_s", writeRate);
+    cJSON_AddNumberToObject(result, "cpu_seconds_per_mb", cpuPerMb);
+
+    bool ok = true;
+    if (!options.resultPath.empty()) {
+        char* json = cJSON_Print(result);
+        FILE* f = fopen(options.resultPath.c_str(), "wb");
+        ok = f && fputs(json, f) >= 0 && fputc('\n', f) != EOF;
+        if (f) ok = fclose(f) == 0 && ok;
+        cJSON_free(json);
+        if (!ok) {
+            logError("Failed to write bench result: %s", options.resultPath.c_str());
+        } else {
+            logVerbose("Bench result written to %s", options.resultPath.c_str());
+        }
+    }
+    if (!options.baselinePath.empty()) {
+        ok = compareBaseline(options.baselinePath, options.threshold, result) && ok;
+    }
+    cJSON_Delete(result);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Soak
+//------------------------------------------------------------------------------
+
+namespace {
+
+// Per-device output of thousands of flashes would bury the report
+void discardEvent(void* context, const char* type, const char* stage, int percent, const char* message) {
+    (void)context; (void)type; (void)stage; (void)percent; (void)message;
+}
+
+} // namespace
+
+bool runSoak(FirmwarePackage* pkg, const SoakOptions& options) {
+    if (!pkg || !pkg->valid) {
+        logError("Invalid firmware package");
+        return false;
+    }
+    uint32_t units = std::max(options.units, 1u);
+    logInfo("=== Soaking %u flash cycle(s), %u simulated unit(s) at a time ===", options.cycles, units);
+    for (int i = 0; i < kFaultClasses; i++) {
+        if (options.faults.rate[i] > 0) {
+            logInfo("  %-12s %g per operation", faultClassName((FaultClass)i), options.faults.rate[i]);
+        }
+    }
+
+    SimProfile profile;
+    if (!simulatedProfile(pkg, profile)) {
+        return false;
+    }
+    ScheduleLimits limits;        // Simulated units share no bus
+    limits.perHub = 0;
+    limits.perController = 0;
+    FaultInjector faults(options.faults);
+    EventSink sink = { discardEvent, nullptr };
+
+    // One engine for every cycle: a unit's slot is refilled as soon as it
+    // finishes, and simulated time runs without sleeping, so timeouts cost
+    // nothing but the engine's own work
+    std::vector<std::string> ports = simulatedPorts(units);
+    FlashEngine engine(pkg, limits);
+    for (uint32_t i = 0; i < options.cycles; i++) {
+        engine.addDevice(ports[i % units], new SimulatedTransport(profile, &faults));
+    }
+    engine.setMaxActive(units);
+    engine.useVirtualClock();
+
+    double start = nowSeconds();
+    double simStart = engine.now();
+    g_eventSink = &sink;
+    uint32_t succeeded = (uint32_t)engine.run();
+    g_eventSink = nullptr;
+    double simSeconds = engine.now() - simStart;
+    double seconds = nowSeconds() - start;
+    uint32_t done = options.cycles;
+
+    logInfo("\n%u of %u flashes succeeded (%.2f%%) in %.1fs simulated (%.1fs wall), %.0f flashes/hour", succeeded,
+            done, done ? succeeded * 100.0 / done : 0, simSeconds, seconds,
+            simSeconds > 0 ? succeeded * 3600 / simSeconds : 0);
+    logInfo("\n%-12s %8s %9s %9s %9s %9s %9s", "Fault", "Injected", "Recovered", "Detect50", "Detect95",
+            "Recover50", "Recover95");
+    for (int i = 0; i < kFaultClasses; i++) {
+        const FaultInjector::Tally& tally = faults.tally((FaultClass)i);
+        if (options.faults.rate[i] <= 0) {
+            continue;
+        }
+        if (i == kFaultDelay) {
+            // Late, not failed: nothing to detect or recover from
+            logInfo("%-12s %8u %9s %9s %9s %9s %9s", faultClassName((FaultClass)i), tally.injected, "-", "-", "-",
+                    "-", "-");
+            continue;
+        }
+        Spread detect = spreadOf(tally.detectSeconds);
+        Spread recover = spreadOf(tally.recoverSeconds);
+        logInfo("%-12s %8u %9u %9s %9s %9s %9s", faultClassName((FaultClass)i), tally.injected, tally.recovered,
+                secondsCell(tally.detectSeconds, detect.p50).c_str(),
+                secondsCell(tally.detectSeconds, detect.p95).c_str(),
+                secondsCell(tally.recoverSeconds, recover.p50).c_str(),
+                secondsCell(tally.recoverSeconds, recover.p95).c_str());
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Scaling
+//------------------------------------------------------------------------------
+
+// Simulated units cost the host only the engine's own work, so this measures
+// the engine and scheduler, not USB. They finish their operations on the
+// loop's timers and never use the I/O pool, so thread scaling is not measured.
+// The result file:
+// {"package":"1.12.0","host_cpus":8,"levels":[{"units":1,"seconds":6.4,
+//  "mb_per_s":0.47,"flashes_per_hour":562,"slowdown":1.0,"cpu_percent":0.1,
+//  "voluntary_switches":120,"involuntary_switches":3},...]}
+
+bool runScale(FirmwarePackage* pkg, const ScaleOptions& options) {
+    if (!pkg || !pkg->valid) {
+        logError("Invalid firmware package");
+        return false;
+    }
+    uint32_t maxUnits = std::max(options.maxUnits, 1u);
+    unsigned hostCpus = std::max(std::thread::hardware_concurrency(), 1u);
+    logInfo("=== Scaling 1 to %u simulated unit(s) on %u host CPU(s) ===", maxUnits, hostCpus);
+
+    std::vector<uint32_t> levels;
+    for (uint32_t units = 1; units < maxUnits; units *= 2) {
+        levels.push_back(units);
+    }
+    levels.push_back(maxUnits);
+
+    SimProfile profile;
+    if (!simulatedProfile(pkg, profile)) {
+        return false;
+    }
+    EventSink sink = { discardEvent, nullptr };
+
+    cJSON* result = cJSON_CreateObject();
+    cJSON_AddStringToObject(result, "package", pkg->version.c_str());
+    cJSON_AddNumberToObject(result, "host_cpus", hostCpus);
+    cJSON* levelItems = cJSON_AddArrayToObject(result, "levels");
+
+    logInfo("\n%6s %9s %9s %10s %9s %8s %10s %10s", "Units", "Seconds", "MB/s", "Flashes/h", "Slowdown",
+            "CPU %", "Voluntary", "Involunt.");
+    bool ok = true;
+    double baseDeviceSeconds = 0;
+    for (size_t level = 0; level < levels.size(); level++) {
+        uint32_t units = levels[level];
+        std::vector<std::string> ports = simulatedPorts(units);
+        FlashEngine engine(pkg, options.limits);
+        for (size_t i = 0; i < ports.size(); i++) {
+            engine.addDevice(ports[i], new SimulatedTransport(profile));
+        }
+
+        double user;
+        double system;
+        uint64_t voluntary;
+        uint64_t involuntary;
+        processCpuTimes(user, system);
+        bool switches = processContextSwitches(voluntary, involuntary);
+        double cpuStart = user + system;
+        uint64_t voluntaryStart = voluntary;
+        uint64_t involuntaryStart = involuntary;
+        double start = nowSeconds();
+        g_eventSink = &sink;
+        size_t succeeded = engine.run();
+        g_eventSink = nullptr;
+        double seconds = nowSeconds() - start;
+        processCpuTimes(user, system);
+        processContextSwitches(voluntary, involuntary);
+        double cpuPercent = seconds > 0 ? (user + system - cpuStart) * 100 / seconds : 0;
+
+        // Per-device time is the device's own flash, start to finish; its
+        // growth over one unit alone is what concurrency costs each unit
+        uint64_t bytes = 0;
+        double deviceSeconds = 0;
+        for (size_t i = 0; i < engine.deviceCount(); i++) {
+            bytes += engine.stats(i).writeBytes;
+            const std::vector<std::pair<std::string, double> >& times = engine.stageTimes(i);
+            for (size_t t = 0; t < times.size(); t++) {
+                deviceSeconds += times[t].second;
+            }
+        }
+        deviceSeconds /= units;
+        if (level == 0) {
+            baseDeviceSeconds = deviceSeconds;
+        }
+        double slowdown = baseDeviceSeconds > 0 ? deviceSeconds / baseDeviceSeconds : 0;
+        double mbPerSec = seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0;
+        double flashesPerHour = seconds > 0 ? succeeded * 3600 / seconds : 0;
+        if (succeeded != units) {
+            logError("%zu of %u simulated unit(s) failed", units - succeeded, units);
+            ok = false;
+        }
+
+        if (switches) {
+            logInfo("%6u %8.2fs %9.2f %10.0f %8.2fx %7.1f%% %10llu %10llu", units, seconds, mbPerSec,
+                    flashesPerHour, slowdown, cpuPercent, (unsigned long long)(voluntary - voluntaryStart),
+                    (unsigned long long)(involuntary - involuntaryStart));
+        } else {
+            logInfo("%6u %8.2fs %9.2f %10.0f %8.2fx %7.1f%% %10s %10s", units, seconds, mbPerSec,
+                    flashesPerHour, slowdown, cpuPercent, "-", "-");
+        }
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "units", units);
+        cJSON_AddNumberToObject(item, "seconds", seconds);
+        cJSON_AddNumberToObject(item, "mb_per_s", mbPerSec);
+        cJSON_AddNumberToObject(item, "flashes_per_hour", flashesPerHour);
+        cJSON_AddNumberToObject(item, "slowdown", slowdown);
+        cJSON_AddNumberToObject(item, "cpu_percent", cpuPercent);
+        if (switches) {
+            cJSON_AddNumberToObject(item, "voluntary_switches", (double)(voluntary - voluntaryStart));
+            cJSON_AddNumberToObject(item, "involuntary_switches", (double)(involuntary - involuntaryStart));
+        }
+        cJSON_AddItemToArray(levelItems, item);
+    }
+    logInfo("\nCPU %% is of one core; the host has %u", hostCpus);
+    logInfo("Simulated units run on the engine loop alone; thread scaling is not measured");
+
+    if (!options.resultPath.empty()) {
+        char* json = cJSON_Print(result);
+        FILE* f = fopen(options.resultPath.c_str(), "wb");
+        bool written = f && fputs(json, f) >= 0 && fputc('\n', f) != EOF;
+        if (f) written = fclose(f) == 0 && written;
+        cJSON_free(json);
+        if (!written) {
+            logError("Failed to write scaling result: %s", options.resultPath.c_str());
+            ok = false;
+        } else {
+            logVerbose("Scaling result written to %s", options.resultPath.c_str());
+        }
+    }
+    cJSON_Delete(result);
+    return ok;
+}
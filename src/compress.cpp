@@ -0,0 +1,231 @@
+/*
+ * NT Flash Tool - Compressed writes to a custom flashloader
+ *
+ * Copyright (c) 2024
+ *
+ * A package's own flashloader may offer to expand compressed data into
+ * flash (see BootloaderOperations::connect()). Write data is then sent as
+ * frames of LZ4 blocks, a format small enough to decode on the device. The
+ * expanding side lives here too, as the simulated flashloader.
+ */
+
+#include <algorithm>
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// LZ4 Blocks
+//------------------------------------------------------------------------------
+
+namespace {
+
+const size_t LZ4_MIN_MATCH = 4;
+const size_t LZ4_LAST_LITERALS = 5;   // A block ends with at least this many literals
+const size_t LZ4_MATCH_LIMIT = 12;    // ... and no match starts closer to its end than this
+const size_t LZ4_MAX_OFFSET = 0xFFFF;
+const unsigned LZ4_HASH_BITS = 12;
+
+inline uint32_t load32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint32_t hash4(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+inline void putLE32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+inline uint32_t getLE32(const uint8_t* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Length beyond the token's 15, in 255s and a remainder
+uint8_t* putLength(uint8_t* out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+bool getLength(const uint8_t*& in, const uint8_t* end, size_t& length) {
+    uint8_t byte;
+    do {
+        if (in == end) return false;
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Literals and the match after them as one sequence; false if out has no room
+bool putSequence(uint8_t*& out, const uint8_t* outEnd, const uint8_t* literals, size_t literalCount,
+                 size_t offset, size_t matchLength) {
+    size_t worst = 1 + literalCount / 255 + 1 + literalCount + 2 + matchLength / 255 + 1;
+    if ((size_t)(outEnd - out) < worst) {
+        return false;
+    }
+    uint8_t* token = out++;
+    *token = (uint8_t)(std::min(literalCount, (size_t)15) << 4);
+    if (literalCount >= 15) out = putLength(out, literalCount - 15);
+    memcpy(out, literals, literalCount);
+    out += literalCount;
+    if (offset) {
+        *out++ = (uint8_t)offset;
+        *out++ = (uint8_t)(offset >> 8);
+        *token |= (uint8_t)std::min(matchLength, (size_t)15);
+        if (matchLength >= 15) out = putLength(out, matchLength - 15);
+    }
+    return true;
+}
+
+// Greedy LZ4 block of src; 0 if it does not fit in capacity. Runs of misses
+// step further each time, so incompressible data costs little.
+size_t lz4Compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity) {
+    uint32_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t* end = src + size;
+    const uint8_t* anchor = src;
+    uint8_t* out = dst;
+    uint8_t* outEnd = dst + capacity;
+
+    if (size > LZ4_MATCH_LIMIT) {
+        const uint8_t* matchLimit = end - LZ4_MATCH_LIMIT;
+        const uint8_t* matchEnd = end - LZ4_LAST_LITERALS;
+        const uint8_t* in = src + 1;
+        while (in < matchLimit) {
+            uint32_t sequence = load32(in);
+            uint32_t& slot = table[hash4(sequence)];
+            const uint8_t* ref = src + slot;
+            slot = (uint32_t)(in - src);
+            if ((size_t)(in - ref) > LZ4_MAX_OFFSET || load32(ref) != sequence) {
+                in += 1 + ((in - anchor) >> 6);
+                continue;
+            }
+
+            while (in > anchor && ref > src && in[-1] == ref[-1]) {
+                in--;
+                ref--;
+            }
+            const uint8_t* matched = in + LZ4_MIN_MATCH;
+            const uint8_t* refMatched = ref + LZ4_MIN_MATCH;
+            while (matched < matchEnd && *matched == *refMatched) {
+                matched++;
+                refMatched++;
+            }
+            if (!putSequence(out, outEnd, anchor, (size_t)(in - anchor), (size_t)(in - ref),
+                             (size_t)(matched - in) - LZ4_MIN_MATCH)) {
+                return 0;
+            }
+            in = anchor = matched;
+            table[hash4(load32(in - 2))] = (uint32_t)(in - 2 - src);
+        }
+    }
+    if (!putSequence(out, outEnd, anchor, (size_t)(end - anchor), 0, 0)) {
+        return 0;
+    }
+    return (size_t)(out - dst);
+}
+
+// Exactly size bytes from one LZ4 block, or false
+bool lz4Expand(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t size) {
+    const uint8_t* in = src;
+    const uint8_t* inEnd = src + srcSize;
+    uint8_t* out = dst;
+    uint8_t* outEnd = dst + size;
+    for (;;) {
+        if (in == inEnd) return false;
+        unsigned token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !getLength(in, inEnd, literals)) return false;
+        if (literals > (size_t)(inEnd - in) || literals > (size_t)(outEnd - out)) return false;
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == inEnd) {
+            return out == outEnd;   // The last sequence has no match
+        }
+
+        if (inEnd - in < 2) return false;
+        size_t offset = in[0] | in[1] << 8;
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !getLength(in, inEnd, length)) return false;
+        length += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - dst) || length > (size_t)(outEnd - out)) return false;
+        const uint8_t* ref = out - offset;
+        for (size_t i = 0; i < length; i++) {
+            out[i] = ref[i];   // Overlapping copies repeat the pattern
+        }
+        out += length;
+    }
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+// Compressed Write Frames
+//------------------------------------------------------------------------------
+
+// Each frame holds at most frameSize image bytes: raw size and stored size
+// (little-endian words), then an LZ4 block, or the raw bytes themselves when
+// the stored size equals the raw size because they did not compress
+void compressFrames(const uint8_t* data, size_t size, uint32_t frameSize, std::vector<uint8_t>& payload) {
+    payload.clear();
+    for (size_t done = 0; done < size; done += frameSize) {
+        size_t raw = std::min((size_t)frameSize, size - done);
+        size_t header = payload.size();
+        payload.resize(header + COMPRESSED_FRAME_HEADER + raw);
+        uint8_t* stored = &payload[header + COMPRESSED_FRAME_HEADER];
+        size_t packed = lz4Compress(data + done, raw, stored, raw - 1);
+        if (!packed) {
+            memcpy(stored, data + done, raw);
+            packed = raw;
+        }
+        putLE32(&payload[header], (uint32_t)raw);
+        putLE32(&payload[header + 4], (uint32_t)packed);
+        payload.resize(header + COMPRESSED_FRAME_HEADER + packed);
+    }
+}
+
+// What the flashloader does with a compressed write; false on a malformed
+// payload or a frame larger than it offered
+bool expandFrames(const uint8_t* payload, size_t size, uint32_t frameSize, std::vector<uint8_t>& data) {
+    data.clear();
+    const uint8_t* end = payload + size;
+    while (payload < end) {
+        if ((size_t)(end - payload) < COMPRESSED_FRAME_HEADER) {
+            return false;
+        }
+        uint32_t raw = getLE32(payload);
+        uint32_t stored = getLE32(payload + 4);
+        payload += COMPRESSED_FRAME_HEADER;
+        if (raw == 0 || raw > frameSize || stored > raw || stored > (size_t)(end - payload)) {
+            return false;
+        }
+        size_t offset = data.size();
+        data.resize(offset + raw);
+        if (stored == raw) {
+            memcpy(&data[offset], payload, raw);
+        } else if (!lz4Expand(payload, stored, &data[offset], raw)) {
+            return false;
+        }
+        payload += stored;
+    }
+    return true;
+}
+
+void logCompressedWrites(const DeviceStats& stats) {
+    if (stats.wireBytes && stats.wireBytes < stats.writeBytes) {
+        logInfo("Compressed writes sent %llu of %llu bytes (%.0f%%)", (unsigned long long)stats.wireBytes,
+                (unsigned long long)stats.writeBytes, stats.wireBytes * 100.0 / stats.writeBytes);
+    }
+}
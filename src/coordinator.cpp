@@ -0,0 +1,821 @@
+/*
+ * NT Flash Tool - Multi-host coordinator, worker agents and job submission
+ *
+ * Copyright (c) 2024
+ *
+ * A coordinator accepts flash jobs ("flash version X on N units") and splits
+ * them across agents: nt-flash processes on station PCs that advertise their
+ * free ports and the firmware they already hold. Everything travels as one
+ * JSON object per line over TCP:
+ *
+ *   agent -> coordinator   {"type":"hello","token":..,"name":..,"ports":[..],"versions":[..]}
+ *                          {"type":"status","ports":[..],"versions":[..]}
+ *                          {"type":"result","task":7,"ok":[..],"failed":[..]}
+ *   coordinator -> agent   {"type":"flash","task":7,"version":..,"package":..,"ports":[..]}
+ *   client -> coordinator  {"type":"job","token":..,"version":..,"package":..,"count":4}
+ *   coordinator -> client  {"type":"accepted","job":3}
+ *                          {"type":"result","agent":..,"port":..,"ok":true}
+ *                          {"type":"done","succeeded":4,"failed":0}
+ *   coordinator -> peer    {"type":"error","message":..}
+ *
+ * A coordinator started with --token only serves peers that send the same
+ * token. Versions and package names arrive from the network and end up in
+ * file names and URLs, so both sides accept only plain names (see safeName).
+ */
+
+#include <set>
+#include <algorithm>
+#include <sys/stat.h>
+
+#if defined(WIN32)
+#include <winsock2.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// Message Helpers
+//------------------------------------------------------------------------------
+
+static cJSON* stringArray(const std::vector<std::string>& items) {
+    cJSON* array = cJSON_CreateArray();
+    for (size_t i = 0; i < items.size(); i++) {
+        cJSON_AddItemToArray(array, cJSON_CreateString(items[i].c_str()));
+    }
+    return array;
+}
+
+static std::vector<std::string> readStringArray(cJSON* message, const char* name) {
+    std::vector<std::string> items;
+    cJSON* array = cJSON_GetObjectItem(message, name);
+    for (cJSON* item = array ? array->child : nullptr; item; item = item->next) {
+        if (cJSON_IsString(item)) items.push_back(item->valuestring);
+    }
+    return items;
+}
+
+static std::string readString(cJSON* message, const char* name) {
+    cJSON* item = cJSON_GetObjectItem(message, name);
+    return cJSON_IsString(item) ? item->valuestring : "";
+}
+
+static int readInt(cJSON* message, const char* name) {
+    cJSON* item = cJSON_GetObjectItem(message, name);
+    return cJSON_IsNumber(item) ? item->valueint : 0;
+}
+
+static cJSON* newMessage(const char* type) {
+    cJSON* message = cJSON_CreateObject();
+    cJSON_AddStringToObject(message, "type", type);
+    return message;
+}
+
+static cJSON* errorMessage(const std::string& text) {
+    cJSON* message = newMessage("error");
+    cJSON_AddStringToObject(message, "message", text.c_str());
+    return message;
+}
+
+// A version or package file name: letters, digits, '.', '_' and '-' only (safe
+// in URLs), no "..", so never a path out of the cache directory
+static bool safeName(const std::string& name) {
+    if (name.empty() || name.find("..") != std::string::npos) {
+        return false;
+    }
+    for (size_t i = 0; i < name.size(); i++) {
+        char c = name[i];
+        if (!isalnum((unsigned char)c) && c != '.' && c != '_' && c != '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compare every byte whatever the first mismatch, so timing does not leak the token
+static bool sameToken(const std::string& given, const std::string& expected) {
+    unsigned char diff = given.size() == expected.size() ? 0 : 1;
+    for (size_t i = 0; i < given.size(); i++) {
+        diff |= (unsigned char)(given[i] ^ expected[i % std::max((size_t)1, expected.size())]);
+    }
+    return diff == 0;
+}
+
+//------------------------------------------------------------------------------
+// Coordinator
+//------------------------------------------------------------------------------
+
+struct CoordAgent {
+    LineConnection* conn;
+    std::string name;
+    std::vector<std::string> ports;   // Free ports as last advertised
+    std::set<std::string> versions;   // Firmware the agent holds
+    std::set<std::string> busy;       // Ports with a task outstanding
+    int sending;                      // Messages posted to conn but not yet sent
+};
+
+struct CoordJob {
+    int id;
+    LineConnection* client;
+    std::string version;
+    std::string package;
+    uint32_t count;
+    uint32_t assigned;                // Units handed to agents
+    uint32_t finished;                // Units reported back
+    uint32_t succeeded;
+    int sending;                      // Messages posted to client but not yet sent
+};
+
+struct CoordTask {
+    CoordJob* job;
+    CoordAgent* agent;
+    std::vector<std::string> ports;
+};
+
+// A message posted under m_mutex, sent once it is released. The peer's
+// sending count keeps its connection alive until then.
+struct CoordMessage {
+    LineConnection* conn;
+    cJSON* message;
+    int* sending;
+};
+
+typedef std::vector<CoordMessage> CoordOutbox;
+
+class Coordinator {
+public:
+    explicit Coordinator(const std::string& token) : m_token(token), m_nextJob(1), m_nextTask(1) {}
+
+    void serveConnection(LineConnection* conn);
+
+private:
+    void serveAgent(LineConnection* conn, cJSON* hello);
+    void serveClient(LineConnection* conn, cJSON* request);
+    void updateAgent(CoordAgent* agent, cJSON* message);
+    void finishTask(int taskId, const std::vector<std::string>& ok, const std::vector<std::string>& failed);
+    CoordAgent* pickAgent(const std::string& version, size_t& freeCount);
+    void dispatch(CoordOutbox& outbox);
+    void post(CoordOutbox& outbox, LineConnection* conn, int& sending, cJSON* message);
+    void send(CoordOutbox& outbox);
+
+    std::string m_token;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;      // A job progressed or a send finished
+    std::vector<CoordAgent*> m_agents;
+    std::deque<CoordJob*> m_pending;        // Jobs with units not yet assigned, oldest first
+    std::map<int, CoordTask> m_tasks;
+    int m_nextJob;
+    int m_nextTask;
+};
+
+// The first message decides whether the peer is an agent or a client
+void Coordinator::serveConnection(LineConnection* conn) {
+    cJSON* first = conn->receiveMessage();
+    std::string type = first ? readString(first, "type") : "";
+    if (first && !m_token.empty() && !sameToken(readString(first, "token"), m_token)) {
+        logError("Rejected %s connection: wrong or missing token", type.c_str());
+        conn->sendMessage(errorMessage("Wrong or missing token"));
+    } else if (type == "hello") {
+        serveAgent(conn, first);
+    } else if (type == "job") {
+        serveClient(conn, first);
+    } else if (first) {
+        logError("Unexpected message from new connection: %s", type.c_str());
+    }
+    cJSON_Delete(first);
+    delete conn;
+}
+
+void Coordinator::post(CoordOutbox& outbox, LineConnection* conn, int& sending, cJSON* message) {
+    CoordMessage posted = {conn, message, &sending};
+    outbox.push_back(posted);
+    sending++;
+}
+
+// Send what was posted under m_mutex, now it is released: a peer that stops
+// reading holds up only the thread sending to it
+void Coordinator::send(CoordOutbox& outbox) {
+    if (outbox.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < outbox.size(); i++) {
+        outbox[i].conn->sendMessage(outbox[i].message);
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < outbox.size(); i++) {
+        (*outbox[i].sending)--;
+    }
+    outbox.clear();
+    m_changed.notify_all();
+}
+
+void Coordinator::updateAgent(CoordAgent* agent, cJSON* message) {
+    agent->ports = readStringArray(message, "ports");
+    std::vector<std::string> versions = readStringArray(message, "versions");
+    agent->versions.insert(versions.begin(), versions.end());
+}
+
+void Coordinator::serveAgent(LineConnection* conn, cJSON* hello) {
+    CoordAgent* agent = new CoordAgent;
+    agent->conn = conn;
+    agent->name = readString(hello, "name");
+    agent->sending = 0;
+    CoordOutbox outbox;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        updateAgent(agent, hello);
+        m_agents.push_back(agent);
+        logInfo("Agent %s joined (%zu free port(s), %zu firmware version(s))",
+                agent->name.c_str(), agent->ports.size(), agent->versions.size());
+        dispatch(outbox);
+    }
+    send(outbox);
+
+    while (cJSON* message = conn->receiveMessage()) {
+        std::string type = readString(message, "type");
+        if (type == "status") {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                updateAgent(agent, message);
+                dispatch(outbox);
+            }
+            send(outbox);
+        } else if (type == "result") {
+            finishTask(readInt(message, "task"), readStringArray(message, "ok"),
+                       readStringArray(message, "failed"));
+        }
+        cJSON_Delete(message);
+    }
+
+    // Fail sends still blocked on the connection, then wait them out: the
+    // connection is deleted once this returns
+    conn->shutdown();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [agent] { return agent->sending == 0; });
+
+    // Units the agent still owed are failures
+    logInfo("Agent %s left", agent->name.c_str());
+    m_agents.erase(std::find(m_agents.begin(), m_agents.end(), agent));
+    std::vector<int> orphaned;
+    for (std::map<int, CoordTask>::iterator it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+        if (it->second.agent == agent) orphaned.push_back(it->first);
+    }
+    for (size_t i = 0; i < orphaned.size(); i++) {
+        CoordTask& task = m_tasks[orphaned[i]];
+        task.job->finished += (uint32_t)task.ports.size();
+        for (size_t p = 0; p < task.ports.size(); p++) {
+            cJSON* result = newMessage("result");
+            cJSON_AddStringToObject(result, "agent", agent->name.c_str());
+            cJSON_AddStringToObject(result, "port", task.ports[p].c_str());
+            cJSON_AddBoolToObject(result, "ok", false);
+            post(outbox, task.job->client, task.job->sending, result);
+        }
+        m_tasks.erase(orphaned[i]);
+    }
+    delete agent;
+    m_changed.notify_all();
+    lock.unlock();
+    send(outbox);
+}
+
+void Coordinator::finishTask(int taskId, const std::vector<std::string>& ok,
+                             const std::vector<std::string>& failed) {
+    CoordOutbox outbox;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::map<int, CoordTask>::iterator it = m_tasks.find(taskId);
+    if (it == m_tasks.end()) {
+        return;
+    }
+    CoordTask& task = it->second;
+    CoordJob* job = task.job;
+
+    for (size_t i = 0; i < task.ports.size(); i++) {
+        const std::string& port = task.ports[i];
+        bool portOk = std::find(ok.begin(), ok.end(), port) != ok.end() &&
+                      std::find(failed.begin(), failed.end(), port) == failed.end();
+        task.agent->busy.erase(port);
+        job->finished++;
+        if (portOk) job->succeeded++;
+
+        cJSON* result = newMessage("result");
+        cJSON_AddStringToObject(result, "agent", task.agent->name.c_str());
+        cJSON_AddStringToObject(result, "port", port.c_str());
+        cJSON_AddBoolToObject(result, "ok", portOk);
+        post(outbox, job->client, job->sending, result);
+    }
+    task.agent->versions.insert(job->version);  // It has the firmware now
+    logInfo("Job %d: %u of %u unit(s) done", job->id, job->finished, job->count);
+
+    m_tasks.erase(it);
+    dispatch(outbox);
+    m_changed.notify_all();
+    lock.unlock();
+    send(outbox);
+}
+
+// Prefer agents that already hold the firmware, then the most idle ports
+CoordAgent* Coordinator::pickAgent(const std::string& version, size_t& freeCount) {
+    CoordAgent* best = nullptr;
+    bool bestWarm = false;
+    freeCount = 0;
+    for (size_t i = 0; i < m_agents.size(); i++) {
+        CoordAgent* agent = m_agents[i];
+        size_t available = 0;
+        for (size_t p = 0; p < agent->ports.size(); p++) {
+            if (!agent->busy.count(agent->ports[p])) available++;
+        }
+        if (available == 0) {
+            continue;
+        }
+        bool warm = agent->versions.count(version) != 0;
+        if (!best || (warm && !bestWarm) || (warm == bestWarm && available > freeCount)) {
+            best = agent;
+            bestWarm = warm;
+            freeCount = available;
+        }
+    }
+    return best;
+}
+
+// Hand waiting units to agents with free ports. Called with m_mutex held;
+// the flash messages go out with send().
+void Coordinator::dispatch(CoordOutbox& outbox) {
+    std::deque<CoordJob*>::iterator it = m_pending.begin();
+    while (it != m_pending.end()) {
+        CoordJob* job = *it;
+        while (job->assigned < job->count) {
+            size_t freeCount;
+            CoordAgent* agent = pickAgent(job->version, freeCount);
+            if (!agent) {
+                break;
+            }
+
+            CoordTask task;
+            task.job = job;
+            task.agent = agent;
+            for (size_t p = 0; p < agent->ports.size() && job->assigned + task.ports.size() < job->count; p++) {
+                if (!agent->busy.count(agent->ports[p])) {
+                    task.ports.push_back(agent->ports[p]);
+                    agent->busy.insert(agent->ports[p]);
+                }
+            }
+            int taskId = m_nextTask++;
+            m_tasks[taskId] = task;
+            job->assigned += (uint32_t)task.ports.size();
+
+            logInfo("Job %d: %zu unit(s) to %s%s", job->id, task.ports.size(), agent->name.c_str(),
+                    agent->versions.count(job->version) ? " (firmware cached)" : "");
+            cJSON* flash = newMessage("flash");
+            cJSON_AddNumberToObject(flash, "task", taskId);
+            cJSON_AddStringToObject(flash, "version", job->version.c_str());
+            cJSON_AddStringToObject(flash, "package", job->package.c_str());
+            cJSON_AddItemToObject(flash, "ports", stringArray(task.ports));
+            post(outbox, agent->conn, agent->sending, flash);
+        }
+
+        if (job->assigned == job->count) {
+            it = m_pending.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Coordinator::serveClient(LineConnection* conn, cJSON* request) {
+    CoordJob* job = new CoordJob;
+    job->client = conn;
+    job->version = readString(request, "version");
+    job->package = readString(request, "package");
+    job->count = (uint32_t)std::max(1, readInt(request, "count"));
+    job->assigned = 0;
+    job->finished = 0;
+    job->succeeded = 0;
+    job->sending = 0;
+    if (!safeName(job->version) || (!job->package.empty() && !safeName(job->package))) {
+        logError("Rejected job: version and package must be plain names");
+        conn->sendMessage(errorMessage("Version and package must be plain names (letters, digits, '.', '_', '-')"));
+        delete job;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        job->id = m_nextJob++;
+    }
+    logInfo("Job %d: flash %s on %u unit(s)", job->id, job->version.c_str(), job->count);
+    cJSON* accepted = newMessage("accepted");
+    cJSON_AddNumberToObject(accepted, "job", job->id);
+    conn->sendMessage(accepted);
+
+    CoordOutbox outbox;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(job);
+        dispatch(outbox);
+    }
+    send(outbox);
+
+    // Every result is sent before "done"
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [job] { return job->finished >= job->count && job->sending == 0; });
+    }
+
+    cJSON* done = newMessage("done");
+    cJSON_AddNumberToObject(done, "succeeded", job->succeeded);
+    cJSON_AddNumberToObject(done, "failed", job->count - job->succeeded);
+    conn->sendMessage(done);
+    logInfo("Job %d finished: %u of %u unit(s) flashed", job->id, job->succeeded, job->count);
+    delete job;
+}
+
+// Accept agents and clients until the process is stopped. A bare port
+// listens on loopback only: other hosts are let in by naming an interface.
+bool runCoordinator(std::string address, const std::string& token) {
+    if (!netStartup()) {
+        return false;
+    }
+    if (address.find(':') == std::string::npos) {
+        address = "127.0.0.1:" + address;
+    }
+    NetSocket listener = netListen(address);
+    if (listener == NET_INVALID_SOCKET) {
+        return false;
+    }
+    logInfo("Coordinator listening on %s%s", address.c_str(), token.empty() ? "" : " (token required)");
+    if (token.empty() && address.compare(0, 10, "127.0.0.1:") != 0 && address.compare(0, 10, "localhost:") != 0) {
+        logInfo("WARNING: No --token, so anyone who can reach %s can submit jobs", address.c_str());
+    }
+
+    Coordinator coordinator(token);
+    for (;;) {
+        NetSocket fd = netAccept(listener);
+        if (fd == NET_INVALID_SOCKET) {
+            continue;
+        }
+        LineConnection* conn = new LineConnection(fd);
+        std::thread(&Coordinator::serveConnection, &coordinator, conn).detach();
+    }
+}
+
+//------------------------------------------------------------------------------
+// Agent
+//------------------------------------------------------------------------------
+
+class Agent {
+public:
+    Agent(LineConnection* conn, const AgentOptions& options)
+        : m_conn(conn), m_options(options), m_running(true), m_tasks(0) {}
+
+    ~Agent();
+
+    cJSON* describe(const char* type);
+    void startTask(cJSON* message);
+    void statusLoop();
+    void stop();
+
+private:
+    void runTask(cJSON* message);
+    FirmwarePackage* obtainPackage(const std::string& version, const std::string& packageName);
+    std::string cachePath(const std::string& version) const;
+
+    LineConnection* m_conn;
+    AgentOptions m_options;
+
+    std::mutex m_mutex;
+    std::condition_variable m_stopped;
+    bool m_running;
+    size_t m_tasks;                     // Task threads still running
+    std::condition_variable m_tasksDone;
+    std::map<std::string, FirmwarePackage*> m_packages;  // Loaded and compiled, by version
+    std::set<std::string> m_busy;
+    std::mutex m_loadMutex;
+};
+
+Agent::~Agent() {
+    for (std::map<std::string, FirmwarePackage*>::iterator it = m_packages.begin(); it != m_packages.end(); ++it) {
+        delete it->second;
+    }
+}
+
+static bool fileExists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+std::string Agent::cachePath(const std::string& version) const {
+    return m_options.cacheDir + "/distingNT_" + version + ".zip";
+}
+
+// Versions held in memory or in the cache directory
+static void listCachedVersions(const std::string& dir, std::set<std::string>& versions) {
+    const std::string prefix = "distingNT_";
+    const std::string suffix = ".zip";
+    std::vector<std::string> names;
+#if defined(WIN32)
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((dir + "\\*.zip").c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            names.push_back(data.cFileName);
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    DIR* d = opendir(dir.c_str());
+    if (d) {
+        while (struct dirent* entry = readdir(d)) {
+            names.push_back(entry->d_name);
+        }
+        closedir(d);
+    }
+#endif
+    for (size_t i = 0; i < names.size(); i++) {
+        const std::string& name = names[i];
+        if (name.size() > prefix.size() + suffix.size() && name.compare(0, prefix.size(), prefix) == 0 &&
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            versions.insert(name.substr(prefix.size(), name.size() - prefix.size() - suffix.size()));
+        }
+    }
+}
+
+// A hello or status message: free ports and firmware on hand
+cJSON* Agent::describe(const char* type) {
+    std::vector<std::string> ports;
+    if (m_options.simulate) {
+        ports = simulatedPorts(m_options.simulate);
+    } else {
+        std::vector<UsbDevice> devices = enumerateDevices();
+        for (size_t i = 0; i < devices.size(); i++) {
+            ports.push_back(devices[i].port);
+        }
+    }
+
+    std::set<std::string> versions;
+    listCachedVersions(m_options.cacheDir, versions);
+
+    std::vector<std::string> free;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (std::map<std::string, FirmwarePackage*>::iterator it = m_packages.begin(); it != m_packages.end(); ++it) {
+            versions.insert(it->first);
+        }
+        for (size_t i = 0; i < ports.size(); i++) {
+            if (!m_busy.count(ports[i])) free.push_back(ports[i]);
+        }
+    }
+
+    cJSON* message = newMessage(type);
+    if (strcmp(type, "hello") == 0) {
+        cJSON_AddStringToObject(message, "name", m_options.name.c_str());
+    }
+    cJSON_AddItemToObject(message, "ports", stringArray(free));
+    cJSON_AddItemToObject(message, "versions", stringArray(std::vector<std::string>(versions.begin(), versions.end())));
+    return message;
+}
+
+// Memory first, then the cache directory, then the job's package file in the
+// cache directory, then the Expert Sleepers download for that version. New
+// packages are cached.
+FirmwarePackage* Agent::obtainPackage(const std::string& version, const std::string& packageName) {
+    std::lock_guard<std::mutex> loadLock(m_loadMutex);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<std::string, FirmwarePackage*>::iterator it = m_packages.find(version);
+        if (it != m_packages.end()) {
+            return it->second;
+        }
+    }
+
+    std::string cached = cachePath(version);
+    std::string packagePath = packageName.empty() ? "" : m_options.cacheDir + "/" + packageName;
+    if (!fileExists(cached)) {
+        std::vector<uint8_t> data;
+        if (!packagePath.empty() && fileExists(packagePath)) {
+            if (!loadFile(packagePath.c_str(), data)) {
+                return nullptr;
+            }
+            FILE* f = fopen(cached.c_str(), "wb");
+            bool ok = f && fwrite(data.data(), 1, data.size(), f) == data.size();
+            if (f) ok = fclose(f) == 0 && ok;
+            if (!ok) {
+                logError("Failed to cache package: %s", cached.c_str());
+                remove(cached.c_str());
+                return nullptr;
+            }
+        } else {
+            char url[512];
+            snprintf(url, sizeof(url), "%sdistingNT_%s.zip", FIRMWARE_BASE_URL, version.c_str());
+            if (!downloadFile(url, cached.c_str())) {
+                remove(cached.c_str());
+                return nullptr;
+            }
+        }
+    }
+
+    std::string index = cached + ".idx";   // Inflate index, for --stream
+    FirmwarePackage* pkg = loadFirmwarePackage(cached.c_str(), index.c_str());
+    if (!pkg) {
+        remove(cached.c_str());  // Do not advertise a broken package
+        remove(index.c_str());
+        return nullptr;
+    }
+    pkg->version = version;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_packages[version] = pkg;
+    return pkg;
+}
+
+// Each task runs on a thread of its own, detached: stop() waits for them all
+void Agent::startTask(cJSON* message) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks++;
+    }
+    std::thread(&Agent::runTask, this, message).detach();
+}
+
+void Agent::runTask(cJSON* message) {
+    int taskId = readInt(message, "task");
+    std::string version = readString(message, "version");
+    std::string packageName = readString(message, "package");
+    std::vector<std::string> ports = readStringArray(message, "ports");
+    cJSON_Delete(message);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_busy.insert(ports.begin(), ports.end());
+    }
+
+    // The coordinator checks these too, but they become file names and URLs here
+    std::vector<std::string> failed;
+    FirmwarePackage* pkg = nullptr;
+    if (!safeName(version) || (!packageName.empty() && !safeName(packageName))) {
+        logError("Task %d: refusing version \"%s\", package \"%s\": not plain names", taskId,
+                 version.c_str(), packageName.c_str());
+    } else {
+        pkg = obtainPackage(version, packageName);
+    }
+    if (pkg) {
+        runStation(pkg, ports, m_options.simulate != 0, StationOptions(), true, &failed);
+    } else {
+        failed = ports;
+    }
+
+    std::vector<std::string> ok;
+    for (size_t i = 0; i < ports.size(); i++) {
+        if (std::find(failed.begin(), failed.end(), ports[i]) == failed.end()) ok.push_back(ports[i]);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < ports.size(); i++) {
+            m_busy.erase(ports[i]);
+        }
+    }
+
+    cJSON* result = newMessage("result");
+    cJSON_AddNumberToObject(result, "task", taskId);
+    cJSON_AddItemToObject(result, "ok", stringArray(ok));
+    cJSON_AddItemToObject(result, "failed", stringArray(failed));
+    m_conn->sendMessage(result);
+    m_conn->sendMessage(describe("status"));
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tasks--;
+    m_tasksDone.notify_all();
+}
+
+// Re-advertise ports periodically: units come and go as operators swap them
+void Agent::statusLoop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_running) {
+        m_stopped.wait_for(lock, std::chrono::milliseconds(AGENT_STATUS_INTERVAL_MS));
+        if (!m_running) {
+            break;
+        }
+        lock.unlock();
+        m_conn->sendMessage(describe("status"));
+        lock.lock();
+    }
+}
+
+// Stop the status loop and wait for running tasks
+void Agent::stop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_running = false;
+    m_stopped.notify_all();
+    m_tasksDone.wait(lock, [this] { return m_tasks == 0; });
+}
+
+// Serve flash tasks from the coordinator until it goes away
+bool runAgent(const std::string& coordinatorAddress, AgentOptions options) {
+    if (!netStartup()) {
+        return false;
+    }
+    if (options.cacheDir.empty()) {
+        options.cacheDir = getTempDir() + "nt-flash-cache";
+    }
+#if defined(WIN32)
+    _mkdir(options.cacheDir.c_str());
+#else
+    mkdir(options.cacheDir.c_str(), 0755);
+#endif
+    if (options.name.empty()) {
+        char host[256] = "agent";
+        gethostname(host, sizeof(host));
+        options.name = host;
+    }
+
+    NetSocket fd = netConnect(coordinatorAddress);
+    if (fd == NET_INVALID_SOCKET) {
+        return false;
+    }
+    LineConnection conn(fd);
+    Agent agent(&conn, options);
+    logInfo("Agent %s connected to %s (cache: %s)", options.name.c_str(),
+            coordinatorAddress.c_str(), options.cacheDir.c_str());
+
+    cJSON* hello = agent.describe("hello");
+    if (!options.token.empty()) {
+        cJSON_AddStringToObject(hello, "token", options.token.c_str());
+    }
+    conn.sendMessage(hello);
+    std::thread status(&Agent::statusLoop, &agent);
+
+    while (cJSON* message = conn.receiveMessage()) {
+        std::string type = readString(message, "type");
+        if (type == "flash") {
+            agent.startTask(message);
+            continue;
+        }
+        if (type == "error") {
+            logError("Coordinator: %s", readString(message, "message").c_str());
+        }
+        cJSON_Delete(message);
+    }
+
+    logError("Lost connection to coordinator");
+    agent.stop();
+    status.join();
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// Job Submission
+//------------------------------------------------------------------------------
+
+// Submit a job and report each unit as it finishes
+bool submitJob(const std::string& coordinatorAddress, const std::string& version,
+               const std::string& packageName, uint32_t count, const std::string& token) {
+    if (!netStartup()) {
+        return false;
+    }
+    NetSocket fd = netConnect(coordinatorAddress);
+    if (fd == NET_INVALID_SOCKET) {
+        return false;
+    }
+    LineConnection conn(fd);
+
+    cJSON* job = newMessage("job");
+    if (!token.empty()) {
+        cJSON_AddStringToObject(job, "token", token.c_str());
+    }
+    cJSON_AddStringToObject(job, "version", version.c_str());
+    cJSON_AddStringToObject(job, "package", packageName.c_str());
+    cJSON_AddNumberToObject(job, "count", count);
+    conn.sendMessage(job);
+
+    bool done = false;
+    int failed = 0;
+    while (cJSON* message = conn.receiveMessage()) {
+        std::string type = readString(message, "type");
+        if (type == "accepted") {
+            logInfo("Job %d queued: %s on %u unit(s)", readInt(message, "job"), version.c_str(), count);
+        } else if (type == "result") {
+            bool ok = cJSON_IsTrue(cJSON_GetObjectItem(message, "ok"));
+            logInfo("  %s %s: %s", readString(message, "agent").c_str(),
+                    readString(message, "port").c_str(), ok ? "OK" : "FAILED");
+        } else if (type == "done") {
+            failed = readInt(message, "failed");
+            logInfo("%d of %u unit(s) flashed", readInt(message, "succeeded"), count);
+            done = true;
+        } else if (type == "error") {
+            logError("Coordinator: %s", readString(message, "message").c_str());
+            cJSON_Delete(message);
+            return false;
+        }
+        cJSON_Delete(message);
+        if (done) {
+            break;
+        }
+    }
+
+    if (!done) {
+        logError("Lost connection to coordinator");
+        return false;
+    }
+    return failed == 0;
+}
@@ -0,0 +1,820 @@
+/*
+ * NT Flash Tool - Device discovery and BLFWK operations
+ *
+ * Copyright (c) 2024
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <chrono>
+
+#include "nt_flash.h"
+
+// BLFWK includes
+#include "blfwk/Logging.h"
+#include "blfwk/utils.h"
+#include "blfwk/SDPCommand.h"
+#include "blfwk/UsbHidPacketizer.h"
+#include "blfwk/Peripheral.h"
+#include "hidapi.h"
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <limits.h>
+#endif
+
+#if defined(LINUX)
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#endif
+
+using namespace blfwk;
+
+//------------------------------------------------------------------------------
+// Device Discovery
+//------------------------------------------------------------------------------
+
+static std::mutex g_hidMutex;
+
+// Map a HID path to the USB port the device is plugged into. On Linux the
+// hidraw node's sysfs parent is the USB interface, named "<bus>-<ports>:<cfg>.<if>".
+// Elsewhere the HID path is the best identifier available.
+std::string usbPortForHidPath(const std::string& hidPath) {
+#if defined(LINUX)
+    size_t slash = hidPath.rfind('/');
+    std::string node = (slash == std::string::npos) ? hidPath : hidPath.substr(slash + 1);
+    std::string sysPath = "/sys/class/hidraw/" + node + "/device";
+
+    char resolved[PATH_MAX];
+    if (!realpath(sysPath.c_str(), resolved)) {
+        return hidPath;
+    }
+
+    std::string port;
+    const char* p = resolved;
+    while (*p) {
+        const char* end = strchr(p + 1, '/');
+        std::string component = end ? std::string(p + 1, end) : std::string(p + 1);
+        size_t colon = component.find(':');
+        size_t dash = component.find('-');
+        if (colon != std::string::npos && dash != std::string::npos && dash < colon &&
+            isdigit((unsigned char)component[0])) {
+            port = component.substr(0, colon);
+        }
+        if (!end) break;
+        p = end;
+    }
+    return port.empty() ? hidPath : port;
+#else
+    return hidPath;
+#endif
+}
+
+// Split a port such as "1-2.3" into the hub it hangs off ("1-2") and its host
+// controller's bus ("1"). Devices on root ports share the root hub ("1").
+// A port without topology (other platforms) is a group of its own.
+void usbTopology(const std::string& port, std::string& hub, std::string& controller) {
+    size_t dash = port.find('-');
+    if (dash == 0 || dash == std::string::npos || dash + 1 == port.size() ||
+        port.find_first_not_of("0123456789.", dash + 1) != std::string::npos) {
+        hub = port;
+        controller = port;
+        return;
+    }
+    controller = port.substr(0, dash);
+    size_t dot = port.rfind('.');
+    hub = (dot == std::string::npos || dot < dash) ? controller : port.substr(0, dot);
+}
+
+#if defined(LINUX)
+static double readSpeed(const std::string& sysName) {
+    FILE* f = fopen(("/sys/bus/usb/devices/" + sysName + "/speed").c_str(), "r");
+    if (!f) {
+        return 0;
+    }
+    double speed = 0;
+    if (fscanf(f, "%lf", &speed) != 1) speed = 0;
+    fclose(f);
+    return speed;
+}
+#endif
+
+// Negotiated speed of the device on a port ("1-2.3") and of the hubs above
+// it ("1-2", then root hub "usb1")
+bool readUsbLink(const std::string& port, UsbLink& link) {
+    link = UsbLink();
+#if defined(LINUX)
+    link.speedMbps = readSpeed(port);
+    if (link.speedMbps == 0) {
+        return false;
+    }
+    std::string hub = port;
+    size_t dot;
+    while ((dot = hub.rfind('.')) != std::string::npos && dot > hub.find('-')) {
+        hub.erase(dot);
+        link.hubs.push_back(std::make_pair(hub, readSpeed(hub)));
+    }
+    size_t dash = port.find('-');
+    if (dash != std::string::npos) {
+        // "1-2" is on a root port: its parent is the bus's root hub
+        std::string root = "usb" + port.substr(0, dash);
+        link.hubs.push_back(std::make_pair(root, readSpeed(root)));
+    }
+    return true;
+#else
+    (void)port;
+    return false;
+#endif
+}
+
+static std::string formatSpeed(double mbps) {
+    char text[16];
+    snprintf(text, sizeof(text), "%gM", mbps);
+    return text;
+}
+
+// "480M via 1-2 (12M), usb1 (480M)"
+std::string describeUsbLink(const UsbLink& link) {
+    if (link.speedMbps == 0) {
+        return "unknown speed";
+    }
+    std::string text = formatSpeed(link.speedMbps);
+    for (size_t i = 0; i < link.hubs.size(); i++) {
+        text += (i == 0) ? " via " : ", ";
+        text += link.hubs[i].first + " (" + formatSpeed(link.hubs[i].second) + ")";
+    }
+    return text;
+}
+
+bool checkLinkThroughput(const UsbLink& link, uint64_t bytes, double seconds) {
+    if (link.speedMbps == 0 || seconds <= 0 || bytes == 0) {
+        return false;
+    }
+    double ceiling = link.speedMbps < 480 ? USB_FULL_SPEED_CEILING : USB_HIGH_SPEED_CEILING;
+    double rate = bytes / seconds;
+    if (rate < ceiling * USB_LINK_BOUND) {
+        return false;
+    }
+
+    // Name the slowest hub if it holds the device back, else the device's own link
+    std::string cause = "the device negotiated " + formatSpeed(link.speedMbps) + " (check cable and port)";
+    for (size_t i = 0; i < link.hubs.size(); i++) {
+        if (link.hubs[i].second > 0 && link.hubs[i].second <= link.speedMbps && link.hubs[i].second < 480) {
+            cause = "hub " + link.hubs[i].first + " runs at " + formatSpeed(link.hubs[i].second);
+            break;
+        }
+    }
+    char message[256];
+    snprintf(message, sizeof(message), "Write at %.2f MB/s is limited by the USB link (ceiling %.2f MB/s): %s",
+             rate / (1024.0 * 1024.0), ceiling / (1024.0 * 1024.0), cause.c_str());
+    logInfo("WARNING: %s", message);
+    machineWarning("LINK_BOTTLENECK", message);
+    return true;
+}
+
+static void appendDevices(uint16_t vid, uint16_t pid, bool flashloader, std::vector<UsbDevice>& devices) {
+    struct hid_device_info* list = hid_enumerate(vid, pid);
+    for (struct hid_device_info* info = list; info; info = info->next) {
+        UsbDevice dev;
+        dev.path = info->path;
+        dev.port = usbPortForHidPath(dev.path);
+        for (const wchar_t* c = info->serial_number; c && *c; c++) {
+            dev.serial += (*c > 0x20 && *c < 0x7f) ? (char)*c : '?';
+        }
+        dev.flashloader = flashloader;
+        readUsbLink(dev.port, dev.link);
+        devices.push_back(dev);
+    }
+    hid_free_enumeration(list);
+}
+
+// List every disting NT in SDP or flashloader mode
+std::vector<UsbDevice> enumerateDevices() {
+    std::lock_guard<std::mutex> lock(g_hidMutex);
+    std::vector<UsbDevice> devices;
+    appendDevices(SDP_VID, SDP_PID, false, devices);
+    appendDevices(BL_VID, BL_PID, true, devices);
+    return devices;
+}
+
+bool findDeviceOnPort(const std::string& port, UsbDevice& device) {
+    std::vector<UsbDevice> devices = enumerateDevices();
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (devices[i].port == port) {
+            device = devices[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Poll until the flashloader enumerates on the given port
+bool waitForFlashloader(const std::string& port, uint32_t timeoutMs, std::string& path) {
+    for (uint32_t waited = 0; waited < timeoutMs; waited += 200) {
+        UsbDevice dev;
+        if (findDeviceOnPort(port, dev) && dev.flashloader) {
+            path = dev.path;
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    return false;
+}
+
+#if defined(LINUX)
+static bool readUsbId(const std::string& port, const char* attribute, unsigned& id) {
+    FILE* f = fopen(("/sys/bus/usb/devices/" + port + "/" + attribute).c_str(), "r");
+    if (!f) {
+        return false;
+    }
+    bool ok = fscanf(f, "%x", &id) == 1;
+    fclose(f);
+    return ok;
+}
+#endif
+
+BootWatch::~BootWatch() {
+#if defined(LINUX)
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+#endif
+}
+
+bool BootWatch::supported() {
+#if defined(LINUX)
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool BootWatch::start(const std::string& port) {
+#if defined(LINUX)
+    m_port = port;
+    m_active = !port.empty();
+    if (!m_active || m_fd >= 0) {
+        return m_active;
+    }
+    // Without the uevent socket the wait falls back to re-checking sysfs
+    m_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (m_fd >= 0) {
+        struct sockaddr_nl addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1;   // Kernel events
+        if (bind(m_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(m_fd);
+            m_fd = -1;
+        }
+    }
+    return true;
+#else
+    (void)port;
+    return false;
+#endif
+}
+
+bool BootWatch::wait(uint32_t timeoutMs) {
+#if defined(LINUX)
+    if (!m_active) {
+        return false;
+    }
+    m_active = false;
+    double deadline = nowSeconds() + timeoutMs / 1000.0;
+    for (;;) {
+        unsigned vid;
+        unsigned pid;
+        if (readUsbId(m_port, "idVendor", vid) && readUsbId(m_port, "idProduct", pid) &&
+            !(vid == SDP_VID && pid == SDP_PID) && !(vid == BL_VID && pid == BL_PID)) {
+            logVerbose("Application enumerated on USB port %s (%04X:%04X)", m_port.c_str(), vid, pid);
+            return true;
+        }
+        double remaining = deadline - nowSeconds();
+        if (remaining <= 0) {
+            logError("Firmware did not boot on USB port %s within %gs", m_port.c_str(), timeoutMs / 1000.0);
+            return false;
+        }
+        int waitMs = (int)std::min(remaining * 1000 + 1, (double)BOOT_POLL_MS);
+        if (m_fd >= 0) {
+            // Any uevent is reason to look again; drain them all
+            struct pollfd pfd = { m_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, waitMs) > 0) {
+                char event[4096];
+                while (recv(m_fd, event, sizeof(event), MSG_DONTWAIT) > 0) {
+                }
+            }
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(waitMs));
+        }
+    }
+#else
+    (void)timeoutMs;
+    return false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// SDP Operations (ROM Bootloader)
+//------------------------------------------------------------------------------
+
+SDPOperations::~SDPOperations() {
+    close();
+}
+
+// Connect to the SDP device at the given HID path (first one found if empty)
+bool SDPOperations::connect(const std::string& path) {
+    if (g_dryRun) {
+        logVerbose("[DRY RUN] Would connect to SDP device %04X:%04X", SDP_VID, SDP_PID);
+        return true;
+    }
+
+    TraceScope trace("sdp-connect", "sdp");
+    try {
+        m_peripheral = new UsbHidPeripheral(SDP_VID, SDP_PID, "", path.c_str());
+        m_packetizer = new SDPUsbHidPacketizer(m_peripheral, SDP_TIMEOUT_MS);
+
+        // Test with error-status command
+        string_vector_t cmdArgs;
+        cmdArgs.push_back("error-status");
+
+        SDPCommand* cmd = SDPCommand::create(&cmdArgs);
+        if (!cmd) {
+            throw std::runtime_error("Failed to create error-status command");
+        }
+
+        cmd->sendTo(*m_packetizer);
+
+        const uint32_vector_t* response = cmd->getResponseValues();
+        if (response->size() == 0 || response->at(0) == SDPCommand::kStatus_NoResponse) {
+            delete cmd;
+            throw std::runtime_error("No response from device");
+        }
+
+        logVerbose("SDP connected (status: 0x%08X)", response->at(0));
+        delete cmd;
+        return true;
+    }
+    catch (const std::exception& e) {
+        logVerbose("SDP connection failed: %s", e.what());
+        close();
+        return false;
+    }
+}
+
+bool SDPOperations::writeFile(uint32_t address, const std::string& filePath) {
+    if (g_dryRun) {
+        logVerbose("[DRY RUN] Would write file to 0x%08X", address);
+        return true;
+    }
+
+    TraceScope trace("write-file", "sdp");
+    try {
+        char addrStr[32];
+        snprintf(addrStr, sizeof(addrStr), "0x%X", address);
+
+        string_vector_t cmdArgs;
+        cmdArgs.push_back("write-file");
+        cmdArgs.push_back(addrStr);
+        cmdArgs.push_back(filePath);
+
+        SDPCommand* cmd = SDPCommand::create(&cmdArgs);
+        if (!cmd) {
+            logError("Failed to create write-file command");
+            return false;
+        }
+
+        Progress progress(displayProgress, nullptr);
+        cmd->registerProgress(&progress);
+
+        cmd->sendTo(*m_packetizer);
+
+        const uint32_vector_t* response = cmd->getResponseValues();
+        bool success = (response->size() > 0 && response->at(0) != SDPCommand::kStatus_NoResponse);
+
+        delete cmd;
+
+        if (!success) {
+            logError("write-file command failed");
+            return false;
+        }
+
+        logVerbose("File written to 0x%08X", address);
+        return true;
+    }
+    catch (const std::exception& e) {
+        logError("write-file failed: %s", e.what());
+        return false;
+    }
+}
+
+bool SDPOperations::jumpAddress(uint32_t address) {
+    if (g_dryRun) {
+        logVerbose("[DRY RUN] Would jump to 0x%08X", address);
+        return true;
+    }
+
+    TraceScope trace("jump-address", "sdp");
+    try {
+        char addrStr[32];
+        snprintf(addrStr, sizeof(addrStr), "0x%X", address);
+
+        string_vector_t cmdArgs;
+        cmdArgs.push_back("jump-address");
+        cmdArgs.push_back(addrStr);
+
+        SDPCommand* cmd = SDPCommand::create(&cmdArgs);
+        if (!cmd) {
+            logError("Failed to create jump-address command");
+            return false;
+        }
+
+        cmd->sendTo(*m_packetizer);
+        delete cmd;
+
+        logVerbose("Jump command sent to 0x%08X", address);
+        return true;
+    }
+    catch (const std::exception& e) {
+        // Expected - device disconnects
+        logVerbose("Jump command completed (device disconnected)");
+        return true;
+    }
+}
+
+void SDPOperations::close() {
+    if (m_packetizer) {
+        delete m_packetizer;
+        m_packetizer = nullptr;
+    }
+    // Peripheral is owned by packetizer, don't double-delete
+    m_peripheral = nullptr;
+}
+
+//------------------------------------------------------------------------------
+// Bootloader Operations (Flashloader)
+//------------------------------------------------------------------------------
+
+BootloaderOperations::~BootloaderOperations() {
+    close();
+}
+
+// Connect to the flashloader at the given HID path (first one found if empty)
+bool BootloaderOperations::connect(const std::string& path) {
+    if (g_dryRun) {
+        logVerbose("[DRY RUN] Would connect to bootloader %04X:%04X", BL_VID, BL_PID);
+        return true;
+    }
+
+    // Try multiple times as device may take time to enumerate
+    for (int attempt = 0; attempt < 5; attempt++) {
+        TraceScope trace("bl-connect", "command");
+        try {
+            Peripheral::PeripheralConfigData config;
+            config.peripheralType = Peripheral::kHostPeripheralType_USB_HID;
+            config.usbHidVid = BL_VID;
+            config.usbHidPid = BL_PID;
+            config.usbPath = path;
+            config.packetTimeoutMs = BL_TIMEOUT_MS;
+            config.ping = false;
+
+            m_bootloader = new Bootloader(config);
+
+            // Test with get-property command
+            string_vector_t cmdArgs;
+            cmdArgs.push_back("get-property");
+            cmdArgs.push_back("1");  // Current version
+
+            Command* cmd = Command::create(&cmdArgs);
+            if (!cmd) {
+                throw std::runtime_error("Failed to create get-property command");
+            }
+
+            m_bootloader->inject(*cmd);
+            m_bootloader->flush();
+
+            const uint32_vector_t* response = cmd->getResponseValues();
+            if (response->size() > 0 && response->at(0) != kStatus_NoResponse) {
+                logVerbose("Bootloader connected");
+                delete cmd;
+                queryCompressedWrite();
+                queryFlashDigest();
+                return true;
+            }
+
+            delete cmd;
+            close();
+        }
+        catch (...) {
+            close();
+        }
+
+        logVerbose("Bootloader not ready, retrying... (%d/5)", attempt + 1);
+#ifdef WIN32
+        Sleep(1000);
+#else
+        sleep(1);
+#endif
+    }
+
+    logError("Failed to connect to bootloader");
+    return false;
+}
+
+// get-property for a vendor tag. NXP's own flashloader does not know these
+// and answers with an error status, which is expected, so it is not reported.
+bool BootloaderOperations::queryProperty(uint32_t tag, uint32_vector_t& response) {
+    char tagStr[32];
+    snprintf(tagStr, sizeof(tagStr), "%u", tag);
+
+    string_vector_t args;
+    args.push_back("get-property");
+    args.push_back(tagStr);
+
+    try {
+        Command* cmd = Command::create(&args);
+        if (!cmd) {
+            return false;
+        }
+        m_bootloader->inject(*cmd);
+        m_bootloader->flush();
+        response = *cmd->getResponseValues();
+        delete cmd;
+    }
+    catch (const std::exception& e) {
+        logVerbose("Property %u query failed: %s", tag, e.what());
+        return false;
+    }
+    return !response.empty() && response[0] == kStatus_Success;
+}
+
+// Ask the flashloader whether it expands compressed writes
+void BootloaderOperations::queryCompressedWrite() {
+    m_compressed = CompressedWrite();
+    if (!g_compressWrites) {
+        return;
+    }
+
+    // status, format version, largest frame, alias base
+    uint32_vector_t response;
+    if (queryProperty(PROPERTY_COMPRESSED_WRITE, response) && response.size() >= 4 &&
+        response[1] == COMPRESSED_WRITE_VERSION && response[2] != 0) {
+        m_compressed.version = response[1];
+        m_compressed.frameSize = std::min(response[2], WRITE_CHUNK_SIZE);
+        m_compressed.alias = response[3];
+    }
+
+    if (m_compressed.version) {
+        logVerbose("Flashloader expands compressed writes (frames of %u bytes)", m_compressed.frameSize);
+    } else {
+        logVerbose("Flashloader does not offer compressed writes");
+    }
+}
+
+// Ask the flashloader whether it digests flash for --verify
+void BootloaderOperations::queryFlashDigest() {
+    m_digest = FlashDigest();
+    if (!g_verifyWrites) {
+        return;
+    }
+
+    // status, format version, sector size, CRC32 view, SHA-256 view
+    uint32_vector_t response;
+    if (queryProperty(PROPERTY_FLASH_DIGEST, response) && response.size() >= 5 &&
+        response[1] == FLASH_DIGEST_VERSION && response[2] != 0 && (response[3] || response[4])) {
+        m_digest.version = response[1];
+        m_digest.sectorSize = response[2];
+        m_digest.crc32View = response[3];
+        m_digest.sha256View = response[4];
+    }
+
+    if (m_digest.version) {
+        logVerbose("Flashloader digests flash (%s per %u-byte sector)", m_digest.crc32View ? "CRC32" : "SHA-256",
+                   m_digest.sectorSize);
+    } else {
+        logVerbose("Flashloader does not offer flash digests, verifying by read-back");
+    }
+}
+
+bool BootloaderOperations::runCommand(const string_vector_t& args, uint32_vector_t* responseValues) {
+    if (g_dryRun) {
+        std::string cmdStr;
+        for (size_t i = 0; i < args.size(); i++) {
+            if (i > 0) cmdStr += " ";
+            cmdStr += args[i];
+        }
+        logVerbose("[DRY RUN] Would run: %s", cmdStr.c_str());
+        return true;
+    }
+
+    try {
+        Command* cmd = Command::create(&args);
+        if (!cmd) {
+            logError("Failed to create command: %s", args[0].c_str());
+            return false;
+        }
+
+        // Register progress for write-memory / read-memory
+        bool success = execute(cmd, args[0].c_str(), responseValues, true);
+
+        delete cmd;
+        return success;
+    }
+    catch (const std::exception& e) {
+        logError("Command failed: %s", e.what());
+        return false;
+    }
+}
+
+bool BootloaderOperations::fillMemory(uint32_t address, uint32_t size, uint32_t pattern) {
+    char addrStr[32], sizeStr[32], patternStr[32];
+    snprintf(addrStr, sizeof(addrStr), "0x%X", address);
+    snprintf(sizeStr, sizeof(sizeStr), "%u", size);
+    snprintf(patternStr, sizeof(patternStr), "0x%X", pattern);
+
+    string_vector_t args;
+    args.push_back("fill-memory");
+    args.push_back(addrStr);
+    args.push_back(sizeStr);
+    args.push_back(patternStr);
+    args.push_back("word");
+
+    return runCommand(args);
+}
+
+bool BootloaderOperations::configureMemory(uint32_t memoryId, uint32_t configAddr) {
+    char memIdStr[32], addrStr[32];
+    snprintf(memIdStr, sizeof(memIdStr), "%u", memoryId);
+    snprintf(addrStr, sizeof(addrStr), "0x%X", configAddr);
+
+    string_vector_t args;
+    args.push_back("configure-memory");
+    args.push_back(memIdStr);
+    args.push_back(addrStr);
+
+    return runCommand(args);
+}
+
+bool BootloaderOperations::flashEraseRegion(uint32_t address, uint32_t size, uint32_t memoryId) {
+    char addrStr[32], sizeStr[32], memIdStr[32];
+    snprintf(addrStr, sizeof(addrStr), "0x%X", address);
+    snprintf(sizeStr, sizeof(sizeStr), "%u", size);
+    snprintf(memIdStr, sizeof(memIdStr), "%u", memoryId);
+
+    string_vector_t args;
+    args.push_back("flash-erase-region");
+    args.push_back(addrStr);
+    args.push_back(sizeStr);
+    args.push_back(memIdStr);  // Explicit memory ID (0 = internal/memory-mapped)
+
+    return runCommand(args);
+}
+
+bool BootloaderOperations::writeMemory(uint32_t address, const std::string& filePath, uint32_t memoryId) {
+    char addrStr[32], memIdStr[32];
+    snprintf(addrStr, sizeof(addrStr), "0x%X", address);
+    snprintf(memIdStr, sizeof(memIdStr), "%u", memoryId);
+
+    string_vector_t args;
+    args.push_back("write-memory");
+    args.push_back(addrStr);
+    args.push_back(filePath);
+    args.push_back(memIdStr);  // Explicit memory ID (0 = internal/memory-mapped)
+
+    return runCommand(args);
+}
+
+// Write a buffer straight from memory (no temp file round-trip). Flash
+// writes go compressed when the flashloader offers it and it saves bytes.
+bool BootloaderOperations::writeData(uint32_t address, const uint8_t* data, size_t size, size_t* sent) {
+    if (sent) *sent = size;
+    if (g_dryRun) {
+        logVerbose("[DRY RUN] Would write %zu bytes to 0x%08X", size, address);
+        return true;
+    }
+
+    try {
+        if (m_compressed.version && address >= FLASH_BASE) {
+            compressFrames(data, size, m_compressed.frameSize, m_payload);
+            if (m_payload.size() < size) {
+                if (sent) *sent = m_payload.size();
+                WriteMemory cmd(m_compressed.alias + (address - FLASH_BASE), m_payload);
+                return execute(&cmd, "write-memory", nullptr, false);
+            }
+        }
+        WriteMemory cmd(address, uchar_vector_t(data, data + size));
+        return execute(&cmd, "write-memory", nullptr, false);
+    }
+    catch (const std::exception& e) {
+        logError("Command failed: %s", e.what());
+        return false;
+    }
+}
+
+bool BootloaderOperations::readMemory(uint32_t address, uint32_t size, const std::string& filePath, uint32_t memoryId) {
+    char addrStr[32], sizeStr[32], memIdStr[32];
+    snprintf(addrStr, sizeof(addrStr), "0x%X", address);
+    snprintf(sizeStr, sizeof(sizeStr), "%u", size);
+    snprintf(memIdStr, sizeof(memIdStr), "%u", memoryId);
+
+    string_vector_t args;
+    args.push_back("read-memory");
+    args.push_back(addrStr);
+    args.push_back(sizeStr);
+    args.push_back(filePath);
+    args.push_back(memIdStr);
+
+    return runCommand(args);
+}
+
+// Query flash geometry (get-property 25 <memoryId>). Leaves the defaults
+// in place when the flashloader does not report the attributes.
+bool BootloaderOperations::getFlashGeometry(uint32_t memoryId, FlashGeometry& geometry) {
+    char memIdStr[32];
+    snprintf(memIdStr, sizeof(memIdStr), "%u", memoryId);
+
+    string_vector_t args;
+    args.push_back("get-property");
+    args.push_back("25");  // External memory attributes
+    args.push_back(memIdStr);
+
+    uint32_vector_t response;
+    if (!runCommand(args, &response)) {
+        return false;
+    }
+
+    // status, available-attributes flags, start, size (KB), page, sector, block
+    if (response.size() >= 7) {
+        uint32_t flags = response[1];
+        if (flags & 0x01) geometry.startAddress = response[2];
+        if ((flags & 0x02) && response[3] != 0) geometry.totalSize = response[3] * 1024;
+        if ((flags & 0x04) && response[4] != 0) geometry.pageSize = response[4];
+        if ((flags & 0x08) && response[5] != 0) geometry.sectorSize = response[5];
+        if ((flags & 0x10) && response[6] != 0) geometry.blockSize = response[6];
+    }
+
+    logVerbose("Flash geometry: %u bytes at 0x%08X (page %u, sector %u, block %u)",
+               geometry.totalSize, geometry.startAddress, geometry.pageSize,
+               geometry.sectorSize, geometry.blockSize);
+    return true;
+}
+
+bool BootloaderOperations::reset() {
+    string_vector_t args;
+    args.push_back("reset");
+
+    try {
+        runCommand(args);
+    }
+    catch (...) {
+        // Expected - device disconnects
+    }
+    return true;
+}
+
+// Per-command progress display (off when several devices share the console)
+void BootloaderOperations::setShowProgress(bool show) {
+    m_showProgress = show;
+}
+
+void BootloaderOperations::close() {
+    if (m_bootloader) {
+        delete m_bootloader;
+        m_bootloader = nullptr;
+    }
+}
+
+bool BootloaderOperations::execute(Command* cmd, const char* name, uint32_vector_t* responseValues, bool showProgress) {
+    TraceScope trace(name, "command");
+    Progress progress(displayProgress, nullptr);
+    if (showProgress && m_showProgress) {
+        cmd->registerProgress(&progress);
+    }
+
+    m_bootloader->inject(*cmd);
+    m_bootloader->flush();
+
+    const uint32_vector_t* response = cmd->getResponseValues();
+    bool success = true;
+
+    if (response->size() > 0) {
+        uint32_t status = response->at(0);
+        if (status == kStatus_NoResponse) {
+            logError("No response for command: %s", name);
+            success = false;
+        } else if (status != kStatus_Success && status != kStatus_NoResponseExpected) {
+            logError("Command %s failed with status: 0x%X", name, status);
+            success = false;
+        }
+    }
+
+    if (responseValues) {
+        *responseValues = *response;
+    }
+    return success;
+}
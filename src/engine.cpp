@@ -0,0 +1,813 @@
+/*
+ * NT Flash Tool - Event-loop flash engine and device transports
+ *
+ * Copyright (c) 2024
+ */
+
+#include <algorithm>
+#include <chrono>
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// Topology Scheduler
+//------------------------------------------------------------------------------
+
+void TopologyScheduler::addDevice(const std::string& port) {
+    std::string hub;
+    std::string controller;
+    usbTopology(port, hub, controller);
+    m_hub.push_back(hub);
+    m_controller.push_back(controller);
+    m_holding.push_back(0);
+}
+
+bool TopologyScheduler::tryAcquire(size_t device) {
+    uint32_t& hubActive = m_hubActive[m_hub[device]];
+    uint32_t& controllerActive = m_controllerActive[m_controller[device]];
+    if ((m_limits.perHub && hubActive >= m_limits.perHub) ||
+        (m_limits.perController && controllerActive >= m_limits.perController)) {
+        return false;
+    }
+    hubActive++;
+    controllerActive++;
+    m_holding[device] = 1;
+    return true;
+}
+
+void TopologyScheduler::release(size_t device) {
+    if (!m_holding[device]) {
+        return;
+    }
+    m_hubActive[m_hub[device]]--;
+    m_controllerActive[m_controller[device]]--;
+    m_holding[device] = 0;
+}
+
+//------------------------------------------------------------------------------
+// Flash Engine
+//------------------------------------------------------------------------------
+
+const char* engineStateName(EngineState state) {
+    switch (state) {
+        case kStateFind:       return "FIND";
+        case kStateSdpConnect: return "SDP_CONNECT";
+        case kStateSdpUpload:  return "SDP_UPLOAD";
+        case kStateSdpJump:    return "SDP_JUMP";
+        case kStateWaitEnum:   return "WAIT_ENUM";
+        case kStateBlConnect:  return "BL_CONNECT";
+        case kStateProgram:    return "PROGRAM";
+        case kStateVerify:     return "VERIFY";
+        case kStateReset:      return "RESET";
+        case kStateBootWait:   return "BOOT_WAIT";
+        case kStateDone:       return "COMPLETE";
+        case kStateFailed:     return "FAILED";
+    }
+    return "UNKNOWN";
+}
+
+FlashEngine::FlashEngine(const FirmwarePackage* pkg, const ScheduleLimits& limits)
+    : m_pkg(pkg), m_active(0), m_writeSteps(0), m_cancel(false), m_virtual(false), m_clock(0),
+      m_maxActive(0), m_started(0), m_cancelled(false), m_scheduler(limits), m_ioIdle(0), m_ioStop(false) {
+    for (size_t i = 0; i < pkg->program.steps.size(); i++) {
+        if (pkg->program.steps[i].args.empty()) m_writeSteps++;
+    }
+}
+
+FlashEngine::~FlashEngine() {
+    {
+        std::lock_guard<std::mutex> lock(m_ioMutex);
+        m_ioStop = true;
+    }
+    m_ioWake.notify_all();
+    for (size_t i = 0; i < m_ioThreads.size(); i++) {
+        m_ioThreads[i].join();
+    }
+    for (size_t i = 0; i < m_devices.size(); i++) {
+        delete m_devices[i].transport;
+    }
+}
+
+size_t FlashEngine::addDevice(const std::string& port, FlashTransport* transport) {
+    Device dev;
+    dev.port = port;
+    dev.transport = transport;
+    dev.state = kStateFind;
+    dev.stage = nullptr;
+    dev.step = 0;
+    dev.writeIndex = 0;
+    dev.opStarted = 0;
+    dev.timedStage = nullptr;
+    dev.stageStarted = 0;
+    dev.started = 0;
+    m_devices.push_back(dev);
+    m_scheduler.addDevice(port);
+    m_active++;
+    return m_devices.size() - 1;
+}
+
+double FlashEngine::now() const {
+    return m_virtual ? m_clock : nowSeconds();
+}
+
+void FlashEngine::useVirtualClock() {
+    m_virtual = true;
+    m_clock = nowSeconds();
+}
+
+void FlashEngine::setMaxActive(size_t devices) {
+    m_maxActive = devices;
+}
+
+// Start devices not yet started while there is room under setMaxActive()
+void FlashEngine::startWaitingDevices() {
+    size_t finished = m_devices.size() - m_active;
+    while (m_started < m_devices.size() && (!m_maxActive || m_started - finished < m_maxActive)) {
+        size_t i = m_started++;
+        g_deviceTag = m_devices[i].port.c_str();
+        logInfo("=== Starting disting NT flash ===");
+        machineStatus("START", 0, "Starting disting NT flash");
+        metricsFlashStarted();
+        m_devices[i].started = now();
+        enter(i);
+        finished = m_devices.size() - m_active;
+    }
+}
+
+void FlashEngine::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);   // Or the loop could miss the wake
+        m_cancel = true;
+    }
+    m_wake.notify_all();
+}
+
+// After cancel(): stop the devices waiting on a timer or for a bus slot.
+// Those on the I/O pool stop in enter() once their operation returns, and
+// those not started yet as they start.
+void FlashEngine::cancelPending() {
+    m_cancelled = true;
+    std::vector<size_t> pending(m_waiting.begin(), m_waiting.end());
+    for (size_t i = 0; i < m_timers.size(); i++) {
+        pending.push_back(m_timers[i].device);
+    }
+    m_waiting.clear();
+    m_timers.clear();
+    for (size_t i = 0; i < pending.size(); i++) {
+        Device& dev = m_devices[pending[i]];
+        if (dev.state == kStateDone || dev.state == kStateFailed) {
+            continue;
+        }
+        g_deviceTag = dev.port.c_str();
+        logError("Cancelled");
+        finish(pending[i], kStateFailed, "CANCELLED");
+    }
+}
+
+void FlashEngine::complete(size_t device, OpResult result) {
+    Completion done = { device, result };
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_completions.push_back(done);
+    }
+    m_wake.notify_one();
+}
+
+void FlashEngine::completeAt(size_t device, double when, OpResult result) {
+    Timer timer = { when, device, result };
+    m_timers.push_back(timer);
+    std::push_heap(m_timers.begin(), m_timers.end(), std::greater<Timer>());
+}
+
+void FlashEngine::submit(size_t device, std::function<OpResult()> work) {
+    std::lock_guard<std::mutex> lock(m_ioMutex);
+    m_ioQueue.push_back(std::make_pair(device, work));
+    if (m_ioQueue.size() > m_ioIdle && m_ioThreads.size() < ENGINE_IO_THREADS) {
+        m_ioThreads.push_back(std::thread(&FlashEngine::ioWorker, this));
+    } else {
+        m_ioWake.notify_one();
+    }
+}
+
+void FlashEngine::ioWorker() {
+    std::unique_lock<std::mutex> lock(m_ioMutex);
+    for (;;) {
+        m_ioIdle++;
+        m_ioWake.wait(lock, [this] { return m_ioStop || !m_ioQueue.empty(); });
+        m_ioIdle--;
+        if (m_ioQueue.empty()) {
+            return;
+        }
+        std::pair<size_t, std::function<OpResult()> > job = m_ioQueue.front();
+        m_ioQueue.pop_front();
+        lock.unlock();
+
+        g_deviceTag = m_devices[job.first].port.c_str();
+        complete(job.first, job.second());
+
+        lock.lock();
+    }
+}
+
+// Bulk transfers that compete for bus bandwidth; everything else is a short
+// command round trip or a wait
+static bool isDataHeavy(const TransportOp& op) {
+    if (op.state == kStateSdpUpload || op.state == kStateVerify) {
+        return true;
+    }
+    return op.state == kStateProgram && (op.step->args.empty() || op.step->args[0] == "read-memory");
+}
+
+// Take or give back the device's bandwidth slot for its next operation.
+// Returns false if the device has to wait for a slot.
+bool FlashEngine::admit(size_t device, const TransportOp& op) {
+    if (!isDataHeavy(op)) {
+        if (m_scheduler.holding(device)) {
+            m_scheduler.release(device);
+        }
+        return true;
+    }
+    if (m_scheduler.holding(device) || m_scheduler.tryAcquire(device)) {
+        return true;
+    }
+    logVerbose("Waiting for USB bandwidth on hub %s", m_scheduler.hub(device).c_str());
+    m_waiting.push_back(device);
+    return false;
+}
+
+// Start waiting devices that now fit, oldest first
+void FlashEngine::admitWaiting() {
+    size_t count = m_waiting.size();
+    for (size_t i = 0; i < count; i++) {
+        size_t device = m_waiting.front();
+        m_waiting.pop_front();
+        if (m_scheduler.tryAcquire(device)) {
+            enter(device);
+        } else {
+            m_waiting.push_back(device);
+        }
+    }
+}
+
+// Log the device's new state and start its operation
+void FlashEngine::enter(size_t device) {
+    Device& dev = m_devices[device];
+    g_deviceTag = dev.port.c_str();
+
+    bool cancelled = m_cancel.load();
+    if (cancelled) {
+        logError("Cancelled");
+    }
+    if (cancelled || flashCancelled()) {
+        finish(device, kStateFailed, "CANCELLED");
+        return;
+    }
+
+    TransportOp op;
+    op.state = dev.state;
+    if (dev.state == kStateProgram) {
+        op.step = &m_pkg->program.steps[dev.step];
+    }
+    if (dev.state != kStateProgram) {
+        stageChanged(dev, engineStateName(dev.state));
+    } else if (op.step->stage) {
+        stageChanged(dev, op.step->stage);
+    }
+    op.stage = dev.timedStage;
+    if (!admit(device, op)) {
+        return;
+    }
+
+    switch (dev.state) {
+        case kStateSdpConnect:
+            logInfo("[1/7] Connecting to SDP bootloader...");
+            machineStatus("SDP_CONNECT", 5, "Connecting to SDP bootloader");
+            break;
+        case kStateSdpUpload:
+            logInfo("[2/7] Uploading flashloader to RAM...");
+            machineStatus("SDP_UPLOAD", 15, "Uploading flashloader to RAM");
+            break;
+        case kStateSdpJump:
+            logInfo("[3/7] Starting flashloader...");
+            machineStatus("SDP_JUMP", 25, "Starting flashloader");
+            break;
+        case kStateWaitEnum:
+            logInfo("[4/7] Waiting for flashloader to start...");
+            machineStatus("WAIT_ENUM", 30, "Waiting for flashloader to start");
+            break;
+        case kStateBlConnect:
+            logInfo("[5/7] Connecting to flashloader...");
+            machineStatus("BL_CONNECT", 40, "Connecting to flashloader");
+            break;
+        case kStateProgram: {
+            const FlashStep& step = m_pkg->program.steps[dev.step];
+            if (!step.info.empty()) logInfo("%s", step.info.c_str());
+            if (step.stage) {
+                machineStatus(step.stage, step.percent, step.message);
+                dev.stage = step.stage;
+            }
+            if (!step.detail.empty()) logVerbose("%s", step.detail.c_str());
+            break;
+        }
+        case kStateVerify:
+            logInfo("Verifying flash...");
+            machineStatus("VERIFY", 92, "Verifying flash");
+            break;
+        case kStateReset:
+            logInfo("Resetting device...");
+            machineStatus("RESET", 95, "Resetting device");
+            break;
+        case kStateBootWait:
+            logInfo("Waiting for firmware to boot...");
+            machineStatus("BOOT_WAIT", 97, "Waiting for firmware to boot");
+            break;
+        default:
+            break;
+    }
+
+    dev.opStarted = now();
+    dev.transport->start(*this, device, op);
+}
+
+// The device's outstanding operation finished: move to the next state
+void FlashEngine::advance(size_t device, OpResult result) {
+    Device& dev = m_devices[device];
+    g_deviceTag = dev.port.c_str();
+
+    if (result == kOpRetry) {
+        enter(device);
+        return;
+    }
+
+    double elapsed = now() - dev.opStarted;
+    if (result == kOpFailed) {
+        // A connect can fail while the device is still settling after enumeration
+        if ((dev.state == kStateSdpConnect || dev.state == kStateBlConnect) &&
+            dev.stats.retries < ENGINE_CONNECT_RETRIES) {
+            dev.stats.retries++;
+            logVerbose("Retrying %s...", engineStateName(dev.state));
+            traceInstant(dev.port.c_str(), "retry", "engine");
+            completeAt(device, now() + ENGINE_RETRY_DELAY, kOpRetry);
+            return;
+        }
+        if (dev.state == kStateWaitEnum) {
+            dev.stats.timedOut = true;
+        }
+        const char* stage = dev.state == kStateProgram && dev.stage ? dev.stage : engineStateName(dev.state);
+        logError("Flash failed during %s", stage);
+        finish(device, kStateFailed, stage);
+        return;
+    }
+
+    const std::vector<FlashStep>& steps = m_pkg->program.steps;
+    switch (dev.state) {
+        case kStateFind:
+            if (result == kOpSkipSdp) {
+                logInfo("Device already in flashloader mode, skipping SDP phase...");
+                machineStatus("BL_FOUND", 15, "Device already in flashloader mode");
+                dev.state = kStateBlConnect;
+            } else {
+                dev.state = kStateSdpConnect;
+            }
+            break;
+        case kStateSdpConnect:
+            dev.state = kStateSdpUpload;
+            break;
+        case kStateSdpUpload:
+            dev.state = kStateSdpJump;
+            break;
+        case kStateSdpJump:
+            dev.state = kStateWaitEnum;
+            break;
+        case kStateWaitEnum:
+            dev.stats.enumSeconds = elapsed;
+            traceInstant(dev.port.c_str(), "re-enumerated", "usb");
+            dev.state = kStateBlConnect;
+            break;
+        case kStateBlConnect:
+            dev.state = steps.empty() ? kStateReset : kStateProgram;
+            dev.step = 0;
+            break;
+        case kStateProgram:
+            if (steps[dev.step].args.empty()) {
+                size_t sent = dev.transport->lastWireBytes();
+                dev.stats.writeBytes += steps[dev.step].size;
+                dev.stats.wireBytes += sent ? sent : steps[dev.step].size;
+                dev.stats.writeSeconds += elapsed;
+                dev.writeIndex++;
+                g_currentStage = dev.stage ? dev.stage : "WRITE";
+                displayProgress((int)(dev.stats.writeBytes * 100 / m_pkg->program.writeBytes),
+                                (int)dev.writeIndex, (int)m_writeSteps);
+            }
+            if (++dev.step == steps.size()) {
+                dev.state = g_verifyWrites ? kStateVerify : kStateReset;
+            }
+            break;
+        case kStateVerify:
+            dev.state = kStateReset;
+            break;
+        case kStateReset:
+            if (g_bootTimeoutMs) {
+                dev.state = kStateBootWait;
+                break;
+            }
+            succeed(device);
+            return;
+        case kStateBootWait:
+            dev.stats.bootSeconds = elapsed;
+            logInfo("Firmware booted in %.2fs", elapsed);
+            traceInstant(dev.port.c_str(), "booted", "usb");
+            succeed(device);
+            return;
+        default:
+            return;
+    }
+
+    enter(device);
+}
+
+void FlashEngine::succeed(size_t device) {
+    Device& dev = m_devices[device];
+    logInfo("=== Flash complete! ===");
+    machineStatus("COMPLETE", 100, "Flash complete");
+    dev.stats.ok = true;
+    logCompressedWrites(dev.stats);
+    UsbLink link;
+    if (dev.transport->link(link)) {
+        checkLinkThroughput(link, dev.stats.wireBytes, dev.stats.writeSeconds);
+    }
+    finish(device, kStateDone);
+}
+
+void FlashEngine::finish(size_t device, EngineState state, const char* failedStage) {
+    Device& dev = m_devices[device];
+    m_scheduler.release(device);
+    stageChanged(dev, nullptr);
+    metricsFlashFinished(state == kStateDone, failedStage, &dev.stats);
+    traceSpan(dev.port.c_str(), state == kStateDone ? "flash" : "flash failed", "flash", dev.started, now());
+
+    JournalEntry entry;
+    entry.port = dev.port;
+    entry.serial = dev.transport->serial();
+    entry.version = m_pkg->version;
+    entry.firmwareHash = m_pkg->firmwareHash;
+    entry.failedStage = failedStage ? failedStage : "";
+    entry.seconds = now() - dev.started;
+    entry.stats = dev.stats;
+    entry.stages = dev.stageTimes;
+    journalFlash(entry);
+
+    dev.state = state;
+    m_active--;
+}
+
+// Close the timed stage and start the next; retries and waits for a bus slot
+// count towards the stage they delay
+void FlashEngine::stageChanged(Device& dev, const char* stage) {
+    if (dev.timedStage && stage && strcmp(dev.timedStage, stage) == 0) {
+        return;
+    }
+    double now = this->now();
+    if (dev.timedStage) {
+        metricsStageFinished(dev.timedStage, now - dev.stageStarted);
+        traceSpan(dev.port.c_str(), dev.timedStage, "stage", dev.stageStarted, now);
+        dev.stageTimes.push_back(std::make_pair(std::string(dev.timedStage), now - dev.stageStarted));
+    }
+    dev.timedStage = stage;
+    dev.stageStarted = now;
+}
+
+static std::chrono::steady_clock::time_point toTimePoint(double seconds) {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(seconds)));
+}
+
+size_t FlashEngine::run() {
+    ResourceScope usage("ENGINE");  // The loop itself, across all devices
+    startWaitingDevices();
+
+    std::vector<Completion> ready;
+    while (m_active > 0) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_completions.empty()) {
+                if (m_timers.empty()) {
+                    m_wake.wait(lock, [this] { return !m_completions.empty() || (m_cancel && !m_cancelled); });
+                } else if (m_virtual) {
+                    m_clock = std::max(m_clock, m_timers.front().when);   // Nothing happens until then
+                } else if (m_timers.front().when > now()) {
+                    m_wake.wait_until(lock, toTimePoint(m_timers.front().when),
+                                      [this] { return !m_completions.empty() || (m_cancel && !m_cancelled); });
+                }
+            }
+            ready.swap(m_completions);
+        }
+
+        for (size_t i = 0; i < ready.size(); i++) {
+            advance(ready[i].device, ready[i].result);
+        }
+        ready.clear();
+        if (m_cancel && !m_cancelled) {
+            cancelPending();
+        }
+
+        double now = this->now();
+        while (!m_timers.empty() && m_timers.front().when <= now) {
+            Timer timer = m_timers.front();
+            std::pop_heap(m_timers.begin(), m_timers.end(), std::greater<Timer>());
+            m_timers.pop_back();
+            advance(timer.device, timer.result);
+        }
+
+        if (!m_waiting.empty()) {
+            admitWaiting();
+        }
+        startWaitingDevices();
+    }
+    g_deviceTag = nullptr;
+
+    size_t succeeded = 0;
+    for (size_t i = 0; i < m_devices.size(); i++) {
+        if (m_devices[i].state == kStateDone) succeeded++;
+    }
+    return succeeded;
+}
+
+//------------------------------------------------------------------------------
+// USB Transport
+//------------------------------------------------------------------------------
+
+void UsbTransport::start(FlashEngine& engine, size_t device, const TransportOp& op) {
+    engine.submit(device, [this, op] {
+        ResourceScope usage(op.stage);
+        return run(op);
+    });
+}
+
+// Blocking part of each operation; runs on an I/O pool thread
+OpResult UsbTransport::run(const TransportOp& op) {
+    switch (op.state) {
+        case kStateFind: {
+            if (g_dryRun) {
+                return kOpOk;
+            }
+            UsbDevice dev;
+            if (!findDeviceOnPort(m_port, dev)) {
+                logError("No disting NT in bootloader mode on USB port %s", m_port.c_str());
+                return kOpFailed;
+            }
+            m_serial = dev.serial;
+            if (dev.flashloader) {
+                m_blPath = dev.path;
+                return kOpSkipSdp;
+            }
+            m_sdpPath = dev.path;
+            return kOpOk;
+        }
+        case kStateSdpConnect:
+            return m_sdp.connect(m_sdpPath) ? kOpOk : kOpFailed;
+        case kStateSdpUpload:
+            g_currentStage = "SDP_UPLOAD";
+            return m_sdp.writeFile(FLASHLOADER_ADDR, m_pkg->flashloaderPath) ? kOpOk : kOpFailed;
+        case kStateSdpJump: {
+            bool ok = m_sdp.jumpAddress(FLASHLOADER_ADDR);
+            m_sdp.close();
+            return ok ? kOpOk : kOpFailed;
+        }
+        case kStateWaitEnum:
+            if (!g_dryRun && !waitForFlashloader(m_port, BL_ENUM_TIMEOUT_MS, m_blPath)) {
+                logError("Flashloader did not appear on USB port %s", m_port.c_str());
+                return kOpFailed;
+            }
+            return kOpOk;
+        case kStateBlConnect:
+            m_bl.setShowProgress(false);  // Progress is reported per program step
+            if (!m_bl.connect(m_blPath)) {
+                return kOpFailed;
+            }
+            if (!g_dryRun && readUsbLink(m_port, m_link)) {
+                logVerbose("USB link: %s", describeUsbLink(m_link).c_str());
+            }
+            return kOpOk;
+        case kStateProgram: {
+            const FlashStep& step = *op.step;
+            if (!step.args.empty()) {
+                return m_bl.runCommand(step.args) ? kOpOk : kOpFailed;
+            }
+            const uint8_t* data = m_image.read(step.offset, step.size);
+            return data && m_bl.writeData(step.address, data, step.size, &m_sent) ? kOpOk : kOpFailed;
+        }
+        case kStateVerify:
+            return verifyFlash(m_bl, m_pkg, m_image) ? kOpOk : kOpFailed;
+        case kStateReset:
+            m_image.close();
+            if (g_bootTimeoutMs && !g_dryRun) {
+                m_boot.start(m_port);
+            }
+            m_bl.reset();
+            m_bl.close();
+            return kOpOk;
+        case kStateBootWait:
+            if (g_dryRun) {
+                logVerbose("[DRY RUN] Would wait for firmware to boot on USB port %s", m_port.c_str());
+                return kOpOk;
+            }
+            return m_boot.wait(g_bootTimeoutMs) ? kOpOk : kOpFailed;
+        default:
+            return kOpFailed;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Simulated Transport
+//------------------------------------------------------------------------------
+
+// Each write step compressed and expanded again, as the simulated flashloader would
+static bool simulateCompressedWrites(const FirmwarePackage* pkg, SimProfile& profile) {
+    if (!g_simCompressedWrite || !g_compressWrites) {
+        return true;
+    }
+
+    ImageStream image(pkg);
+    std::vector<uint8_t> payload;
+    std::vector<uint8_t> expanded;
+    uint64_t sent = 0;
+    for (size_t i = 0; i < pkg->program.steps.size(); i++) {
+        const FlashStep& step = pkg->program.steps[i];
+        if (!step.args.empty()) {
+            continue;
+        }
+        const uint8_t* data = image.read(step.offset, step.size);
+        if (!data) {
+            return false;
+        }
+        compressFrames(data, step.size, SIM_COMPRESSED_FRAME_SIZE, payload);
+        if (payload.size() >= step.size) {
+            sent += step.size;
+            continue;   // Sent plain, as writeData() would
+        }
+        if (!expandFrames(payload.data(), payload.size(), SIM_COMPRESSED_FRAME_SIZE, expanded) ||
+            expanded.size() != step.size || memcmp(expanded.data(), data, step.size) != 0) {
+            logError("Simulated flashloader expanded the write at 0x%08X wrongly", step.address);
+            return false;
+        }
+        profile.wireSizes[step.offset] = (uint32_t)payload.size();
+        sent += payload.size();
+    }
+    logVerbose("Simulated compressed writes: %llu of %llu bytes sent", (unsigned long long)sent,
+               (unsigned long long)pkg->program.writeBytes);
+    return true;
+}
+
+// --verify: the simulated flashloader's digests of the flash, which holds the
+// image, must match the package's; without digests the image is read back
+static bool simulateVerify(const FirmwarePackage* pkg, SimProfile& profile) {
+    if (!g_verifyWrites) {
+        return true;
+    }
+    if (!g_simFlashDigest) {
+        profile.verifyBytes = (uint32_t)pkg->firmwareSize;
+        return true;
+    }
+
+    ImageStream image(pkg);
+    std::vector<uint8_t> digests;
+    for (size_t offset = 0; offset < pkg->firmwareSize; offset += FLASH_SECTOR_SIZE_DEFAULT) {
+        size_t size = std::min((size_t)FLASH_SECTOR_SIZE_DEFAULT, pkg->firmwareSize - offset);
+        const uint8_t* data = image.read(offset, size);
+        if (!data) {
+            return false;
+        }
+        appendSectorDigest(digests, kDigestCrc32, data, size, FLASH_SECTOR_SIZE_DEFAULT);
+    }
+    if (digests != pkg->sectorCrcs) {
+        logError("Simulated flashloader's flash digests differ from the package's");
+        return false;
+    }
+    profile.verifyBytes = (uint32_t)digests.size();
+    profile.digestedBytes = (uint32_t)pkg->firmwareSize;
+    return true;
+}
+
+bool simulatedProfile(const FirmwarePackage* pkg, SimProfile& profile) {
+    profile = SimProfile();
+    profile.flashloaderSize = (uint32_t)pkg->flashloader.size();
+    return simulateCompressedWrites(pkg, profile) && simulateVerify(pkg, profile);
+}
+
+void SimulatedTransport::start(FlashEngine& engine, size_t device, const TransportOp& op) {
+    double seconds = m_profile.commandSeconds;
+    switch (op.state) {
+        case kStateSdpUpload:
+            seconds += m_profile.flashloaderSize / m_profile.sdpBytesPerSec;
+            break;
+        case kStateWaitEnum:
+            seconds = m_profile.enumSeconds;
+            break;
+        case kStateBootWait:
+            seconds = m_profile.bootSeconds;
+            break;
+        case kStateProgram:
+            if (op.step->args.empty()) {
+                std::map<size_t, uint32_t>::const_iterator wire = m_profile.wireSizes.find(op.step->offset);
+                m_sent = wire != m_profile.wireSizes.end() ? wire->second : op.step->size;
+                seconds += m_sent / m_profile.writeBytesPerSec;
+            } else if (op.step->args[0] == "flash-erase-region") {
+                seconds += strtoul(op.step->args[2].c_str(), nullptr, 0) / m_profile.eraseBytesPerSec;
+            }
+            break;
+        case kStateVerify:
+            seconds += m_profile.verifyBytes / m_profile.readBytesPerSec +
+                       m_profile.digestedBytes / m_profile.digestBytesPerSec;
+            break;
+        default:
+            break;
+    }
+
+    OpResult result = kOpOk;
+    double now = engine.now();
+    FaultClass fault = m_faults ? m_faults->roll(op) : kFaultClasses;
+    switch (fault) {
+        case kFaultDrop:
+            seconds = (op.state == kStateSdpConnect || op.state == kStateSdpUpload || op.state == kStateSdpJump)
+                          ? SDP_TIMEOUT_MS / 1000.0 : BL_TIMEOUT_MS / 1000.0;
+            result = kOpFailed;
+            break;
+        case kFaultDelay:
+            seconds += FAULT_ACK_DELAY;
+            break;
+        case kFaultDisconnect:
+            seconds *= m_faults->uniform();
+            result = kOpFailed;
+            break;
+        case kFaultEnum:
+            seconds = BL_ENUM_TIMEOUT_MS / 1000.0;
+            result = kOpFailed;
+            break;
+        case kFaultNak:
+            seconds = m_profile.commandSeconds;
+            result = kOpFailed;
+            break;
+        default:
+            break;
+    }
+    // A delay is neither detected nor recovered from: the operation just ends late
+    if (fault != kFaultClasses && fault != kFaultDelay) {
+        m_pending.push_back(std::make_pair(fault, now));
+        if (result == kOpFailed) {
+            m_faults->detected(fault, seconds);
+        }
+    }
+    if (result == kOpOk) {
+        for (size_t i = 0; i < m_pending.size(); i++) {
+            m_faults->recovered(m_pending[i].first, now + seconds - m_pending[i].second);
+        }
+        m_pending.clear();
+    }
+    engine.completeAt(device, now + seconds, result);
+}
+
+//------------------------------------------------------------------------------
+// Fault Injection
+//------------------------------------------------------------------------------
+
+const char* faultClassName(FaultClass fault) {
+    switch (fault) {
+        case kFaultDrop:       return "drop";
+        case kFaultDelay:      return "delay";
+        case kFaultDisconnect: return "disconnect";
+        case kFaultEnum:       return "enum";
+        case kFaultNak:        return "nak";
+        default:               break;
+    }
+    return "none";
+}
+
+// xorshift32: reproducible from the plan's seed on every platform
+double FaultInjector::uniform() {
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 17;
+    m_random ^= m_random << 5;
+    return m_random / 4294967296.0;
+}
+
+FaultClass FaultInjector::roll(const TransportOp& op) {
+    // Finding the unit and waiting for enumeration exchange no reports
+    bool hid = op.state != kStateFind && op.state != kStateWaitEnum && op.state != kStateBootWait;
+    bool write = op.state == kStateProgram && op.step->args.empty();
+    for (int i = 0; i < kFaultClasses; i++) {
+        FaultClass fault = (FaultClass)i;
+        bool applies = (fault == kFaultDisconnect) ? write : (fault == kFaultEnum) ? op.state == kStateWaitEnum : hid;
+        if (applies && m_plan.rate[i] > 0 && uniform() < m_plan.rate[i]) {
+            m_tally[i].injected++;
+            return fault;
+        }
+    }
+    return kFaultClasses;
+}
+
+void FaultInjector::recovered(FaultClass fault, double seconds) {
+    m_tally[fault].recovered++;
+    m_tally[fault].recoverSeconds.push_back(seconds);
+}
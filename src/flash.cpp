@@ -0,0 +1,827 @@
+/*
+ * NT Flash Tool - Flash orchestration: flash, backup, restore, clone, station
+ *
+ * Copyright (c) 2024
+ */
+
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "nt_flash.h"
+#include "hidapi.h"
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+//------------------------------------------------------------------------------
+// Flash Orchestration
+//------------------------------------------------------------------------------
+
+// Bring the device up in flashloader mode (steps 1-5) and connect to it.
+// Shared by flashing, backup, restore and clone. With a port, only the device
+// plugged into that USB port is touched, so several can run side by side.
+bool startFlashloader(FirmwarePackage* pkg, BootloaderOperations& bl, bool skipSdp,
+                      const std::string& port) {
+    std::string sdpPath;
+    std::string blPath;
+
+    if (!port.empty() && !g_dryRun) {
+        UsbDevice dev;
+        if (!findDeviceOnPort(port, dev)) {
+            logError("No disting NT in bootloader mode on USB port %s", port.c_str());
+            return false;
+        }
+        if (dev.flashloader) {
+            logInfo("Device already in flashloader mode, skipping SDP phase...");
+            machineStatus("BL_FOUND", 15, "Device already in flashloader mode");
+            skipSdp = true;
+            blPath = dev.path;
+        } else {
+            sdpPath = dev.path;
+        }
+    }
+
+    // Phase 1: SDP - Load flashloader (skip if already in flashloader mode)
+    if (!skipSdp) {
+        SDPOperations sdp;
+
+        logInfo("[1/7] Connecting to SDP bootloader...");
+        machineStatus("SDP_CONNECT", 5, "Connecting to SDP bootloader");
+        if (!sdp.connect(sdpPath)) {
+            if (!port.empty()) {
+                logError("Failed to connect to SDP bootloader");
+                return false;
+            }
+
+            // Check if device is already in flashloader mode
+            BootloaderOperations blCheck;
+            machineStatus("BL_CHECK", 10, "Checking for flashloader mode");
+            if (blCheck.connect()) {
+                logInfo("Device already in flashloader mode, skipping SDP phase...");
+                machineStatus("BL_FOUND", 15, "Device already in flashloader mode");
+                blCheck.close();
+                skipSdp = true;
+            } else {
+                logError("Device not found in SDP mode or flashloader mode");
+                logInfo("Make sure disting NT is in bootloader mode:");
+                logInfo("  Menu > Misc > Enter bootloader mode...");
+                return false;
+            }
+        }
+
+        if (!skipSdp) {
+            if (flashCancelled()) {
+                return false;
+            }
+
+            logInfo("[2/7] Uploading flashloader to RAM...");
+            machineStatus("SDP_UPLOAD", 15, "Uploading flashloader to RAM");
+            g_currentStage = "SDP_UPLOAD";
+            if (!sdp.writeFile(FLASHLOADER_ADDR, pkg->flashloaderPath)) {
+                return false;
+            }
+
+            logInfo("[3/7] Starting flashloader...");
+            machineStatus("SDP_JUMP", 25, "Starting flashloader");
+            if (!sdp.jumpAddress(FLASHLOADER_ADDR)) {
+                return false;
+            }
+
+            sdp.close();
+
+            // Wait for device to re-enumerate (give it extra time on macOS)
+            logInfo("[4/7] Waiting for flashloader to start...");
+            machineStatus("WAIT_ENUM", 30, "Waiting for flashloader to start");
+            if (!port.empty()) {
+                if (!g_dryRun && !waitForFlashloader(port, BL_ENUM_TIMEOUT_MS, blPath)) {
+                    logError("Flashloader did not appear on USB port %s", port.c_str());
+                    return false;
+                }
+                traceInstant(nullptr, "re-enumerated", "usb");
+            } else {
+#ifdef WIN32
+                Sleep(3000);
+#else
+                sleep(5);  // Increased from 3 to 5 seconds
+#endif
+            }
+        }
+    }
+
+    // Reset HID subsystem to get fresh device list after re-enumeration
+    // This is critical on macOS where the IOHIDManager caches devices.
+    // Port-addressed devices were just found by a fresh enumeration, and
+    // other threads may have devices open, so leave it alone then. Without a
+    // port no other flash runs: the library refuses such a job beside others.
+    if (port.empty()) {
+        hid_exit();
+    }
+
+    if (flashCancelled()) {
+        return false;
+    }
+
+    logInfo("[5/7] Connecting to flashloader...");
+    machineStatus("BL_CONNECT", 40, "Connecting to flashloader");
+    return bl.connect(blPath);
+}
+
+// Point the flashloader at the FlexSPI NOR so memory-mapped access works
+bool configureFlexSpiNor(BootloaderOperations& bl) {
+    logVerbose("Configuring FlexSPI NOR...");
+    if (!bl.fillMemory(CONFIG_ADDR, 4, FLEXSPI_NOR_CONFIG)) {
+        return false;
+    }
+    return bl.configureMemory(MEMORY_ID_FLEXSPI_NOR, CONFIG_ADDR);
+}
+
+static void logThroughput(const char* what, int percent, uint64_t bytes, double seconds) {
+    double rate = seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0;
+    logInfo("%s %llu bytes in %.2fs (%.2f MB/s)", what, (unsigned long long)bytes, seconds, rate);
+
+    char message[128];
+    snprintf(message, sizeof(message), "%llu bytes in %.2fs (%.2f MB/s)",
+             (unsigned long long)bytes, seconds, rate);
+    machineStatus("THROUGHPUT", percent, message);
+}
+
+// Replay a compiled flash program on a connected flashloader
+bool runFlashProgram(BootloaderOperations& bl, const FlashProgram& program,
+                     ImageStream& image, DeviceStats* stats) {
+    uint64_t written = 0;
+    size_t writeSteps = 0;
+    size_t writeIndex = 0;
+    for (size_t i = 0; i < program.steps.size(); i++) {
+        if (program.steps[i].args.empty()) writeSteps++;
+    }
+
+    for (size_t i = 0; i < program.steps.size(); i++) {
+        const FlashStep& step = program.steps[i];
+        if (flashCancelled()) {
+            return false;
+        }
+
+        if (!step.info.empty()) logInfo("%s", step.info.c_str());
+        if (step.stage) {
+            machineStatus(step.stage, step.percent, step.message);
+            g_currentStage = step.stage;
+        }
+        if (!step.detail.empty()) logVerbose("%s", step.detail.c_str());
+
+        if (!step.args.empty()) {
+            if (!bl.runCommand(step.args)) {
+                return false;
+            }
+            continue;
+        }
+
+        double writeStarted = nowSeconds();
+        const uint8_t* data = image.read(step.offset, step.size);
+        size_t sent = 0;
+        if (!data || !bl.writeData(step.address, data, step.size, &sent)) {
+            return false;
+        }
+        if (stats) {
+            stats->writeBytes += step.size;
+            stats->wireBytes += sent;
+            stats->writeSeconds += nowSeconds() - writeStarted;
+        }
+        written += step.size;
+        writeIndex++;
+        displayProgress((int)(written * 100 / program.writeBytes), (int)writeIndex, (int)writeSteps);
+    }
+    return true;
+}
+
+// Metrics and journal for a single-device flash; a failure is put down to
+// the last stage reported
+static void recordFlash(const FirmwarePackage* pkg, const std::string& port, double started,
+                        DeviceStats& stats) {
+    bool ok = stats.ok;
+    const char* failedStage = ok ? nullptr : g_lastStatusStage;
+    metricsFlashFinished(ok, failedStage, &stats);
+    traceStage(nullptr);
+    resourceStage(nullptr);
+    traceSpan(port.empty() ? nullptr : port.c_str(), ok ? "flash" : "flash failed", "flash", started, nowSeconds());
+
+    JournalEntry entry;
+    entry.port = port;
+    entry.version = pkg->version;
+    entry.firmwareHash = pkg->firmwareHash;
+    entry.failedStage = failedStage ? failedStage : "";
+    entry.seconds = nowSeconds() - started;
+    entry.stats = stats;
+    journalFlash(entry);
+}
+
+// Port of the flashloader just connected to: the one asked for, or the only one
+static std::string flashloaderPort(const std::string& port) {
+    if (!port.empty()) {
+        return port;
+    }
+    std::vector<UsbDevice> devices = enumerateDevices();
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (devices[i].flashloader) {
+            return devices[i].port;
+        }
+    }
+    return std::string();
+}
+
+bool flashFirmware(FirmwarePackage* pkg, bool skipSdp, const std::string& port) {
+    if (!pkg || !pkg->valid) {
+        logError("Invalid firmware package");
+        return false;
+    }
+
+    logInfo("=== Starting disting NT flash ===");
+    machineStatus("START", 0, "Starting disting NT flash");
+    metricsFlashStarted();
+    traceStage("START");
+    resourceStage("START");
+    double started = nowSeconds();
+
+    // Phase 1: SDP, Phase 2: Bootloader - Flash firmware
+    DeviceStats stats;
+    BootloaderOperations bl;
+    bl.setShowProgress(false);  // Progress is reported per program step
+    if (!startFlashloader(pkg, bl, skipSdp, port)) {
+        recordFlash(pkg, port, started, stats);
+        return false;
+    }
+    std::string blPort = g_dryRun ? port : flashloaderPort(port);
+    UsbLink link;
+    if (!g_dryRun && readUsbLink(blPort, link)) {
+        logVerbose("USB link: %s", describeUsbLink(link).c_str());
+    }
+
+    // Configure, erase, FCB and write
+    ImageStream image(pkg);
+    if (!runFlashProgram(bl, pkg->program, image, &stats)) {
+        recordFlash(pkg, port, started, stats);
+        return false;
+    }
+    if (g_verifyWrites) {
+        logInfo("Verifying flash...");
+        machineStatus("VERIFY", 92, "Verifying flash");
+        if (!verifyFlash(bl, pkg, image)) {
+            recordFlash(pkg, port, started, stats);
+            return false;
+        }
+    }
+    image.close();
+    logCompressedWrites(stats);
+    checkLinkThroughput(link, stats.wireBytes, stats.writeSeconds);
+
+    logInfo("Resetting device...");
+    machineStatus("RESET", 95, "Resetting device");
+    BootWatch boot;
+    bool watching = g_bootTimeoutMs && !g_dryRun && boot.start(blPort);
+    bl.reset();
+    bl.close();
+    double reset = nowSeconds();
+
+    if (g_bootTimeoutMs) {
+        logInfo("Waiting for firmware to boot...");
+        machineStatus("BOOT_WAIT", 97, "Waiting for firmware to boot");
+        if (watching) {
+            if (!boot.wait(g_bootTimeoutMs)) {
+                recordFlash(pkg, port, started, stats);
+                return false;
+            }
+            stats.bootSeconds = nowSeconds() - reset;
+            logInfo("Firmware booted in %.2fs", stats.bootSeconds);
+            traceInstant(blPort.empty() ? nullptr : blPort.c_str(), "booted", "usb");
+        } else if (g_dryRun) {
+            logVerbose("[DRY RUN] Would wait for firmware to boot");
+        } else {
+            logInfo("WARNING: USB port of the device unknown, boot not checked");
+        }
+    }
+
+    logInfo("=== Flash complete! ===");
+    machineStatus("COMPLETE", 100, "Flash complete");
+    stats.ok = true;
+    recordFlash(pkg, port, started, stats);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Backup / Restore
+//------------------------------------------------------------------------------
+
+// Dump the FlexSPI NOR region to a file. The whole region is fetched with a
+// single read-memory command whose data phase BLFWK streams straight into the
+// output file, so there are no per-chunk command round-trips or host buffers.
+// The device is left in flashloader mode so a flash or restore can follow.
+bool backupFlash(FirmwarePackage* pkg, const char* outPath, uint32_t sizeOverride) {
+    if (!pkg || !pkg->valid) {
+        logError("Invalid firmware package");
+        return false;
+    }
+
+    logInfo("=== Starting disting NT flash backup ===");
+    machineStatus("START", 0, "Starting disting NT flash backup");
+
+    BootloaderOperations bl;
+    if (!startFlashloader(pkg, bl)) {
+        return false;
+    }
+
+    logInfo("[6/7] Configuring flash...");
+    machineStatus("CONFIGURE", 50, "Configuring flash memory");
+    if (!configureFlexSpiNor(bl)) {
+        return false;
+    }
+
+    FlashGeometry geometry;
+    bl.getFlashGeometry(MEMORY_ID_FLEXSPI_NOR, geometry);
+    uint32_t size = sizeOverride ? sizeOverride : geometry.totalSize;
+
+    logInfo("[7/7] Reading flash (%u bytes) to %s...", size, outPath);
+    machineStatus("READ", 60, "Reading flash");
+    g_currentStage = "READ";
+    double start = nowSeconds();
+    if (!bl.readMemory(FLASH_BASE, size, outPath, 0)) {
+        return false;
+    }
+    logThroughput("Read", 95, size, nowSeconds() - start);
+
+    bl.close();
+
+    logInfo("=== Backup complete! ===");
+    machineStatus("COMPLETE", 100, "Backup complete");
+    return true;
+}
+
+// Write a dump produced by backupFlash() back to the FlexSPI NOR. The region
+// is erased in whole sectors and only sectors holding data are written.
+bool restoreFlash(FirmwarePackage* pkg, const char* dumpPath) {
+    if (!pkg || !pkg->valid) {
+        logError("Invalid firmware package");
+        return false;
+    }
+
+    std::vector<uint8_t> image;
+    if (!loadFile(dumpPath, image)) {
+        return false;
+    }
+    if (image.empty()) {
+        logError("Backup file is empty: %s", dumpPath);
+        return false;
+    }
+
+    logInfo("=== Starting disting NT flash restore ===");
+    machineStatus("START", 0, "Starting disting NT flash restore");
+
+    BootloaderOperations bl;
+    if (!startFlashloader(pkg, bl)) {
+        return false;
+    }
+
+    logInfo("[6/7] Configuring flash and erasing...");
+    machineStatus("CONFIGURE", 50, "Configuring flash memory");
+    if (!configureFlexSpiNor(bl)) {
+        return false;
+    }
+
+    FlashGeometry geometry;
+    bl.getFlashGeometry(MEMORY_ID_FLEXSPI_NOR, geometry);
+    if (image.size() > geometry.totalSize) {
+        logError("Backup (%zu bytes) is larger than flash (%u bytes)", image.size(), geometry.totalSize);
+        return false;
+    }
+
+    uint32_t sectorSize = geometry.sectorSize;
+    uint32_t eraseSize = (uint32_t)((image.size() + sectorSize - 1) / sectorSize * sectorSize);
+    logVerbose("Erasing flash region 0x%08X, size %u bytes...", FLASH_BASE, eraseSize);
+    machineStatus("ERASE", 55, "Erasing flash region");
+    if (!bl.flashEraseRegion(FLASH_BASE, eraseSize, 0)) {
+        return false;
+    }
+
+    std::vector<WriteRun> runs = planSparseWrite(image, sectorSize);
+    size_t dataBytes = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        dataBytes += runs[i].size;
+    }
+
+    logInfo("[7/7] Writing %zu bytes in %zu runs (%zu blank bytes skipped)...",
+            dataBytes, runs.size(), image.size() - dataBytes);
+    machineStatus("WRITE", 65, "Writing flash");
+    g_currentStage = "WRITE";
+    double start = nowSeconds();
+    size_t written = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        if (!bl.writeData(FLASH_BASE + (uint32_t)runs[i].offset,
+                          image.data() + runs[i].offset, runs[i].size)) {
+            return false;
+        }
+        written += runs[i].size;
+        displayProgress((int)(written * 100 / dataBytes), (int)i + 1, (int)runs.size());
+    }
+    logThroughput("Wrote", 90, written, nowSeconds() - start);
+
+    logInfo("Resetting device...");
+    machineStatus("RESET", 95, "Resetting device");
+    bl.reset();
+    bl.close();
+
+    logInfo("=== Restore complete! ===");
+    machineStatus("COMPLETE", 100, "Restore complete");
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Clone
+//------------------------------------------------------------------------------
+
+// Chunks read from the golden unit and shared by every target writer. Chunk i
+// lives in slot i % CLONE_BUFFER_CHUNKS until all live writers have written it;
+// the reader blocks while the buffer is full, so the slowest target sets the pace.
+struct ClonePipeline {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::vector<uint8_t> > slots;
+    uint32_t chunkCount;
+    uint32_t produced;               // Chunks read from the golden unit
+    std::vector<uint32_t> consumed;  // Per target: chunks written
+    std::vector<char> failed;        // Per target
+    bool readFailed;
+
+    ClonePipeline(uint32_t chunks, size_t targets)
+        : slots(CLONE_BUFFER_CHUNKS), chunkCount(chunks), produced(0),
+          consumed(targets, 0), failed(targets, 0), readFailed(false) {}
+
+    // Oldest chunk a live writer still needs (chunkCount when none are left)
+    uint32_t lowestConsumed() const {
+        uint32_t lowest = chunkCount;
+        for (size_t i = 0; i < consumed.size(); i++) {
+            if (!failed[i]) lowest = std::min(lowest, consumed[i]);
+        }
+        return lowest;
+    }
+
+    bool finished() const {
+        for (size_t i = 0; i < consumed.size(); i++) {
+            if (!failed[i] && consumed[i] < chunkCount) return false;
+        }
+        return true;
+    }
+};
+
+static void cloneReader(ClonePipeline& pipe, BootloaderOperations& golden, const std::string& port,
+                        uint32_t size, const std::string& chunkPath) {
+    g_deviceTag = port.c_str();
+
+    for (uint32_t i = 0; i < pipe.chunkCount; i++) {
+        {
+            std::unique_lock<std::mutex> lock(pipe.mutex);
+            pipe.changed.wait(lock, [&] { return i < pipe.lowestConsumed() + CLONE_BUFFER_CHUNKS; });
+            if (pipe.finished()) {
+                return;  // Every target has failed
+            }
+        }
+
+        // read-memory only delivers into a file, so each chunk passes through
+        // one small scratch file; the full image never exists on disk
+        uint32_t offset = i * CLONE_CHUNK_SIZE;
+        uint32_t len = std::min(CLONE_CHUNK_SIZE, size - offset);
+        std::vector<uint8_t> chunk;
+        bool ok = golden.readMemory(FLASH_BASE + offset, len, chunkPath, 0);
+        if (ok && g_dryRun) {
+            chunk.assign(len, 0xFF);
+        } else if (ok) {
+            ok = loadFile(chunkPath.c_str(), chunk) && chunk.size() == len;
+        }
+
+        std::lock_guard<std::mutex> lock(pipe.mutex);
+        if (!ok) {
+            logError("Failed to read flash at 0x%08X", FLASH_BASE + offset);
+            pipe.readFailed = true;
+            pipe.changed.notify_all();
+            return;
+        }
+        pipe.slots[i % CLONE_BUFFER_CHUNKS].swap(chunk);
+        pipe.produced = i + 1;
+        pipe.changed.notify_all();
+    }
+}
+
+static void cloneWriter(ClonePipeline& pipe, size_t index, BootloaderOperations& bl,
+                        const std::string& port, uint32_t size, uint32_t sectorSize) {
+    g_deviceTag = port.c_str();
+
+    uint32_t eraseSize = (size + sectorSize - 1) / sectorSize * sectorSize;
+    bool ok = bl.flashEraseRegion(FLASH_BASE, eraseSize, 0);
+
+    for (uint32_t i = 0; ok && i < pipe.chunkCount; i++) {
+        {
+            std::unique_lock<std::mutex> lock(pipe.mutex);
+            pipe.changed.wait(lock, [&] { return pipe.produced > i || pipe.readFailed; });
+            if (pipe.produced <= i) {
+                ok = false;
+                break;
+            }
+        }
+
+        // The slot cannot be recycled until this writer bumps its count
+        const std::vector<uint8_t>& chunk = pipe.slots[i % CLONE_BUFFER_CHUNKS];
+        std::vector<WriteRun> runs = planSparseWrite(chunk, sectorSize);
+        for (size_t r = 0; ok && r < runs.size(); r++) {
+            ok = bl.writeData(FLASH_BASE + i * CLONE_CHUNK_SIZE + (uint32_t)runs[r].offset,
+                              chunk.data() + runs[r].offset, runs[r].size);
+        }
+
+        if (ok) {
+            std::lock_guard<std::mutex> lock(pipe.mutex);
+            pipe.consumed[index] = i + 1;
+            pipe.changed.notify_all();
+        }
+    }
+
+    if (!ok) {
+        std::lock_guard<std::mutex> lock(pipe.mutex);
+        pipe.failed[index] = 1;
+        pipe.changed.notify_all();
+    }
+}
+
+// Replicate the golden unit's flash onto every target. All units are brought
+// up in parallel; one thread reads the golden unit chunk by chunk while one
+// thread per target erases and then writes each chunk as soon as it arrives.
+bool cloneFlash(FirmwarePackage* pkg, const std::string& goldenPort,
+                std::vector<std::string> targetPorts, uint32_t sizeOverride) {
+    if (!pkg || !pkg->valid) {
+        logError("Invalid firmware package");
+        return false;
+    }
+
+    if (targetPorts.empty()) {
+        std::vector<UsbDevice> devices = enumerateDevices();
+        for (size_t i = 0; i < devices.size(); i++) {
+            if (devices[i].port != goldenPort &&
+                std::find(targetPorts.begin(), targetPorts.end(), devices[i].port) == targetPorts.end()) {
+                targetPorts.push_back(devices[i].port);
+            }
+        }
+    }
+    if (targetPorts.empty()) {
+        logError("No target devices found (use --target <port> or connect units in bootloader mode)");
+        return false;
+    }
+
+    logInfo("=== Cloning %s to %zu device(s) ===", goldenPort.c_str(), targetPorts.size());
+    machineStatus("START", 0, "Starting disting NT clone");
+
+    // Slot 0 is the golden unit
+    std::vector<std::string> ports;
+    ports.push_back(goldenPort);
+    ports.insert(ports.end(), targetPorts.begin(), targetPorts.end());
+
+    std::vector<BootloaderOperations> units(ports.size());
+    std::vector<char> ready(ports.size(), 0);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < ports.size(); i++) {
+        threads.push_back(std::thread([&, i] {
+            g_deviceTag = ports[i].c_str();
+            units[i].setShowProgress(false);
+            ready[i] = startFlashloader(pkg, units[i], false, ports[i]) && configureFlexSpiNor(units[i]);
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    threads.clear();
+
+    if (!ready[0]) {
+        logError("Golden unit on %s is not ready", goldenPort.c_str());
+        return false;
+    }
+
+    std::vector<size_t> live;
+    for (size_t i = 1; i < ports.size(); i++) {
+        if (ready[i]) live.push_back(i);
+    }
+    if (live.empty()) {
+        logError("No target devices are ready");
+        return false;
+    }
+
+    FlashGeometry geometry;
+    units[0].getFlashGeometry(MEMORY_ID_FLEXSPI_NOR, geometry);
+    uint32_t size = sizeOverride ? sizeOverride : geometry.totalSize;
+
+    std::string chunkPath = saveToTempFile(std::vector<uint8_t>(), ".bin");
+    if (chunkPath.empty()) {
+        logError("Failed to create temporary files");
+        return false;
+    }
+
+    logInfo("Cloning %u bytes to %zu device(s)...", size, live.size());
+    machineStatus("CLONE", 55, "Erasing targets and streaming flash");
+    g_currentStage = "CLONE";
+
+    ClonePipeline pipe((size + CLONE_CHUNK_SIZE - 1) / CLONE_CHUNK_SIZE, live.size());
+    uint32_t sectorSize = geometry.sectorSize;
+    double start = nowSeconds();
+
+    threads.push_back(std::thread(cloneReader, std::ref(pipe), std::ref(units[0]),
+                                  std::cref(ports[0]), size, std::cref(chunkPath)));
+    for (size_t t = 0; t < live.size(); t++) {
+        threads.push_back(std::thread(cloneWriter, std::ref(pipe), t, std::ref(units[live[t]]),
+                                      std::cref(ports[live[t]]), size, sectorSize));
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(pipe.mutex);
+        uint32_t shown = 0;
+        while (!pipe.finished()) {
+            pipe.changed.wait(lock);
+            uint32_t done = pipe.lowestConsumed();
+            if (done != shown && done <= pipe.chunkCount) {
+                shown = done;
+                displayProgress((int)((uint64_t)done * 100 / pipe.chunkCount), (int)done, (int)pipe.chunkCount);
+            }
+        }
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    remove(chunkPath.c_str());
+
+    size_t succeeded = 0;
+    for (size_t t = 0; t < live.size(); t++) {
+        if (!pipe.failed[t]) succeeded++;
+    }
+    logThroughput("Cloned", 90, (uint64_t)size * succeeded, nowSeconds() - start);
+
+    logInfo("Resetting devices...");
+    machineStatus("RESET", 95, "Resetting devices");
+    for (size_t i = 0; i < ports.size(); i++) {
+        if (ready[i]) {
+            units[i].reset();
+            units[i].close();
+        }
+    }
+
+    for (size_t i = 1; i < ports.size(); i++) {
+        std::vector<size_t>::iterator it = std::find(live.begin(), live.end(), i);
+        bool ok = it != live.end() && !pipe.failed[it - live.begin()];
+        logInfo("  %s: %s", ports[i].c_str(), ok ? "OK" : "FAILED");
+    }
+
+    if (succeeded != targetPorts.size()) {
+        logError("Clone failed on %zu of %zu device(s)", targetPorts.size() - succeeded, targetPorts.size());
+        return false;
+    }
+
+    logInfo("=== Clone complete! ===");
+    machineStatus("COMPLETE", 100, "Clone complete");
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Station Mode
+//------------------------------------------------------------------------------
+
+// Order ports for a run: ports flagged degraded by their last run go last, so
+// they are admitted after healthy ones, or are left out with --avoid-degraded
+static std::vector<std::string> applyPortHealth(const std::vector<std::string>& ports,
+                                                const HealthTable& health, bool avoidDegraded) {
+    std::vector<std::string> healthy;
+    std::vector<std::string> degraded;
+    for (size_t i = 0; i < ports.size(); i++) {
+        HealthTable::const_iterator it = health.find(ports[i]);
+        if (it == health.end() || !it->second.degraded) {
+            healthy.push_back(ports[i]);
+        } else if (avoidDegraded) {
+            logInfo("Skipping degraded port %s", ports[i].c_str());
+        } else {
+            degraded.push_back(ports[i]);
+        }
+    }
+    healthy.insert(healthy.end(), degraded.begin(), degraded.end());
+    return healthy;
+}
+
+// Log per-device results of an engine run and record them in the port history
+static bool reportEngine(FlashEngine& engine, size_t succeeded, double start,
+                         const StationOptions& options, HealthTable& health) {
+    double seconds = nowSeconds() - start;
+
+    if (!options.healthPath.empty()) {
+        for (size_t i = 0; i < engine.deviceCount(); i++) {
+            g_deviceTag = engine.port(i).c_str();
+            updatePortHealth(health[engine.port(i)], engine.stats(i));
+        }
+        g_deviceTag = nullptr;
+        savePortHealth(options.healthPath, health);
+    }
+
+    for (size_t i = 0; i < engine.deviceCount(); i++) {
+        const char* result = engine.succeeded(i) ? "OK" : "FAILED";
+        if (health.count(engine.port(i)) && health[engine.port(i)].degraded) {
+            result = engine.succeeded(i) ? "OK (degraded)" : "FAILED (degraded)";
+        }
+        logInfo("  %s: %s", engine.port(i).c_str(), result);
+    }
+    logInfo("%zu of %zu device(s) flashed in %.1fs", succeeded, engine.deviceCount(), seconds);
+    return succeeded == engine.deviceCount();
+}
+
+// Flash the given ports with one engine run. Shared by station mode,
+// simulation and coordinator agents; failed ports are appended to failedPorts.
+bool runStation(FirmwarePackage* pkg, std::vector<std::string> ports, bool simulated,
+                const StationOptions& options, bool chosenPorts, std::vector<std::string>* failedPorts) {
+    HealthTable health;
+    if (!options.healthPath.empty()) {
+        if (!loadPortHealth(options.healthPath, health)) {
+            return false;
+        }
+        for (size_t i = 0; i < options.healthReset.size(); i++) {
+            if (health.erase(options.healthReset[i])) {
+                logInfo("Port health history of %s reset", options.healthReset[i].c_str());
+            }
+        }
+        // Degraded ports named with --target are still flashed
+        ports = applyPortHealth(ports, health, options.avoidDegraded && !chosenPorts);
+    }
+    if (ports.empty()) {
+        logError("No disting NT found in SDP or flashloader mode");
+        return false;
+    }
+
+    logInfo("=== Flashing %zu %sdevice(s) ===", ports.size(), simulated ? "simulated " : "");
+    SimProfile profile;
+    if (simulated && !simulatedProfile(pkg, profile)) {
+        return false;
+    }
+
+    FlashEngine engine(pkg, options.limits);
+    for (size_t i = 0; i < ports.size(); i++) {
+        FlashTransport* transport;
+        if (simulated) {
+            transport = new SimulatedTransport(profile);
+        } else {
+            transport = new UsbTransport(pkg, ports[i]);
+        }
+        engine.addDevice(ports[i], transport);
+    }
+
+    double start = nowSeconds();
+    size_t succeeded = engine.run();
+    if (simulated) {
+        logThroughput("Wrote", 100, pkg->program.writeBytes * succeeded, nowSeconds() - start);
+    }
+    if (failedPorts) {
+        for (size_t i = 0; i < engine.deviceCount(); i++) {
+            if (!engine.succeeded(i)) failedPorts->push_back(engine.port(i));
+        }
+    }
+    return reportEngine(engine, succeeded, start, options, health);
+}
+
+// Flash every connected unit (or the given ports) at once. One event loop
+// drives all devices; their blocking USB transfers run on the engine's I/O
+// pool and the package's compiled program is shared by every device. Uploads
+// and writes are limited per hub and controller so they do not starve each other.
+bool flashStation(FirmwarePackage* pkg, std::vector<std::string> ports, const StationOptions& options) {
+    bool chosenPorts = !ports.empty();
+    if (ports.empty()) {
+        std::vector<UsbDevice> devices = enumerateDevices();
+        for (size_t i = 0; i < devices.size(); i++) {
+            if (std::find(ports.begin(), ports.end(), devices[i].port) == ports.end()) {
+                ports.push_back(devices[i].port);
+            }
+        }
+    }
+    return runStation(pkg, ports, false, options, chosenPorts, nullptr);
+}
+
+// Ports of simulated units, laid out as 7-port hubs, four per controller,
+// so the scheduler has work
+std::vector<std::string> simulatedPorts(uint32_t count) {
+    std::vector<std::string> ports;
+    for (uint32_t i = 0; i < count; i++) {
+        char port[32];
+        snprintf(port, sizeof(port), "sim%u-%u.%u", i / 28 + 1, i % 28 / 7 + 1, i % 7 + 1);
+        ports.push_back(port);
+    }
+    return ports;
+}
+
+// Flash simulated units with the real flow and timings but no hardware,
+// to exercise the engine with more devices than a bench can hold
+bool flashSimulated(FirmwarePackage* pkg, uint32_t count, const StationOptions& options) {
+    if (!pkg || !pkg->valid) {
+        logError("Invalid firmware package");
+        return false;
+    }
+    return runStation(pkg, simulatedPorts(count), true, options, false, nullptr);
+}
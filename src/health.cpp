@@ -0,0 +1,190 @@
+/*
+ * NT Flash Tool - Per-port health history
+ *
+ * Copyright (c) 2024
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// Port Health
+//------------------------------------------------------------------------------
+
+// File format: { "<port>": { "runs": 12, "write_rate": 1048576.0, ... }, ... }
+
+static double jsonNumber(cJSON* object, const char* name) {
+    cJSON* item = cJSON_GetObjectItem(object, name);
+    return cJSON_IsNumber(item) ? item->valuedouble : 0;
+}
+
+// A missing file is an empty history
+bool loadPortHealth(const std::string& path, HealthTable& table) {
+    table.clear();
+
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return true;
+    }
+    fclose(f);
+
+    std::vector<uint8_t> data;
+    if (!loadFile(path.c_str(), data)) {
+        return false;
+    }
+    std::string json(data.begin(), data.end());
+    cJSON* root = cJSON_Parse(json.c_str());
+    if (!cJSON_IsObject(root)) {
+        logError("Invalid port health file: %s", path.c_str());
+        cJSON_Delete(root);
+        return false;
+    }
+
+    for (cJSON* item = root->child; item; item = item->next) {
+        if (!cJSON_IsObject(item) || !item->string) {
+            continue;
+        }
+        PortHealth& health = table[item->string];
+        health.runs = (uint32_t)jsonNumber(item, "runs");
+        health.failures = (uint32_t)jsonNumber(item, "failures");
+        health.timeouts = (uint32_t)jsonNumber(item, "timeouts");
+        health.retries = (uint32_t)jsonNumber(item, "retries");
+        health.samples = (uint32_t)jsonNumber(item, "samples");
+        health.writeRate = jsonNumber(item, "write_rate");
+        health.enumSeconds = jsonNumber(item, "enum_seconds");
+        health.longWriteRate = jsonNumber(item, "long_write_rate");
+        health.longEnumSeconds = jsonNumber(item, "long_enum_seconds");
+        health.lastWriteRate = jsonNumber(item, "last_write_rate");
+        health.lastEnumSeconds = jsonNumber(item, "last_enum_seconds");
+        health.slowRuns = (uint32_t)jsonNumber(item, "slow_runs");
+        health.degraded = cJSON_IsTrue(cJSON_GetObjectItem(item, "degraded"));
+    }
+
+    cJSON_Delete(root);
+    return true;
+}
+
+// Written to a temporary file and renamed over the old one, so an interrupted
+// run never leaves a truncated history
+bool savePortHealth(const std::string& path, const HealthTable& table) {
+    cJSON* root = cJSON_CreateObject();
+    for (HealthTable::const_iterator it = table.begin(); it != table.end(); ++it) {
+        const PortHealth& health = it->second;
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "runs", health.runs);
+        cJSON_AddNumberToObject(item, "failures", health.failures);
+        cJSON_AddNumberToObject(item, "timeouts", health.timeouts);
+        cJSON_AddNumberToObject(item, "retries", health.retries);
+        cJSON_AddNumberToObject(item, "samples", health.samples);
+        cJSON_AddNumberToObject(item, "write_rate", health.writeRate);
+        cJSON_AddNumberToObject(item, "enum_seconds", health.enumSeconds);
+        cJSON_AddNumberToObject(item, "long_write_rate", health.longWriteRate);
+        cJSON_AddNumberToObject(item, "long_enum_seconds", health.longEnumSeconds);
+        cJSON_AddNumberToObject(item, "last_write_rate", health.lastWriteRate);
+        cJSON_AddNumberToObject(item, "last_enum_seconds", health.lastEnumSeconds);
+        cJSON_AddNumberToObject(item, "slow_runs", health.slowRuns);
+        cJSON_AddBoolToObject(item, "degraded", health.degraded);
+        cJSON_AddItemToObject(root, it->first.c_str(), item);
+    }
+    char* json = cJSON_Print(root);
+    cJSON_Delete(root);
+
+    bool ok = writeFileAtomic(path, json);
+    cJSON_free(json);
+    if (!ok) {
+        logError("Failed to write port health file: %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// A baseline missing from an older history file starts at the sample
+static double fold(double baseline, double sample, double alpha) {
+    return baseline > 0 ? baseline + alpha * (sample - baseline) : sample;
+}
+
+// Within HEALTH_REBASELINE_SPREAD of the previous run's figure
+static bool steady(double figure, double previous) {
+    return previous > 0 && std::fabs(figure - previous) <= previous * HEALTH_REBASELINE_SPREAD;
+}
+
+static void reportDegraded(const char* message) {
+    logInfo("WARNING: %s", message);
+    machineStatus("DEGRADED", 100, message);
+}
+
+// Call with g_deviceTag set to the port, so warnings carry it
+void updatePortHealth(PortHealth& health, const DeviceStats& run) {
+    health.runs++;
+    health.retries += run.retries;
+    if (run.timedOut) {
+        health.timeouts++;
+    }
+
+    if (!run.ok) {
+        health.failures++;
+        health.slowRuns = 0;
+        health.degraded = true;
+        return;
+    }
+
+    double rate = run.writeSeconds > 0 ? run.writeBytes / run.writeSeconds : 0;
+    bool steadyWrite = steady(rate, health.lastWriteRate);
+    bool steadyEnum = steady(run.enumSeconds, health.lastEnumSeconds);
+    health.lastWriteRate = rate;
+    health.lastEnumSeconds = run.enumSeconds;
+    health.degraded = false;
+
+    // Judged against the better of the two baselines, so a port that slows a
+    // little every run is still caught by the long-term one
+    bool slowWrite = false;
+    bool slowEnum = false;
+    if (health.samples >= HEALTH_MIN_SAMPLES) {
+        char message[160];
+        double writeBaseline = std::max(health.writeRate, health.longWriteRate);
+        if (rate > 0 && rate < writeBaseline * HEALTH_SLOW_WRITE) {
+            snprintf(message, sizeof(message), "Port wrote at %.2f MB/s, below its baseline of %.2f MB/s",
+                     rate / (1024.0 * 1024.0), writeBaseline / (1024.0 * 1024.0));
+            reportDegraded(message);
+            slowWrite = true;
+        }
+        double enumBaseline = health.longEnumSeconds > 0 ? std::min(health.enumSeconds, health.longEnumSeconds)
+                                                         : health.enumSeconds;
+        if (run.enumSeconds > 0 && enumBaseline > 0 && run.enumSeconds > enumBaseline * HEALTH_SLOW_ENUM) {
+            snprintf(message, sizeof(message), "Port took %.2fs to re-enumerate, baseline %.2fs",
+                     run.enumSeconds, enumBaseline);
+            reportDegraded(message);
+            slowEnum = true;
+        }
+        health.degraded = slowWrite || slowEnum;
+    }
+
+    // A port that stays slow at a steady figure has changed (a new hub or
+    // cable, say) rather than failing: the figure becomes its baseline
+    bool steadyRun = (!slowWrite || steadyWrite) && (!slowEnum || steadyEnum);
+    health.slowRuns = health.degraded ? (steadyRun ? health.slowRuns + 1 : 1) : 0;
+    if (health.slowRuns >= HEALTH_REBASELINE_RUNS) {
+        if (slowWrite) {
+            health.writeRate = health.longWriteRate = rate;
+        }
+        if (slowEnum) {
+            health.enumSeconds = health.longEnumSeconds = run.enumSeconds;
+        }
+        logInfo("Port re-baselined after %u steady slow runs", health.slowRuns);
+        health.slowRuns = 0;
+        health.degraded = slowWrite = slowEnum = false;
+    }
+
+    // A flagged figure stays out of the baselines, or it would drag them down
+    if (rate > 0 && !slowWrite) {
+        health.writeRate = fold(health.writeRate, rate, HEALTH_EWMA_ALPHA);
+        health.longWriteRate = fold(health.longWriteRate, rate, HEALTH_LONG_EWMA_ALPHA);
+    }
+    if (run.enumSeconds > 0 && !slowEnum) {
+        health.enumSeconds = fold(health.enumSeconds, run.enumSeconds, HEALTH_EWMA_ALPHA);
+        health.longEnumSeconds = fold(health.longEnumSeconds, run.enumSeconds, HEALTH_LONG_EWMA_ALPHA);
+    }
+    health.samples++;
+}
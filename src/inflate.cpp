@@ -0,0 +1,558 @@
+/*
+ * NT Flash Tool - Whole-buffer DEFLATE decoder for package loading
+ *
+ * Copyright (c) 2024
+ *
+ * Used instead of tinfl when an entry's inflated size is known and the
+ * whole output buffer is at hand, which is how loadFirmwarePackage()
+ * extracts. Faster through a 64-bit bit buffer refilled a word at a time,
+ * literal/length table entries that decode two literals in one lookup, and
+ * match copies a word at a time. tinfl still does the streaming.
+ */
+
+#include <algorithm>
+#include <memory>
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// Huffman Tables
+//------------------------------------------------------------------------------
+
+namespace {
+
+// A table entry, looked up by the next tableBits bits of input:
+//   all         bits 0-7 code bits consumed, 8-10 kind
+//   literal     bits 16-23 literal, 24-31 second literal (kLiteralPair)
+//   length      bits 16-24 base, 25-29 extra bits
+//   distance    bits 11-15 extra bits, 16-31 base
+//   subtable    bits 11-15 index bits, 16-31 start
+enum EntryKind {
+    kInvalid = 0,
+    kLiteral = 1,
+    kLiteralPair = 2,
+    kLength = 3,
+    kEndOfBlock = 4,
+    kSubtable = 5,
+    kDistance = 6
+};
+
+const unsigned LITLEN_TABLE_BITS = 11;
+const unsigned DIST_TABLE_BITS = 8;
+const unsigned PRECODE_TABLE_BITS = 7;
+const unsigned MAX_CODE_BITS = 15;
+
+const unsigned LITLEN_SYMBOLS = 288;
+const unsigned DIST_SYMBOLS = 32;
+const unsigned PRECODE_SYMBOLS = 19;
+
+// Primary table plus the largest subtables the symbols can need
+const unsigned LITLEN_TABLE_SIZE = (1 << LITLEN_TABLE_BITS) + LITLEN_SYMBOLS * (1 << (MAX_CODE_BITS - LITLEN_TABLE_BITS));
+const unsigned DIST_TABLE_SIZE = (1 << DIST_TABLE_BITS) + DIST_SYMBOLS * (1 << (MAX_CODE_BITS - DIST_TABLE_BITS));
+
+const uint16_t LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const uint8_t LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const uint16_t DIST_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+const uint8_t DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+const uint8_t PRECODE_ORDER[PRECODE_SYMBOLS] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+inline uint32_t entryBits(uint32_t entry) { return entry & 0xFF; }
+inline uint32_t entryKind(uint32_t entry) { return (entry >> 8) & 0x7; }
+
+inline uint32_t makeEntry(EntryKind kind, uint32_t bits, uint32_t payload) {
+    return bits | (uint32_t)kind << 8 | payload << 16;
+}
+
+// Entry of one litlen symbol, without its code length
+uint32_t litlenEntry(unsigned symbol) {
+    if (symbol < 256) return makeEntry(kLiteral, 0, symbol);
+    if (symbol == 256) return makeEntry(kEndOfBlock, 0, 0);
+    if (symbol > 285) return makeEntry(kInvalid, 0, 0);
+    return makeEntry(kLength, 0, LENGTH_BASE[symbol - 257] | (uint32_t)LENGTH_EXTRA[symbol - 257] << 9);
+}
+
+// Distance: bits 11-15 extra bits, 16-31 base
+uint32_t distEntry(unsigned symbol) {
+    if (symbol >= 30) return makeEntry(kInvalid, 0, 0);
+    return makeEntry(kDistance, 0, DIST_BASE[symbol]) | (uint32_t)DIST_EXTRA[symbol] << 11;
+}
+
+uint32_t precodeEntry(unsigned symbol) {
+    return makeEntry(kLiteral, 0, symbol);
+}
+
+inline unsigned reverseBits(unsigned code, unsigned length) {
+    unsigned reversed = 0;
+    for (unsigned i = 0; i < length; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    return reversed;
+}
+
+// Canonical Huffman decode table from code lengths. Codes longer than
+// tableBits go to a subtable hung off the primary entry of their first
+// tableBits bits, sized for the longest of them. Unused entries stay
+// kInvalid, so an incomplete code is only an error if the data uses a gap.
+bool buildTable(uint32_t* table, unsigned tableSize, unsigned tableBits, const uint8_t* lengths,
+                unsigned count, uint32_t (*entryOf)(unsigned)) {
+    unsigned lengthCount[MAX_CODE_BITS + 1] = { 0 };
+    for (unsigned i = 0; i < count; i++) {
+        lengthCount[lengths[i]]++;
+    }
+    lengthCount[0] = 0;
+
+    // Over-subscribed codes cannot be decoded
+    int left = 1;
+    for (unsigned len = 1; len <= MAX_CODE_BITS; len++) {
+        left = (left << 1) - (int)lengthCount[len];
+        if (left < 0) {
+            return false;
+        }
+    }
+
+    unsigned nextCode[MAX_CODE_BITS + 1];
+    unsigned code = 0;
+    for (unsigned len = 1; len <= MAX_CODE_BITS; len++) {
+        code = (code + lengthCount[len - 1]) << 1;
+        nextCode[len] = code;
+    }
+
+    unsigned primarySize = 1u << tableBits;
+    for (unsigned i = 0; i < primarySize; i++) {
+        table[i] = makeEntry(kInvalid, 0, 0);
+    }
+
+    // Size the subtables: the longest code under each primary prefix
+    uint8_t subBits[1 << LITLEN_TABLE_BITS] = { 0 };
+    unsigned codes[LITLEN_SYMBOLS];
+    for (unsigned symbol = 0; symbol < count; symbol++) {
+        unsigned len = lengths[symbol];
+        if (!len) continue;
+        codes[symbol] = reverseBits(nextCode[len]++, len);
+        if (len > tableBits) {
+            unsigned prefix = codes[symbol] & (primarySize - 1);
+            subBits[prefix] = (uint8_t)std::max((unsigned)subBits[prefix], len - tableBits);
+        }
+    }
+    unsigned used = primarySize;
+    for (unsigned prefix = 0; prefix < primarySize; prefix++) {
+        if (!subBits[prefix]) continue;
+        unsigned size = 1u << subBits[prefix];
+        if (used + size > tableSize) {
+            return false;
+        }
+        for (unsigned i = 0; i < size; i++) {
+            table[used + i] = makeEntry(kInvalid, 0, 0);
+        }
+        table[prefix] = makeEntry(kSubtable, tableBits, used) | (uint32_t)subBits[prefix] << 11;
+        used += size;
+    }
+
+    for (unsigned symbol = 0; symbol < count; symbol++) {
+        unsigned len = lengths[symbol];
+        if (!len) continue;
+        if (len <= tableBits) {
+            uint32_t entry = entryOf(symbol) | len;
+            for (unsigned i = codes[symbol]; i < primarySize; i += 1u << len) {
+                table[i] = entry;
+            }
+        } else {
+            uint32_t sub = table[codes[symbol] & (primarySize - 1)];
+            unsigned start = sub >> 16;
+            unsigned size = 1u << ((sub >> 11) & 0x1F);
+            uint32_t entry = entryOf(symbol) | (len - tableBits);
+            for (unsigned i = codes[symbol] >> tableBits; i < size; i += 1u << (len - tableBits)) {
+                table[start + i] = entry;
+            }
+        }
+    }
+    return true;
+}
+
+// Where the next tableBits bits start with a short literal and the bits
+// after it with another, one entry yields both
+void pairLiterals(uint32_t* table) {
+    const unsigned size = 1 << LITLEN_TABLE_BITS;
+    uint32_t single[size];
+    memcpy(single, table, sizeof(single));
+    for (unsigned i = 0; i < size; i++) {
+        uint32_t first = single[i];
+        if (entryKind(first) != kLiteral) continue;
+        unsigned firstBits = entryBits(first);
+        uint32_t second = single[i >> firstBits];
+        unsigned secondBits = entryBits(second);
+        if (entryKind(second) == kLiteral && firstBits + secondBits <= LITLEN_TABLE_BITS) {
+            table[i] = makeEntry(kLiteralPair, firstBits + secondBits, (first >> 16) | (second >> 16) << 8);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Decoder
+//------------------------------------------------------------------------------
+
+struct Decoder {
+    const uint8_t* in;
+    const uint8_t* inEnd;
+    size_t overread;          // Zero bytes fed in past the end of the input
+    uint64_t bits;
+    unsigned bitCount;
+
+    uint32_t litlen[LITLEN_TABLE_SIZE];
+    uint32_t dist[DIST_TABLE_SIZE];
+    uint32_t precode[1 << PRECODE_TABLE_BITS];
+};
+
+inline uint64_t loadLE64(const uint8_t* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Top the bit buffer up to at least 56 bits: a whole word at once while 8
+// bytes of input remain, then a byte at a time with zeros past the end
+inline void refill(Decoder& d) {
+    if (d.inEnd - d.in >= 8) {
+        d.bits |= loadLE64(d.in) << d.bitCount;
+        d.in += (63 - d.bitCount) >> 3;
+        d.bitCount |= 56;
+        return;
+    }
+    while (d.bitCount < 56) {
+        if (d.in < d.inEnd) {
+            d.bits |= (uint64_t)*d.in++ << d.bitCount;
+        } else {
+            d.overread++;
+        }
+        d.bitCount += 8;
+    }
+}
+
+inline uint32_t takeBits(Decoder& d, unsigned count) {
+    uint32_t value = (uint32_t)(d.bits & ((1ull << count) - 1));
+    d.bits >>= count;
+    d.bitCount -= count;
+    return value;
+}
+
+// Next symbol's entry, through a subtable if need be; consumes its code
+inline uint32_t decodeEntry(Decoder& d, const uint32_t* table, unsigned tableBits) {
+    uint32_t entry = table[d.bits & ((1u << tableBits) - 1)];
+    if (entryKind(entry) == kSubtable) {
+        d.bits >>= tableBits;
+        d.bitCount -= tableBits;
+        entry = table[(entry >> 16) + (d.bits & ((1u << ((entry >> 11) & 0x1F)) - 1))];
+    }
+    d.bits >>= entryBits(entry);
+    d.bitCount -= entryBits(entry);
+    return entry;
+}
+
+// Copy a match a word at a time when the distance allows it and the output
+// has slack for the overshoot
+inline void copyMatch(uint8_t* out, size_t distance, size_t length, const uint8_t* outEnd) {
+    const uint8_t* src = out - distance;
+    if (distance >= 8 && (size_t)(outEnd - out) >= length + 8) {
+        uint8_t* end = out + length;
+        do {
+            uint64_t word;
+            memcpy(&word, src, 8);
+            memcpy(out, &word, 8);
+            src += 8;
+            out += 8;
+        } while (out < end);
+    } else if (distance == 1) {
+        memset(out, *src, length);
+    } else {
+        for (size_t i = 0; i < length; i++) {
+            out[i] = src[i];
+        }
+    }
+}
+
+bool readDynamicTables(Decoder& d) {
+    refill(d);
+    unsigned litlenCount = takeBits(d, 5) + 257;
+    unsigned distCount = takeBits(d, 5) + 1;
+    unsigned precodeCount = takeBits(d, 4) + 4;
+
+    uint8_t precodeLengths[PRECODE_SYMBOLS] = { 0 };
+    for (unsigned i = 0; i < precodeCount; i++) {
+        refill(d);
+        precodeLengths[PRECODE_ORDER[i]] = (uint8_t)takeBits(d, 3);
+    }
+    if (!buildTable(d.precode, 1 << PRECODE_TABLE_BITS, PRECODE_TABLE_BITS, precodeLengths, PRECODE_SYMBOLS,
+                    precodeEntry)) {
+        return false;
+    }
+
+    uint8_t lengths[LITLEN_SYMBOLS + DIST_SYMBOLS];
+    unsigned total = litlenCount + distCount;
+    for (unsigned i = 0; i < total;) {
+        refill(d);
+        uint32_t entry = decodeEntry(d, d.precode, PRECODE_TABLE_BITS);
+        if (entryKind(entry) != kLiteral) {
+            return false;
+        }
+        unsigned symbol = entry >> 16;
+        if (symbol < 16) {
+            lengths[i++] = (uint8_t)symbol;
+            continue;
+        }
+        unsigned repeat;
+        uint8_t value = 0;
+        if (symbol == 16) {
+            if (i == 0) return false;
+            value = lengths[i - 1];
+            repeat = 3 + takeBits(d, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + takeBits(d, 3);
+        } else {
+            repeat = 11 + takeBits(d, 7);
+        }
+        if (i + repeat > total) {
+            return false;
+        }
+        memset(lengths + i, value, repeat);
+        i += repeat;
+    }
+    if (!lengths[256]) {
+        return false;
+    }
+    return buildTable(d.litlen, LITLEN_TABLE_SIZE, LITLEN_TABLE_BITS, lengths, litlenCount, litlenEntry) &&
+           buildTable(d.dist, DIST_TABLE_SIZE, DIST_TABLE_BITS, lengths + litlenCount, distCount, distEntry);
+}
+
+void buildFixedTables(Decoder& d) {
+    uint8_t lengths[LITLEN_SYMBOLS];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    buildTable(d.litlen, LITLEN_TABLE_SIZE, LITLEN_TABLE_BITS, lengths, LITLEN_SYMBOLS, litlenEntry);
+    memset(lengths, 5, DIST_SYMBOLS);
+    buildTable(d.dist, DIST_TABLE_SIZE, DIST_TABLE_BITS, lengths, DIST_SYMBOLS, distEntry);
+}
+
+// Stored block: drop to a byte boundary, hand back the whole bytes still in
+// the bit buffer, then copy
+bool copyStored(Decoder& d, uint8_t*& out, const uint8_t* outEnd) {
+    takeBits(d, d.bitCount & 7);
+    size_t buffered = d.bitCount >> 3;
+    if (buffered < d.overread) {
+        return false;
+    }
+    d.in -= buffered - d.overread;
+    d.overread = 0;
+    d.bits = 0;
+    d.bitCount = 0;
+
+    if (d.inEnd - d.in < 4) {
+        return false;
+    }
+    unsigned len = d.in[0] | d.in[1] << 8;
+    unsigned nlen = d.in[2] | d.in[3] << 8;
+    d.in += 4;
+    if (len != (~nlen & 0xFFFF) || (size_t)(d.inEnd - d.in) < len || (size_t)(outEnd - out) < len) {
+        return false;
+    }
+    memcpy(out, d.in, len);
+    d.in += len;
+    out += len;
+    return true;
+}
+
+// Input and output the fast loop needs ahead of it: a word refilled twice,
+// and three literal pairs then the longest match with a word of overshoot
+const size_t FAST_INPUT_SLACK = 16;
+const size_t FAST_OUTPUT_SLACK = 6 + 258 + 8;
+
+// Most of a block: bit state in locals (stores through out could alias the
+// decoder), refills without a branch, up to six literals per refill and no
+// bounds checks but the match distance. Returns with the slack used up, at
+// the end of the block, or on corrupt data.
+enum FastResult { kFastSlack, kFastEndOfBlock, kFastCorrupt };
+
+FastResult decodeFast(Decoder& d, uint8_t*& outRef, const uint8_t* outStart, const uint8_t* outEnd) {
+    const uint8_t* in = d.in;
+    uint64_t bits = d.bits;
+    unsigned bitCount = d.bitCount;
+    uint8_t* out = outRef;
+    const uint32_t* litlen = d.litlen;
+    FastResult result = kFastSlack;
+
+#define FAST_REFILL()                                         \
+    do {                                                      \
+        bits |= loadLE64(in) << bitCount;                     \
+        in += (63 - bitCount) >> 3;                           \
+        bitCount |= 56;                                       \
+    } while (0)
+#define FAST_DECODE(table, tableBits, entry)                  \
+    do {                                                      \
+        entry = table[bits & ((1u << (tableBits)) - 1)];      \
+        if (entryKind(entry) == kSubtable) {                  \
+            bits >>= (tableBits);                             \
+            bitCount -= (tableBits);                          \
+            entry = table[(entry >> 16) + (bits & ((1u << ((entry >> 11) & 0x1F)) - 1))]; \
+        }                                                     \
+        bits >>= entryBits(entry);                            \
+        bitCount -= entryBits(entry);                         \
+    } while (0)
+
+    while ((size_t)(d.inEnd - in) >= FAST_INPUT_SLACK && (size_t)(outEnd - out) >= FAST_OUTPUT_SLACK) {
+        FAST_REFILL();
+        uint32_t entry;
+        FAST_DECODE(litlen, LITLEN_TABLE_BITS, entry);
+        uint32_t kind = entryKind(entry);
+        if (kind == kLiteral || kind == kLiteralPair) {
+            // 56 bits cover three literal codes; a length needs a refill
+            out[0] = (uint8_t)(entry >> 16);
+            out[1] = (uint8_t)(entry >> 24);
+            out += kind == kLiteralPair ? 2 : 1;
+            FAST_DECODE(litlen, LITLEN_TABLE_BITS, entry);
+            kind = entryKind(entry);
+            if (kind == kLiteral || kind == kLiteralPair) {
+                out[0] = (uint8_t)(entry >> 16);
+                out[1] = (uint8_t)(entry >> 24);
+                out += kind == kLiteralPair ? 2 : 1;
+                FAST_DECODE(litlen, LITLEN_TABLE_BITS, entry);
+                kind = entryKind(entry);
+                if (kind == kLiteral || kind == kLiteralPair) {
+                    out[0] = (uint8_t)(entry >> 16);
+                    out[1] = (uint8_t)(entry >> 24);
+                    out += kind == kLiteralPair ? 2 : 1;
+                    continue;
+                }
+            }
+            FAST_REFILL();
+        }
+        if (kind == kLength) {
+            // Code already taken: extra bits, distance code and extra bits fit in 33
+            size_t length = ((entry >> 16) & 0x1FF) + (size_t)(bits & ((1u << ((entry >> 25) & 0x1F)) - 1));
+            bits >>= (entry >> 25) & 0x1F;
+            bitCount -= (entry >> 25) & 0x1F;
+            uint32_t distance;
+            FAST_DECODE(d.dist, DIST_TABLE_BITS, distance);
+            if (entryKind(distance) != kDistance) {
+                result = kFastCorrupt;
+                break;
+            }
+            unsigned extra = (distance >> 11) & 0x1F;
+            size_t offset = (distance >> 16) + (size_t)(bits & ((1u << extra) - 1));
+            bits >>= extra;
+            bitCount -= extra;
+            if (offset > (size_t)(out - outStart)) {
+                result = kFastCorrupt;
+                break;
+            }
+            copyMatch(out, offset, length, outEnd);
+            out += length;
+            continue;
+        }
+        result = kind == kEndOfBlock ? kFastEndOfBlock : kFastCorrupt;
+        break;
+    }
+#undef FAST_REFILL
+#undef FAST_DECODE
+
+    d.in = in;
+    d.bits = bits;
+    d.bitCount = bitCount;
+    outRef = out;
+    return result;
+}
+
+bool decodeBlock(Decoder& d, uint8_t*& out, const uint8_t* outStart, const uint8_t* outEnd) {
+    FastResult fast = decodeFast(d, out, outStart, outEnd);
+    if (fast != kFastSlack) {
+        return fast == kFastEndOfBlock;
+    }
+    for (;;) {
+        refill(d);
+        uint32_t entry = decodeEntry(d, d.litlen, LITLEN_TABLE_BITS);
+        switch (entryKind(entry)) {
+            case kLiteralPair:
+                if (outEnd - out < 2) return false;
+                out[0] = (uint8_t)(entry >> 16);
+                out[1] = (uint8_t)(entry >> 24);
+                out += 2;
+                break;
+            case kLiteral:
+                if (out == outEnd) return false;
+                *out++ = (uint8_t)(entry >> 16);
+                break;
+            case kLength: {
+                size_t length = ((entry >> 16) & 0x1FF) + takeBits(d, (entry >> 25) & 0x1F);
+                uint32_t distance = decodeEntry(d, d.dist, DIST_TABLE_BITS);
+                if (entryKind(distance) != kDistance) return false;
+                size_t offset = (distance >> 16) + takeBits(d, (distance >> 11) & 0x1F);
+                if (offset > (size_t)(out - outStart) || length > (size_t)(outEnd - out)) return false;
+                copyMatch(out, offset, length, outEnd);
+                out += length;
+                break;
+            }
+            case kEndOfBlock:
+                return true;
+            default:
+                return false;
+        }
+        if (d.overread > 8) {
+            return false;   // Ran off the end of the input
+        }
+    }
+}
+
+} // namespace
+
+bool inflateBuffer(const uint8_t* in, size_t inSize, uint8_t* out, size_t outSize) {
+    std::unique_ptr<Decoder> d(new Decoder);
+    d->in = in;
+    d->inEnd = in + inSize;
+    d->overread = 0;
+    d->bits = 0;
+    d->bitCount = 0;
+
+    uint8_t* next = out;
+    const uint8_t* outEnd = out + outSize;
+    bool last = false;
+    while (!last) {
+        refill(*d);
+        last = takeBits(*d, 1) != 0;
+        unsigned type = takeBits(*d, 2);
+        bool ok;
+        if (type == 0) {
+            ok = copyStored(*d, next, outEnd);
+        } else if (type == 1) {
+            buildFixedTables(*d);
+            pairLiterals(d->litlen);
+            ok = decodeBlock(*d, next, out, outEnd);
+        } else if (type == 2) {
+            ok = readDynamicTables(*d);
+            if (ok) pairLiterals(d->litlen);
+            ok = ok && decodeBlock(*d, next, out, outEnd);
+        } else {
+            ok = false;
+        }
+        if (!ok || d->overread > 8) {
+            return false;
+        }
+    }
+    // Padding still in the bit buffer is fine; padding decoded is truncation
+    return next == outEnd && d->overread * 8 <= d->bitCount;
+}
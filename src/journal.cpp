@@ -0,0 +1,323 @@
+/*
+ * NT Flash Tool - Append-only journal of flashed units
+ *
+ * Copyright (c) 2024
+ */
+
+#include <chrono>
+#include <cmath>
+#include <ctime>
+
+#include "nt_flash.h"
+
+#if defined(WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+//------------------------------------------------------------------------------
+// Journal
+//------------------------------------------------------------------------------
+
+// One JSON object per line:
+// {"time":1700000000.123,"port":"1-2.3","serial":"","version":"1.12.0",
+//  "sha256":"...","result":"ok","seconds":11.8,"bytes":1503232,
+//  "write_seconds":1.4,"enum_seconds":1.5,"retries":0,"stages":{"FIND":0.01,...}}
+// "stage" names where a failed flash stopped; "boot_seconds" is present when
+// the application was seen to enumerate after the reset. A crash can leave a torn last
+// line; readers skip it and the next open starts a fresh line.
+
+namespace {
+
+class Journal {
+public:
+    Journal() : m_file(nullptr), m_stop(false) {}
+    ~Journal() { close(); }   // A joinable writer must not reach static teardown
+
+    bool open(const std::string& path);
+    void append(const std::string& line);
+    void close();
+
+private:
+    void writerLoop();
+
+    FILE* m_file;
+    std::thread m_writer;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::vector<std::string> m_pending;
+    bool m_stop;
+};
+
+Journal g_journal;
+
+bool syncFile(FILE* f) {
+    if (fflush(f) != 0) {
+        return false;
+    }
+#if defined(WIN32)
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+// May be called again after close(), as a library user would
+bool Journal::open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_file) {
+        logError("Journal already open");
+        return false;
+    }
+    FILE* f = fopen(path.c_str(), "a+b");
+    if (!f) {
+        logError("Cannot open journal: %s", path.c_str());
+        return false;
+    }
+    // Terminate a line torn by a crash so the next record stays readable
+    if (fseek(f, -1, SEEK_END) == 0 && fgetc(f) != '\n') {
+        fseek(f, 0, SEEK_END);
+        fputc('\n', f);
+    }
+    fseek(f, 0, SEEK_END);
+    m_file = f;
+    m_stop = false;
+    m_writer = std::thread(&Journal::writerLoop, this);
+    return true;
+}
+
+// Only queues the line: the flash path never waits for the disk
+void Journal::append(const std::string& line) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_file || m_stop) {  // Closing: the writer may already have drained the queue
+            return;
+        }
+        m_pending.push_back(line);
+    }
+    m_wake.notify_one();
+}
+
+// Group commit: everything queued while the previous fsync was in progress
+// goes out in one write and one fsync
+void Journal::writerLoop() {
+    std::vector<std::string> batch;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_wake.wait(lock, [this] { return m_stop || !m_pending.empty(); });
+        if (m_pending.empty()) {
+            break;
+        }
+        batch.swap(m_pending);
+        lock.unlock();
+
+        bool ok = true;
+        for (size_t i = 0; i < batch.size(); i++) {
+            ok = fwrite(batch[i].data(), 1, batch[i].size(), m_file) == batch[i].size() && ok;
+        }
+        if (!syncFile(m_file) || !ok) {
+            logError("Failed to write journal");
+        }
+        batch.clear();
+
+        lock.lock();
+    }
+}
+
+void Journal::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_file || m_stop) {
+            return;
+        }
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_writer.join();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    fclose(m_file);
+    m_file = nullptr;
+}
+
+double wallClockSeconds() {
+    return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Millisecond resolution keeps records short
+double ms(double seconds) {
+    return floor(seconds * 1000 + 0.5) / 1000;
+}
+
+} // namespace
+
+bool openJournal(const std::string& path) {
+    return g_journal.open(path);
+}
+
+void closeJournal() {
+    g_journal.close();
+}
+
+// Serialized here, on the caller's thread, so the writer only copies bytes
+void journalFlash(const JournalEntry& entry) {
+    cJSON* record = cJSON_CreateObject();
+    cJSON_AddNumberToObject(record, "time", ms(wallClockSeconds()));
+    cJSON_AddStringToObject(record, "port", entry.port.c_str());
+    cJSON_AddStringToObject(record, "serial", entry.serial.c_str());
+    cJSON_AddStringToObject(record, "version", entry.version.c_str());
+    cJSON_AddStringToObject(record, "sha256", entry.firmwareHash.c_str());
+    cJSON_AddStringToObject(record, "result", entry.stats.ok ? "ok" : "failed");
+    if (!entry.stats.ok) {
+        cJSON_AddStringToObject(record, "stage", entry.failedStage.c_str());
+    }
+    cJSON_AddNumberToObject(record, "seconds", ms(entry.seconds));
+    cJSON_AddNumberToObject(record, "bytes", (double)entry.stats.writeBytes);
+    cJSON_AddNumberToObject(record, "write_seconds", ms(entry.stats.writeSeconds));
+    cJSON_AddNumberToObject(record, "enum_seconds", ms(entry.stats.enumSeconds));
+    cJSON_AddNumberToObject(record, "retries", entry.stats.retries);
+    if (entry.stats.bootSeconds > 0) {
+        cJSON_AddNumberToObject(record, "boot_seconds", ms(entry.stats.bootSeconds));
+    }
+
+    cJSON* stages = cJSON_AddObjectToObject(record, "stages");
+    for (size_t i = 0; i < entry.stages.size(); i++) {
+        cJSON* item = cJSON_GetObjectItem(stages, entry.stages[i].first.c_str());
+        if (item) {
+            cJSON_SetNumberValue(item, ms(item->valuedouble + entry.stages[i].second));
+        } else {
+            cJSON_AddNumberToObject(stages, entry.stages[i].first.c_str(), ms(entry.stages[i].second));
+        }
+    }
+
+    char* json = cJSON_PrintUnformatted(record);
+    cJSON_Delete(record);
+    g_journal.append(std::string(json) + "\n");
+    cJSON_free(json);
+}
+
+//------------------------------------------------------------------------------
+// Journal Report
+//------------------------------------------------------------------------------
+
+namespace {
+
+struct Period {
+    uint32_t units;
+    uint32_t ok;
+    double seconds;           // Sum over successful flashes
+    double bytes;
+    double writeSeconds;
+
+    Period() : units(0), ok(0), seconds(0), bytes(0), writeSeconds(0) {}
+};
+
+double recordNumber(cJSON* record, const char* name) {
+    cJSON* item = cJSON_GetObjectItem(record, name);
+    return cJSON_IsNumber(item) ? item->valuedouble : 0;
+}
+
+void printPeriod(const char* label, const Period& period, double hours) {
+    double perHour = hours > 0 ? period.units / hours : 0;
+    printf("%-18s %6u %6u %6u %8.1f %8.1fs %9.2f\n", label, period.units, period.ok,
+           period.units - period.ok, perHour, period.ok ? period.seconds / period.ok : 0,
+           period.writeSeconds > 0 ? period.bytes / period.writeSeconds / (1024.0 * 1024.0) : 0);
+}
+
+} // namespace
+
+// Units flashed per period, with success rate, mean flash time and write throughput
+bool reportJournal(const std::string& path, uint32_t intervalMinutes) {
+    std::vector<uint8_t> data;
+    if (!loadFile(path.c_str(), data)) {
+        return false;
+    }
+    if (intervalMinutes == 0) {
+        intervalMinutes = 60;
+    }
+    double interval = intervalMinutes * 60.0;
+
+    std::map<int64_t, Period> periods;
+    std::map<std::string, uint32_t> failures;
+    std::map<std::string, uint32_t> firmware;
+    Period total;
+    size_t skipped = 0;
+
+    std::string text(data.begin(), data.end());
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        std::string line = text.substr(pos, end - pos);
+        pos = end + 1;
+        if (line.empty()) {
+            continue;
+        }
+
+        cJSON* record = cJSON_Parse(line.c_str());
+        if (!cJSON_IsObject(record)) {
+            skipped++;
+            cJSON_Delete(record);
+            continue;
+        }
+        cJSON* result = cJSON_GetObjectItem(record, "result");
+        bool ok = cJSON_IsString(result) && strcmp(result->valuestring, "ok") == 0;
+
+        Period& period = periods[(int64_t)floor(recordNumber(record, "time") / interval)];
+        Period* counts[] = { &period, &total };
+        for (int i = 0; i < 2; i++) {
+            counts[i]->units++;
+            if (ok) {
+                counts[i]->ok++;
+                counts[i]->seconds += recordNumber(record, "seconds");
+            }
+            counts[i]->bytes += recordNumber(record, "bytes");
+            counts[i]->writeSeconds += recordNumber(record, "write_seconds");
+        }
+        if (!ok) {
+            cJSON* stage = cJSON_GetObjectItem(record, "stage");
+            failures[cJSON_IsString(stage) ? stage->valuestring : "UNKNOWN"]++;
+        }
+        cJSON* version = cJSON_GetObjectItem(record, "version");
+        cJSON* hash = cJSON_GetObjectItem(record, "sha256");
+        std::string name = cJSON_IsString(version) && version->valuestring[0] ? version->valuestring : "?";
+        if (cJSON_IsString(hash) && strlen(hash->valuestring) >= 12) {
+            name += std::string(" (") + std::string(hash->valuestring, 12) + ")";
+        }
+        firmware[name]++;
+        cJSON_Delete(record);
+    }
+
+    printf("%-18s %6s %6s %6s %8s %9s %9s\n", "Period", "Units", "OK", "Failed", "Units/h", "Mean", "Write MB/s");
+    for (std::map<int64_t, Period>::const_iterator it = periods.begin(); it != periods.end(); ++it) {
+        time_t start = (time_t)(it->first * interval);
+        struct tm local;
+#if defined(WIN32)
+        localtime_s(&local, &start);
+#else
+        localtime_r(&start, &local);
+#endif
+        char label[32];
+        strftime(label, sizeof(label), "%Y-%m-%d %H:%M", &local);
+        printPeriod(label, it->second, interval / 3600);
+    }
+    printPeriod("Total", total, periods.size() * interval / 3600);  // Rate over periods with activity
+
+    if (!failures.empty()) {
+        printf("\nFailures by stage:\n");
+        for (std::map<std::string, uint32_t>::const_iterator it = failures.begin(); it != failures.end(); ++it) {
+            printf("  %-16s %u\n", it->first.c_str(), it->second);
+        }
+    }
+    if (!firmware.empty()) {
+        printf("\nFirmware:\n");
+        for (std::map<std::string, uint32_t>::const_iterator it = firmware.begin(); it != firmware.end(); ++it) {
+            printf("  %-32s %u\n", it->first.c_str(), it->second);
+        }
+    }
+    if (skipped) {
+        printf("\n%zu unreadable record(s) skipped\n", skipped);
+    }
+    fflush(stdout);
+    return true;
+}
@@ -0,0 +1,260 @@
+/*
+ * NT Flash Tool - libntflash C API
+ *
+ * Copyright (c) 2024
+ */
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "nt_flash.h"
+#include "ntflash.h"
+
+struct ntf_package {
+    FirmwarePackage* pkg;
+};
+
+struct QueuedEvent {
+    ntf_event_type type;
+    std::string stage;
+    int percent;
+    std::string message;
+};
+
+struct ntf_job {
+    FirmwarePackage* pkg;
+    std::string port;
+    bool skipSdp;
+    ntf_event_callback callback;
+    void* user;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::deque<QueuedEvent> events;
+    QueuedEvent current;          // Backs the strings of the last polled event
+    std::atomic<bool> cancel;
+    int state;
+
+    ntf_job() : pkg(nullptr), skipSdp(false), callback(nullptr), user(nullptr),
+                cancel(false), state(NTF_RUNNING) {}
+};
+
+static thread_local std::string t_lastError;
+
+// A job without a port resets the HID library (see startFlashloader()),
+// which would pull the devices from under any other job, so it runs alone
+static std::mutex s_jobsMutex;
+static uint32_t s_runningJobs = 0;
+static bool s_portlessRunning = false;
+
+static void pushEvent(ntf_job* job, ntf_event_type type, const char* stage, int percent,
+                      const char* message) {
+    if (job->callback) {
+        ntf_event ev;
+        ev.type = type;
+        ev.stage = stage;
+        ev.percent = percent;
+        ev.message = message;
+        ev.port = job->port.c_str();
+        job->callback(&ev, job->user);
+    }
+
+    QueuedEvent queued;
+    queued.type = type;
+    queued.stage = stage;
+    queued.percent = percent;
+    queued.message = message;
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->events.push_back(queued);
+}
+
+static void sinkHandler(void* context, const char* type, const char* stage, int percent,
+                        const char* message) {
+    ntf_job* job = (ntf_job*)context;
+    ntf_event_type eventType = NTF_EVENT_STATUS;
+    if (strcmp(type, "PROGRESS") == 0) {
+        eventType = NTF_EVENT_PROGRESS;
+    } else if (strcmp(type, "ERROR") == 0) {
+        eventType = NTF_EVENT_ERROR;
+    } else if (strcmp(type, "WARNING") == 0) {
+        eventType = NTF_EVENT_WARNING;
+    }
+    pushEvent(job, eventType, stage, percent, message);
+}
+
+static void runJob(ntf_job* job) {
+    EventSink sink = { sinkHandler, job };
+    g_eventSink = &sink;
+    g_cancel = &job->cancel;
+    g_deviceTag = job->port.empty() ? nullptr : job->port.c_str();
+
+    bool ok = flashFirmware(job->pkg, job->skipSdp, job->port);
+
+    g_eventSink = nullptr;
+    g_cancel = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(s_jobsMutex);
+        s_runningJobs--;
+        if (job->port.empty()) {
+            s_portlessRunning = false;
+        }
+    }
+    pushEvent(job, NTF_EVENT_DONE, "", ok ? 100 : 0, ok ? "Flash complete" : "Flash failed");
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->state = ok ? NTF_SUCCEEDED : NTF_FAILED;
+    job->finished.notify_all();
+}
+
+extern "C" {
+
+const char* ntf_version(void) {
+    return VERSION;
+}
+
+void ntf_set_dry_run(int enabled) {
+    g_dryRun = enabled != 0;
+}
+
+void ntf_set_verbose(int enabled) {
+    g_verbose = enabled != 0;
+}
+
+void ntf_set_boot_timeout(unsigned seconds) {
+    g_bootTimeoutMs = BootWatch::supported() ? seconds * 1000 : 0;
+}
+
+void ntf_set_streaming(int enabled) {
+    g_streamFirmware = enabled != 0;
+}
+
+const char* ntf_last_error(void) {
+    return t_lastError.c_str();
+}
+
+ntf_package* ntf_package_open(const char* zip_path) {
+    // Capture load errors instead of printing them
+    struct Capture {
+        static void handler(void* context, const char* type, const char*, int, const char* message) {
+            if (strcmp(type, "ERROR") == 0) {
+                *(std::string*)context = message;
+            }
+        }
+    };
+    t_lastError.clear();
+    EventSink sink = { Capture::handler, &t_lastError };
+    const EventSink* previous = g_eventSink;
+    g_eventSink = &sink;
+    FirmwarePackage* pkg = loadFirmwarePackage(zip_path);
+    g_eventSink = previous;
+
+    if (!pkg) {
+        return nullptr;
+    }
+    ntf_package* handle = new ntf_package;
+    handle->pkg = pkg;
+    return handle;
+}
+
+void ntf_package_close(ntf_package* pkg) {
+    if (pkg) {
+        delete pkg->pkg;
+        delete pkg;
+    }
+}
+
+size_t ntf_package_firmware_size(const ntf_package* pkg) {
+    return pkg ? pkg->pkg->firmwareSize : 0;
+}
+
+int ntf_enumerate_devices(ntf_device* devices, int max) {
+    std::vector<UsbDevice> found = enumerateDevices();
+    for (int i = 0; i < max && i < (int)found.size(); i++) {
+        snprintf(devices[i].port, sizeof(devices[i].port), "%s", found[i].port.c_str());
+        snprintf(devices[i].path, sizeof(devices[i].path), "%s", found[i].path.c_str());
+        devices[i].flashloader = found[i].flashloader ? 1 : 0;
+    }
+    return (int)found.size();
+}
+
+ntf_job* ntf_flash_start(ntf_package* pkg, const ntf_flash_options* options) {
+    if (!pkg || !pkg->pkg || !pkg->pkg->valid) {
+        t_lastError = "Invalid firmware package";
+        return nullptr;
+    }
+
+    ntf_job* job = new ntf_job;
+    job->pkg = pkg->pkg;
+    if (options) {
+        job->port = options->port ? options->port : "";
+        job->skipSdp = options->skip_sdp != 0;
+        job->callback = options->callback;
+        job->user = options->user;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(s_jobsMutex);
+        if (s_portlessRunning || (job->port.empty() && s_runningJobs > 0)) {
+            t_lastError = "A job without a port cannot run beside other jobs";
+            delete job;
+            return nullptr;
+        }
+        s_runningJobs++;
+        s_portlessRunning = job->port.empty();
+    }
+    job->thread = std::thread(runJob, job);
+    return job;
+}
+
+int ntf_job_poll(ntf_job* job, ntf_event* event) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->events.empty()) {
+        return 0;
+    }
+    job->current = job->events.front();
+    job->events.pop_front();
+
+    event->type = job->current.type;
+    event->stage = job->current.stage.c_str();
+    event->percent = job->current.percent;
+    event->message = job->current.message.c_str();
+    event->port = job->port.c_str();
+    return 1;
+}
+
+int ntf_job_wait(ntf_job* job, int timeout_ms) {
+    std::unique_lock<std::mutex> lock(job->mutex);
+    if (timeout_ms < 0) {
+        job->finished.wait(lock, [job] { return job->state != NTF_RUNNING; });
+    } else {
+        job->finished.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                               [job] { return job->state != NTF_RUNNING; });
+    }
+    return job->state;
+}
+
+int ntf_job_state(ntf_job* job) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    return job->state;
+}
+
+void ntf_job_cancel(ntf_job* job) {
+    job->cancel = true;
+}
+
+void ntf_job_free(ntf_job* job) {
+    if (!job) {
+        return;
+    }
+    if (job->thread.joinable()) {
+        job->thread.join();
+    }
+    delete job;
+}
+
+} // extern "C"
@@ -4,886 +4,17 @@
  * Copyright (c) 2024
  *
  * This tool wraps the NXP BLFWK library to provide a simple command-line
- * interface for flashing disting NT firmware.
+ * interface for flashing disting NT firmware. The flashing logic lives in
+ * libntflash; this file only parses arguments and dispatches.
  */
 
-#include <cstdio>
-#include <cstdlib>
-#include <cstring>
-#include <string>
-#include <vector>
-#include <stdexcept>
+#include "nt_flash.h"
 
 // BLFWK includes
 #include "blfwk/Logging.h"
-#include "blfwk/host_types.h"
-#include "blfwk/utils.h"
-#include "blfwk/SDPCommand.h"
-#include "blfwk/Command.h"
-#include "blfwk/UsbHidPeripheral.h"
-#include "blfwk/SDPUsbHidPacketizer.h"
-#include "blfwk/UsbHidPacketizer.h"
-#include "blfwk/Bootloader.h"
-#include "blfwk/Peripheral.h"
-#include "hidapi.h"
-
-// Embedded libraries
-#include "miniz.h"
-#include "miniz_zip.h"
-
-extern "C" {
-#include "cJSON.h"
-}
-
-#if defined(WIN32)
-#include <windows.h>
-#else
-#include <unistd.h>
-#include <signal.h>
-#endif
 
 using namespace blfwk;
 
-//------------------------------------------------------------------------------
-// Constants
-//------------------------------------------------------------------------------
-
-const char* VERSION = "0.1.0";
-const char* TOOL_NAME = "nt-flash";
-
-// USB IDs for disting NT
-const uint16_t SDP_VID = 0x1FC9;    // NXP ROM bootloader
-const uint16_t SDP_PID = 0x0135;    // i.MX RT in SDP mode
-const uint16_t BL_VID = 0x15A2;     // NXP flashloader
-const uint16_t BL_PID = 0x0073;     // Flashloader running
-
-// Memory addresses for i.MX RT1060
-const uint32_t FLASHLOADER_ADDR = 0x20001C00;  // RAM address for flashloader
-const uint32_t FLASH_BASE = 0x60000000;        // External flash base
-const uint32_t FIRMWARE_ADDR = 0x60001000;     // Firmware write address
-const uint32_t CONFIG_ADDR = 0x2000;           // Configuration memory
-
-// FlexSPI configuration values
-const uint32_t FLEXSPI_NOR_CONFIG = 0xC0000008;
-const uint32_t FCB_CONFIG = 0xF000000F;
-const uint32_t MEMORY_ID_FLEXSPI_NOR = 9;
-
-// Timeouts
-const uint32_t SDP_TIMEOUT_MS = 5000;
-const uint32_t BL_TIMEOUT_MS = 60000;  // Long timeout for flash operations
-
-// Expert Sleepers firmware URLs
-const char* FIRMWARE_BASE_URL = "https://www.expert-sleepers.co.uk/downloads/firmware/";
-
-//------------------------------------------------------------------------------
-// Globals
-//------------------------------------------------------------------------------
-
-static bool g_verbose = false;
-static bool g_dryRun = false;
-static bool g_machineOutput = false;
-
-//------------------------------------------------------------------------------
-// Logging
-//------------------------------------------------------------------------------
-
-void logInfo(const char* fmt, ...) {
-    if (g_machineOutput) return;  // Suppress in machine mode
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-    printf("\n");
-    fflush(stdout);
-}
-
-void logVerbose(const char* fmt, ...) {
-    if (!g_verbose || g_machineOutput) return;  // Suppress in machine mode
-    va_list args;
-    va_start(args, fmt);
-    printf("  ");
-    vprintf(fmt, args);
-    va_end(args);
-    printf("\n");
-    fflush(stdout);
-}
-
-void logError(const char* fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    if (g_machineOutput) {
-        printf("ERROR:");
-        vprintf(fmt, args);
-        printf("\n");
-        fflush(stdout);
-    } else {
-        fprintf(stderr, "ERROR: ");
-        vfprintf(stderr, fmt, args);
-        fprintf(stderr, "\n");
-        fflush(stderr);
-    }
-    va_end(args);
-}
-
-//------------------------------------------------------------------------------
-// Machine-readable output (for --machine flag)
-// Format: TYPE:STAGE:PERCENT:MESSAGE
-//------------------------------------------------------------------------------
-
-void machineStatus(const char* stage, int percent, const char* message) {
-    if (!g_machineOutput) return;
-    printf("STATUS:%s:%d:%s\n", stage, percent, message);
-    fflush(stdout);
-}
-
-void machineProgress(const char* stage, int percent, const char* message) {
-    if (!g_machineOutput) return;
-    printf("PROGRESS:%s:%d:%s\n", stage, percent, message);
-    fflush(stdout);
-}
-
-//------------------------------------------------------------------------------
-// File Utilities
-//------------------------------------------------------------------------------
-
-// Load a local file into memory
-bool loadFile(const char* path, std::vector<uint8_t>& data) {
-    FILE* f = fopen(path, "rb");
-    if (!f) {
-        logError("Cannot open file: %s", path);
-        return false;
-    }
-
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    data.resize(size);
-    size_t bytesRead = fread(data.data(), 1, size, f);
-    fclose(f);
-
-    if (bytesRead != (size_t)size) {
-        logError("Failed to read file: %s", path);
-        return false;
-    }
-
-    logVerbose("Loaded %s (%zu bytes)", path, data.size());
-    return true;
-}
-
-// Get the system temp directory (cross-platform)
-std::string getTempDir() {
-#ifdef WIN32
-    char tempPath[MAX_PATH];
-    DWORD len = GetTempPathA(MAX_PATH, tempPath);
-    if (len > 0 && len < MAX_PATH) {
-        return std::string(tempPath);
-    }
-    const char* userProfile = getenv("USERPROFILE");
-    if (userProfile) {
-        return std::string(userProfile) + "\\Downloads\\";
-    }
-    return ".\\";
-#else
-    const char* tmpdir = getenv("TMPDIR");
-    if (tmpdir && tmpdir[0]) {
-        std::string dir(tmpdir);
-        if (dir.back() != '/') dir += '/';
-        return dir;
-    }
-    return "/tmp/";
-#endif
-}
-
-// Save data to a temporary file
-std::string saveToTempFile(const std::vector<uint8_t>& data, const char* suffix) {
-#ifdef WIN32
-    char tempPath[MAX_PATH];
-    char tempFile[MAX_PATH];
-    GetTempPathA(MAX_PATH, tempPath);
-    GetTempFileNameA(tempPath, "ntf", 0, tempFile);
-    std::string path = std::string(tempFile) + suffix;
-#else
-    std::string path = getTempDir() + "nt_flash_XXXXXX" + suffix;
-    // Create unique file
-    char* pathBuf = strdup(path.c_str());
-    int fd = mkstemps(pathBuf, strlen(suffix));
-    if (fd < 0) {
-        free(pathBuf);
-        return "";
-    }
-    close(fd);
-    path = pathBuf;
-    free(pathBuf);
-#endif
-
-    FILE* f = fopen(path.c_str(), "wb");
-    if (!f) {
-        return "";
-    }
-    fwrite(data.data(), 1, data.size(), f);
-    fclose(f);
-
-    return path;
-}
-
-//------------------------------------------------------------------------------
-// Firmware Package Handling
-//------------------------------------------------------------------------------
-
-struct FirmwarePackage {
-    std::vector<uint8_t> flashloader;
-    std::vector<uint8_t> firmware;
-    std::string flashloaderPath;  // Temp file path for BLFWK
-    std::string firmwarePath;     // Temp file path for BLFWK
-    std::string version;
-    bool valid;
-
-    FirmwarePackage() : valid(false) {}
-
-    ~FirmwarePackage() {
-        // Clean up temp files
-        if (!flashloaderPath.empty()) {
-            remove(flashloaderPath.c_str());
-        }
-        if (!firmwarePath.empty()) {
-            remove(firmwarePath.c_str());
-        }
-    }
-};
-
-// Extract a file from a ZIP archive in memory
-bool extractFileFromZip(const std::vector<uint8_t>& zipData,
-                        const char* filename,
-                        std::vector<uint8_t>& outData) {
-    mz_zip_archive zip;
-    memset(&zip, 0, sizeof(zip));
-
-    if (!mz_zip_reader_init_mem(&zip, zipData.data(), zipData.size(), 0)) {
-        logError("Failed to open ZIP archive");
-        return false;
-    }
-
-    int fileIndex = mz_zip_reader_locate_file(&zip, filename, NULL, 0);
-    if (fileIndex < 0) {
-        mz_zip_reader_end(&zip);
-        logError("File not found in ZIP: %s", filename);
-        return false;
-    }
-
-    mz_zip_archive_file_stat stat;
-    if (!mz_zip_reader_file_stat(&zip, fileIndex, &stat)) {
-        mz_zip_reader_end(&zip);
-        logError("Failed to get file info: %s", filename);
-        return false;
-    }
-
-    outData.resize((size_t)stat.m_uncomp_size);
-    if (!mz_zip_reader_extract_to_mem(&zip, fileIndex, outData.data(), outData.size(), 0)) {
-        mz_zip_reader_end(&zip);
-        logError("Failed to extract file: %s", filename);
-        return false;
-    }
-
-    mz_zip_reader_end(&zip);
-    logVerbose("Extracted %s (%zu bytes)", filename, outData.size());
-    return true;
-}
-
-// Parse MANIFEST.json from firmware package
-bool parseManifest(const std::vector<uint8_t>& jsonData, std::string& firmwarePath) {
-    std::string jsonStr(jsonData.begin(), jsonData.end());
-    cJSON* root = cJSON_Parse(jsonStr.c_str());
-    if (!root) {
-        logError("Failed to parse MANIFEST.json");
-        return false;
-    }
-
-    cJSON* processor = cJSON_GetObjectItem(root, "processor");
-    if (processor && processor->valuestring && strcmp(processor->valuestring, "MIMXRT1060") != 0) {
-        logError("Unsupported processor: %s (expected MIMXRT1060)", processor->valuestring);
-        cJSON_Delete(root);
-        return false;
-    }
-
-    cJSON* appFirmware = cJSON_GetObjectItem(root, "app_firmware");
-    if (appFirmware && appFirmware->valuestring) {
-        firmwarePath = appFirmware->valuestring;
-    } else {
-        firmwarePath = "bootable_images/disting_NT.bin";
-    }
-
-    cJSON_Delete(root);
-    return true;
-}
-
-// Load firmware package from ZIP file
-FirmwarePackage* loadFirmwarePackage(const char* zipPath) {
-    FirmwarePackage* pkg = new FirmwarePackage();
-
-    logInfo("Loading firmware package: %s", zipPath);
-    machineStatus("LOAD", 0, "Loading firmware package");
-
-    std::vector<uint8_t> zipData;
-    if (!loadFile(zipPath, zipData)) {
-        delete pkg;
-        return nullptr;
-    }
-
-    // Parse manifest
-    std::vector<uint8_t> manifestData;
-    if (!extractFileFromZip(zipData, "MANIFEST.json", manifestData)) {
-        delete pkg;
-        return nullptr;
-    }
-
-    std::string firmwareBinPath;
-    if (!parseManifest(manifestData, firmwareBinPath)) {
-        delete pkg;
-        return nullptr;
-    }
-
-    // Extract flashloader
-    if (!extractFileFromZip(zipData, "bootable_images/unsigned_MIMXRT1060_flashloader.bin",
-                            pkg->flashloader)) {
-        delete pkg;
-        return nullptr;
-    }
-
-    // Extract firmware
-    if (!extractFileFromZip(zipData, firmwareBinPath.c_str(), pkg->firmware)) {
-        delete pkg;
-        return nullptr;
-    }
-
-    // Save to temp files (BLFWK needs file paths for write-file command)
-    pkg->flashloaderPath = saveToTempFile(pkg->flashloader, ".bin");
-    pkg->firmwarePath = saveToTempFile(pkg->firmware, ".bin");
-
-    if (pkg->flashloaderPath.empty() || pkg->firmwarePath.empty()) {
-        logError("Failed to create temporary files");
-        delete pkg;
-        return nullptr;
-    }
-
-    pkg->valid = true;
-    logInfo("Package loaded: flashloader=%zu bytes, firmware=%zu bytes",
-            pkg->flashloader.size(), pkg->firmware.size());
-
-    return pkg;
-}
-
-//------------------------------------------------------------------------------
-// Download Functions
-//------------------------------------------------------------------------------
-
-// Download a file using system curl
-bool downloadFile(const char* url, const char* destPath) {
-    logInfo("Downloading: %s", url);
-    machineStatus("DOWNLOAD", 0, "Downloading firmware");
-
-    char cmd[2048];
-#ifdef WIN32
-    snprintf(cmd, sizeof(cmd), "curl.exe -L -s -o \"%s\" \"%s\"", destPath, url);
-#else
-    snprintf(cmd, sizeof(cmd), "curl -L -s -o \"%s\" \"%s\"", destPath, url);
-#endif
-
-    int ret = system(cmd);
-    if (ret != 0) {
-        logError("Download failed (curl exit code: %d)", ret);
-        return false;
-    }
-
-    logVerbose("Downloaded to: %s", destPath);
-    return true;
-}
-
-//------------------------------------------------------------------------------
-// Progress Display
-//------------------------------------------------------------------------------
-
-static const char* g_currentStage = "WRITE";
-
-static void displayProgress(int percentage, int segmentIndex, int segmentCount) {
-    if (g_machineOutput) {
-        char message[128];
-        snprintf(message, sizeof(message), "Segment %d/%d", segmentIndex, segmentCount);
-        machineProgress(g_currentStage, percentage, message);
-    } else {
-        printf("\r  Progress: (%d/%d) %d%%", segmentIndex, segmentCount, percentage);
-        fflush(stdout);
-        if (percentage >= 100) {
-            printf(" Done!\n");
-        }
-    }
-}
-
-//------------------------------------------------------------------------------
-// SDP Operations (ROM Bootloader)
-//------------------------------------------------------------------------------
-
-class SDPOperations {
-public:
-    SDPOperations() : m_peripheral(nullptr), m_packetizer(nullptr) {}
-
-    ~SDPOperations() {
-        close();
-    }
-
-    bool connect() {
-        if (g_dryRun) {
-            logVerbose("[DRY RUN] Would connect to SDP device %04X:%04X", SDP_VID, SDP_PID);
-            return true;
-        }
-
-        try {
-            m_peripheral = new UsbHidPeripheral(SDP_VID, SDP_PID, "", "");
-            m_packetizer = new SDPUsbHidPacketizer(m_peripheral, SDP_TIMEOUT_MS);
-
-            // Test with error-status command
-            string_vector_t cmdArgs;
-            cmdArgs.push_back("error-status");
-
-            SDPCommand* cmd = SDPCommand::create(&cmdArgs);
-            if (!cmd) {
-                throw std::runtime_error("Failed to create error-status command");
-            }
-
-            cmd->sendTo(*m_packetizer);
-
-            const uint32_vector_t* response = cmd->getResponseValues();
-            if (response->size() == 0 || response->at(0) == SDPCommand::kStatus_NoResponse) {
-                delete cmd;
-                throw std::runtime_error("No response from device");
-            }
-
-            logVerbose("SDP connected (status: 0x%08X)", response->at(0));
-            delete cmd;
-            return true;
-        }
-        catch (const std::exception& e) {
-            logVerbose("SDP connection failed: %s", e.what());
-            close();
-            return false;
-        }
-    }
-
-    bool writeFile(uint32_t address, const std::string& filePath) {
-        if (g_dryRun) {
-            logVerbose("[DRY RUN] Would write file to 0x%08X", address);
-            return true;
-        }
-
-        try {
-            char addrStr[32];
-            snprintf(addrStr, sizeof(addrStr), "0x%X", address);
-
-            string_vector_t cmdArgs;
-            cmdArgs.push_back("write-file");
-            cmdArgs.push_back(addrStr);
-            cmdArgs.push_back(filePath);
-
-            SDPCommand* cmd = SDPCommand::create(&cmdArgs);
-            if (!cmd) {
-                logError("Failed to create write-file command");
-                return false;
-            }
-
-            Progress progress(displayProgress, nullptr);
-            cmd->registerProgress(&progress);
-
-            cmd->sendTo(*m_packetizer);
-
-            const uint32_vector_t* response = cmd->getResponseValues();
-            bool success = (response->size() > 0 && response->at(0) != SDPCommand::kStatus_NoResponse);
-
-            delete cmd;
-
-            if (!success) {
-                logError("write-file command failed");
-                return false;
-            }
-
-            logVerbose("File written to 0x%08X", address);
-            return true;
-        }
-        catch (const std::exception& e) {
-            logError("write-file failed: %s", e.what());
-            return false;
-        }
-    }
-
-    bool jumpAddress(uint32_t address) {
-        if (g_dryRun) {
-            logVerbose("[DRY RUN] Would jump to 0x%08X", address);
-            return true;
-        }
-
-        try {
-            char addrStr[32];
-            snprintf(addrStr, sizeof(addrStr), "0x%X", address);
-
-            string_vector_t cmdArgs;
-            cmdArgs.push_back("jump-address");
-            cmdArgs.push_back(addrStr);
-
-            SDPCommand* cmd = SDPCommand::create(&cmdArgs);
-            if (!cmd) {
-                logError("Failed to create jump-address command");
-                return false;
-            }
-
-            cmd->sendTo(*m_packetizer);
-            delete cmd;
-
-            logVerbose("Jump command sent to 0x%08X", address);
-            return true;
-        }
-        catch (const std::exception& e) {
-            // Expected - device disconnects
-            logVerbose("Jump command completed (device disconnected)");
-            return true;
-        }
-    }
-
-    void close() {
-        if (m_packetizer) {
-            delete m_packetizer;
-            m_packetizer = nullptr;
-        }
-        // Peripheral is owned by packetizer, don't double-delete
-        m_peripheral = nullptr;
-    }
-
-private:
-    UsbHidPeripheral* m_peripheral;
-    SDPUsbHidPacketizer* m_packetizer;
-};
-
-//------------------------------------------------------------------------------
-// Bootloader Operations (Flashloader)
-//------------------------------------------------------------------------------
-
-class BootloaderOperations {
-public:
-    BootloaderOperations() : m_bootloader(nullptr) {}
-
-    ~BootloaderOperations() {
-        close();
-    }
-
-    bool connect() {
-        if (g_dryRun) {
-            logVerbose("[DRY RUN] Would connect to bootloader %04X:%04X", BL_VID, BL_PID);
-            return true;
-        }
-
-        // Try multiple times as device may take time to enumerate
-        for (int attempt = 0; attempt < 5; attempt++) {
-            try {
-                Peripheral::PeripheralConfigData config;
-                config.peripheralType = Peripheral::kHostPeripheralType_USB_HID;
-                config.usbHidVid = BL_VID;
-                config.usbHidPid = BL_PID;
-                config.packetTimeoutMs = BL_TIMEOUT_MS;
-                config.ping = false;
-
-                m_bootloader = new Bootloader(config);
-
-                // Test with get-property command
-                string_vector_t cmdArgs;
-                cmdArgs.push_back("get-property");
-                cmdArgs.push_back("1");  // Current version
-
-                Command* cmd = Command::create(&cmdArgs);
-                if (!cmd) {
-                    throw std::runtime_error("Failed to create get-property command");
-                }
-
-                m_bootloader->inject(*cmd);
-                m_bootloader->flush();
-
-                const uint32_vector_t* response = cmd->getResponseValues();
-                if (response->size() > 0 && response->at(0) != kStatus_NoResponse) {
-                    logVerbose("Bootloader connected");
-                    delete cmd;
-                    return true;
-                }
-
-                delete cmd;
-                close();
-            }
-            catch (...) {
-                close();
-            }
-
-            logVerbose("Bootloader not ready, retrying... (%d/5)", attempt + 1);
-#ifdef WIN32
-            Sleep(1000);
-#else
-            sleep(1);
-#endif
-        }
-
-        logError("Failed to connect to bootloader");
-        return false;
-    }
-
-    bool runCommand(const string_vector_t& args) {
-        if (g_dryRun) {
-            std::string cmdStr;
-            for (size_t i = 0; i < args.size(); i++) {
-                if (i > 0) cmdStr += " ";
-                cmdStr += args[i];
-            }
-            logVerbose("[DRY RUN] Would run: %s", cmdStr.c_str());
-            return true;
-        }
-
-        try {
-            Command* cmd = Command::create(&args);
-            if (!cmd) {
-                logError("Failed to create command: %s", args[0].c_str());
-                return false;
-            }
-
-            // Register progress for write-memory
-            Progress progress(displayProgress, nullptr);
-            cmd->registerProgress(&progress);
-
-            m_bootloader->inject(*cmd);
-            m_bootloader->flush();
-
-            const uint32_vector_t* response = cmd->getResponseValues();
-            bool success = true;
-
-            if (response->size() > 0) {
-                uint32_t status = response->at(0);
-                if (status == kStatus_NoResponse) {
-                    logError("No response for command: %s", args[0].c_str());
-                    success = false;
-                } else if (status != kStatus_Success && status != kStatus_NoResponseExpected) {
-                    logError("Command %s failed with status: 0x%X", args[0].c_str(), status);
-                    success = false;
-                }
-            }
-
-            delete cmd;
-            return success;
-        }
-        catch (const std::exception& e) {
-            logError("Command failed: %s", e.what());
-            return false;
-        }
-    }
-
-    bool fillMemory(uint32_t address, uint32_t size, uint32_t pattern) {
-        char addrStr[32], sizeStr[32], patternStr[32];
-        snprintf(addrStr, sizeof(addrStr), "0x%X", address);
-        snprintf(sizeStr, sizeof(sizeStr), "%u", size);
-        snprintf(patternStr, sizeof(patternStr), "0x%X", pattern);
-
-        string_vector_t args;
-        args.push_back("fill-memory");
-        args.push_back(addrStr);
-        args.push_back(sizeStr);
-        args.push_back(patternStr);
-        args.push_back("word");
-
-        return runCommand(args);
-    }
-
-    bool configureMemory(uint32_t memoryId, uint32_t configAddr) {
-        char memIdStr[32], addrStr[32];
-        snprintf(memIdStr, sizeof(memIdStr), "%u", memoryId);
-        snprintf(addrStr, sizeof(addrStr), "0x%X", configAddr);
-
-        string_vector_t args;
-        args.push_back("configure-memory");
-        args.push_back(memIdStr);
-        args.push_back(addrStr);
-
-        return runCommand(args);
-    }
-
-    bool flashEraseRegion(uint32_t address, uint32_t size, uint32_t memoryId = 0) {
-        char addrStr[32], sizeStr[32], memIdStr[32];
-        snprintf(addrStr, sizeof(addrStr), "0x%X", address);
-        snprintf(sizeStr, sizeof(sizeStr), "%u", size);
-        snprintf(memIdStr, sizeof(memIdStr), "%u", memoryId);
-
-        string_vector_t args;
-        args.push_back("flash-erase-region");
-        args.push_back(addrStr);
-        args.push_back(sizeStr);
-        args.push_back(memIdStr);  // Explicit memory ID (0 = internal/memory-mapped)
-
-        return runCommand(args);
-    }
-
-    bool writeMemory(uint32_t address, const std::string& filePath, uint32_t memoryId = 0) {
-        char addrStr[32], memIdStr[32];
-        snprintf(addrStr, sizeof(addrStr), "0x%X", address);
-        snprintf(memIdStr, sizeof(memIdStr), "%u", memoryId);
-
-        string_vector_t args;
-        args.push_back("write-memory");
-        args.push_back(addrStr);
-        args.push_back(filePath);
-        args.push_back(memIdStr);  // Explicit memory ID (0 = internal/memory-mapped)
-
-        return runCommand(args);
-    }
-
-    bool reset() {
-        string_vector_t args;
-        args.push_back("reset");
-
-        try {
-            runCommand(args);
-        }
-        catch (...) {
-            // Expected - device disconnects
-        }
-        return true;
-    }
-
-    void close() {
-        if (m_bootloader) {
-            delete m_bootloader;
-            m_bootloader = nullptr;
-        }
-    }
-
-private:
-    Bootloader* m_bootloader;
-};
-
-//------------------------------------------------------------------------------
-// Flash Orchestration
-//------------------------------------------------------------------------------
-
-bool flashFirmware(FirmwarePackage* pkg, bool skipSdp = false) {
-    if (!pkg || !pkg->valid) {
-        logError("Invalid firmware package");
-        return false;
-    }
-
-    logInfo("=== Starting disting NT flash ===");
-    machineStatus("START", 0, "Starting disting NT flash");
-
-    // Phase 1: SDP - Load flashloader (skip if already in flashloader mode)
-    if (!skipSdp) {
-        SDPOperations sdp;
-
-        logInfo("[1/7] Connecting to SDP bootloader...");
-        machineStatus("SDP_CONNECT", 5, "Connecting to SDP bootloader");
-        if (!sdp.connect()) {
-            // Check if device is already in flashloader mode
-            BootloaderOperations blCheck;
-            machineStatus("BL_CHECK", 10, "Checking for flashloader mode");
-            if (blCheck.connect()) {
-                logInfo("Device already in flashloader mode, skipping SDP phase...");
-                machineStatus("BL_FOUND", 15, "Device already in flashloader mode");
-                blCheck.close();
-                skipSdp = true;
-            } else {
-                logError("Device not found in SDP mode or flashloader mode");
-                logInfo("Make sure disting NT is in bootloader mode:");
-                logInfo("  Menu > Misc > Enter bootloader mode...");
-                return false;
-            }
-        }
-
-        if (!skipSdp) {
-            logInfo("[2/7] Uploading flashloader to RAM...");
-            machineStatus("SDP_UPLOAD", 15, "Uploading flashloader to RAM");
-            g_currentStage = "SDP_UPLOAD";
-            if (!sdp.writeFile(FLASHLOADER_ADDR, pkg->flashloaderPath)) {
-                return false;
-            }
-
-            logInfo("[3/7] Starting flashloader...");
-            machineStatus("SDP_JUMP", 25, "Starting flashloader");
-            if (!sdp.jumpAddress(FLASHLOADER_ADDR)) {
-                return false;
-            }
-
-            sdp.close();
-
-            // Wait for device to re-enumerate (give it extra time on macOS)
-            logInfo("[4/7] Waiting for flashloader to start...");
-            machineStatus("WAIT_ENUM", 30, "Waiting for flashloader to start");
-#ifdef WIN32
-            Sleep(3000);
-#else
-            sleep(5);  // Increased from 3 to 5 seconds
-#endif
-        }
-    }
-
-    // Reset HID subsystem to get fresh device list after re-enumeration
-    // This is critical on macOS where the IOHIDManager caches devices
-    hid_exit();
-
-    // Phase 2: Bootloader - Flash firmware
-    BootloaderOperations bl;
-
-    logInfo("[5/7] Connecting to flashloader...");
-    machineStatus("BL_CONNECT", 40, "Connecting to flashloader");
-    if (!bl.connect()) {
-        return false;
-    }
-
-    logInfo("[6/7] Configuring flash and erasing...");
-    machineStatus("CONFIGURE", 50, "Configuring flash memory");
-
-    // Configure FlexSPI NOR
-    logVerbose("Configuring FlexSPI NOR...");
-    if (!bl.fillMemory(CONFIG_ADDR, 4, FLEXSPI_NOR_CONFIG)) {
-        return false;
-    }
-    if (!bl.configureMemory(MEMORY_ID_FLEXSPI_NOR, CONFIG_ADDR)) {
-        return false;
-    }
-
-    // Erase flash region (FCB area + firmware size, matching official script exactly)
-    // The FCB is at 0x60000000, firmware starts at 0x60001000 (0x1000 offset)
-    uint32_t eraseSize = pkg->firmware.size() + 0x1000;  // Matches official: firmware + FCB area
-    logVerbose("Erasing flash region 0x%08X, size %u bytes...", FLASH_BASE, eraseSize);
-    machineStatus("ERASE", 55, "Erasing flash region");
-    if (!bl.flashEraseRegion(FLASH_BASE, eraseSize, 0)) {
-        return false;
-    }
-
-    // Create FCB
-    logVerbose("Creating Flash Configuration Block...");
-    machineStatus("FCB", 60, "Creating Flash Configuration Block");
-    if (!bl.fillMemory(CONFIG_ADDR, 4, FCB_CONFIG)) {
-        return false;
-    }
-    if (!bl.configureMemory(MEMORY_ID_FLEXSPI_NOR, CONFIG_ADDR)) {
-        return false;
-    }
-
-    logInfo("[7/7] Writing firmware (%zu bytes)...", pkg->firmware.size());
-    machineStatus("WRITE", 65, "Writing firmware");
-    g_currentStage = "WRITE";
-    if (!bl.writeMemory(FIRMWARE_ADDR, pkg->firmwarePath, 0)) {
-        return false;
-    }
-
-    logInfo("Resetting device...");
-    machineStatus("RESET", 95, "Resetting device");
-    bl.reset();
-    bl.close();
-
-    logInfo("=== Flash complete! ===");
-    machineStatus("COMPLETE", 100, "Flash complete");
-    return true;
-}
-
 //------------------------------------------------------------------------------
 // CLI Interface
 //------------------------------------------------------------------------------
@@ -896,21 +27,93 @@ void printUsage() {
     printf("  %s --latest                    Download and flash latest version\n", TOOL_NAME);
     printf("  %s --url <url>                 Download and flash from URL\n", TOOL_NAME);
     printf("  %s --list                      List available firmware versions\n", TOOL_NAME);
+    printf("  %s --backup <file> <firmware.zip>  Save the device's flash to a file\n", TOOL_NAME);
+    printf("  %s --restore <file> <firmware.zip> Write a saved flash image back\n", TOOL_NAME);
+    printf("  %s --clone <port> <firmware.zip>   Copy one unit's flash to the others\n", TOOL_NAME);
+    printf("  %s --list-devices              List connected units and their USB ports\n", TOOL_NAME);
+    printf("  %s --bench <runs> [firmware.zip]   Time repeated flashes of a simulated (or --target) unit\n", TOOL_NAME);
+    printf("  %s --soak <cycles> [firmware.zip]  Flash simulated units with injected faults\n", TOOL_NAME);
+    printf("  %s --scale <units> [firmware.zip]  Flash 1, 2, 4 ... simulated units at once and compare\n", TOOL_NAME);
+    printf("  %s --coordinator <[host:]port> Accept flash jobs and dispatch them to agents\n", TOOL_NAME);
+    printf("  %s --agent <host:port>         Flash units on this PC for a coordinator\n", TOOL_NAME);
+    printf("  %s --submit <host:port> <firmware.zip>  Queue a flash job on a coordinator\n", TOOL_NAME);
     printf("\n");
     printf("Options:\n");
     printf("  -v, --verbose                  Show detailed output\n");
     printf("  -n, --dry-run                  Validate without flashing\n");
     printf("  -m, --machine                  Machine-readable output for tool integration\n");
+    printf("  --stream                       Inflate the firmware from the package while writing it\n");
+    printf("  --no-compress                  Send plain writes even if the flashloader offers compressed ones\n");
+    printf("  --verify                       Check the flash against the image after writing it\n");
+    printf("  --backup-size <bytes>          Bytes to back up or clone (default: reported flash size)\n");
+    printf("  --station                      Flash every connected unit at once\n");
+    printf("  --target <port>                Clone/station target (repeatable; default: all units)\n");
+    printf("  --simulate <count>             Flash simulated units instead of hardware\n");
+    printf("  --sim-compress                 Simulated flashloaders offer compressed writes\n");
+    printf("  --sim-digest                   Simulated flashloaders offer flash digests for --verify\n");
+    printf("  --hub-limit <n>                Units uploading/writing at once per USB hub (default: %u, 0 = no limit)\n",
+           SCHED_HUB_LIMIT_DEFAULT);
+    printf("  --controller-limit <n>         ... per USB host controller (default: %u, 0 = no limit)\n",
+           SCHED_CONTROLLER_LIMIT_DEFAULT);
+    printf("  --verify-boot                  After reset, wait for the new firmware to enumerate\n");
+    printf("  --boot-timeout <sec>           Seconds --verify-boot waits (default: %u)\n",
+           BOOT_TIMEOUT_DEFAULT_MS / 1000);
+    printf("  --health <file>                Track per-port throughput across station runs\n");
+    printf("  --avoid-degraded               Leave ports flagged by --health out of the run\n");
+    printf("  --health-reset <port>          Drop a port's --health history, so it starts a new baseline\n");
+    printf("  --metrics-file <file>          Write Prometheus metrics for the node exporter textfile collector\n");
+    printf("  --metrics-interval <sec>       Seconds between metrics file updates (default: %u)\n",
+           METRICS_INTERVAL_DEFAULT);
+    printf("  --metrics-listen <[host:]port> Serve Prometheus metrics over HTTP\n");
+    printf("  --trace <file>                 Write a Chrome/Perfetto timeline of stages and USB commands\n");
+    printf("  --stats=resources              Report peak memory, heap allocations and CPU time per stage\n");
+    printf("  --journal <file>               Append a record of every unit flashed\n");
+    printf("  --journal-report <file>        Summarize a journal's throughput over time\n");
+    printf("  --report-interval <minutes>    Period length for --journal-report (default: 60)\n");
+    printf("  --bench-size <bytes>           Synthetic firmware size for --bench/--soak/--scale without a package (default: %u)\n",
+           BENCH_FIRMWARE_SIZE_DEFAULT);
+    printf("  --bench-json <file>            Write the --bench or --scale result as JSON\n");
+    printf("  --baseline <file>              Compare the --bench result with an earlier one\n");
+    printf("  --threshold <percent>          How much worse than the baseline is a regression (default: %g)\n",
+           BENCH_THRESHOLD_DEFAULT);
+    printf("  --soak-units <n>               Simulated units flashed at once by --soak (default: %u)\n",
+           SOAK_UNITS_DEFAULT);
+    printf("  --fault <class>=<rate>         Fault chance per operation for --soak (repeatable;\n");
+    printf("                                 drop, delay, disconnect, enum, nak)\n");
+    printf("  --soak-seed <n>                Seed for --soak fault injection (default: 1)\n");
+    printf("  --count <n>                    Units to flash for --submit (default: 1)\n");
+    printf("  --name <name>                  Agent name shown by the coordinator (default: host name)\n");
+    printf("  --cache <dir>                  Agent firmware cache directory\n");
+    printf("  --token <secret>               Shared secret for --coordinator, --agent and --submit\n");
+    printf("                                 (default: $NT_FLASH_TOKEN)\n");
     printf("  -h, --help                     Show this help\n");
     printf("\n");
     printf("Before flashing, put disting NT in bootloader mode:\n");
     printf("  Menu > Misc > Enter bootloader mode...\n");
+    printf("\n");
+    printf("Backup and restore use the flashloader from the given firmware package.\n");
 }
 
 void printVersionInfo() {
     printf("NT Flash Tool v%s\n", VERSION);
 }
 
+// Every exit once the exporters have started, early errors included: the
+// trace is written, queued journal records are fsynced, the metrics threads
+// stop after a last textfile write, and a downloaded ZIP is removed
+struct ExitCleanup {
+    std::string tempZipPath;
+
+    ~ExitCleanup() {
+        writeTrace();
+        closeJournal();
+        stopMetricsExport();
+        if (!tempZipPath.empty()) {
+            remove(tempZipPath.c_str());
+        }
+    }
+};
+
 int main(int argc, char* argv[]) {
     // Initialize BLFWK logger (suppress unless verbose)
     StdoutLogger* logger = new StdoutLogger();
@@ -928,6 +131,36 @@ int main(int argc, char* argv[]) {
     std::string url;
     bool listVersions = false;
     bool useLatest = false;
+    std::string backupPath;
+    std::string restorePath;
+    uint32_t backupSize = 0;
+    std::string clonePort;
+    std::vector<std::string> targetPorts;
+    bool listDevices = false;
+    bool station = false;
+    uint32_t simulate = 0;
+    StationOptions stationOptions;
+    BenchOptions benchOptions;
+    bool bench = false;
+    SoakOptions soakOptions;
+    bool soak = false;
+    bool faultsGiven = false;
+    ScaleOptions scaleOptions;
+    bool scale = false;
+    std::string coordinatorAddress;
+    std::string agentAddress;
+    std::string submitAddress;
+    uint32_t submitCount = 1;
+    AgentOptions agentOptions;
+    const char* tokenVariable = getenv("NT_FLASH_TOKEN");
+    std::string token = tokenVariable ? tokenVariable : "";
+    std::string metricsPath;
+    uint32_t metricsInterval = METRICS_INTERVAL_DEFAULT;
+    std::string metricsAddress;
+    std::string tracePath;
+    std::string journalPath;
+    std::string journalReportPath;
+    uint32_t reportInterval = 60;
 
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
@@ -950,6 +183,21 @@ int main(int argc, char* argv[]) {
         else if (arg == "-m" || arg == "--machine") {
             g_machineOutput = true;
         }
+        else if (arg == "--stream") {
+            g_streamFirmware = true;
+        }
+        else if (arg == "--no-compress") {
+            g_compressWrites = false;
+        }
+        else if (arg == "--sim-compress") {
+            g_simCompressedWrite = true;
+        }
+        else if (arg == "--verify") {
+            g_verifyWrites = true;
+        }
+        else if (arg == "--sim-digest") {
+            g_simFlashDigest = true;
+        }
         else if (arg == "--list") {
             listVersions = true;
         }
@@ -962,6 +210,140 @@ int main(int argc, char* argv[]) {
         else if (arg == "--url" && i + 1 < argc) {
             url = argv[++i];
         }
+        else if (arg == "--backup" && i + 1 < argc) {
+            backupPath = argv[++i];
+        }
+        else if (arg == "--restore" && i + 1 < argc) {
+            restorePath = argv[++i];
+        }
+        else if (arg == "--backup-size" && i + 1 < argc) {
+            backupSize = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--clone" && i + 1 < argc) {
+            clonePort = argv[++i];
+        }
+        else if (arg == "--target" && i + 1 < argc) {
+            targetPorts.push_back(argv[++i]);
+        }
+        else if (arg == "--list-devices") {
+            listDevices = true;
+        }
+        else if (arg == "--station") {
+            station = true;
+        }
+        else if (arg == "--simulate" && i + 1 < argc) {
+            simulate = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--hub-limit" && i + 1 < argc) {
+            stationOptions.limits.perHub = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--controller-limit" && i + 1 < argc) {
+            stationOptions.limits.perController = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--verify-boot") {
+            if (!g_bootTimeoutMs) g_bootTimeoutMs = BOOT_TIMEOUT_DEFAULT_MS;
+        }
+        else if (arg == "--boot-timeout" && i + 1 < argc) {
+            g_bootTimeoutMs = (uint32_t)strtoul(argv[++i], nullptr, 0) * 1000;
+        }
+        else if (arg == "--health" && i + 1 < argc) {
+            stationOptions.healthPath = argv[++i];
+        }
+        else if (arg == "--avoid-degraded") {
+            stationOptions.avoidDegraded = true;
+        }
+        else if (arg == "--health-reset" && i + 1 < argc) {
+            stationOptions.healthReset.push_back(argv[++i]);
+        }
+        else if (arg == "--metrics-file" && i + 1 < argc) {
+            metricsPath = argv[++i];
+        }
+        else if (arg == "--metrics-interval" && i + 1 < argc) {
+            metricsInterval = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--metrics-listen" && i + 1 < argc) {
+            metricsAddress = argv[++i];
+        }
+        else if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        }
+        else if (arg == "--stats=resources") {
+            enableResourceStats();
+        }
+        else if (arg == "--journal" && i + 1 < argc) {
+            journalPath = argv[++i];
+        }
+        else if (arg == "--journal-report" && i + 1 < argc) {
+            journalReportPath = argv[++i];
+        }
+        else if (arg == "--report-interval" && i + 1 < argc) {
+            reportInterval = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--bench" && i + 1 < argc) {
+            bench = true;
+            benchOptions.runs = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--bench-size" && i + 1 < argc) {
+            benchOptions.firmwareSize = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--bench-json" && i + 1 < argc) {
+            benchOptions.resultPath = argv[++i];
+        }
+        else if (arg == "--baseline" && i + 1 < argc) {
+            benchOptions.baselinePath = argv[++i];
+        }
+        else if (arg == "--threshold" && i + 1 < argc) {
+            benchOptions.threshold = strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--soak" && i + 1 < argc) {
+            soak = true;
+            soakOptions.cycles = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--scale" && i + 1 < argc) {
+            scale = true;
+            scaleOptions.maxUnits = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--soak-units" && i + 1 < argc) {
+            soakOptions.units = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--soak-seed" && i + 1 < argc) {
+            soakOptions.faults.seed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--fault" && i + 1 < argc) {
+            std::string fault = argv[++i];
+            size_t equals = fault.find('=');
+            int found = kFaultClasses;
+            for (int f = 0; f < kFaultClasses && equals != std::string::npos; f++) {
+                if (fault.compare(0, equals, faultClassName((FaultClass)f)) == 0) found = f;
+            }
+            if (found == kFaultClasses) {
+                logError("Unknown fault: %s (use drop, delay, disconnect, enum or nak=<rate>)", fault.c_str());
+                return 1;
+            }
+            soakOptions.faults.rate[found] = strtod(fault.c_str() + equals + 1, nullptr);
+            faultsGiven = true;
+        }
+        else if (arg == "--coordinator" && i + 1 < argc) {
+            coordinatorAddress = argv[++i];
+        }
+        else if (arg == "--agent" && i + 1 < argc) {
+            agentAddress = argv[++i];
+        }
+        else if (arg == "--submit" && i + 1 < argc) {
+            submitAddress = argv[++i];
+        }
+        else if (arg == "--count" && i + 1 < argc) {
+            submitCount = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--name" && i + 1 < argc) {
+            agentOptions.name = argv[++i];
+        }
+        else if (arg == "--cache" && i + 1 < argc) {
+            agentOptions.cacheDir = argv[++i];
+        }
+        else if (arg == "--token" && i + 1 < argc) {
+            token = argv[++i];
+        }
         else if (arg[0] != '-') {
             zipPath = arg;
         }
@@ -971,6 +353,11 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (g_bootTimeoutMs && !simulate && !BootWatch::supported()) {
+        logInfo("WARNING: --verify-boot needs Linux sysfs; boot will not be checked");
+        g_bootTimeoutMs = 0;
+    }
+
     // Handle --list
     if (listVersions) {
         logInfo("Available firmware versions from Expert Sleepers:");
@@ -979,13 +366,94 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    // Handle --list-devices
+    if (listDevices) {
+        std::vector<UsbDevice> devices = enumerateDevices();
+        if (devices.empty()) {
+            logInfo("No disting NT found in SDP or flashloader mode");
+        }
+        for (size_t i = 0; i < devices.size(); i++) {
+            const char* mode = devices[i].flashloader ? "FLASHLOADER" : "SDP";
+            const UsbLink& link = devices[i].link;
+            if (g_machineOutput) {
+                printf("DEVICE:%s:%s", mode, devices[i].port.c_str());
+                if (link.speedMbps > 0) {
+                    printf(":%g:", link.speedMbps);
+                    for (size_t h = 0; h < link.hubs.size(); h++) {
+                        printf("%s%s@%g", h ? "," : "", link.hubs[h].first.c_str(), link.hubs[h].second);
+                    }
+                }
+                printf("\n");
+            } else {
+                printf("  %-12s %-16s %s\n", mode, devices[i].port.c_str(), devices[i].path.c_str());
+                if (link.speedMbps > 0) {
+                    printf("  %-12s %-16s %s\n", "", "", describeUsbLink(link).c_str());
+                }
+            }
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    // Handle --journal-report
+    if (!journalReportPath.empty()) {
+        return reportJournal(journalReportPath, reportInterval) ? 0 : 1;
+    }
+
+    ExitCleanup cleanup;
+    if (!startMetricsExport(metricsPath, metricsInterval, metricsAddress)) {
+        return 1;
+    }
+    if (!journalPath.empty() && !openJournal(journalPath)) {
+        return 1;
+    }
+    if (!tracePath.empty()) {
+        startTrace(tracePath);
+    }
+
+    // Multi-host modes
+    if (!coordinatorAddress.empty()) {
+        return runCoordinator(coordinatorAddress, token) ? 0 : 1;
+    }
+    if (!agentAddress.empty()) {
+        agentOptions.simulate = simulate;
+        agentOptions.token = token;
+        bool ok = runAgent(agentAddress, agentOptions);
+        if (resourceStatsEnabled()) {
+            printResourceStats();
+        }
+        return ok ? 0 : 1;
+    }
+
     if (useLatest) {
         logInfo("Downloading latest firmware (1.12.0)...");
         version = "1.12.0";
     }
 
+    // Jobs name the firmware by version; a local ZIP is passed by file name,
+    // for agents that hold it in their cache directories
+    if (!submitAddress.empty()) {
+        std::string packageName;
+        if (version.empty() && !zipPath.empty()) {
+            size_t slash = zipPath.find_last_of("/\\");
+            packageName = (slash == std::string::npos) ? zipPath : zipPath.substr(slash + 1);
+            version = packageName;
+            if (version.size() > 4 && version.compare(version.size() - 4, 4, ".zip") == 0) {
+                version.erase(version.size() - 4);
+            }
+            if (version.compare(0, 10, "distingNT_") == 0) {
+                version.erase(0, 10);
+            }
+        }
+        if (version.empty()) {
+            logError("No firmware specified for --submit (use --version or a ZIP file)");
+            return 1;
+        }
+        return submitJob(submitAddress, version, packageName, submitCount, token) ? 0 : 1;
+    }
+
     // Determine source
-    std::string tempZipPath;
+    std::string& tempZipPath = cleanup.tempZipPath;
 
     if (!version.empty()) {
         // Download specific version
@@ -1007,30 +475,66 @@ int main(int argc, char* argv[]) {
         zipPath = tempZipPath;
     }
 
-    if (zipPath.empty()) {
+    if (zipPath.empty() && !bench && !soak && !scale) {
         logError("No firmware source specified");
         printUsage();
         return 1;
     }
 
-    // Load and flash
-    FirmwarePackage* pkg = loadFirmwarePackage(zipPath.c_str());
+    // Load and flash; --bench, --soak and --scale without a package use a synthetic one
+    FirmwarePackage* pkg;
+    {
+        ResourceScope usage("LOAD");
+        pkg = zipPath.empty() ? syntheticFirmwarePackage(benchOptions.firmwareSize, BENCH_FLASHLOADER_SIZE)
+                              : loadFirmwarePackage(zipPath.c_str());
+    }
     if (!pkg) {
         return 1;
     }
+    if (!zipPath.empty()) {
+        pkg->version = version;
+    }
 
     if (g_dryRun) {
         logInfo("[DRY RUN MODE - No actual flashing will occur]");
     }
 
-    bool success = flashFirmware(pkg);
+    bool success;
+    if (!backupPath.empty()) {
+        success = backupFlash(pkg, backupPath.c_str(), backupSize);
+    } else if (!restorePath.empty()) {
+        success = restoreFlash(pkg, restorePath.c_str());
+    } else if (!clonePort.empty()) {
+        success = cloneFlash(pkg, clonePort, targetPorts, backupSize);
+    } else if (bench) {
+        if (!targetPorts.empty()) {
+            benchOptions.port = targetPorts[0];
+        }
+        success = runBench(pkg, benchOptions);
+    } else if (soak) {
+        if (!faultsGiven) {
+            soakOptions.faults.rate[kFaultDrop] = 0.001;
+            soakOptions.faults.rate[kFaultDelay] = 0.01;
+            soakOptions.faults.rate[kFaultDisconnect] = 0.002;
+            soakOptions.faults.rate[kFaultEnum] = 0.01;
+            soakOptions.faults.rate[kFaultNak] = 0.005;
+        }
+        success = runSoak(pkg, soakOptions);
+    } else if (scale) {
+        scaleOptions.limits = stationOptions.limits;
+        scaleOptions.resultPath = benchOptions.resultPath;
+        success = runScale(pkg, scaleOptions);
+    } else if (simulate > 0) {
+        success = flashSimulated(pkg, simulate, stationOptions);
+    } else if (station) {
+        success = flashStation(pkg, targetPorts, stationOptions);
+    } else {
+        success = flashFirmware(pkg);
+    }
 
     delete pkg;
-
-    // Clean up downloaded zip
-    if (!tempZipPath.empty()) {
-        remove(tempZipPath.c_str());
+    if (resourceStatsEnabled()) {
+        printResourceStats();
     }
-
     return success ? 0 : 1;
 }
@@ -0,0 +1,310 @@
+/*
+ * NT Flash Tool - Prometheus metrics
+ *
+ * Copyright (c) 2024
+ */
+
+#if defined(WIN32)
+#include <winsock2.h>
+#endif
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// Metrics
+//------------------------------------------------------------------------------
+
+namespace {
+
+struct Histogram {
+    std::vector<double> bounds;
+    std::vector<uint64_t> counts;   // Per bucket, not cumulative
+    double sum;
+    uint64_t count;
+
+    Histogram() : sum(0), count(0) {}
+
+    Histogram(const double* b, size_t n) : bounds(b, b + n), counts(n, 0), sum(0), count(0) {}
+
+    void observe(double value) {
+        for (size_t i = 0; i < bounds.size(); i++) {
+            if (value <= bounds[i]) {
+                counts[i]++;
+                break;
+            }
+        }
+        sum += value;
+        count++;
+    }
+
+    void render(std::string& out, const char* name, const std::string& labels) const {
+        char line[256];
+        const char* sep = labels.empty() ? "" : ",";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < bounds.size(); i++) {
+            cumulative += counts[i];
+            snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels.c_str(), sep,
+                     bounds[i], (unsigned long long)cumulative);
+            out += line;
+        }
+        snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels.c_str(), sep,
+                 (unsigned long long)count);
+        out += line;
+        std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        snprintf(line, sizeof(line), "%s_sum%s %g\n%s_count%s %llu\n", name, braces.c_str(), sum,
+                 name, braces.c_str(), (unsigned long long)count);
+        out += line;
+    }
+};
+
+const double STAGE_BUCKETS[] = { 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+const double RATE_BUCKETS[] = { 131072, 262144, 524288, 1048576, 2097152, 4194304, 8388608 };
+const double ENUM_BUCKETS[] = { 0.5, 1, 1.5, 2, 3, 5, 10 };
+const double BOOT_BUCKETS[] = { 0.5, 1, 2, 3, 5, 8, 13, 20 };
+
+#define BUCKETS(b) b, sizeof(b) / sizeof(b[0])
+
+struct Metrics {
+    std::mutex mutex;
+    uint64_t started;
+    uint64_t succeeded;
+    std::map<std::string, uint64_t> failed;   // By stage
+    uint64_t bytesWritten;
+    uint64_t retries;
+    uint64_t enumTimeouts;
+    std::map<std::string, Histogram> stageSeconds;
+    Histogram writeRate;
+    Histogram enumSeconds;
+    Histogram bootSeconds;
+
+    Metrics()
+        : started(0), succeeded(0), bytesWritten(0), retries(0), enumTimeouts(0),
+          writeRate(BUCKETS(RATE_BUCKETS)), enumSeconds(BUCKETS(ENUM_BUCKETS)),
+          bootSeconds(BUCKETS(BOOT_BUCKETS)) {}
+};
+
+Metrics g_metrics;
+
+void renderCounter(std::string& out, const char* name, const char* help, uint64_t value) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+             (unsigned long long)value);
+    out += line;
+}
+
+void renderHeader(std::string& out, const char* name, const char* type, const char* help) {
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+// A quoted label value: backslash, double quote and newline are escaped
+std::string labelValue(const std::string& value) {
+    std::string out = "\"";
+    for (size_t i = 0; i < value.size(); i++) {
+        char c = value[i];
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+} // namespace
+
+void metricsFlashStarted() {
+    std::lock_guard<std::mutex> lock(g_metrics.mutex);
+    g_metrics.started++;
+}
+
+void metricsStageFinished(const char* stage, double seconds) {
+    std::lock_guard<std::mutex> lock(g_metrics.mutex);
+    std::map<std::string, Histogram>::iterator it = g_metrics.stageSeconds.find(stage);
+    if (it == g_metrics.stageSeconds.end()) {
+        it = g_metrics.stageSeconds.insert(std::make_pair(std::string(stage), Histogram(BUCKETS(STAGE_BUCKETS)))).first;
+    }
+    it->second.observe(seconds);
+}
+
+// failedStage is the stage the flash failed in (ignored on success)
+void metricsFlashFinished(bool ok, const char* failedStage, const DeviceStats* stats) {
+    std::lock_guard<std::mutex> lock(g_metrics.mutex);
+    if (ok) {
+        g_metrics.succeeded++;
+    } else {
+        g_metrics.failed[failedStage ? failedStage : "UNKNOWN"]++;
+    }
+    if (!stats) {
+        return;
+    }
+    g_metrics.bytesWritten += stats->writeBytes;
+    g_metrics.retries += stats->retries;
+    if (stats->timedOut) {
+        g_metrics.enumTimeouts++;
+    }
+    if (ok && stats->writeSeconds > 0) {
+        g_metrics.writeRate.observe(stats->writeBytes / stats->writeSeconds);
+    }
+    if (stats->enumSeconds > 0) {
+        g_metrics.enumSeconds.observe(stats->enumSeconds);
+    }
+    if (stats->bootSeconds > 0) {
+        g_metrics.bootSeconds.observe(stats->bootSeconds);
+    }
+}
+
+// Prometheus text exposition format
+std::string metricsText() {
+    std::lock_guard<std::mutex> lock(g_metrics.mutex);
+    std::string out;
+
+    renderCounter(out, "ntflash_flashes_started_total", "Flashes started", g_metrics.started);
+    renderCounter(out, "ntflash_flashes_succeeded_total", "Flashes completed successfully", g_metrics.succeeded);
+
+    renderHeader(out, "ntflash_flashes_failed_total", "counter", "Flashes failed, by the stage they failed in");
+    for (std::map<std::string, uint64_t>::const_iterator it = g_metrics.failed.begin(); it != g_metrics.failed.end(); ++it) {
+        char count[32];
+        snprintf(count, sizeof(count), "%llu", (unsigned long long)it->second);
+        out += "ntflash_flashes_failed_total{reason=" + labelValue(it->first) + "} " + count + "\n";
+    }
+
+    renderCounter(out, "ntflash_bytes_written_total", "Firmware bytes written to flash", g_metrics.bytesWritten);
+    renderCounter(out, "ntflash_retries_total", "Connect attempts retried", g_metrics.retries);
+    renderCounter(out, "ntflash_enum_timeouts_total", "Flashloaders that never re-enumerated", g_metrics.enumTimeouts);
+
+    renderHeader(out, "ntflash_stage_duration_seconds", "histogram", "Time spent in each flash stage");
+    for (std::map<std::string, Histogram>::const_iterator it = g_metrics.stageSeconds.begin();
+         it != g_metrics.stageSeconds.end(); ++it) {
+        it->second.render(out, "ntflash_stage_duration_seconds", "stage=" + labelValue(it->first));
+    }
+
+    renderHeader(out, "ntflash_write_throughput_bytes_per_second", "histogram", "Write throughput per flash");
+    g_metrics.writeRate.render(out, "ntflash_write_throughput_bytes_per_second", "");
+
+    renderHeader(out, "ntflash_reenumeration_seconds", "histogram", "SDP jump to flashloader on the port");
+    g_metrics.enumSeconds.render(out, "ntflash_reenumeration_seconds", "");
+
+    renderHeader(out, "ntflash_boot_seconds", "histogram", "Reset to the application enumerating on the port");
+    g_metrics.bootSeconds.render(out, "ntflash_boot_seconds", "");
+    return out;
+}
+
+// Replace the file atomically, as the textfile collector may read at any time
+bool writeMetricsFile(const std::string& path) {
+    if (!writeFileAtomic(path, metricsText())) {
+        logError("Failed to write metrics file: %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Metrics Export
+//------------------------------------------------------------------------------
+
+namespace {
+
+std::mutex g_exportMutex;
+std::condition_variable g_exportWake;
+bool g_exportStop = false;
+std::thread g_fileThread;
+std::thread g_httpThread;
+std::string g_metricsPath;
+
+bool exportStopping() {
+    std::lock_guard<std::mutex> lock(g_exportMutex);
+    return g_exportStop;
+}
+
+void fileLoop(uint32_t intervalSec) {
+    std::unique_lock<std::mutex> lock(g_exportMutex);
+    while (!g_exportStop) {
+        g_exportWake.wait_for(lock, std::chrono::seconds(intervalSec));
+        writeMetricsFile(g_metricsPath);
+    }
+}
+
+// Minimal HTTP/1.0: every request gets the metrics. One connection at a
+// time, so a scraper that stalls is cut off by the socket timeout. The
+// listener is polled so stopMetricsExport() is noticed.
+void httpLoop(NetSocket listener) {
+    while (!exportStopping()) {
+        if (!netWaitReadable(listener, METRICS_HTTP_POLL_MS)) {
+            continue;
+        }
+        NetSocket fd = netAccept(listener);
+        if (fd == NET_INVALID_SOCKET) {
+            continue;
+        }
+        netSetTimeout(fd, METRICS_HTTP_TIMEOUT_MS);
+        LineConnection conn(fd);
+        std::string line;
+        size_t lines = 0;
+        bool complete = false;
+        while (lines++ < METRICS_HTTP_MAX_LINES && conn.readLine(line)) {
+            if (line == "\r" || line.empty()) {  // End of request line and headers
+                complete = true;
+                break;
+            }
+        }
+        if (!complete) {
+            continue;
+        }
+        std::string body = metricsText();
+        char header[160];
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                 body.size());
+        conn.write(header + body);
+        conn.shutdown();
+    }
+    netClose(listener);
+}
+
+} // namespace
+
+// Write the textfile every intervalSec and/or serve GET /metrics on address
+bool startMetricsExport(const std::string& path, uint32_t intervalSec, const std::string& address) {
+    {
+        std::lock_guard<std::mutex> lock(g_exportMutex);
+        g_exportStop = false;
+    }
+    if (!address.empty()) {
+        if (!netStartup()) {
+            return false;
+        }
+        NetSocket listener = netListen(address);
+        if (listener == NET_INVALID_SOCKET) {
+            return false;
+        }
+        logVerbose("Serving metrics on http://%s/metrics", address.c_str());
+        g_httpThread = std::thread(httpLoop, listener);
+    }
+    if (!path.empty()) {
+        g_metricsPath = path;
+        if (!writeMetricsFile(path)) {
+            return false;
+        }
+        g_fileThread = std::thread(fileLoop, intervalSec ? intervalSec : 1);
+    }
+    return true;
+}
+
+// Final textfile write so the last run is not lost, and the endpoint closed.
+// Safe to call when nothing was started, and more than once.
+void stopMetricsExport() {
+    {
+        std::lock_guard<std::mutex> lock(g_exportMutex);
+        g_exportStop = true;
+    }
+    g_exportWake.notify_all();
+    if (g_fileThread.joinable()) {
+        g_fileThread.join();
+    }
+    if (g_httpThread.joinable()) {
+        g_httpThread.join();
+    }
+}
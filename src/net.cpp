@@ -0,0 +1,235 @@
+/*
+ * NT Flash Tool - TCP connections carrying one JSON message per line
+ *
+ * Copyright (c) 2024
+ */
+
+#if defined(WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+
+#include "nt_flash.h"
+
+#if defined(WIN32)
+#define closeSocket closesocket
+#else
+#define closeSocket ::close
+#endif
+
+// A peer that has gone must fail the send, not raise SIGPIPE
+#if defined(MSG_NOSIGNAL)
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+static void configureSocket(NetSocket fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+#if defined(SO_NOSIGPIPE)
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&one, sizeof(one));
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Network
+//------------------------------------------------------------------------------
+
+bool netStartup() {
+#if defined(WIN32)
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        logError("Failed to initialize Winsock");
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Split "host:port" (or just "port") into its parts
+static void splitAddress(const std::string& address, std::string& host, std::string& port) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        host.clear();
+        port = address;
+    } else {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+}
+
+static NetSocket openSocket(const std::string& address, bool listening) {
+    std::string host;
+    std::string port;
+    splitAddress(address, host, port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+    struct addrinfo* list = nullptr;
+    if (getaddrinfo(host.empty() ? (listening ? nullptr : "localhost") : host.c_str(),
+                    port.c_str(), &hints, &list) != 0) {
+        logError("Cannot resolve address: %s", address.c_str());
+        return NET_INVALID_SOCKET;
+    }
+
+    NetSocket fd = NET_INVALID_SOCKET;
+    for (struct addrinfo* ai = list; ai; ai = ai->ai_next) {
+        NetSocket s = (NetSocket)socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == NET_INVALID_SOCKET) {
+            continue;
+        }
+        int one = 1;
+        bool ok;
+        if (listening) {
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+            ok = bind(s, ai->ai_addr, (int)ai->ai_addrlen) == 0 && listen(s, 16) == 0;
+        } else {
+            ok = connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0;
+            if (ok) {
+                configureSocket(s);
+            }
+        }
+        if (ok) {
+            fd = s;
+            break;
+        }
+        closeSocket(s);
+    }
+    freeaddrinfo(list);
+
+    if (fd == NET_INVALID_SOCKET) {
+        logError("Cannot %s %s", listening ? "listen on" : "connect to", address.c_str());
+    }
+    return fd;
+}
+
+NetSocket netListen(const std::string& address) {
+    return openSocket(address, true);
+}
+
+NetSocket netConnect(const std::string& address) {
+    return openSocket(address, false);
+}
+
+NetSocket netAccept(NetSocket listener) {
+    NetSocket fd = (NetSocket)accept(listener, nullptr, nullptr);
+    if (fd != NET_INVALID_SOCKET) {
+        configureSocket(fd);
+    }
+    return fd;
+}
+
+void netSetTimeout(NetSocket fd, uint32_t ms) {
+#if defined(WIN32)
+    DWORD timeout = ms;
+#else
+    struct timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+#endif
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+bool netWaitReadable(NetSocket fd, uint32_t ms) {
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(fd, &readable);
+    struct timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+    return select((int)fd + 1, &readable, nullptr, nullptr, &timeout) > 0;
+}
+
+void netClose(NetSocket fd) {
+    if (fd != NET_INVALID_SOCKET) {
+        closeSocket(fd);
+    }
+}
+
+LineConnection::~LineConnection() {
+    netClose(m_fd);
+}
+
+bool LineConnection::readLine(std::string& line) {
+    for (;;) {
+        size_t newline = m_buffer.find('\n');
+        if (newline != std::string::npos) {
+            line = m_buffer.substr(0, newline);
+            m_buffer.erase(0, newline + 1);
+            return true;
+        }
+        char chunk[4096];
+        int n = (int)::recv(m_fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            return false;
+        }
+        m_buffer.append(chunk, n);
+    }
+}
+
+bool LineConnection::writeLine(const std::string& line) {
+    return write(line + "\n");
+}
+
+bool LineConnection::write(const std::string& data) {
+    std::lock_guard<std::mutex> lock(m_writeMutex);
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int n = (int)::send(m_fd, data.data() + sent, (int)(data.size() - sent), SEND_FLAGS);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// Send a message and free it
+bool LineConnection::sendMessage(cJSON* message) {
+    char* json = cJSON_PrintUnformatted(message);
+    cJSON_Delete(message);
+    bool ok = writeLine(json);
+    cJSON_free(json);
+    return ok;
+}
+
+// Next message; false once the peer has gone or sent something that is not JSON
+cJSON* LineConnection::receiveMessage() {
+    std::string line;
+    while (readLine(line)) {
+        if (line.empty()) {
+            continue;
+        }
+        cJSON* message = cJSON_Parse(line.c_str());
+        if (!cJSON_IsObject(message)) {
+            logError("Invalid message: %s", line.c_str());
+            cJSON_Delete(message);
+            return nullptr;
+        }
+        return message;
+    }
+    return nullptr;
+}
+
+// Unblock a reader on another thread; the socket is released by the destructor
+void LineConnection::shutdown() {
+#if defined(WIN32)
+    ::shutdown(m_fd, SD_BOTH);
+#else
+    ::shutdown(m_fd, SHUT_RDWR);
+#endif
+}
@@ -0,0 +1,1241 @@
+/*
+ * NT Flash Tool - Shared declarations
+ *
+ * Copyright (c) 2024
+ *
+ * Internal C++ interface of libntflash, used by the library's C API
+ * (include/ntflash.h) and by the nt-flash command-line tool.
+ */
+
+#ifndef NT_FLASH_H
+#define NT_FLASH_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// BLFWK includes
+#include "blfwk/host_types.h"
+#include "blfwk/Command.h"
+#include "blfwk/Bootloader.h"
+#include "blfwk/UsbHidPeripheral.h"
+#include "blfwk/SDPUsbHidPacketizer.h"
+
+extern "C" {
+#include "cJSON.h"
+}
+
+//------------------------------------------------------------------------------
+// Constants
+//------------------------------------------------------------------------------
+
+const char* const VERSION = "0.1.0";
+const char* const TOOL_NAME = "nt-flash";
+
+// USB IDs for disting NT
+const uint16_t SDP_VID = 0x1FC9;    // NXP ROM bootloader
+const uint16_t SDP_PID = 0x0135;    // i.MX RT in SDP mode
+const uint16_t BL_VID = 0x15A2;     // NXP flashloader
+const uint16_t BL_PID = 0x0073;     // Flashloader running
+
+// Memory addresses for i.MX RT1060
+const uint32_t FLASHLOADER_ADDR = 0x20001C00;  // RAM address for flashloader
+const uint32_t FLASH_BASE = 0x60000000;        // External flash base
+const uint32_t FIRMWARE_ADDR = 0x60001000;     // Firmware write address
+const uint32_t CONFIG_ADDR = 0x2000;           // Configuration memory
+const uint32_t FLASH_SIZE_DEFAULT = 0x800000;  // 8 MiB FlexSPI NOR
+const uint32_t FLASH_SECTOR_SIZE_DEFAULT = 0x1000;
+
+// FlexSPI configuration values
+const uint32_t FLEXSPI_NOR_CONFIG = 0xC0000008;
+const uint32_t FCB_CONFIG = 0xF000000F;
+const uint32_t MEMORY_ID_FLEXSPI_NOR = 9;
+
+// Timeouts
+const uint32_t SDP_TIMEOUT_MS = 5000;
+const uint32_t BL_TIMEOUT_MS = 60000;  // Long timeout for flash operations
+const uint32_t BL_ENUM_TIMEOUT_MS = 10000;  // Flashloader appearing on a port after jump
+const uint32_t BOOT_TIMEOUT_DEFAULT_MS = 20000;  // Application appearing on a port after reset
+const uint32_t BOOT_POLL_MS = 250;          // Re-check when no uevent arrives (containers)
+
+// Clone pipeline
+const uint32_t CLONE_CHUNK_SIZE = 0x10000;  // Read/write unit (multiple of sector size)
+const uint32_t CLONE_BUFFER_CHUNKS = 16;    // Chunks held in memory before the reader blocks
+
+// Compiled flash program
+const uint32_t WRITE_CHUNK_SIZE = 0x40000;  // Largest single write-memory in a program
+const uint32_t STREAM_INPUT_SIZE = 0x4000;  // Compressed bytes read at a time when streaming
+const uint32_t INFLATE_INDEX_SPAN = 0x100000;   // Image bytes between inflate index checkpoints
+
+// Compressed writes (custom flashloaders only, see compress.cpp)
+const uint32_t PROPERTY_COMPRESSED_WRITE = 0xA0;    // Vendor get-property tag offering them
+const uint32_t COMPRESSED_WRITE_VERSION = 1;        // Frame format this host sends
+const uint32_t COMPRESSED_FRAME_HEADER = 8;         // Raw size, stored size
+const uint32_t SIM_COMPRESSED_FRAME_SIZE = 0x10000; // Offered by the simulated flashloader
+const uint32_t SIM_COMPRESSED_ALIAS = 0x70000000;
+
+// Verification (--verify, see verify.cpp)
+const uint32_t PROPERTY_FLASH_DIGEST = 0xA1;        // Vendor get-property tag offering flash digests
+const uint32_t FLASH_DIGEST_VERSION = 1;
+const uint32_t VERIFY_CHUNK_SIZE = 0x10000;         // Read-back unit without digests
+const uint32_t SIM_DIGEST_CRC32_VIEW = 0x78000000;  // Offered by the simulated flashloader
+const uint32_t SIM_DIGEST_SHA256_VIEW = 0x7C000000;
+
+// Flash engine
+const uint32_t ENGINE_IO_THREADS = 32;      // Most blocking USB operations in flight at once
+const uint32_t SCHED_HUB_LIMIT_DEFAULT = 4;         // Data-heavy stages at once per USB hub
+const uint32_t SCHED_CONTROLLER_LIMIT_DEFAULT = 8;  // ... and per host controller
+const uint32_t ENGINE_CONNECT_RETRIES = 2;  // Extra attempts at SDP/flashloader connect
+const double ENGINE_RETRY_DELAY = 0.5;      // Seconds before a retry
+
+// Coordinator
+const uint32_t AGENT_STATUS_INTERVAL_MS = 2000;  // Agents re-advertise free ports this often
+
+// Metrics
+const uint32_t METRICS_INTERVAL_DEFAULT = 15;   // Seconds between metrics file updates
+const uint32_t METRICS_HTTP_TIMEOUT_MS = 5000;  // A scraper this slow is dropped
+const size_t METRICS_HTTP_MAX_LINES = 100;      // Request line and headers read at most
+const uint32_t METRICS_HTTP_POLL_MS = 200;      // How soon the endpoint notices it is stopped
+
+// Bench
+const uint32_t BENCH_RUNS_DEFAULT = 10;
+const uint32_t BENCH_FIRMWARE_SIZE_DEFAULT = 0x300000;  // Synthetic image when no package is given
+const uint32_t BENCH_FLASHLOADER_SIZE = 0x10000;
+const double BENCH_THRESHOLD_DEFAULT = 10;  // Percent worse than baseline that counts as a regression
+const double BENCH_NOISE_FLOOR = 0.01;      // Baseline figures below this (seconds) are not compared
+const uint32_t BENCH_REARM_TIMEOUT_MS = 120000;  // Operator putting a real unit back in bootloader mode
+const uint32_t SOAK_UNITS_DEFAULT = 32;     // Simulated units flashed at once by --soak
+const double FAULT_ACK_DELAY = 0.25;        // Seconds a delayed acknowledgement arrives late
+const uint32_t SCALE_UNITS_DEFAULT = 64;    // Largest simulated unit count --scale steps up to
+
+// Trace
+const size_t TRACE_MAX_EVENTS = 65536;      // Preallocated; later events are dropped
+
+// USB link ceilings for HID interrupt transfers (one max-size packet per
+// frame at full speed, per microframe at high speed)
+const double USB_FULL_SPEED_CEILING = 64 * 1000.0;     // Bytes/s
+const double USB_HIGH_SPEED_CEILING = 1024 * 8000.0;
+const double USB_LINK_BOUND = 0.8;          // Fraction of the ceiling that means link-bound
+
+// Port health
+const double HEALTH_EWMA_ALPHA = 0.1;       // Weight of a new run in a port's baseline
+const double HEALTH_LONG_EWMA_ALPHA = 0.02; // ... in its long-term baseline, which gradual decline cannot drag along
+const uint32_t HEALTH_MIN_SAMPLES = 3;      // Runs before a port is judged against its baseline
+const double HEALTH_SLOW_WRITE = 0.7;       // Degraded below this fraction of baseline throughput
+const double HEALTH_SLOW_ENUM = 1.5;        // ... or above this multiple of baseline re-enumeration
+const uint32_t HEALTH_REBASELINE_RUNS = 5;  // Consecutive slow runs at a steady figure that become the baseline
+const double HEALTH_REBASELINE_SPREAD = 0.15; // Steady: within this fraction of the previous run's figure
+
+// Expert Sleepers firmware URLs
+const char* const FIRMWARE_BASE_URL = "https://www.expert-sleepers.co.uk/downloads/firmware/";
+
+//------------------------------------------------------------------------------
+// Globals
+//------------------------------------------------------------------------------
+
+extern bool g_verbose;
+extern bool g_dryRun;
+extern bool g_machineOutput;
+extern uint32_t g_bootTimeoutMs;    // Wait for the application after reset (0 = don't)
+extern bool g_streamFirmware;       // Inflate the firmware from the package as it is written
+extern bool g_compressWrites;       // Compress writes when the flashloader offers it
+extern bool g_simCompressedWrite;   // Simulated flashloaders offer compressed writes
+extern bool g_verifyWrites;         // Check the flash against the image after writing it
+extern bool g_simFlashDigest;       // Simulated flashloaders offer flash digests
+
+// USB port of the device the current thread is working on (multi-device modes)
+extern thread_local const char* g_deviceTag;
+
+// Stage reported with progress callbacks from BLFWK
+extern thread_local const char* g_currentStage;
+
+// Library jobs route STATUS/PROGRESS/ERROR output of their thread here
+// instead of stdout. type is "STATUS", "PROGRESS" or "ERROR".
+struct EventSink {
+    void (*handler)(void* context, const char* type, const char* stage, int percent, const char* message);
+    void* context;
+};
+extern thread_local const EventSink* g_eventSink;
+
+// Set by the owner of the current thread's job to request cancellation
+extern thread_local const std::atomic<bool>* g_cancel;
+
+//------------------------------------------------------------------------------
+// Logging and machine-readable output
+//------------------------------------------------------------------------------
+
+void logInfo(const char* fmt, ...);
+void logVerbose(const char* fmt, ...);
+void logError(const char* fmt, ...);
+void machineStatus(const char* stage, int percent, const char* message);
+void machineProgress(const char* stage, int percent, const char* message);
+void machineWarning(const char* kind, const char* message);  // Leaves the stage as it is
+void displayProgress(int percentage, int segmentIndex, int segmentCount);
+
+// Stage of the last machineStatus() on this thread (single-device flows)
+extern thread_local const char* g_lastStatusStage;
+
+// True (and logs an error) once the current job has been cancelled
+bool flashCancelled();
+
+double nowSeconds();
+
+//------------------------------------------------------------------------------
+// File Utilities
+//------------------------------------------------------------------------------
+
+bool loadFile(const char* path, std::vector<uint8_t>& data);
+std::string getTempDir();
+std::string absolutePath(const std::string& path);
+std::string saveToTempFile(const std::vector<uint8_t>& data, const char* suffix);
+bool writeFileAtomic(const std::string& path, const std::string& data);
+bool downloadFile(const char* url, const char* destPath);
+
+//------------------------------------------------------------------------------
+// Flash Sequences
+//------------------------------------------------------------------------------
+
+// One operation of a declarative flash sequence. The built-in sequence for
+// disting NT can be replaced by a "flash_sequence" array in MANIFEST.json:
+//
+//   { "op": "configure", "memory_id": 9, "option": "0xC0000008" }
+//   { "op": "erase", "address": "0x60000000", "size": "image+0x1000" }
+//   { "op": "write", "address": "0x60001000" }
+//
+// Each op may also carry "stage", "percent" and "message" for --machine output.
+struct FlashScriptOp {
+    enum Kind { kConfigure, kErase, kWrite };
+
+    Kind kind;
+    uint32_t memoryId;      // configure
+    uint32_t option;        // configure: FlexSPI configuration word
+    uint32_t address;       // erase, write
+    uint32_t size;          // erase: bytes (added to the image size if sizeFromImage)
+    bool sizeFromImage;
+    std::string stage;
+    int percent;
+    std::string message;
+
+    FlashScriptOp()
+        : kind(kConfigure), memoryId(MEMORY_ID_FLEXSPI_NOR), option(0), address(0), size(0),
+          sizeFromImage(false), percent(-1) {}
+
+    // 64-bit so "image+N" cannot wrap; validateFlashScript() rejects any
+    // range that does not fit in flash
+    uint64_t eraseSize(uint32_t imageSize) const {
+        return sizeFromImage ? (uint64_t)imageSize + size : size;
+    }
+};
+
+typedef std::vector<FlashScriptOp> FlashScript;
+
+// One flashloader operation of a compiled flash program
+struct FlashStep {
+    const char* stage;        // Machine-readable stage started by this step (or nullptr)
+    int percent;
+    const char* message;
+    std::string info;         // Human-readable line logged before the step (optional)
+    std::string detail;       // Verbose line logged before the step (optional)
+    string_vector_t args;     // Prebuilt command; empty for payload writes
+    uint32_t address;         // Payload writes: destination
+    size_t offset;            // Payload writes: slice of the firmware image
+    size_t size;
+
+    FlashStep() : stage(nullptr), percent(0), message(nullptr), address(0), offset(0), size(0) {}
+};
+
+// The command sequence for flashing a package, built once when the package is
+// loaded and replayed unchanged on every device: command arguments are already
+// formatted and write data is sliced from the image (see ImageStream) with
+// blank sectors dropped, so a device costs no planning of its own.
+struct FlashProgram {
+    std::vector<FlashStep> steps;
+    uint64_t writeBytes;      // Payload bytes actually sent
+    uint64_t skippedBytes;    // Blank payload bytes not sent
+
+    FlashProgram() : writeBytes(0), skippedBytes(0) {}
+};
+
+struct WriteRun {
+    size_t offset;
+    size_t size;
+};
+
+std::vector<WriteRun> planSparseWrite(const std::vector<uint8_t>& image, uint32_t sectorSize);
+// Add one sector at offset to a sparse write plan, unless it is blank
+void planSparseSector(std::vector<WriteRun>& runs, size_t offset, const uint8_t* data, size_t size);
+void defaultFlashScript(FlashScript& script);
+bool parseFlashScript(cJSON* sequence, FlashScript& script);
+bool validateFlashScript(const FlashScript& script, uint32_t imageSize);
+void optimizeFlashScript(FlashScript& script, uint32_t imageSize);
+void compileFlashProgram(const FlashScript& script, const std::vector<uint8_t>& firmware,
+                         FlashProgram& program);
+void compileFlashProgram(const FlashScript& script, uint32_t imageSize, const std::vector<WriteRun>& runs,
+                         FlashProgram& program);
+
+//------------------------------------------------------------------------------
+// Firmware Package Handling
+//------------------------------------------------------------------------------
+
+// Random access into a deflated entry, after zlib's zran.c: the inflater
+// state and dictionary about every INFLATE_INDEX_SPAN bytes of output, so a
+// range of the image can be inflated from the nearest checkpoint instead of
+// from the start
+struct InflateCheckpoint {
+    uint64_t output;          // Image offset the checkpoint resumes at
+    uint64_t input;           // Compressed bytes consumed to get there
+    std::vector<uint8_t> inflater;    // tinfl_decompressor, copied whole
+    std::vector<uint8_t> dictionary;  // Circular; output % size is the next byte
+};
+
+typedef std::vector<InflateCheckpoint> InflateIndex;
+
+// Where a streamed firmware lies in its package
+struct PackageEntry {
+    std::string zipPath;      // Empty unless streamed
+    std::string name;
+    uint32_t crc;             // CRC-32 of the image
+    uint64_t headerOffset;    // Local header
+    uint64_t dataOffset;      // Compressed data
+    uint64_t compressedSize;
+    bool deflated;            // Otherwise stored
+    InflateIndex index;
+
+    PackageEntry() : crc(0), headerOffset(0), dataOffset(0), compressedSize(0), deflated(false) {}
+};
+
+// One image listed by the extended MANIFEST.json schema ("images"), so a
+// package can be checked and its erases planned from the manifest and the
+// ZIP central directory before anything is inflated
+enum ManifestImageField {
+    kImageLoadAddress = 1 << 0,
+    kImageSize = 1 << 1,
+    kImageCompressedSize = 1 << 2,
+    kImageCrc32 = 1 << 3,
+    kImageRegion = 1 << 4
+};
+
+struct ManifestImage {
+    std::string name;         // Entry in the package
+    uint32_t fields;          // ManifestImageField bits of the fields given
+    uint32_t loadAddress;
+    uint32_t size;            // Inflated
+    uint32_t compressedSize;
+    uint32_t crc;             // CRC-32 of the image
+    uint32_t entryCrc;        // CRC-32 in the ZIP central directory
+    std::string sha256;       // Lower-case hex; empty if not given
+    uint32_t regionAddress;   // Flash region the image must lie in
+    uint32_t regionSize;
+    std::vector<uint8_t> sectorCrcs;  // Per default-size sector, as appendSectorDigest; empty if not given
+
+    ManifestImage()
+        : fields(0), loadAddress(0), size(0), compressedSize(0), crc(0), entryCrc(0), regionAddress(0), regionSize(0) {}
+};
+
+struct FirmwarePackage {
+    std::vector<uint8_t> flashloader;
+    std::vector<uint8_t> firmware;    // Empty when streamed
+    std::string flashloaderPath;  // Temp file path for BLFWK
+    std::string version;
+    std::string firmwareHash; // SHA-256 of the firmware image
+    uint32_t firmwareSize;
+    PackageEntry stream;      // Streamed: the firmware entry in the package
+    FlashScript script;       // Sequence from MANIFEST.json, or the built-in one
+    FlashProgram program;     // script compiled for this firmware image
+    std::vector<uint8_t> sectorCrcs;  // --verify: CRC32 of each default-size sector (see appendSectorDigest)
+    std::vector<ManifestImage> images;    // Extended MANIFEST.json; empty for the plain schema
+    bool valid;
+
+    FirmwarePackage() : firmwareSize(0), valid(false) {}
+
+    ~FirmwarePackage() {
+        // Clean up temp files
+        if (!flashloaderPath.empty()) {
+            remove(flashloaderPath.c_str());
+        }
+    }
+};
+
+bool extractFileFromZip(const std::vector<uint8_t>& zipData, const char* filename,
+                        std::vector<uint8_t>& outData);
+// Raw DEFLATE data inflated whole into a buffer of the exact inflated size;
+// false if the data is corrupt or does not fill it (inflate.cpp)
+bool inflateBuffer(const uint8_t* in, size_t inSize, uint8_t* out, size_t outSize);
+// images, if given, receives the extended schema's image list
+bool parseManifest(const std::vector<uint8_t>& jsonData, std::string& firmwarePath,
+                   FlashScript& script, std::vector<ManifestImage>* images = nullptr);
+// indexPath, if given, caches the inflate index of a streamed firmware
+FirmwarePackage* loadFirmwarePackage(const char* zipPath, const char* indexPath = nullptr);
+// Pseudo-random image with one blank sector in eight, reproducible from the seed
+void syntheticImage(std::vector<uint8_t>& image, uint32_t size, uint32_t seed);
+// Package built in memory around a synthetic image, for simulated benchmarks only
+FirmwarePackage* syntheticFirmwarePackage(uint32_t firmwareSize, uint32_t flashloaderSize);
+std::string sha256Hex(const uint8_t* data, size_t size);
+
+// SHA-256 fed in pieces, for hashing an image as it is inflated
+class Sha256 {
+public:
+    Sha256();
+    void update(const uint8_t* data, size_t size);
+    std::string hexDigest();  // Once, after the last update
+    void digest(uint8_t out[32]);   // ... or this
+
+private:
+    uint32_t m_state[8];
+    uint8_t m_block[64];
+    size_t m_used;            // Bytes in m_block
+    uint64_t m_size;
+};
+
+// Reader of the firmware image for write steps. An in-memory image is handed
+// out in place. A streamed one is read from the package into a window the
+// size of the largest read, so a device holds at most one write step of it
+// plus the inflater state. Reads are cheapest in order; any other starts
+// from the nearest checkpoint of the package's inflate index.
+struct ImageStreamState;
+class ImageStream {
+public:
+    // build, if given, receives checkpoints as the image is inflated
+    explicit ImageStream(const FirmwarePackage* pkg, InflateIndex* build = nullptr)
+        : m_pkg(pkg), m_build(build), m_state(nullptr) {}
+    ~ImageStream();
+
+    // Bytes [offset, offset + size) of the image, valid until the next call;
+    // nullptr (error logged) if they cannot be read
+    const uint8_t* read(size_t offset, size_t size);
+    void close();
+
+private:
+    bool open();
+    bool seek(size_t offset);
+    bool inflateTo(uint8_t* out, size_t size);
+
+    const FirmwarePackage* m_pkg;
+    InflateIndex* m_build;
+    ImageStreamState* m_state;
+};
+
+//------------------------------------------------------------------------------
+// Devices
+//------------------------------------------------------------------------------
+
+// Negotiated speed of a device's link and of each hub between it and the
+// host controller (Linux sysfs; empty elsewhere)
+struct UsbLink {
+    double speedMbps;         // 0 if unknown
+    std::vector<std::pair<std::string, double> > hubs;   // Nearest hub first, root hub last
+
+    UsbLink() : speedMbps(0) {}
+};
+
+struct UsbDevice {
+    std::string path;   // HID path, passed to BLFWK
+    std::string port;   // Physical USB port (e.g. "1-2.3"), stable across re-enumeration
+    std::string serial; // USB serial number, if the device reports one
+    bool flashloader;   // Running the flashloader (otherwise SDP ROM)
+    UsbLink link;
+};
+
+std::string usbPortForHidPath(const std::string& hidPath);
+void usbTopology(const std::string& port, std::string& hub, std::string& controller);
+bool readUsbLink(const std::string& port, UsbLink& link);
+std::string describeUsbLink(const UsbLink& link);
+// Warn when a write rate is what the link allows rather than what the flash allows
+bool checkLinkThroughput(const UsbLink& link, uint64_t bytes, double seconds);
+std::vector<UsbDevice> enumerateDevices();
+bool findDeviceOnPort(const std::string& port, UsbDevice& device);
+bool waitForFlashloader(const std::string& port, uint32_t timeoutMs, std::string& path);
+
+// Watches a port for the application to enumerate once the flashloader resets
+// into it. Kernel uevents wake the wait; sysfs decides what is on the port.
+class BootWatch {
+public:
+    BootWatch() : m_fd(-1), m_active(false) {}
+    ~BootWatch();
+
+    static bool supported();
+    // Call before the reset so the new enumeration cannot be missed
+    bool start(const std::string& port);
+    // Wait for a device other than SDP or the flashloader on the port
+    bool wait(uint32_t timeoutMs);
+
+private:
+    std::string m_port;
+    int m_fd;
+    bool m_active;
+};
+
+// SDP operations (ROM bootloader)
+class SDPOperations {
+public:
+    SDPOperations() : m_peripheral(nullptr), m_packetizer(nullptr) {}
+
+    ~SDPOperations();
+
+    // Connect to the SDP device at the given HID path (first one found if empty)
+    bool connect(const std::string& path = "");
+
+    bool writeFile(uint32_t address, const std::string& filePath);
+
+    bool jumpAddress(uint32_t address);
+
+    void close();
+
+private:
+    blfwk::UsbHidPeripheral* m_peripheral;
+    blfwk::SDPUsbHidPacketizer* m_packetizer;
+};
+
+// FlexSPI NOR geometry as reported by the flashloader
+struct FlashGeometry {
+    uint32_t startAddress;
+    uint32_t totalSize;
+    uint32_t pageSize;
+    uint32_t sectorSize;
+    uint32_t blockSize;
+
+    FlashGeometry()
+        : startAddress(FLASH_BASE), totalSize(FLASH_SIZE_DEFAULT), pageSize(256),
+          sectorSize(FLASH_SECTOR_SIZE_DEFAULT), blockSize(0x10000) {}
+};
+
+// Bootloader operations (flashloader)
+// Compressed writes a flashloader offers (get-property PROPERTY_COMPRESSED_WRITE):
+// a write-memory to alias + (flash address - FLASH_BASE) carries frames it
+// expands into flash at that address (see compressFrames)
+struct CompressedWrite {
+    uint32_t version;         // 0 = not offered
+    uint32_t frameSize;       // Largest frame it expands
+    uint32_t alias;
+
+    CompressedWrite() : version(0), frameSize(0), alias(0) {}
+};
+
+void compressFrames(const uint8_t* data, size_t size, uint32_t frameSize, std::vector<uint8_t>& payload);
+// The flashloader's side, for the simulated one
+bool expandFrames(const uint8_t* payload, size_t size, uint32_t frameSize, std::vector<uint8_t>& data);
+
+// Flash digests a flashloader offers (get-property PROPERTY_FLASH_DIGEST): a
+// read-memory from a view + (sector index from FLASH_BASE) * digest size
+// returns the digests of consecutive sectors, computed on the device
+struct FlashDigest {
+    uint32_t version;         // 0 = not offered
+    uint32_t sectorSize;
+    uint32_t crc32View;       // 0 = not offered
+    uint32_t sha256View;
+
+    FlashDigest() : version(0), sectorSize(0), crc32View(0), sha256View(0) {}
+};
+
+enum DigestKind { kDigestCrc32, kDigestSha256 };
+
+inline size_t digestSize(DigestKind kind) {
+    return kind == kDigestCrc32 ? 4 : 32;
+}
+
+// Digest of one sector as a flashloader reports it: CRC32 little-endian or
+// SHA-256, over the sector padded to sectorSize with erased (0xFF) bytes
+void appendSectorDigest(std::vector<uint8_t>& digests, DigestKind kind, const uint8_t* data, size_t size,
+                        uint32_t sectorSize);
+
+class BootloaderOperations {
+public:
+    BootloaderOperations() : m_bootloader(nullptr), m_showProgress(true) {}
+
+    ~BootloaderOperations();
+
+    // Connect to the flashloader at the given HID path (first one found if empty)
+    bool connect(const std::string& path = "");
+
+    bool runCommand(const string_vector_t& args, uint32_vector_t* responseValues = nullptr);
+
+    bool fillMemory(uint32_t address, uint32_t size, uint32_t pattern);
+
+    bool configureMemory(uint32_t memoryId, uint32_t configAddr);
+
+    bool flashEraseRegion(uint32_t address, uint32_t size, uint32_t memoryId = 0);
+
+    bool writeMemory(uint32_t address, const std::string& filePath, uint32_t memoryId = 0);
+
+    // Write a buffer straight from memory (no temp file round-trip), compressed
+    // if the flashloader offers it. sent, if given, receives the bytes sent.
+    bool writeData(uint32_t address, const uint8_t* data, size_t size, size_t* sent = nullptr);
+
+    bool readMemory(uint32_t address, uint32_t size, const std::string& filePath, uint32_t memoryId = 0);
+
+    // Query flash geometry (get-property 25 <memoryId>). Leaves the defaults
+    // in place when the flashloader does not report the attributes.
+    bool getFlashGeometry(uint32_t memoryId, FlashGeometry& geometry);
+
+    bool reset();
+
+    // Per-command progress display (off when several devices share the console)
+    void setShowProgress(bool show);
+
+    const FlashDigest& flashDigest() const { return m_digest; }
+
+    void close();
+
+private:
+    bool execute(blfwk::Command* cmd, const char* name, uint32_vector_t* responseValues, bool showProgress);
+    bool queryProperty(uint32_t tag, uint32_vector_t& response);
+    void queryCompressedWrite();
+    void queryFlashDigest();
+
+    blfwk::Bootloader* m_bootloader;
+    bool m_showProgress;
+    CompressedWrite m_compressed;
+    FlashDigest m_digest;
+    std::vector<uint8_t> m_payload;   // Frames of the last compressed write
+};
+
+//------------------------------------------------------------------------------
+// Flash Operations
+//------------------------------------------------------------------------------
+
+bool startFlashloader(FirmwarePackage* pkg, BootloaderOperations& bl, bool skipSdp = false,
+                      const std::string& port = "");
+bool configureFlexSpiNor(BootloaderOperations& bl);
+struct DeviceStats;
+// Bytes compressed writes saved on a device, if they did
+void logCompressedWrites(const DeviceStats& stats);
+// stats, if given, receives the bytes written and the time spent writing
+bool runFlashProgram(BootloaderOperations& bl, const FlashProgram& program,
+                     ImageStream& image, DeviceStats* stats = nullptr);
+// Check the flash holds the package's image (--verify)
+bool verifyFlash(BootloaderOperations& bl, const FirmwarePackage* pkg, ImageStream& image);
+bool flashFirmware(FirmwarePackage* pkg, bool skipSdp = false, const std::string& port = "");
+bool backupFlash(FirmwarePackage* pkg, const char* outPath, uint32_t sizeOverride);
+bool restoreFlash(FirmwarePackage* pkg, const char* dumpPath);
+bool cloneFlash(FirmwarePackage* pkg, const std::string& goldenPort,
+                std::vector<std::string> targetPorts, uint32_t sizeOverride);
+// Caps on devices in data-heavy stages (SDP upload, flash writes) at once,
+// per USB hub and per host controller; 0 = no cap
+struct ScheduleLimits {
+    uint32_t perHub;
+    uint32_t perController;
+
+    ScheduleLimits()
+        : perHub(SCHED_HUB_LIMIT_DEFAULT), perController(SCHED_CONTROLLER_LIMIT_DEFAULT) {}
+};
+
+// Settings for station and simulated runs
+struct StationOptions {
+    ScheduleLimits limits;
+    std::string healthPath;   // Port health file to judge and update (optional)
+    bool avoidDegraded;       // Leave ports flagged degraded out of the run
+    std::vector<std::string> healthReset;  // Ports whose history is dropped before the run
+
+    StationOptions() : avoidDegraded(false) {}
+};
+
+bool flashStation(FirmwarePackage* pkg, std::vector<std::string> ports,
+                  const StationOptions& options = StationOptions());
+bool flashSimulated(FirmwarePackage* pkg, uint32_t count,
+                    const StationOptions& options = StationOptions());
+bool runStation(FirmwarePackage* pkg, std::vector<std::string> ports, bool simulated,
+                const StationOptions& options, bool chosenPorts, std::vector<std::string>* failedPorts);
+std::vector<std::string> simulatedPorts(uint32_t count);
+
+//------------------------------------------------------------------------------
+// Network
+//------------------------------------------------------------------------------
+
+#if defined(WIN32)
+typedef uintptr_t NetSocket;
+const NetSocket NET_INVALID_SOCKET = (NetSocket)~(uintptr_t)0;
+#else
+typedef int NetSocket;
+const NetSocket NET_INVALID_SOCKET = -1;
+#endif
+
+bool netStartup();
+// Addresses are "host:port"; a bare port listens on every interface or connects to localhost
+NetSocket netListen(const std::string& address);
+NetSocket netConnect(const std::string& address);
+NetSocket netAccept(NetSocket listener);
+void netSetTimeout(NetSocket fd, uint32_t ms);  // Sends and receives fail after ms
+bool netWaitReadable(NetSocket fd, uint32_t ms);  // A listener: true once accept() will not block
+void netClose(NetSocket fd);
+
+// A TCP connection carrying one JSON message per line. Any thread may send;
+// one thread reads.
+class LineConnection {
+public:
+    explicit LineConnection(NetSocket fd) : m_fd(fd) {}
+    ~LineConnection();
+
+    bool readLine(std::string& line);
+    bool writeLine(const std::string& line);
+    bool write(const std::string& data);
+
+    bool sendMessage(cJSON* message);     // Frees message
+    cJSON* receiveMessage();              // nullptr once the peer has gone
+
+    void shutdown();
+
+private:
+    NetSocket m_fd;
+    std::string m_buffer;
+    std::mutex m_writeMutex;
+};
+
+//------------------------------------------------------------------------------
+// Coordinator
+//------------------------------------------------------------------------------
+
+struct AgentOptions {
+    std::string name;         // Shown by the coordinator (default: host name)
+    std::string cacheDir;     // Downloaded/received packages (default: temp dir)
+    uint32_t simulate;        // Offer this many simulated units instead of USB devices
+    std::string token;        // Shared secret the coordinator requires, if any
+
+    AgentOptions() : simulate(0) {}
+};
+
+// A bare port listens on loopback only; with a token, peers must present it
+bool runCoordinator(std::string address, const std::string& token);
+bool runAgent(const std::string& coordinatorAddress, AgentOptions options);
+// version names the firmware; packageName is a ZIP file name the agents may
+// hold in their cache directories, if any
+bool submitJob(const std::string& coordinatorAddress, const std::string& version,
+               const std::string& packageName, uint32_t count, const std::string& token);
+
+//------------------------------------------------------------------------------
+// Port Health
+//------------------------------------------------------------------------------
+
+// What one run measured on a device's port
+struct DeviceStats {
+    bool ok;
+    bool timedOut;            // Flashloader never re-enumerated
+    uint32_t retries;
+    uint64_t writeBytes;
+    uint64_t wireBytes;       // Bytes the writes took over USB (fewer if compressed)
+    double writeSeconds;      // Time spent in write operations
+    double enumSeconds;       // SDP jump to flashloader on the port (0 if skipped)
+    double bootSeconds;       // Reset to application on the port (0 if not checked)
+
+    DeviceStats()
+        : ok(false), timedOut(false), retries(0), writeBytes(0), wireBytes(0), writeSeconds(0),
+          enumSeconds(0), bootSeconds(0) {}
+};
+
+// History of one USB port across runs. Baselines are moving averages over
+// successful runs; the latest run is judged against them before folding in,
+// and a figure it is flagged for is left out of them. A port that stays slow
+// at a steady figure for HEALTH_REBASELINE_RUNS runs takes it as its baseline.
+struct PortHealth {
+    uint32_t runs;
+    uint32_t failures;
+    uint32_t timeouts;
+    uint32_t retries;
+    uint32_t samples;         // Runs in the baselines
+    double writeRate;         // Baseline bytes/s
+    double enumSeconds;       // Baseline re-enumeration time
+    double longWriteRate;     // Long-term baselines
+    double longEnumSeconds;
+    double lastWriteRate;
+    double lastEnumSeconds;
+    uint32_t slowRuns;        // Consecutive flagged runs at a steady figure
+    bool degraded;            // Flagged by the latest run
+
+    PortHealth()
+        : runs(0), failures(0), timeouts(0), retries(0), samples(0), writeRate(0), enumSeconds(0),
+          longWriteRate(0), longEnumSeconds(0), lastWriteRate(0), lastEnumSeconds(0), slowRuns(0),
+          degraded(false) {}
+};
+
+typedef std::map<std::string, PortHealth> HealthTable;
+
+bool loadPortHealth(const std::string& path, HealthTable& table);
+bool savePortHealth(const std::string& path, const HealthTable& table);
+// Judge a run against the port's baseline (logging why it is degraded), then record it
+void updatePortHealth(PortHealth& health, const DeviceStats& run);
+
+//------------------------------------------------------------------------------
+// Metrics
+//------------------------------------------------------------------------------
+
+void metricsFlashStarted();
+void metricsStageFinished(const char* stage, double seconds);
+void metricsFlashFinished(bool ok, const char* failedStage, const DeviceStats* stats);
+std::string metricsText();
+bool writeMetricsFile(const std::string& path);
+bool startMetricsExport(const std::string& path, uint32_t intervalSec, const std::string& address);
+void stopMetricsExport();
+
+//------------------------------------------------------------------------------
+// Trace
+//------------------------------------------------------------------------------
+
+// Times are nowSeconds(); a null track is the current g_deviceTag
+void startTrace(const std::string& path);
+bool traceEnabled();
+void traceSpan(const char* track, const char* name, const char* category, double start, double end);
+void traceInstant(const char* track, const char* name, const char* category);
+void traceStage(const char* stage);
+void traceStatus(const char* stage);
+bool writeTrace();
+
+// Span covering one USB transaction on the current device
+class TraceScope {
+public:
+    TraceScope(const char* name, const char* category)
+        : m_name(name), m_category(category), m_start(traceEnabled() ? nowSeconds() : 0) {}
+    ~TraceScope() {
+        if (m_start > 0) traceSpan(nullptr, m_name, m_category, m_start, nowSeconds());
+    }
+
+private:
+    const char* m_name;
+    const char* m_category;
+    double m_start;
+};
+
+//------------------------------------------------------------------------------
+// Resource Accounting
+//------------------------------------------------------------------------------
+
+// Maintained by the allocator hook (CLI only)
+extern std::atomic<bool> g_allocHookInstalled;
+extern std::atomic<uint64_t> g_heapAllocations;
+extern std::atomic<uint64_t> g_heapAllocatedBytes;
+extern std::atomic<int64_t> g_heapLiveBytes;
+extern std::atomic<int64_t> g_heapPeakBytes;
+extern thread_local uint64_t g_threadAllocations;
+extern thread_local uint64_t g_threadAllocatedBytes;
+
+// CPU time and allocations of the calling thread so far
+struct ResourceSample {
+    double userSeconds;
+    double systemSeconds;
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+
+    ResourceSample() : userSeconds(0), systemSeconds(0), allocations(0), allocatedBytes(0) {}
+};
+
+void enableResourceStats();
+bool resourceStatsEnabled();
+ResourceSample sampleThreadResources();
+void processCpuTimes(double& user, double& system);
+// Voluntary and involuntary context switches of the process; false where
+// the platform does not count them
+bool processContextSwitches(uint64_t& voluntary, uint64_t& involuntary);
+void resourceStage(const char* stage);
+void resourceStatus(const char* stage);
+void printResourceStats();
+
+// Charges what the calling thread uses while in scope to a stage
+class ResourceScope {
+public:
+    explicit ResourceScope(const char* stage);
+    ~ResourceScope();
+
+private:
+    const char* m_stage;
+    ResourceSample m_start;
+};
+
+//------------------------------------------------------------------------------
+// Journal
+//------------------------------------------------------------------------------
+
+// One flashed unit
+struct JournalEntry {
+    std::string port;
+    std::string serial;
+    std::string version;
+    std::string firmwareHash;
+    std::string failedStage;
+    double seconds;           // START to COMPLETE or failure
+    DeviceStats stats;
+    std::vector<std::pair<std::string, double> > stages;   // Seconds per stage, in order
+
+    JournalEntry() : seconds(0) {}
+};
+
+// false if a journal is already open; reopening after closeJournal() is fine
+bool openJournal(const std::string& path);
+// Queue a record for the writer thread; a no-op while no journal is open
+void journalFlash(const JournalEntry& entry);
+// Write out everything queued, then close
+void closeJournal();
+bool reportJournal(const std::string& path, uint32_t intervalMinutes);
+
+//------------------------------------------------------------------------------
+// Flash Engine
+//------------------------------------------------------------------------------
+
+// Where a device is in the flash flow. Each state is one transport operation;
+// kStateProgram repeats once per step of the package's compiled program.
+enum EngineState {
+    kStateFind,          // Locate the device on its port (SDP or flashloader)
+    kStateSdpConnect,
+    kStateSdpUpload,
+    kStateSdpJump,
+    kStateWaitEnum,      // Flashloader re-enumerating on the same port
+    kStateBlConnect,
+    kStateProgram,       // configure / erase / write steps
+    kStateVerify,        // Flash checked against the image (g_verifyWrites)
+    kStateReset,
+    kStateBootWait,      // Application enumerating after the reset (g_bootTimeoutMs)
+    kStateDone,
+    kStateFailed
+};
+
+const char* engineStateName(EngineState state);
+
+enum OpResult {
+    kOpFailed,
+    kOpOk,
+    kOpSkipSdp,          // kStateFind: the device is already running the flashloader
+    kOpRetry             // Engine timer: start the current state again
+};
+
+struct TransportOp {
+    EngineState state;
+    const FlashStep* step;   // kStateProgram only
+    const char* stage;       // Stage the operation belongs to (for accounting)
+
+    TransportOp() : state(kStateFind), step(nullptr), stage(nullptr) {}
+};
+
+class FlashEngine;
+
+// Admission control for data-heavy stages. Devices are grouped by the hub and
+// host controller their port hangs off; a device may start a heavy stage only
+// while both of its groups are under their caps. Cheap stages are not limited.
+class TopologyScheduler {
+public:
+    explicit TopologyScheduler(const ScheduleLimits& limits) : m_limits(limits) {}
+
+    void addDevice(const std::string& port);
+
+    bool tryAcquire(size_t device);
+    void release(size_t device);
+    bool holding(size_t device) const { return m_holding[device] != 0; }
+    const std::string& hub(size_t device) const { return m_hub[device]; }
+
+private:
+    ScheduleLimits m_limits;
+    std::vector<std::string> m_hub;
+    std::vector<std::string> m_controller;
+    std::vector<char> m_holding;
+    std::map<std::string, uint32_t> m_hubActive;
+    std::map<std::string, uint32_t> m_controllerActive;
+};
+
+// One device's link as seen by the engine. start() must return without
+// blocking the event loop; the operation is finished later through
+// FlashEngine::complete() (any thread), FlashEngine::completeAt() (a timer on
+// the loop) or FlashEngine::submit() (blocking work on the I/O pool).
+class FlashTransport {
+public:
+    virtual ~FlashTransport() {}
+    virtual void start(FlashEngine& engine, size_t device, const TransportOp& op) = 0;
+    // Identity of the unit found on the port, for the journal
+    virtual std::string serial() const { return std::string(); }
+    // USB link the flashloader came up on, if known
+    virtual bool link(UsbLink& link) const { (void)link; return false; }
+    // Bytes the last write step sent over USB (0 = its size)
+    virtual size_t lastWireBytes() const { return 0; }
+};
+
+// Real device behind a USB port, driven through BLFWK. BLFWK calls block, so
+// every operation runs on the engine's I/O pool.
+class UsbTransport : public FlashTransport {
+public:
+    UsbTransport(const FirmwarePackage* pkg, const std::string& port)
+        : m_pkg(pkg), m_port(port), m_image(pkg), m_sent(0) {}
+
+    virtual void start(FlashEngine& engine, size_t device, const TransportOp& op);
+    virtual std::string serial() const { return m_serial; }
+    virtual bool link(UsbLink& link) const {
+        link = m_link;
+        return m_link.speedMbps > 0;
+    }
+    virtual size_t lastWireBytes() const { return m_sent; }
+
+private:
+    OpResult run(const TransportOp& op);
+
+    const FirmwarePackage* m_pkg;
+    std::string m_port;
+    std::string m_serial;
+    UsbLink m_link;
+    std::string m_sdpPath;
+    std::string m_blPath;
+    SDPOperations m_sdp;
+    BootloaderOperations m_bl;
+    BootWatch m_boot;
+    ImageStream m_image;
+    size_t m_sent;
+};
+
+// Timing model of a simulated disting NT
+struct SimProfile {
+    double sdpBytesPerSec;     // Flashloader upload over SDP
+    double writeBytesPerSec;   // write-memory into FlexSPI NOR, per byte sent
+    double eraseBytesPerSec;
+    double commandSeconds;     // Round trip of any other command
+    double enumSeconds;        // Flashloader re-enumeration after the jump
+    double bootSeconds;        // Application enumerating after the reset
+    double readBytesPerSec;    // read-memory
+    double digestBytesPerSec;  // Flash digested on the device
+    uint32_t flashloaderSize;
+    std::map<size_t, uint32_t> wireSizes;   // Compressed writes: bytes sent, by image offset
+    uint32_t verifyBytes;      // Bytes --verify reads back: digests or the image
+    uint32_t digestedBytes;    // ... and flash the device digests for it
+
+    SimProfile()
+        : sdpBytesPerSec(600 * 1024.0), writeBytesPerSec(1024 * 1024.0),
+          eraseBytesPerSec(4 * 1024 * 1024.0), commandSeconds(0.002), enumSeconds(1.5),
+          bootSeconds(2.5), readBytesPerSec(1024 * 1024.0), digestBytesPerSec(32 * 1024 * 1024.0),
+          flashloaderSize(0), verifyBytes(0), digestedBytes(0) {}
+};
+
+// Profile of a simulated unit running the package's flashloader. With
+// g_simCompressedWrite it offers compressed writes: each write step of the
+// program is compressed as for a real unit and expanded by the simulated
+// flashloader, which fails if the result differs from the image. With
+// g_simFlashDigest it offers flash digests, which --verify compares with the
+// package's as for a real unit.
+bool simulatedProfile(const FirmwarePackage* pkg, SimProfile& profile);
+
+// Glitches a simulated unit can be told to have. Rates are the chance per
+// operation the fault applies to.
+enum FaultClass {
+    kFaultDrop,          // Report lost: the operation times out (HID operations)
+    kFaultDelay,         // Acknowledgement arrives FAULT_ACK_DELAY late
+    kFaultDisconnect,    // Unit drops off the bus part-way through a write
+    kFaultEnum,          // Flashloader never enumerates after the jump
+    kFaultNak,           // Command answered with an error status
+    kFaultClasses
+};
+
+const char* faultClassName(FaultClass fault);
+
+struct FaultPlan {
+    double rate[kFaultClasses];
+    uint32_t seed;
+
+    FaultPlan() : seed(1) {
+        for (int i = 0; i < kFaultClasses; i++) rate[i] = 0;
+    }
+};
+
+// Decides which operations fail and keeps the tally. A fault is detected
+// when the engine sees its operation fail, and recovered when the unit next
+// completes an operation. Loop thread only.
+class FaultInjector {
+public:
+    struct Tally {
+        uint32_t injected;
+        uint32_t recovered;
+        std::vector<double> detectSeconds;
+        std::vector<double> recoverSeconds;
+
+        Tally() : injected(0), recovered(0) {}
+    };
+
+    explicit FaultInjector(const FaultPlan& plan) : m_plan(plan), m_random(plan.seed ? plan.seed : 1) {}
+
+    // Fault to inject into an operation, or kFaultClasses for none
+    FaultClass roll(const TransportOp& op);
+    void detected(FaultClass fault, double seconds) { m_tally[fault].detectSeconds.push_back(seconds); }
+    void recovered(FaultClass fault, double seconds);
+    double uniform();
+    const Tally& tally(FaultClass fault) const { return m_tally[fault]; }
+
+private:
+    FaultPlan m_plan;
+    uint32_t m_random;
+    Tally m_tally[kFaultClasses];
+};
+
+// Device that completes each operation after the time the profile predicts,
+// using timers on the loop; it needs no threads of its own.
+class SimulatedTransport : public FlashTransport {
+public:
+    explicit SimulatedTransport(const SimProfile& profile, FaultInjector* faults = nullptr)
+        : m_profile(profile), m_faults(faults), m_sent(0) {}
+
+    virtual void start(FlashEngine& engine, size_t device, const TransportOp& op);
+    virtual size_t lastWireBytes() const { return m_sent; }
+
+private:
+    SimProfile m_profile;
+    FaultInjector* m_faults;
+    size_t m_sent;
+    std::vector<std::pair<FaultClass, double> > m_pending;   // Injected, not yet recovered from
+};
+
+// Drives many devices through the flash flow from one thread. Each device is
+// a state machine with at most one transport operation outstanding; the loop
+// sleeps until an operation completes or a timer expires, then advances that
+// device to its next state. Only blocking transports use the I/O pool.
+class FlashEngine {
+public:
+    FlashEngine(const FirmwarePackage* pkg, const ScheduleLimits& limits = ScheduleLimits());
+    ~FlashEngine();
+
+    // Takes ownership of the transport
+    size_t addDevice(const std::string& port, FlashTransport* transport);
+
+    // Run until every device has finished; returns how many succeeded
+    size_t run();
+
+    // Stop every device (any thread): at once if it is waiting on a timer or
+    // for a bus slot, or when its blocking operation on the I/O pool returns
+    void cancel();
+
+    // Simulated time: the loop jumps to each timer instead of sleeping. Only
+    // for transports that complete by timers alone (SimulatedTransport).
+    void useVirtualClock();
+    // Devices flashed at once (0 = all); the next starts as soon as one finishes
+    void setMaxActive(size_t devices);
+    double now() const;       // nowSeconds(), or the simulated time
+
+    size_t deviceCount() const { return m_devices.size(); }
+    const std::string& port(size_t device) const { return m_devices[device].port; }
+    bool succeeded(size_t device) const { return m_devices[device].state == kStateDone; }
+    const DeviceStats& stats(size_t device) const { return m_devices[device].stats; }
+    // Seconds per stage, in order (a stage entered twice appears twice)
+    const std::vector<std::pair<std::string, double> >& stageTimes(size_t device) const {
+        return m_devices[device].stageTimes;
+    }
+
+    // For transports
+    void complete(size_t device, OpResult result);
+    void completeAt(size_t device, double when, OpResult result);
+    void submit(size_t device, std::function<OpResult()> work);
+
+private:
+    struct Device {
+        std::string port;
+        FlashTransport* transport;
+        EngineState state;
+        const char* stage;    // Last program stage entered (for progress and errors)
+        const char* timedStage;   // Stage being timed for metrics
+        double stageStarted;
+        double started;
+        std::vector<std::pair<std::string, double> > stageTimes;
+        size_t step;          // kStateProgram: index into the program
+        size_t writeIndex;
+        double opStarted;     // When the outstanding operation was started
+        DeviceStats stats;
+    };
+
+    struct Completion {
+        size_t device;
+        OpResult result;
+    };
+
+    struct Timer {
+        double when;
+        size_t device;
+        OpResult result;
+
+        bool operator>(const Timer& other) const { return when > other.when; }
+    };
+
+    bool admit(size_t device, const TransportOp& op);
+    void admitWaiting();
+    void cancelPending();
+    void enter(size_t device);
+    void advance(size_t device, OpResult result);
+    void succeed(size_t device);
+    void finish(size_t device, EngineState state, const char* failedStage = nullptr);
+    void stageChanged(Device& dev, const char* stage);
+    void startWaitingDevices();
+    void ioWorker();
+
+    const FirmwarePackage* m_pkg;
+    std::vector<Device> m_devices;
+    size_t m_active;
+    size_t m_writeSteps;
+    std::atomic<bool> m_cancel;
+    bool m_virtual;
+    double m_clock;           // Simulated time, with m_virtual
+    size_t m_maxActive;
+    size_t m_started;         // Devices started so far, in order
+
+    // Loop thread only
+    bool m_cancelled;              // cancel() seen and pending devices stopped
+    std::vector<Timer> m_timers;   // Min-heap on when
+    TopologyScheduler m_scheduler;
+    std::deque<size_t> m_waiting;  // Devices held back by the scheduler, oldest first
+
+    // Shared with I/O workers and complete()
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::vector<Completion> m_completions;
+
+    // I/O pool, started on first use
+    std::mutex m_ioMutex;
+    std::condition_variable m_ioWake;
+    std::deque<std::pair<size_t, std::function<OpResult()> > > m_ioQueue;
+    std::vector<std::thread> m_ioThreads;
+    size_t m_ioIdle;
+    bool m_ioStop;
+};
+
+//------------------------------------------------------------------------------
+// Bench
+//------------------------------------------------------------------------------
+
+struct BenchOptions {
+    uint32_t runs;
+    uint32_t firmwareSize;    // Synthetic image size when no package is given
+    std::string port;         // Real unit to flash; simulated if empty
+    std::string resultPath;   // JSON result to write (optional)
+    std::string baselinePath; // JSON result of an earlier run to compare against (optional)
+    double threshold;         // Percent
+
+    BenchOptions()
+        : runs(BENCH_RUNS_DEFAULT), firmwareSize(BENCH_FIRMWARE_SIZE_DEFAULT),
+          threshold(BENCH_THRESHOLD_DEFAULT) {}
+};
+
+// Flash one unit options.runs times and report the spread of stage and total
+// times; false if a run fails or the result regresses against the baseline
+bool runBench(FirmwarePackage* pkg, const BenchOptions& options);
+
+struct SoakOptions {
+    uint32_t cycles;
+    uint32_t units;           // Simulated units per engine run
+    FaultPlan faults;
+
+    SoakOptions() : cycles(1000), units(SOAK_UNITS_DEFAULT) {}
+};
+
+// Flash simulated units options.cycles times with faults injected and report
+// the success rate and how quickly each fault class is detected and recovered
+bool runSoak(FirmwarePackage* pkg, const SoakOptions& options);
+
+struct ScaleOptions {
+    uint32_t maxUnits;        // Steps 1, 2, 4 ... up to this
+    ScheduleLimits limits;
+    std::string resultPath;   // JSON result to write (optional)
+
+    ScaleOptions() : maxUnits(SCALE_UNITS_DEFAULT) {}
+};
+
+// Flash 1, 2, 4 ... options.maxUnits simulated units at once and report how
+// throughput, per-device time, host CPU and context switches scale
+bool runScale(FirmwarePackage* pkg, const ScaleOptions& options);
+
+#endif // NT_FLASH_H
@@ -0,0 +1,161 @@
+/*
+ * NT Flash Tool - Logging, machine-readable output and progress display
+ *
+ * Copyright (c) 2024
+ */
+
+#include <chrono>
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// Globals
+//------------------------------------------------------------------------------
+
+bool g_verbose = false;
+bool g_dryRun = false;
+bool g_machineOutput = false;
+uint32_t g_bootTimeoutMs = 0;
+bool g_streamFirmware = false;
+bool g_compressWrites = true;
+bool g_simCompressedWrite = false;
+bool g_verifyWrites = false;
+bool g_simFlashDigest = false;
+
+thread_local const char* g_deviceTag = nullptr;
+thread_local const char* g_currentStage = "WRITE";
+thread_local const char* g_lastStatusStage = nullptr;
+thread_local const EventSink* g_eventSink = nullptr;
+thread_local const std::atomic<bool>* g_cancel = nullptr;
+
+//------------------------------------------------------------------------------
+// Logging
+//------------------------------------------------------------------------------
+
+void logInfo(const char* fmt, ...) {
+    if (g_machineOutput || g_eventSink) return;  // Suppress in machine mode
+    va_list args;
+    va_start(args, fmt);
+    if (g_deviceTag) printf("[%s] ", g_deviceTag);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+}
+
+void logVerbose(const char* fmt, ...) {
+    if (!g_verbose || g_machineOutput || g_eventSink) return;  // Suppress in machine mode
+    va_list args;
+    va_start(args, fmt);
+    printf("  ");
+    if (g_deviceTag) printf("[%s] ", g_deviceTag);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+}
+
+void logError(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if (g_eventSink) {
+        char message[512];
+        vsnprintf(message, sizeof(message), fmt, args);
+        g_eventSink->handler(g_eventSink->context, "ERROR", "", 0, message);
+    } else if (g_machineOutput) {
+        printf("ERROR:");
+        if (g_deviceTag) printf("[%s] ", g_deviceTag);
+        vprintf(fmt, args);
+        printf("\n");
+        fflush(stdout);
+    } else {
+        fprintf(stderr, "ERROR: ");
+        if (g_deviceTag) fprintf(stderr, "[%s] ", g_deviceTag);
+        vfprintf(stderr, fmt, args);
+        fprintf(stderr, "\n");
+        fflush(stderr);
+    }
+    va_end(args);
+}
+
+//------------------------------------------------------------------------------
+// Machine-readable output (for --machine flag)
+// Format: TYPE:STAGE:PERCENT:MESSAGE
+//------------------------------------------------------------------------------
+
+void machineStatus(const char* stage, int percent, const char* message) {
+    g_lastStatusStage = stage;
+    traceStatus(stage);
+    resourceStatus(stage);
+    if (g_eventSink) {
+        g_eventSink->handler(g_eventSink->context, "STATUS", stage, percent, message);
+        return;
+    }
+    if (!g_machineOutput) return;
+    if (g_deviceTag) {
+        printf("STATUS:%s:%d:[%s] %s\n", stage, percent, g_deviceTag, message);
+    } else {
+        printf("STATUS:%s:%d:%s\n", stage, percent, message);
+    }
+    fflush(stdout);
+}
+
+void machineProgress(const char* stage, int percent, const char* message) {
+    if (g_eventSink) {
+        g_eventSink->handler(g_eventSink->context, "PROGRESS", stage, percent, message);
+        return;
+    }
+    if (!g_machineOutput) return;
+    if (g_deviceTag) {
+        printf("PROGRESS:%s:%d:[%s] %s\n", stage, percent, g_deviceTag, message);
+    } else {
+        printf("PROGRESS:%s:%d:%s\n", stage, percent, message);
+    }
+    fflush(stdout);
+}
+
+// A finding about the run, not a stage: the stage, trace and progress stay put
+void machineWarning(const char* kind, const char* message) {
+    if (g_eventSink) {
+        g_eventSink->handler(g_eventSink->context, "WARNING", kind, 0, message);
+        return;
+    }
+    if (!g_machineOutput) return;
+    if (g_deviceTag) {
+        printf("WARNING:%s:[%s] %s\n", kind, g_deviceTag, message);
+    } else {
+        printf("WARNING:%s:%s\n", kind, message);
+    }
+    fflush(stdout);
+}
+
+//------------------------------------------------------------------------------
+// Progress Display
+//------------------------------------------------------------------------------
+
+void displayProgress(int percentage, int segmentIndex, int segmentCount) {
+    if (g_machineOutput || g_eventSink) {
+        char message[128];
+        snprintf(message, sizeof(message), "Segment %d/%d", segmentIndex, segmentCount);
+        machineProgress(g_currentStage, percentage, message);
+    } else if (!g_deviceTag) {  // Several devices would overwrite each other's line
+        printf("\r  Progress: (%d/%d) %d%%", segmentIndex, segmentCount, percentage);
+        fflush(stdout);
+        if (percentage >= 100) {
+            printf(" Done!\n");
+        }
+    }
+}
+
+bool flashCancelled() {
+    if (g_cancel && g_cancel->load()) {
+        logError("Cancelled");
+        return true;
+    }
+    return false;
+}
+
+double nowSeconds() {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,1608 @@
+/*
+ * NT Flash Tool - Firmware packages and flash sequences
+ *
+ * Copyright (c) 2024
+ */
+
+#include <algorithm>
+
+#include "nt_flash.h"
+
+// Embedded libraries
+#include "miniz.h"
+#include "miniz_zip.h"
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <limits.h>
+#endif
+
+//------------------------------------------------------------------------------
+// File Utilities
+//------------------------------------------------------------------------------
+
+// Load a local file into memory
+bool loadFile(const char* path, std::vector<uint8_t>& data) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        logError("Cannot open file: %s", path);
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data.resize(size);
+    size_t bytesRead = fread(data.data(), 1, size, f);
+    fclose(f);
+
+    if (bytesRead != (size_t)size) {
+        logError("Failed to read file: %s", path);
+        return false;
+    }
+
+    logVerbose("Loaded %s (%zu bytes)", path, data.size());
+    return true;
+}
+
+// Get the system temp directory (cross-platform)
+std::string absolutePath(const std::string& path) {
+#ifdef WIN32
+    char full[MAX_PATH];
+    return _fullpath(full, path.c_str(), MAX_PATH) ? std::string(full) : path;
+#else
+    char full[PATH_MAX];
+    return realpath(path.c_str(), full) ? std::string(full) : path;
+#endif
+}
+
+std::string getTempDir() {
+#ifdef WIN32
+    char tempPath[MAX_PATH];
+    DWORD len = GetTempPathA(MAX_PATH, tempPath);
+    if (len > 0 && len < MAX_PATH) {
+        return std::string(tempPath);
+    }
+    const char* userProfile = getenv("USERPROFILE");
+    if (userProfile) {
+        return std::string(userProfile) + "\\Downloads\\";
+    }
+    return ".\\";
+#else
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir && tmpdir[0]) {
+        std::string dir(tmpdir);
+        if (dir.back() != '/') dir += '/';
+        return dir;
+    }
+    return "/tmp/";
+#endif
+}
+
+// Write path.tmp, then replace path with it, so a reader sees the old file or
+// the new one and never a missing or partial one
+bool writeFileAtomic(const std::string& path, const std::string& data) {
+    std::string tempPath = path + ".tmp";
+    FILE* f = fopen(tempPath.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = fclose(f) == 0 && ok;
+#ifdef WIN32
+    ok = ok && MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    ok = ok && rename(tempPath.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok) {
+        remove(tempPath.c_str());
+    }
+    return ok;
+}
+
+// Save data to a temporary file
+std::string saveToTempFile(const std::vector<uint8_t>& data, const char* suffix) {
+#ifdef WIN32
+    char tempPath[MAX_PATH];
+    char tempFile[MAX_PATH];
+    GetTempPathA(MAX_PATH, tempPath);
+    GetTempFileNameA(tempPath, "ntf", 0, tempFile);
+    std::string path = std::string(tempFile) + suffix;
+#else
+    std::string path = getTempDir() + "nt_flash_XXXXXX" + suffix;
+    // Create unique file
+    char* pathBuf = strdup(path.c_str());
+    int fd = mkstemps(pathBuf, strlen(suffix));
+    if (fd < 0) {
+        free(pathBuf);
+        return "";
+    }
+    close(fd);
+    path = pathBuf;
+    free(pathBuf);
+#endif
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return "";
+    }
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+
+    return path;
+}
+
+//------------------------------------------------------------------------------
+// Flash Sequences
+//------------------------------------------------------------------------------
+
+// Split an image into runs of sectors that hold data. Sectors that are
+// entirely 0xFF are already in the erased state and need no write.
+std::vector<WriteRun> planSparseWrite(const std::vector<uint8_t>& image, uint32_t sectorSize) {
+    std::vector<WriteRun> runs;
+    for (size_t offset = 0; offset < image.size(); offset += sectorSize) {
+        planSparseSector(runs, offset, image.data() + offset, std::min((size_t)sectorSize, image.size() - offset));
+    }
+    return runs;
+}
+
+void planSparseSector(std::vector<WriteRun>& runs, size_t offset, const uint8_t* data, size_t size) {
+    bool blank = true;
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != 0xFF) {
+            blank = false;
+            break;
+        }
+    }
+    if (blank) {
+        return;
+    }
+    if (!runs.empty() && runs.back().offset + runs.back().size == offset) {
+        runs.back().size += size;
+    } else {
+        WriteRun run = { offset, size };
+        runs.push_back(run);
+    }
+}
+
+static std::string formatArg(const char* fmt, uint32_t value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), fmt, value);
+    return buf;
+}
+
+static const char* opName(FlashScriptOp::Kind kind) {
+    switch (kind) {
+        case FlashScriptOp::kConfigure: return "configure";
+        case FlashScriptOp::kErase: return "erase";
+        case FlashScriptOp::kWrite: return "write";
+    }
+    return "?";
+}
+
+// Built-in disting NT sequence, matching the official flashing script:
+// configure FlexSPI NOR, erase FCB area plus image, create the FCB, write.
+void defaultFlashScript(FlashScript& script) {
+    script.clear();
+
+    FlashScriptOp op;
+    op.kind = FlashScriptOp::kConfigure;
+    op.option = FLEXSPI_NOR_CONFIG;
+    script.push_back(op);
+
+    // The FCB is at 0x60000000, firmware starts at 0x60001000 (0x1000 offset)
+    op = FlashScriptOp();
+    op.kind = FlashScriptOp::kErase;
+    op.address = FLASH_BASE;
+    op.size = 0x1000;
+    op.sizeFromImage = true;
+    script.push_back(op);
+
+    op = FlashScriptOp();
+    op.kind = FlashScriptOp::kConfigure;
+    op.option = FCB_CONFIG;
+    op.stage = "FCB";
+    op.percent = 60;
+    op.message = "Creating Flash Configuration Block";
+    script.push_back(op);
+
+    op = FlashScriptOp();
+    op.kind = FlashScriptOp::kWrite;
+    op.address = FIRMWARE_ADDR;
+    script.push_back(op);
+}
+
+// Parse a number given as JSON number or string ("0x1000", "4096")
+// Decimal or 0x hex text; false unless all of it is a number that fits 32 bits
+static bool parseScriptText(const char* text, uint32_t& value) {
+    if (!text[0] || text[0] == '-') {
+        return false;
+    }
+    char* end;
+    unsigned long long parsed = strtoull(text, &end, 0);
+    value = (uint32_t)parsed;
+    return *end == '\0' && parsed <= 0xFFFFFFFFull;
+}
+
+static bool parseScriptNumber(cJSON* item, uint32_t& value) {
+    if (cJSON_IsNumber(item)) {
+        value = (uint32_t)item->valuedouble;
+        return item->valuedouble >= 0 && item->valuedouble <= 4294967295.0;
+    }
+    return cJSON_IsString(item) && parseScriptText(item->valuestring, value);
+}
+
+// Parse the manifest's "flash_sequence" array
+bool parseFlashScript(cJSON* sequence, FlashScript& script) {
+    script.clear();
+    if (!cJSON_IsArray(sequence)) {
+        logError("flash_sequence must be an array");
+        return false;
+    }
+
+    int index = 0;
+    for (cJSON* item = sequence->child; item; item = item->next, index++) {
+        cJSON* opItem = cJSON_GetObjectItem(item, "op");
+        if (!cJSON_IsString(opItem)) {
+            logError("flash_sequence[%d]: missing \"op\"", index);
+            return false;
+        }
+
+        FlashScriptOp op;
+        std::string name = opItem->valuestring;
+        bool ok = true;
+        if (name == "configure") {
+            op.kind = FlashScriptOp::kConfigure;
+            cJSON* memId = cJSON_GetObjectItem(item, "memory_id");
+            ok = (!memId || parseScriptNumber(memId, op.memoryId)) &&
+                 parseScriptNumber(cJSON_GetObjectItem(item, "option"), op.option);
+        } else if (name == "erase") {
+            op.kind = FlashScriptOp::kErase;
+            ok = parseScriptNumber(cJSON_GetObjectItem(item, "address"), op.address);
+            cJSON* size = cJSON_GetObjectItem(item, "size");
+            if (ok && cJSON_IsString(size) && strncmp(size->valuestring, "image", 5) == 0) {
+                // "image" or "image+<bytes>"
+                const char* extra = size->valuestring + 5;
+                op.sizeFromImage = true;
+                if (*extra == '+') {
+                    ok = parseScriptText(extra + 1, op.size);
+                } else {
+                    ok = *extra == '\0';
+                }
+            } else if (ok) {
+                ok = parseScriptNumber(size, op.size);
+            }
+        } else if (name == "write") {
+            op.kind = FlashScriptOp::kWrite;
+            ok = parseScriptNumber(cJSON_GetObjectItem(item, "address"), op.address);
+        } else {
+            logError("flash_sequence[%d]: unknown op \"%s\"", index, name.c_str());
+            return false;
+        }
+        if (!ok) {
+            logError("flash_sequence[%d]: invalid or missing arguments for \"%s\"", index, name.c_str());
+            return false;
+        }
+
+        cJSON* stage = cJSON_GetObjectItem(item, "stage");
+        cJSON* percent = cJSON_GetObjectItem(item, "percent");
+        cJSON* message = cJSON_GetObjectItem(item, "message");
+        if (cJSON_IsString(stage)) op.stage = stage->valuestring;
+        if (cJSON_IsNumber(percent)) op.percent = percent->valueint;
+        if (cJSON_IsString(message)) op.message = message->valuestring;
+
+        script.push_back(op);
+    }
+    return true;
+}
+
+// Check a sequence against the image before any device is touched
+bool validateFlashScript(const FlashScript& script, uint32_t imageSize) {
+    bool configured = false;
+    int writes = 0;
+    std::vector<WriteRun> erased;
+    uint32_t writeStart = 0, writeEnd = 0;
+
+    for (size_t i = 0; i < script.size(); i++) {
+        const FlashScriptOp& op = script[i];
+        if (op.kind == FlashScriptOp::kConfigure) {
+            configured = true;
+            continue;
+        }
+        if (!configured) {
+            logError("Flash sequence: %s before any configure", opName(op.kind));
+            return false;
+        }
+
+        uint64_t fullSize = (op.kind == FlashScriptOp::kErase) ? op.eraseSize(imageSize) : imageSize;
+        if (fullSize > 0xFFFFFFFFull) {
+            logError("Flash sequence: erase size image+0x%X overflows with a %u-byte image", op.size, imageSize);
+            return false;
+        }
+        uint32_t size = (uint32_t)fullSize;
+        if (op.address < FLASH_BASE || (uint64_t)op.address + size > (uint64_t)FLASH_BASE + FLASH_SIZE_DEFAULT) {
+            logError("Flash sequence: %s at 0x%08X (%u bytes) is outside flash", opName(op.kind), op.address, size);
+            return false;
+        }
+
+        if (op.kind == FlashScriptOp::kErase) {
+            if (writes && op.address < writeEnd && op.address + size > writeStart) {
+                logError("Flash sequence: erase at 0x%08X overwrites the image", op.address);
+                return false;
+            }
+            WriteRun range = { op.address, size };
+            erased.push_back(range);
+        } else {
+            if (++writes > 1) {
+                logError("Flash sequence: image is written more than once");
+                return false;
+            }
+            writeStart = op.address;
+            writeEnd = op.address + imageSize;
+        }
+    }
+
+    if (writes == 0) {
+        logError("Flash sequence: no write op");
+        return false;
+    }
+
+    // Every byte of the image must lie in an erased range
+    uint32_t covered = writeStart;
+    bool progress = true;
+    while (covered < writeEnd && progress) {
+        progress = false;
+        for (size_t i = 0; i < erased.size(); i++) {
+            if (erased[i].offset <= covered && erased[i].offset + erased[i].size > covered) {
+                covered = (uint32_t)(erased[i].offset + erased[i].size);
+                progress = true;
+            }
+        }
+    }
+    if (covered < writeEnd) {
+        logError("Flash sequence: image byte 0x%08X is written without being erased", covered);
+        return false;
+    }
+    return true;
+}
+
+// Cut round-trips: drop a configure that repeats the one just applied, and
+// within each stretch between configures issue erases first, merging
+// overlapping or adjacent ranges. Erases never overlap the image (checked
+// by validateFlashScript), so moving them ahead of the write is safe.
+void optimizeFlashScript(FlashScript& script, uint32_t imageSize) {
+    FlashScript out;
+    size_t segment = 0;  // First op after the last configure in out
+
+    for (size_t i = 0; i < script.size(); i++) {
+        const FlashScriptOp& op = script[i];
+        if (op.kind == FlashScriptOp::kConfigure) {
+            if (!out.empty() && out.back().kind == FlashScriptOp::kConfigure &&
+                out.back().memoryId == op.memoryId && out.back().option == op.option) {
+                continue;
+            }
+            out.push_back(op);
+            segment = out.size();
+            continue;
+        }
+
+        if (op.kind == FlashScriptOp::kWrite) {
+            out.push_back(op);
+            continue;
+        }
+
+        // Merge into an earlier erase of this segment, or insert ahead of its write
+        FlashScriptOp erase = op;
+        erase.size = (uint32_t)op.eraseSize(imageSize);  // Validated to fit
+        erase.sizeFromImage = false;
+        size_t insertAt = out.size();
+        bool merged = false;
+        for (size_t j = segment; j < out.size(); j++) {
+            FlashScriptOp& prev = out[j];
+            if (prev.kind == FlashScriptOp::kWrite) {
+                insertAt = std::min(insertAt, j);
+                continue;
+            }
+            uint32_t prevEnd = prev.address + prev.size;
+            uint32_t end = erase.address + erase.size;
+            if (erase.address <= prevEnd && end >= prev.address) {
+                prev.address = std::min(prev.address, erase.address);
+                prev.size = std::max(prevEnd, end) - prev.address;
+                merged = true;
+                break;
+            }
+        }
+        if (!merged) {
+            out.insert(out.begin() + insertAt, erase);
+        }
+    }
+
+    script.swap(out);
+}
+
+static FlashStep commandStep(const char* name, const std::string& a1, const std::string& a2,
+                             const std::string& a3 = "", const std::string& a4 = "") {
+    FlashStep step;
+    step.args.push_back(name);
+    step.args.push_back(a1);
+    step.args.push_back(a2);
+    if (!a3.empty()) step.args.push_back(a3);
+    if (!a4.empty()) step.args.push_back(a4);
+    return step;
+}
+
+static void setStage(FlashStep& step, const FlashScriptOp& op, const char* stage, int percent,
+                     const char* message) {
+    step.stage = op.stage.empty() ? stage : op.stage.c_str();
+    step.percent = op.percent >= 0 ? op.percent : percent;
+    step.message = op.message.empty() ? message : op.message.c_str();
+}
+
+// Lower a validated sequence to flashloader commands. A configure becomes
+// fill-memory + configure-memory, except that the fill is skipped when the
+// configuration word already holds the value. The write becomes the non-blank
+// parts of the image. Steps point into the script for stage names, so the
+// script must outlive the program.
+//
+// Skipping the fill assumes CONFIG_ADDR still holds the word the program
+// last filled. That holds as long as a program runs from its first step in
+// one flashloader session (a retry restarts at step 0), no step but
+// fill-memory writes RAM (erases and writes are validated to lie in flash),
+// and configure-memory only reads the word.
+void compileFlashProgram(const FlashScript& script, const std::vector<uint8_t>& firmware,
+                         FlashProgram& program) {
+    compileFlashProgram(script, (uint32_t)firmware.size(), planSparseWrite(firmware, FLASH_SECTOR_SIZE_DEFAULT),
+                        program);
+}
+
+// runs is the image's sparse write plan (see planSparseWrite)
+void compileFlashProgram(const FlashScript& script, uint32_t imageSize, const std::vector<WriteRun>& runs,
+                         FlashProgram& program) {
+    program = FlashProgram();
+    bool haveConfigWord = false;
+    uint32_t configWord = 0;
+    bool firstConfigure = true;
+
+    for (size_t i = 0; i < script.size(); i++) {
+        const FlashScriptOp& op = script[i];
+        size_t first = program.steps.size();
+
+        if (op.kind == FlashScriptOp::kConfigure) {
+            if (!haveConfigWord || configWord != op.option) {
+                program.steps.push_back(commandStep("fill-memory", formatArg("0x%X", CONFIG_ADDR), "4",
+                                                    formatArg("0x%X", op.option), "word"));
+                haveConfigWord = true;
+                configWord = op.option;
+            }
+            program.steps.push_back(commandStep("configure-memory", formatArg("%u", op.memoryId),
+                                                formatArg("0x%X", CONFIG_ADDR)));
+            setStage(program.steps[first], op, "CONFIGURE", 50, "Configuring flash memory");
+            if (firstConfigure) {
+                program.steps[first].detail = "Configuring FlexSPI NOR...";
+            } else if (op.stage == "FCB") {
+                program.steps[first].detail = "Creating Flash Configuration Block...";
+            }
+            firstConfigure = false;
+        } else if (op.kind == FlashScriptOp::kErase) {
+            uint32_t size = (uint32_t)op.eraseSize(imageSize);  // Validated to fit
+            program.steps.push_back(commandStep("flash-erase-region", formatArg("0x%X", op.address),
+                                                formatArg("%u", size), "0"));
+            setStage(program.steps[first], op, "ERASE", 55, "Erasing flash region");
+            program.steps[first].detail = "Erasing flash region " + formatArg("0x%08X", op.address) +
+                                          ", size " + formatArg("%u", size) + " bytes...";
+        } else {
+            for (size_t r = 0; r < runs.size(); r++) {
+                for (size_t done = 0; done < runs[r].size; done += WRITE_CHUNK_SIZE) {
+                    FlashStep write;
+                    write.offset = runs[r].offset + done;
+                    write.size = std::min((size_t)WRITE_CHUNK_SIZE, runs[r].size - done);
+                    write.address = op.address + (uint32_t)write.offset;
+                    program.writeBytes += write.size;
+                    program.steps.push_back(write);
+                }
+            }
+            program.skippedBytes = imageSize - program.writeBytes;
+            if (program.steps.size() > first) {
+                setStage(program.steps[first], op, "WRITE", 65, "Writing firmware");
+                program.steps[first].info = "[7/7] Writing firmware (" +
+                                            formatArg("%u", imageSize) + " bytes)...";
+            }
+        }
+
+        if (i == 0 && !program.steps.empty()) {
+            program.steps[0].info = "[6/7] Configuring flash and erasing...";
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Firmware Hash
+//------------------------------------------------------------------------------
+
+// SHA-256 (FIPS 180-4), used to identify the image in the journal
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256Block(uint32_t state[8], const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+Sha256::Sha256() : m_used(0), m_size(0) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(m_state, initial, sizeof(m_state));
+}
+
+void Sha256::update(const uint8_t* data, size_t size) {
+    m_size += size;
+    if (m_used) {
+        size_t take = std::min(size, sizeof(m_block) - m_used);
+        memcpy(m_block + m_used, data, take);
+        m_used += take;
+        data += take;
+        size -= take;
+        if (m_used < sizeof(m_block)) {
+            return;
+        }
+        sha256Block(m_state, m_block);
+        m_used = 0;
+    }
+    size_t full = size - size % 64;
+    for (size_t i = 0; i < full; i += 64) {
+        sha256Block(m_state, data + i);
+    }
+    m_used = size - full;
+    if (m_used) memcpy(m_block, data + full, m_used);
+}
+
+// Big-endian digest bytes
+void Sha256::digest(uint8_t out[32]) {
+    // Final block(s): remaining bytes, 0x80, zero padding, bit length
+    uint8_t tail[128];
+    memset(tail, 0, sizeof(tail));
+    if (m_used) memcpy(tail, m_block, m_used);
+    tail[m_used] = 0x80;
+    size_t tailSize = m_used < 56 ? 64 : 128;
+    uint64_t bits = m_size * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tailSize - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    for (size_t i = 0; i < tailSize; i += 64) {
+        sha256Block(m_state, tail + i);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        for (int b = 0; b < 4; b++) {
+            out[i * 4 + b] = (uint8_t)(m_state[i] >> (24 - b * 8));
+        }
+    }
+}
+
+// Lower-case hex digest
+std::string Sha256::hexDigest() {
+    uint8_t bytes[32];
+    digest(bytes);
+    char hex[65];
+    for (int i = 0; i < 32; i++) {
+        snprintf(hex + i * 2, 3, "%02x", bytes[i]);
+    }
+    return std::string(hex, 64);
+}
+
+std::string sha256Hex(const uint8_t* data, size_t size) {
+    Sha256 hash;
+    hash.update(data, size);
+    return hash.hexDigest();
+}
+
+// Sector CRCs of an in-memory image, for --verify and the extended manifest
+static void digestSectors(const std::vector<uint8_t>& image, std::vector<uint8_t>& crcs) {
+    crcs.clear();
+    for (size_t offset = 0; offset < image.size(); offset += FLASH_SECTOR_SIZE_DEFAULT) {
+        size_t size = std::min((size_t)FLASH_SECTOR_SIZE_DEFAULT, image.size() - offset);
+        appendSectorDigest(crcs, kDigestCrc32, &image[offset], size, FLASH_SECTOR_SIZE_DEFAULT);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Image Stream
+//------------------------------------------------------------------------------
+
+struct ImageStreamState {
+    FILE* file;
+    tinfl_decompressor inflater;
+    tinfl_status status;
+    std::vector<uint8_t> dictionary;  // Circular, TINFL_LZ_DICT_SIZE
+    std::vector<uint8_t> input;
+    size_t inputPos;
+    size_t inputEnd;
+    uint64_t inputLeft;       // Compressed bytes not yet read from the file
+    size_t pendingOfs;        // Inflated bytes in the dictionary not yet copied out
+    size_t pending;
+    uint64_t position;        // Image offset of the next byte copied out
+    std::vector<uint8_t> window;
+};
+
+// Find an entry's data in a package: the central directory gives its local
+// header, and the data follows the header's name and extra fields
+static bool locateEntry(const std::string& zipPath, const std::string& name, PackageEntry& entry,
+                        uint32_t& size) {
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+    if (!mz_zip_reader_init_file(&zip, zipPath.c_str(), 0)) {
+        logError("Failed to open ZIP archive: %s", zipPath.c_str());
+        return false;
+    }
+    int fileIndex = mz_zip_reader_locate_file(&zip, name.c_str(), NULL, 0);
+    mz_zip_archive_file_stat stat;
+    bool found = fileIndex >= 0 && mz_zip_reader_file_stat(&zip, fileIndex, &stat);
+    mz_zip_reader_end(&zip);
+    if (!found) {
+        logError("File not found in ZIP: %s", name.c_str());
+        return false;
+    }
+    if (stat.m_is_encrypted || (stat.m_method != 0 && stat.m_method != MZ_DEFLATED)) {
+        logError("Cannot stream %s: unsupported compression", name.c_str());
+        return false;
+    }
+
+    uint8_t header[30];
+    FILE* f = fopen(zipPath.c_str(), "rb");
+    bool ok = f && fseek(f, (long)stat.m_local_header_ofs, SEEK_SET) == 0 &&
+              fread(header, 1, sizeof(header), f) == sizeof(header) && memcmp(header, "PK\x03\x04", 4) == 0;
+    if (f) fclose(f);
+    if (!ok) {
+        logError("Corrupt ZIP entry: %s", name.c_str());
+        return false;
+    }
+
+    entry.zipPath = zipPath;
+    entry.name = name;
+    entry.crc = stat.m_crc32;
+    entry.headerOffset = stat.m_local_header_ofs;
+    entry.dataOffset = stat.m_local_header_ofs + sizeof(header) + (header[26] | header[27] << 8) +
+                       (header[28] | header[29] << 8);
+    entry.compressedSize = stat.m_comp_size;
+    entry.deflated = stat.m_method == MZ_DEFLATED;
+    size = (uint32_t)stat.m_uncomp_size;
+    return true;
+}
+
+// Start again at a checkpoint, or at the start of the image
+static bool resume(ImageStreamState& state, const PackageEntry& entry, const InflateCheckpoint* checkpoint) {
+    uint64_t input = 0;
+    state.position = 0;
+    if (checkpoint) {
+        input = checkpoint->input;
+        state.position = checkpoint->output;
+        memcpy(&state.inflater, checkpoint->inflater.data(), sizeof(state.inflater));
+        state.dictionary = checkpoint->dictionary;
+    } else {
+        tinfl_init(&state.inflater);
+    }
+    state.status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    state.inputPos = 0;
+    state.inputEnd = 0;
+    state.inputLeft = entry.compressedSize - input;
+    state.pendingOfs = 0;
+    state.pending = 0;
+    return fseek(state.file, (long)(entry.dataOffset + input), SEEK_SET) == 0;
+}
+
+ImageStream::~ImageStream() {
+    close();
+}
+
+// Open the package and start at the first byte of the image. The entry is
+// located again, so a package replaced since it was loaded is refused.
+bool ImageStream::open() {
+    const PackageEntry& entry = m_pkg->stream;
+    PackageEntry current;
+    uint32_t size;
+    if (!locateEntry(entry.zipPath, entry.name, current, size)) {
+        return false;
+    }
+    if (size != m_pkg->firmwareSize || current.crc != entry.crc || current.dataOffset != entry.dataOffset ||
+        current.compressedSize != entry.compressedSize) {
+        logError("Firmware package changed since it was loaded: %s", entry.zipPath.c_str());
+        return false;
+    }
+
+    FILE* file = fopen(entry.zipPath.c_str(), "rb");
+    if (!file) {
+        logError("Cannot open file: %s", entry.zipPath.c_str());
+        return false;
+    }
+    m_state = new ImageStreamState();
+    m_state->file = file;
+    m_state->dictionary.resize(TINFL_LZ_DICT_SIZE);
+    m_state->input.resize(STREAM_INPUT_SIZE);
+    if (!resume(*m_state, entry, nullptr)) {
+        logError("Failed to read firmware: %s", entry.zipPath.c_str());
+        close();
+        return false;
+    }
+    return true;
+}
+
+void ImageStream::close() {
+    if (!m_state) {
+        return;
+    }
+    fclose(m_state->file);
+    delete m_state;
+    m_state = nullptr;
+}
+
+// Move to offset: directly in a stored entry; in a deflated one by inflating
+// forward, first jumping to the nearest checkpoint if that gets closer
+bool ImageStream::seek(size_t offset) {
+    ImageStreamState& state = *m_state;
+    const PackageEntry& entry = m_pkg->stream;
+    if (!entry.deflated) {
+        state.position = offset;
+        return fseek(state.file, (long)(entry.dataOffset + offset), SEEK_SET) == 0;
+    }
+
+    const InflateCheckpoint* nearest = nullptr;
+    for (size_t i = 0; i < entry.index.size() && entry.index[i].output <= offset; i++) {
+        nearest = &entry.index[i];
+    }
+    if (offset < state.position || (nearest && nearest->output > state.position)) {
+        if (!resume(state, entry, nearest)) {
+            return false;
+        }
+    }
+    return inflateTo(nullptr, (size_t)(offset - state.position));
+}
+
+// Copy the next size bytes of a deflated image to out (nullptr: skip them).
+// While an index is being built, a checkpoint is taken every
+// INFLATE_INDEX_SPAN bytes, between calls to the inflater.
+bool ImageStream::inflateTo(uint8_t* out, size_t size) {
+    ImageStreamState& state = *m_state;
+    while (size) {
+        if (state.pending) {
+            size_t take = std::min(state.pending, size);
+            if (out) {
+                memcpy(out, state.dictionary.data() + state.pendingOfs, take);
+                out += take;
+            }
+            state.pendingOfs += take;
+            state.pending -= take;
+            state.position += take;
+            size -= take;
+            continue;
+        }
+        if (state.status == TINFL_STATUS_DONE) {
+            break;
+        }
+
+        uint64_t due = (m_build && !m_build->empty() ? m_build->back().output : 0) + INFLATE_INDEX_SPAN;
+        if (m_build && state.position >= due) {
+            InflateCheckpoint checkpoint;
+            checkpoint.output = state.position;
+            checkpoint.input = m_pkg->stream.compressedSize - state.inputLeft - (state.inputEnd - state.inputPos);
+            checkpoint.inflater.assign((const uint8_t*)&state.inflater, (const uint8_t*)(&state.inflater + 1));
+            checkpoint.dictionary = state.dictionary;
+            m_build->push_back(checkpoint);
+        }
+
+        if (state.inputPos == state.inputEnd && state.inputLeft) {
+            size_t want = (size_t)std::min((uint64_t)state.input.size(), state.inputLeft);
+            if (fread(state.input.data(), 1, want, state.file) != want) {
+                break;
+            }
+            state.inputPos = 0;
+            state.inputEnd = want;
+            state.inputLeft -= want;
+        }
+        size_t inBytes = state.inputEnd - state.inputPos;
+        size_t dictOfs = (size_t)(state.position % TINFL_LZ_DICT_SIZE);
+        size_t outBytes = TINFL_LZ_DICT_SIZE - dictOfs;
+        state.status = tinfl_decompress(&state.inflater, state.input.data() + state.inputPos, &inBytes,
+                                        state.dictionary.data(), state.dictionary.data() + dictOfs, &outBytes,
+                                        state.inputLeft ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+        state.inputPos += inBytes;
+        state.pendingOfs = dictOfs;
+        state.pending = outBytes;
+        if (state.status < 0) {
+            break;
+        }
+    }
+    if (size) {
+        logError("Failed to inflate firmware at offset 0x%llX", (unsigned long long)state.position);
+        return false;
+    }
+    return true;
+}
+
+const uint8_t* ImageStream::read(size_t offset, size_t size) {
+    if (offset + size > m_pkg->firmwareSize) {
+        logError("Read past the end of the firmware image (0x%zX, %zu bytes)", offset, size);
+        return nullptr;
+    }
+    if (m_pkg->stream.zipPath.empty()) {
+        return m_pkg->firmware.data() + offset;
+    }
+    if (!m_state && !open()) {
+        return nullptr;
+    }
+
+    ImageStreamState& state = *m_state;
+    if (state.window.size() < size) {
+        state.window.resize(size);
+    }
+    bool ok;
+    if (m_pkg->stream.deflated) {
+        ok = seek(offset) && inflateTo(state.window.data(), size);
+    } else {
+        ok = seek(offset) && fread(state.window.data(), 1, size, state.file) == size;
+        state.position += size;
+        if (!ok) {
+            logError("Failed to read firmware at offset 0x%zX", offset);
+        }
+    }
+    if (!ok) {
+        close();
+        return nullptr;
+    }
+    return state.window.data();
+}
+
+//------------------------------------------------------------------------------
+// Inflate Index Cache
+//------------------------------------------------------------------------------
+
+// Native layout, for the host that wrote it: this header, then per
+// checkpoint its two offsets, the inflater and the dictionary
+struct IndexFileHeader {
+    char magic[8];
+    uint32_t crc;             // Of the entry the index belongs to
+    uint32_t size;
+    uint64_t compressedSize;
+    uint32_t inflaterSize;    // sizeof(tinfl_decompressor) of the writer
+    uint32_t span;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+static const char INDEX_MAGIC[8] = { 'N', 'T', 'F', 'I', 'N', 'D', 'X', '1' };
+
+static void indexFileHeader(const FirmwarePackage* pkg, uint32_t count, IndexFileHeader& header) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.crc = pkg->stream.crc;
+    header.size = pkg->firmwareSize;
+    header.compressedSize = pkg->stream.compressedSize;
+    header.inflaterSize = (uint32_t)sizeof(tinfl_decompressor);
+    header.span = INFLATE_INDEX_SPAN;
+    header.count = count;
+}
+
+// False if there is no index for this entry at path
+static bool readInflateIndex(const char* path, const FirmwarePackage* pkg, InflateIndex& index) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    IndexFileHeader header;
+    IndexFileHeader expected;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1;
+    indexFileHeader(pkg, ok ? header.count : 0, expected);
+    ok = ok && memcmp(&header, &expected, sizeof(header)) == 0;
+
+    index.clear();
+    for (uint32_t i = 0; ok && i < header.count; i++) {
+        InflateCheckpoint checkpoint;
+        checkpoint.inflater.resize(sizeof(tinfl_decompressor));
+        checkpoint.dictionary.resize(TINFL_LZ_DICT_SIZE);
+        ok = fread(&checkpoint.output, sizeof(checkpoint.output), 1, f) == 1 &&
+             fread(&checkpoint.input, sizeof(checkpoint.input), 1, f) == 1 &&
+             fread(checkpoint.inflater.data(), checkpoint.inflater.size(), 1, f) == 1 &&
+             fread(checkpoint.dictionary.data(), checkpoint.dictionary.size(), 1, f) == 1 &&
+             checkpoint.output <= pkg->firmwareSize && checkpoint.input <= pkg->stream.compressedSize;
+        index.push_back(checkpoint);
+    }
+    fclose(f);
+    if (!ok) {
+        index.clear();
+        logVerbose("Ignoring stale inflate index: %s", path);
+    }
+    return ok;
+}
+
+static void writeInflateIndex(const char* path, const FirmwarePackage* pkg, const InflateIndex& index) {
+    IndexFileHeader header;
+    indexFileHeader(pkg, (uint32_t)index.size(), header);
+    FILE* f = fopen(path, "wb");
+    bool ok = f && fwrite(&header, sizeof(header), 1, f) == 1;
+    for (size_t i = 0; ok && i < index.size(); i++) {
+        const InflateCheckpoint& checkpoint = index[i];
+        ok = fwrite(&checkpoint.output, sizeof(checkpoint.output), 1, f) == 1 &&
+             fwrite(&checkpoint.input, sizeof(checkpoint.input), 1, f) == 1 &&
+             fwrite(checkpoint.inflater.data(), checkpoint.inflater.size(), 1, f) == 1 &&
+             fwrite(checkpoint.dictionary.data(), checkpoint.dictionary.size(), 1, f) == 1;
+    }
+    if (f) ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        remove(path);
+        logVerbose("Failed to cache inflate index: %s", path);
+        return;
+    }
+    logVerbose("Inflate index cached: %s (%zu checkpoints)", path, index.size());
+}
+
+//------------------------------------------------------------------------------
+// Firmware Package Handling
+//------------------------------------------------------------------------------
+
+// Deflated entry of an archive held in memory, inflated in place by
+// inflateBuffer(); false sends the caller to miniz
+static bool inflateInMemory(const std::vector<uint8_t>& zipData, const mz_zip_archive_file_stat& stat,
+                            std::vector<uint8_t>& outData) {
+    if (stat.m_method != MZ_DEFLATED || (stat.m_bit_flag & 1) || stat.m_local_header_ofs + 30 > zipData.size()) {
+        return false;
+    }
+    const uint8_t* header = zipData.data() + stat.m_local_header_ofs;
+    if (header[0] != 'P' || header[1] != 'K' || header[2] != 3 || header[3] != 4) {
+        return false;
+    }
+    uint64_t dataOffset = stat.m_local_header_ofs + 30 + (header[26] | header[27] << 8) + (header[28] | header[29] << 8);
+    if (dataOffset + stat.m_comp_size > zipData.size()) {
+        return false;
+    }
+    outData.resize((size_t)stat.m_uncomp_size);
+    return inflateBuffer(zipData.data() + dataOffset, (size_t)stat.m_comp_size, outData.data(), outData.size()) &&
+           mz_crc32(MZ_CRC32_INIT, outData.data(), outData.size()) == stat.m_crc32;
+}
+
+// zipData, when the archive was opened from memory, allows the fast inflater
+static bool extractFromArchive(mz_zip_archive& zip, const char* filename, std::vector<uint8_t>& outData,
+                               const std::vector<uint8_t>* zipData = nullptr) {
+    int fileIndex = mz_zip_reader_locate_file(&zip, filename, NULL, 0);
+    if (fileIndex < 0) {
+        logError("File not found in ZIP: %s", filename);
+        return false;
+    }
+
+    mz_zip_archive_file_stat stat;
+    if (!mz_zip_reader_file_stat(&zip, fileIndex, &stat)) {
+        logError("Failed to get file info: %s", filename);
+        return false;
+    }
+
+    if (zipData && inflateInMemory(*zipData, stat, outData)) {
+        logVerbose("Extracted %s (%zu bytes)", filename, outData.size());
+        return true;
+    }
+
+    outData.resize((size_t)stat.m_uncomp_size);
+    if (!mz_zip_reader_extract_to_mem(&zip, fileIndex, outData.data(), outData.size(), 0)) {
+        logError("Failed to extract file: %s", filename);
+        return false;
+    }
+
+    logVerbose("Extracted %s (%zu bytes)", filename, outData.size());
+    return true;
+}
+
+// Extract a file from a ZIP archive in memory
+bool extractFileFromZip(const std::vector<uint8_t>& zipData,
+                        const char* filename,
+                        std::vector<uint8_t>& outData) {
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+
+    if (!mz_zip_reader_init_mem(&zip, zipData.data(), zipData.size(), 0)) {
+        logError("Failed to open ZIP archive");
+        return false;
+    }
+
+    bool ok = extractFromArchive(zip, filename, outData, &zipData);
+    mz_zip_reader_end(&zip);
+    return ok;
+}
+
+// Optional number of an image entry: absent is fine, present must parse
+static bool parseImageField(cJSON* item, int index, const char* key, uint32_t field, uint32_t& value,
+                            ManifestImage& image) {
+    cJSON* number = cJSON_GetObjectItem(item, key);
+    if (!number) {
+        return true;
+    }
+    if (!parseScriptNumber(number, value)) {
+        logError("images[%d]: invalid \"%s\"", index, key);
+        return false;
+    }
+    image.fields |= field;
+    return true;
+}
+
+// Parse the manifest's "images" array (extended schema)
+static bool parseManifestImages(cJSON* list, std::vector<ManifestImage>& images) {
+    images.clear();
+    if (!cJSON_IsArray(list)) {
+        logError("images must be an array");
+        return false;
+    }
+
+    int index = 0;
+    for (cJSON* item = list->child; item; item = item->next, index++) {
+        ManifestImage image;
+        cJSON* name = cJSON_GetObjectItem(item, "name");
+        if (!cJSON_IsString(name)) {
+            logError("images[%d]: missing \"name\"", index);
+            return false;
+        }
+        image.name = name->valuestring;
+
+        if (!parseImageField(item, index, "load_address", kImageLoadAddress, image.loadAddress, image) ||
+            !parseImageField(item, index, "size", kImageSize, image.size, image) ||
+            !parseImageField(item, index, "compressed_size", kImageCompressedSize, image.compressedSize, image) ||
+            !parseImageField(item, index, "crc32", kImageCrc32, image.crc, image)) {
+            return false;
+        }
+
+        cJSON* region = cJSON_GetObjectItem(item, "region");
+        if (region) {
+            if (!parseScriptNumber(cJSON_GetObjectItem(region, "address"), image.regionAddress) ||
+                !parseScriptNumber(cJSON_GetObjectItem(region, "size"), image.regionSize) || !image.regionSize) {
+                logError("images[%d]: invalid \"region\"", index);
+                return false;
+            }
+            image.fields |= kImageRegion;
+        }
+
+        cJSON* sha256 = cJSON_GetObjectItem(item, "sha256");
+        if (sha256) {
+            const char* hex = cJSON_IsString(sha256) ? sha256->valuestring : "";
+            bool ok = strlen(hex) == 64;
+            for (int i = 0; ok && i < 64; i++) {
+                ok = isxdigit((unsigned char)hex[i]) != 0;
+                image.sha256 += (char)tolower((unsigned char)hex[i]);
+            }
+            if (!ok) {
+                logError("images[%d]: invalid \"sha256\"", index);
+                return false;
+            }
+        }
+
+        cJSON* sectors = cJSON_GetObjectItem(item, "sector_crc32");
+        if (sectors) {
+            bool ok = cJSON_IsArray(sectors);
+            for (cJSON* crc = ok ? sectors->child : nullptr; ok && crc; crc = crc->next) {
+                uint32_t value;
+                ok = parseScriptNumber(crc, value);
+                for (int i = 0; i < 4; i++) {
+                    image.sectorCrcs.push_back((uint8_t)(value >> (i * 8)));
+                }
+            }
+            if (!ok) {
+                logError("images[%d]: invalid \"sector_crc32\"", index);
+                return false;
+            }
+        }
+
+        images.push_back(image);
+    }
+    return true;
+}
+
+// Parse MANIFEST.json from firmware package
+bool parseManifest(const std::vector<uint8_t>& jsonData, std::string& firmwarePath,
+                   FlashScript& script, std::vector<ManifestImage>* images) {
+    std::string jsonStr(jsonData.begin(), jsonData.end());
+    cJSON* root = cJSON_Parse(jsonStr.c_str());
+    if (!root) {
+        logError("Failed to parse MANIFEST.json");
+        return false;
+    }
+
+    cJSON* processor = cJSON_GetObjectItem(root, "processor");
+    if (processor && processor->valuestring && strcmp(processor->valuestring, "MIMXRT1060") != 0) {
+        logError("Unsupported processor: %s (expected MIMXRT1060)", processor->valuestring);
+        cJSON_Delete(root);
+        return false;
+    }
+
+    cJSON* appFirmware = cJSON_GetObjectItem(root, "app_firmware");
+    if (appFirmware && appFirmware->valuestring) {
+        firmwarePath = appFirmware->valuestring;
+    } else {
+        firmwarePath = "bootable_images/disting_NT.bin";
+    }
+
+    cJSON* sequence = cJSON_GetObjectItem(root, "flash_sequence");
+    if (sequence) {
+        if (!parseFlashScript(sequence, script)) {
+            cJSON_Delete(root);
+            return false;
+        }
+        logVerbose("Using flash sequence from MANIFEST.json (%zu ops)", script.size());
+    } else {
+        defaultFlashScript(script);
+    }
+
+    cJSON* list = cJSON_GetObjectItem(root, "images");
+    if (list && images) {
+        if (!parseManifestImages(list, *images)) {
+            cJSON_Delete(root);
+            return false;
+        }
+        logVerbose("MANIFEST.json lists %zu images", images->size());
+    }
+
+    cJSON_Delete(root);
+    return true;
+}
+
+// The extended manifest checked against the central directory: every image
+// listed must be in the package with the sizes and CRC given, inside its
+// flash region, and the firmware's flash sequence is validated for its size.
+// Nothing is inflated, so a mismatched package fails before any work.
+static bool checkManifestImages(mz_zip_archive& zip, FirmwarePackage* pkg, const std::string& firmwarePath) {
+    if (pkg->images.empty()) {
+        return true;
+    }
+    for (size_t i = 0; i < pkg->images.size(); i++) {
+        ManifestImage& image = pkg->images[i];
+        const char* name = image.name.c_str();
+        int fileIndex = mz_zip_reader_locate_file(&zip, name, NULL, 0);
+        mz_zip_archive_file_stat stat;
+        if (fileIndex < 0 || !mz_zip_reader_file_stat(&zip, (mz_uint)fileIndex, &stat)) {
+            logError("MANIFEST.json lists %s, which is not in the package", name);
+            return false;
+        }
+        if (((image.fields & kImageSize) && image.size != stat.m_uncomp_size) ||
+            ((image.fields & kImageCompressedSize) && image.compressedSize != stat.m_comp_size) ||
+            ((image.fields & kImageCrc32) && image.crc != stat.m_crc32)) {
+            logError("MANIFEST.json does not match the package: %s", name);
+            return false;
+        }
+        image.entryCrc = stat.m_crc32;
+
+        uint64_t size = stat.m_uncomp_size;
+        if (!image.sectorCrcs.empty() &&
+            image.sectorCrcs.size() != (size + FLASH_SECTOR_SIZE_DEFAULT - 1) / FLASH_SECTOR_SIZE_DEFAULT * 4) {
+            logError("MANIFEST.json: sector_crc32 of %s does not cover the image", name);
+            return false;
+        }
+        if (image.fields & kImageRegion) {
+            uint64_t regionEnd = (uint64_t)image.regionAddress + image.regionSize;
+            if (image.regionAddress < FLASH_BASE || regionEnd > (uint64_t)FLASH_BASE + FLASH_SIZE_DEFAULT) {
+                logError("MANIFEST.json: region of %s is outside flash", name);
+                return false;
+            }
+            if ((image.fields & kImageLoadAddress) &&
+                (image.loadAddress < image.regionAddress || image.loadAddress + size > regionEnd)) {
+                logError("MANIFEST.json: %s (%llu bytes at 0x%08X) does not fit its region", name,
+                         (unsigned long long)size, image.loadAddress);
+                return false;
+            }
+        }
+
+        if (image.name != firmwarePath) {
+            continue;
+        }
+        for (size_t op = 0; op < pkg->script.size(); op++) {
+            if (pkg->script[op].kind == FlashScriptOp::kWrite && (image.fields & kImageLoadAddress) &&
+                pkg->script[op].address != image.loadAddress) {
+                logError("MANIFEST.json: %s loads at 0x%08X but the flash sequence writes it at 0x%08X", name,
+                         image.loadAddress, pkg->script[op].address);
+                return false;
+            }
+        }
+        if (!validateFlashScript(pkg->script, (uint32_t)size)) {
+            return false;
+        }
+    }
+    logVerbose("MANIFEST.json images match the package");
+    return true;
+}
+
+// The firmware as listed by the extended manifest, if it is
+static const ManifestImage* manifestImage(const FirmwarePackage* pkg, const std::string& firmwarePath) {
+    for (size_t i = 0; i < pkg->images.size(); i++) {
+        if (pkg->images[i].name == firmwarePath) {
+            return &pkg->images[i];
+        }
+    }
+    return nullptr;
+}
+
+// The manifest's SHA-256 against the image's: a package whose manifest
+// describes another image (a stale one, say) is rejected
+static bool checkManifestHash(const ManifestImage* image, const std::string& sha256) {
+    if (image && !image->sha256.empty() && image->sha256 != sha256) {
+        logError("MANIFEST.json: sha256 of %s does not match the image", image->name.c_str());
+        return false;
+    }
+    return true;
+}
+
+// GF(2) matrix times vector and matrix squared, as in zlib's crc32_combine()
+static uint32_t gf2Times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (int n = 0; vec; n++, vec >>= 1) {
+        if (vec & 1) {
+            sum ^= mat[n];
+        }
+    }
+    return sum;
+}
+
+static void gf2Square(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2Times(mat, mat[n]);
+    }
+}
+
+// A CRC-32 carried through len zero bytes: crc32Shift(crc(A), len(B)) ^ crc(B)
+// is crc(AB)
+static uint32_t crc32Shift(uint32_t crc, size_t len) {
+    uint32_t odd[32], even[32];
+    odd[0] = 0xEDB88320;  // One zero bit
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2Square(even, odd);  // Two
+    gf2Square(odd, even);  // Four
+    while (len) {
+        gf2Square(even, odd);
+        if (len & 1) {
+            crc = gf2Times(even, crc);
+        }
+        len >>= 1;
+        if (!len) {
+            break;
+        }
+        gf2Square(odd, even);
+        if (len & 1) {
+            crc = gf2Times(odd, crc);
+        }
+        len >>= 1;
+    }
+    return crc;
+}
+
+// The manifest's sector CRCs against the image without a pass over it:
+// chained over the full sectors and the image's unpadded tail, they must give
+// the CRC-32 the ZIP holds for the image (which inflating it checks). The
+// listed CRC of a partial last sector is of it padded, so it is checked
+// against the tail directly.
+static bool checkManifestSectorCrcs(const ManifestImage* image, const uint8_t* tail, size_t tailSize) {
+    const std::vector<uint8_t>& listed = image->sectorCrcs;
+    uint32_t sectorShift[32];
+    for (int n = 0; n < 32; n++) {
+        sectorShift[n] = crc32Shift(1u << n, FLASH_SECTOR_SIZE_DEFAULT);
+    }
+    size_t fullSectors = listed.size() / 4 - (tailSize ? 1 : 0);
+    uint32_t crc = 0;  // Of no bytes
+    for (size_t i = 0; i < fullSectors; i++) {
+        const uint8_t* p = &listed[i * 4];
+        crc = gf2Times(sectorShift, crc) ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+    }
+    bool match = true;
+    if (tailSize) {
+        std::vector<uint8_t> last;
+        appendSectorDigest(last, kDigestCrc32, tail, tailSize, FLASH_SECTOR_SIZE_DEFAULT);
+        match = std::equal(last.begin(), last.end(), listed.end() - 4);
+        crc = crc32Shift(crc, tailSize) ^ (uint32_t)mz_crc32(MZ_CRC32_INIT, tail, tailSize);
+    }
+    if (!match || crc != image->entryCrc) {
+        logError("MANIFEST.json: sector_crc32 of %s does not match the image", image->name.c_str());
+        return false;
+    }
+    return true;
+}
+
+static const char* const FLASHLOADER_ENTRY = "bootable_images/unsigned_MIMXRT1060_flashloader.bin";
+
+// Check the sequence against the image and compile it; runs is the image's
+// sparse write plan
+static bool compilePackage(FirmwarePackage* pkg, const std::vector<WriteRun>& runs) {
+    if (!validateFlashScript(pkg->script, pkg->firmwareSize)) {
+        return false;
+    }
+    optimizeFlashScript(pkg->script, pkg->firmwareSize);
+    compileFlashProgram(pkg->script, pkg->firmwareSize, runs, pkg->program);
+    logVerbose("Flash program: %zu steps, %llu bytes to write, %llu blank bytes skipped",
+               pkg->program.steps.size(), (unsigned long long)pkg->program.writeBytes,
+               (unsigned long long)pkg->program.skippedBytes);
+    return true;
+}
+
+// Inflate a streamed firmware once, a sector at a time, to plan its sparse
+// write, hash it, check its CRC and, for --verify, take its sector CRCs
+// (those the manifest lists, once checked, are used instead). The whole
+// image is never held. build, if given, receives the inflate index.
+static bool scanStreamedFirmware(FirmwarePackage* pkg, const ManifestImage* listed, std::vector<WriteRun>& runs,
+                                 InflateIndex* build) {
+    ImageStream image(pkg, build);
+    bool adopting = listed && !listed->sectorCrcs.empty();
+    bool digesting = g_verifyWrites && !adopting;
+    std::vector<uint8_t> sectorCrcs;
+    std::vector<uint8_t> tail;  // Partial last sector
+    Sha256 hash;
+    mz_ulong crc = MZ_CRC32_INIT;
+    for (size_t offset = 0; offset < pkg->firmwareSize; offset += FLASH_SECTOR_SIZE_DEFAULT) {
+        size_t size = std::min((size_t)FLASH_SECTOR_SIZE_DEFAULT, pkg->firmwareSize - offset);
+        const uint8_t* data = image.read(offset, size);
+        if (!data) {
+            return false;
+        }
+        hash.update(data, size);
+        crc = mz_crc32(crc, data, size);
+        planSparseSector(runs, offset, data, size);
+        if (digesting) {
+            appendSectorDigest(sectorCrcs, kDigestCrc32, data, size, FLASH_SECTOR_SIZE_DEFAULT);
+        }
+        if (size < FLASH_SECTOR_SIZE_DEFAULT) {
+            tail.assign(data, data + size);
+        }
+    }
+    if (crc != pkg->stream.crc) {
+        logError("Firmware image is corrupt (CRC mismatch): %s", pkg->stream.name.c_str());
+        return false;
+    }
+    pkg->firmwareHash = hash.hexDigest();
+    if (!checkManifestHash(listed, pkg->firmwareHash)) {
+        return false;
+    }
+    if (adopting) {
+        if (!checkManifestSectorCrcs(listed, tail.data(), tail.size())) {
+            return false;
+        }
+        sectorCrcs = listed->sectorCrcs;
+    }
+    if (g_verifyWrites) {
+        pkg->sectorCrcs.swap(sectorCrcs);
+    }
+    return true;
+}
+
+// Streaming mode: only the manifest and the flashloader are extracted. Each
+// device inflates the firmware from the package as it writes it, so memory
+// does not grow with the image. The inflate index comes from indexPath if
+// it holds one for this image, and is built and saved there otherwise.
+static FirmwarePackage* loadStreamedPackage(const char* zipPath, const char* indexPath) {
+    FirmwarePackage* pkg = new FirmwarePackage();
+
+    logInfo("Loading firmware package: %s (streamed)", zipPath);
+    machineStatus("LOAD", 0, "Loading firmware package");
+
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+    if (!mz_zip_reader_init_file(&zip, zipPath, 0)) {
+        logError("Failed to open ZIP archive: %s", zipPath);
+        delete pkg;
+        return nullptr;
+    }
+    std::vector<uint8_t> manifestData;
+    std::string firmwareBinPath;
+    bool ok = extractFromArchive(zip, "MANIFEST.json", manifestData) &&
+              parseManifest(manifestData, firmwareBinPath, pkg->script, &pkg->images) &&
+              checkManifestImages(zip, pkg, firmwareBinPath) &&
+              extractFromArchive(zip, FLASHLOADER_ENTRY, pkg->flashloader);
+    mz_zip_reader_end(&zip);
+    if (!ok || !locateEntry(absolutePath(zipPath), firmwareBinPath, pkg->stream, pkg->firmwareSize)) {
+        delete pkg;
+        return nullptr;
+    }
+
+    InflateIndex index;
+    bool cached = pkg->stream.deflated && indexPath && readInflateIndex(indexPath, pkg, index);
+    std::vector<WriteRun> runs;
+    if (!scanStreamedFirmware(pkg, manifestImage(pkg, firmwareBinPath), runs, pkg->stream.deflated && !cached ? &index : nullptr)) {
+        delete pkg;
+        return nullptr;
+    }
+    if (pkg->stream.deflated && !cached && indexPath) {
+        writeInflateIndex(indexPath, pkg, index);
+    }
+    pkg->stream.index.swap(index);
+    logVerbose("Firmware SHA-256: %s", pkg->firmwareHash.c_str());
+    if (pkg->stream.deflated) {
+        logVerbose("Inflate index: %zu checkpoints%s", pkg->stream.index.size(), cached ? " (cached)" : "");
+    }
+
+    pkg->flashloaderPath = saveToTempFile(pkg->flashloader, ".bin");
+    if (pkg->flashloaderPath.empty()) {
+        logError("Failed to create temporary files");
+        delete pkg;
+        return nullptr;
+    }
+    if (!compilePackage(pkg, runs)) {
+        delete pkg;
+        return nullptr;
+    }
+
+    pkg->valid = true;
+    logInfo("Package loaded: flashloader=%zu bytes, firmware=%u bytes (streamed)",
+            pkg->flashloader.size(), pkg->firmwareSize);
+    return pkg;
+}
+
+// Load firmware package from ZIP file
+FirmwarePackage* loadFirmwarePackage(const char* zipPath, const char* indexPath) {
+    if (g_streamFirmware) {
+        return loadStreamedPackage(zipPath, indexPath);
+    }
+    FirmwarePackage* pkg = new FirmwarePackage();
+
+    logInfo("Loading firmware package: %s", zipPath);
+    machineStatus("LOAD", 0, "Loading firmware package");
+
+    std::vector<uint8_t> zipData;
+    if (!loadFile(zipPath, zipData)) {
+        delete pkg;
+        return nullptr;
+    }
+
+    // One pass over the central directory serves every entry
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+    if (!mz_zip_reader_init_mem(&zip, zipData.data(), zipData.size(), 0)) {
+        logError("Failed to open ZIP archive");
+        delete pkg;
+        return nullptr;
+    }
+
+    // Parse manifest, check the images it lists, then extract the flashloader
+    // and the firmware
+    std::vector<uint8_t> manifestData;
+    std::string firmwareBinPath;
+    bool ok = extractFromArchive(zip, "MANIFEST.json", manifestData, &zipData) &&
+              parseManifest(manifestData, firmwareBinPath, pkg->script, &pkg->images) &&
+              checkManifestImages(zip, pkg, firmwareBinPath) &&
+              extractFromArchive(zip, FLASHLOADER_ENTRY, pkg->flashloader, &zipData) &&
+              extractFromArchive(zip, firmwareBinPath.c_str(), pkg->firmware, &zipData);
+    mz_zip_reader_end(&zip);
+    if (!ok) {
+        delete pkg;
+        return nullptr;
+    }
+    pkg->firmwareSize = (uint32_t)pkg->firmware.size();
+
+    // Save to temp file (BLFWK needs a file path for the SDP write-file command).
+    // The firmware itself is written from memory by the compiled program.
+    pkg->flashloaderPath = saveToTempFile(pkg->flashloader, ".bin");
+
+    if (pkg->flashloaderPath.empty()) {
+        logError("Failed to create temporary files");
+        delete pkg;
+        return nullptr;
+    }
+
+    if (!compilePackage(pkg, planSparseWrite(pkg->firmware, FLASH_SECTOR_SIZE_DEFAULT))) {
+        delete pkg;
+        return nullptr;
+    }
+
+    pkg->firmwareHash = sha256Hex(pkg->firmware.data(), pkg->firmware.size());
+    logVerbose("Firmware SHA-256: %s", pkg->firmwareHash.c_str());
+    const ManifestImage* listed = manifestImage(pkg, firmwareBinPath);
+    if (!checkManifestHash(listed, pkg->firmwareHash)) {
+        delete pkg;
+        return nullptr;
+    }
+    if (listed && !listed->sectorCrcs.empty()) {
+        size_t tailSize = pkg->firmware.size() % FLASH_SECTOR_SIZE_DEFAULT;
+        if (!checkManifestSectorCrcs(listed, pkg->firmware.data() + pkg->firmware.size() - tailSize, tailSize)) {
+            delete pkg;
+            return nullptr;
+        }
+        if (g_verifyWrites) {
+            pkg->sectorCrcs = listed->sectorCrcs;
+        }
+    } else if (g_verifyWrites) {
+        digestSectors(pkg->firmware, pkg->sectorCrcs);
+    }
+
+    pkg->valid = true;
+    logInfo("Package loaded: flashloader=%zu bytes, firmware=%zu bytes",
+            pkg->flashloader.size(), pkg->firmware.size());
+
+    return pkg;
+}
+
+void syntheticImage(std::vector<uint8_t>& image, uint32_t size, uint32_t seed) {
+    image.resize(size);
+    uint32_t x = seed ? seed : 1;
+    for (uint32_t i = 0; i < size; i++) {
+        if ((i / FLASH_SECTOR_SIZE_DEFAULT) % 8 == 7) {
+            image[i] = 0xFF;
+            continue;
+        }
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        image[i] = (uint8_t)x;
+    }
+}
+
+FirmwarePackage* syntheticFirmwarePackage(uint32_t firmwareSize, uint32_t flashloaderSize) {
+    FirmwarePackage* pkg = new FirmwarePackage();
+    logInfo("Synthetic firmware package: flashloader=%u bytes, firmware=%u bytes", flashloaderSize, firmwareSize);
+
+    syntheticImage(pkg->flashloader, flashloaderSize, 0x10AD);
+    syntheticImage(pkg->firmware, firmwareSize, 0xF1A5);
+    pkg->firmwareSize = firmwareSize;
+    defaultFlashScript(pkg->script);
+    if (!validateFlashScript(pkg->script, firmwareSize)) {
+        delete pkg;
+        return nullptr;
+    }
+    optimizeFlashScript(pkg->script, firmwareSize);
+    compileFlashProgram(pkg->script, pkg->firmware, pkg->program);
+    pkg->firmwareHash = sha256Hex(pkg->firmware.data(), pkg->firmware.size());
+    if (g_verifyWrites) {
+        digestSectors(pkg->firmware, pkg->sectorCrcs);
+    }
+    pkg->version = "synthetic";
+    pkg->valid = true;
+    return pkg;
+}
+
+//------------------------------------------------------------------------------
+// Download Functions
+//------------------------------------------------------------------------------
+
+// Download a file using system curl
+bool downloadFile(const char* url, const char* destPath) {
+    logInfo("Downloading: %s", url);
+    machineStatus("DOWNLOAD", 0, "Downloading firmware");
+
+    char cmd[2048];
+#ifdef WIN32
+    snprintf(cmd, sizeof(cmd), "curl.exe -L -s -o \"%s\" \"%s\"", destPath, url);
+#else
+    snprintf(cmd, sizeof(cmd), "curl -L -s -o \"%s\" \"%s\"", destPath, url);
+#endif
+
+    int ret = system(cmd);
+    if (ret != 0) {
+        logError("Download failed (curl exit code: %d)", ret);
+        return false;
+    }
+
+    logVerbose("Downloaded to: %s", destPath);
+    return true;
+}
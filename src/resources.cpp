@@ -0,0 +1,218 @@
+/*
+ * NT Flash Tool - Memory and CPU accounting (--stats=resources)
+ *
+ * Copyright (c) 2024
+ */
+
+#include "nt_flash.h"
+
+#if defined(WIN32)
+#include <windows.h>
+#include <psapi.h>
+#elif defined(MACOSX)
+#include <sys/resource.h>
+#include <mach/mach.h>
+#else
+#include <sys/resource.h>
+#endif
+
+//------------------------------------------------------------------------------
+// Resource Accounting
+//------------------------------------------------------------------------------
+
+// Updated by the allocator hook linked into the CLI (alloc_hook.cpp). In
+// libntflash nothing installs it and the heap figures stay at zero.
+std::atomic<bool> g_allocHookInstalled(false);
+std::atomic<uint64_t> g_heapAllocations(0);
+std::atomic<uint64_t> g_heapAllocatedBytes(0);
+std::atomic<int64_t> g_heapLiveBytes(0);
+std::atomic<int64_t> g_heapPeakBytes(0);
+thread_local uint64_t g_threadAllocations = 0;
+thread_local uint64_t g_threadAllocatedBytes = 0;
+
+namespace {
+
+struct StageUsage {
+    uint32_t samples;
+    double userSeconds;
+    double systemSeconds;
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+
+    StageUsage() : samples(0), userSeconds(0), systemSeconds(0), allocations(0), allocatedBytes(0) {}
+};
+
+bool g_resourceStats = false;
+std::mutex g_stageMutex;
+std::map<std::string, StageUsage> g_stages;
+std::vector<std::string> g_stageOrder;     // First seen first
+
+// Open stage of the single-device flow running on this thread
+thread_local const char* g_resourceStage = nullptr;
+thread_local ResourceSample g_resourceStageStart;
+
+// CPU time of the calling thread
+void threadCpuTimes(double& user, double& system) {
+#if defined(WIN32)
+    FILETIME created, exited, kernel, userTime;
+    GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &userTime);
+    user = (((uint64_t)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime) / 1e7;
+    system = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 1e7;
+#elif defined(MACOSX)
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    mach_port_t thread = mach_thread_self();
+    thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&info, &count);
+    mach_port_deallocate(mach_task_self(), thread);
+    user = info.user_time.seconds + info.user_time.microseconds / 1e6;
+    system = info.system_time.seconds + info.system_time.microseconds / 1e6;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#endif
+}
+
+uint64_t peakRssBytes() {
+#if defined(WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))
+               ? counters.PeakWorkingSetSize : 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(MACOSX)
+    return (uint64_t)usage.ru_maxrss;          // Bytes
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;   // Kilobytes
+#endif
+#endif
+}
+
+void addUsage(const char* stage, const ResourceSample& start, const ResourceSample& end) {
+    std::lock_guard<std::mutex> lock(g_stageMutex);
+    std::map<std::string, StageUsage>::iterator it = g_stages.find(stage);
+    if (it == g_stages.end()) {
+        it = g_stages.insert(std::make_pair(std::string(stage), StageUsage())).first;
+        g_stageOrder.push_back(stage);
+    }
+    StageUsage& usage = it->second;
+    usage.samples++;
+    usage.userSeconds += end.userSeconds - start.userSeconds;
+    usage.systemSeconds += end.systemSeconds - start.systemSeconds;
+    usage.allocations += end.allocations - start.allocations;
+    usage.allocatedBytes += end.allocatedBytes - start.allocatedBytes;
+}
+
+double mb(double bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+} // namespace
+
+void enableResourceStats() {
+    g_resourceStats = true;
+}
+
+bool resourceStatsEnabled() {
+    return g_resourceStats;
+}
+
+// CPU time of the whole process, every thread included
+void processCpuTimes(double& user, double& system) {
+#if defined(WIN32)
+    FILETIME created, exited, kernel, userTime;
+    GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &userTime);
+    user = (((uint64_t)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime) / 1e7;
+    system = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 1e7;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#endif
+}
+
+bool processContextSwitches(uint64_t& voluntary, uint64_t& involuntary) {
+#if defined(WIN32)
+    voluntary = 0;
+    involuntary = 0;
+    return false;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    voluntary = (uint64_t)usage.ru_nvcsw;
+    involuntary = (uint64_t)usage.ru_nivcsw;
+    return true;
+#endif
+}
+
+ResourceSample sampleThreadResources() {
+    ResourceSample sample;
+    threadCpuTimes(sample.userSeconds, sample.systemSeconds);
+    sample.allocations = g_threadAllocations;
+    sample.allocatedBytes = g_threadAllocatedBytes;
+    return sample;
+}
+
+ResourceScope::ResourceScope(const char* stage) : m_stage(g_resourceStats ? stage : nullptr) {
+    if (m_stage) {
+        m_start = sampleThreadResources();
+    }
+}
+
+ResourceScope::~ResourceScope() {
+    if (m_stage) {
+        addUsage(m_stage, m_start, sampleThreadResources());
+    }
+}
+
+// Close the stage open on this thread (if any) and open the next; nullptr
+// just closes it
+void resourceStage(const char* stage) {
+    if (!g_resourceStats) {
+        return;
+    }
+    ResourceSample now = sampleThreadResources();
+    if (g_resourceStage) {
+        addUsage(g_resourceStage, g_resourceStageStart, now);
+    }
+    g_resourceStage = stage;
+    g_resourceStageStart = now;
+}
+
+// Each status of an accounted single-device flow starts a new stage
+void resourceStatus(const char* stage) {
+    if (g_resourceStage) {
+        resourceStage(stage);
+    }
+}
+
+void printResourceStats() {
+    double user;
+    double system;
+    processCpuTimes(user, system);
+
+    printf("\nResources:\n");
+    printf("  Peak RSS:          %.1f MB\n", mb((double)peakRssBytes()));
+    if (g_allocHookInstalled) {
+        printf("  Heap allocations:  %llu (%.1f MB)\n", (unsigned long long)g_heapAllocations.load(),
+               mb((double)g_heapAllocatedBytes.load()));
+        printf("  Peak heap in use:  %.1f MB (%.1f MB at exit)\n", mb((double)g_heapPeakBytes.load()),
+               mb((double)g_heapLiveBytes.load()));
+    }
+    printf("  CPU time:          %.3fs user, %.3fs system\n", user, system);
+
+    std::lock_guard<std::mutex> lock(g_stageMutex);
+    if (!g_stageOrder.empty()) {
+        printf("\n  %-16s %6s %10s %10s %8s %10s\n", "Stage", "Count", "User", "System", "Allocs", "Alloc MB");
+        for (size_t i = 0; i < g_stageOrder.size(); i++) {
+            const StageUsage& usage = g_stages[g_stageOrder[i]];
+            printf("  %-16s %6u %9.3fs %9.3fs %8llu %10.2f\n", g_stageOrder[i].c_str(), usage.samples,
+                   usage.userSeconds, usage.systemSeconds, (unsigned long long)usage.allocations,
+                   mb((double)usage.allocatedBytes));
+        }
+    }
+    fflush(stdout);
+}
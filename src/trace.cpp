@@ -0,0 +1,168 @@
+/*
+ * NT Flash Tool - Chrome trace-event timeline
+ *
+ * Copyright (c) 2024
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "nt_flash.h"
+
+//------------------------------------------------------------------------------
+// Trace
+//------------------------------------------------------------------------------
+
+// Events go into a buffer allocated up front and claimed with one atomic
+// increment, so recording takes no lock and no allocation. Names are copied
+// in, so they need not outlive the engine or the package.
+
+namespace {
+
+struct TraceEvent {
+    char phase;               // 'X' span or 'i' instant
+    char name[40];
+    char category[12];
+    char track[24];           // USB port, one timeline row per device
+    double start;
+    double end;
+};
+
+std::vector<TraceEvent> g_events;
+std::atomic<size_t> g_eventCount(0);
+std::atomic<bool> g_tracing(false);
+std::string g_tracePath;
+double g_traceOrigin = 0;
+
+// Open stage of the single-device flow running on this thread
+thread_local const char* g_traceStage = nullptr;
+thread_local double g_traceStageStarted = 0;
+
+void copyName(char* dest, size_t size, const char* src) {
+    strncpy(dest, src ? src : "", size - 1);
+    dest[size - 1] = '\0';
+}
+
+void record(char phase, const char* track, const char* name, const char* category, double start, double end) {
+    size_t index = g_eventCount.fetch_add(1);
+    if (index >= g_events.size()) {
+        return;
+    }
+    TraceEvent& event = g_events[index];
+    event.phase = phase;
+    copyName(event.name, sizeof(event.name), name);
+    copyName(event.category, sizeof(event.category), category);
+    copyName(event.track, sizeof(event.track), track ? track : (g_deviceTag ? g_deviceTag : "device"));
+    event.start = start;
+    event.end = end;
+}
+
+} // namespace
+
+void startTrace(const std::string& path) {
+    g_tracePath = path;
+    g_events.resize(TRACE_MAX_EVENTS);
+    g_traceOrigin = nowSeconds();
+    g_tracing = true;
+}
+
+bool traceEnabled() {
+    return g_tracing.load(std::memory_order_relaxed);
+}
+
+void traceSpan(const char* track, const char* name, const char* category, double start, double end) {
+    if (traceEnabled()) {
+        record('X', track, name, category, start, end);
+    }
+}
+
+void traceInstant(const char* track, const char* name, const char* category) {
+    if (traceEnabled()) {
+        double now = nowSeconds();
+        record('i', track, name, category, now, now);
+    }
+}
+
+// Close the stage open on this thread (if any) and open the next; nullptr
+// just closes it
+void traceStage(const char* stage) {
+    if (!traceEnabled()) {
+        return;
+    }
+    double now = nowSeconds();
+    if (g_traceStage) {
+        record('X', nullptr, g_traceStage, "stage", g_traceStageStarted, now);
+    }
+    g_traceStage = stage;
+    g_traceStageStarted = now;
+}
+
+// Each status of a traced single-device flow starts a new stage
+void traceStatus(const char* stage) {
+    if (g_traceStage) {
+        traceStage(stage);
+    }
+}
+
+// Chrome trace-event JSON, for chrome://tracing or ui.perfetto.dev
+bool writeTrace() {
+    if (!g_tracing.exchange(false)) {
+        return true;
+    }
+    size_t count = std::min(g_eventCount.load(), g_events.size());
+    if (g_eventCount.load() > g_events.size()) {
+        logInfo("WARNING: Trace buffer full, %zu events dropped",
+                g_eventCount.load() - g_events.size());
+    }
+
+    // One thread id per track, in order of first appearance
+    std::map<std::string, int> tracks;
+    cJSON* events = cJSON_CreateArray();
+    for (size_t i = 0; i < count; i++) {
+        const TraceEvent& event = g_events[i];
+        std::map<std::string, int>::iterator track = tracks.find(event.track);
+        if (track == tracks.end()) {
+            int tid = (int)tracks.size() + 1;
+            track = tracks.insert(std::make_pair(std::string(event.track), tid)).first;
+            cJSON* meta = cJSON_CreateObject();
+            cJSON_AddStringToObject(meta, "name", "thread_name");
+            cJSON_AddStringToObject(meta, "ph", "M");
+            cJSON_AddNumberToObject(meta, "pid", 1);
+            cJSON_AddNumberToObject(meta, "tid", tid);
+            cJSON_AddStringToObject(cJSON_AddObjectToObject(meta, "args"), "name", event.track);
+            cJSON_AddItemToArray(events, meta);
+        }
+
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", event.name);
+        cJSON_AddStringToObject(item, "cat", event.category);
+        char phase[2] = { event.phase, '\0' };
+        cJSON_AddStringToObject(item, "ph", phase);
+        cJSON_AddNumberToObject(item, "ts", floor((event.start - g_traceOrigin) * 1e6));
+        if (event.phase == 'X') {
+            cJSON_AddNumberToObject(item, "dur", floor((event.end - event.start) * 1e6));
+        } else {
+            cJSON_AddStringToObject(item, "s", "t");
+        }
+        cJSON_AddNumberToObject(item, "pid", 1);
+        cJSON_AddNumberToObject(item, "tid", track->second);
+        cJSON_AddItemToArray(events, item);
+    }
+
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "traceEvents", events);
+    cJSON_AddStringToObject(root, "displayTimeUnit", "ms");
+    char* json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+
+    FILE* f = fopen(g_tracePath.c_str(), "wb");
+    bool ok = f && fputs(json, f) >= 0;
+    if (f) ok = fclose(f) == 0 && ok;
+    cJSON_free(json);
+    if (!ok) {
+        logError("Failed to write trace: %s", g_tracePath.c_str());
+        return false;
+    }
+    logVerbose("Trace written to %s (%zu events)", g_tracePath.c_str(), count);
+    return true;
+}
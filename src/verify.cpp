@@ -0,0 +1,161 @@
+/*
+ * NT Flash Tool - Checking the flash after writing it (--verify)
+ *
+ * Copyright (c) 2024
+ *
+ * A package's own flashloader may offer flash digests (see
+ * BootloaderOperations::connect()): the device hashes its sectors and only
+ * the digests cross USB. Otherwise the image is read back and compared.
+ */
+
+#include <algorithm>
+
+#include "nt_flash.h"
+
+#include "miniz.h"
+
+//------------------------------------------------------------------------------
+// Sector Digests
+//------------------------------------------------------------------------------
+
+void appendSectorDigest(std::vector<uint8_t>& digests, DigestKind kind, const uint8_t* data, size_t size,
+                        uint32_t sectorSize) {
+    std::vector<uint8_t> padded;
+    if (size < sectorSize) {
+        padded.assign(sectorSize, 0xFF);
+        memcpy(padded.data(), data, size);
+        data = padded.data();
+        size = sectorSize;
+    }
+    if (kind == kDigestCrc32) {
+        uint32_t crc = (uint32_t)mz_crc32(MZ_CRC32_INIT, data, size);
+        for (int i = 0; i < 4; i++) {
+            digests.push_back((uint8_t)(crc >> (i * 8)));
+        }
+    } else {
+        uint8_t digest[32];
+        Sha256 hash;
+        hash.update(data, size);
+        hash.digest(digest);
+        digests.insert(digests.end(), digest, digest + sizeof(digest));
+    }
+}
+
+// Digests of the image's sectors; false (error logged) if it cannot be read
+static bool imageDigests(ImageStream& image, size_t imageSize, DigestKind kind, uint32_t sectorSize,
+                         std::vector<uint8_t>& digests) {
+    digests.clear();
+    for (size_t offset = 0; offset < imageSize; offset += sectorSize) {
+        size_t size = std::min((size_t)sectorSize, imageSize - offset);
+        const uint8_t* data = image.read(offset, size);
+        if (!data) {
+            return false;
+        }
+        appendSectorDigest(digests, kind, data, size, sectorSize);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Verification
+//------------------------------------------------------------------------------
+
+// read-memory only delivers into a file, so reads pass through one scratch file
+static bool readFlash(BootloaderOperations& bl, uint32_t address, uint32_t size, const std::string& path,
+                      std::vector<uint8_t>& data) {
+    return bl.readMemory(address, size, path, 0) && loadFile(path.c_str(), data) && data.size() == size;
+}
+
+// Compare the device's digests of the sectors under the image with the host's
+static bool verifyDigests(BootloaderOperations& bl, const FirmwarePackage* pkg, ImageStream& image,
+                          uint32_t base, const std::string& path) {
+    const FlashDigest& device = bl.flashDigest();
+    DigestKind kind = device.crc32View ? kDigestCrc32 : kDigestSha256;
+    uint32_t view = device.crc32View ? device.crc32View : device.sha256View;
+    uint32_t sectors = (uint32_t)((pkg->firmwareSize + device.sectorSize - 1) / device.sectorSize);
+    size_t size = digestSize(kind);
+
+    // The package's CRCs serve when the device uses the same sectors
+    std::vector<uint8_t> computed;
+    const std::vector<uint8_t>* expected = &pkg->sectorCrcs;
+    if (kind != kDigestCrc32 || device.sectorSize != FLASH_SECTOR_SIZE_DEFAULT || pkg->sectorCrcs.empty()) {
+        if (!imageDigests(image, pkg->firmwareSize, kind, device.sectorSize, computed)) {
+            return false;
+        }
+        expected = &computed;
+    }
+
+    std::vector<uint8_t> reported;
+    uint32_t first = (base - FLASH_BASE) / device.sectorSize;
+    if (!readFlash(bl, view + first * (uint32_t)size, sectors * (uint32_t)size, path, reported)) {
+        logError("Failed to read flash digests");
+        return false;
+    }
+    for (uint32_t i = 0; i < sectors; i++) {
+        if (memcmp(&reported[i * size], &(*expected)[i * size], size) != 0) {
+            logError("Verify failed: sector at 0x%08X differs from the image", base + i * device.sectorSize);
+            return false;
+        }
+    }
+    logVerbose("Verified %u sectors by %s digest", sectors, kind == kDigestCrc32 ? "CRC32" : "SHA-256");
+    return true;
+}
+
+// Read the image back a chunk at a time and compare it
+static bool verifyReadBack(BootloaderOperations& bl, const FirmwarePackage* pkg, ImageStream& image,
+                           uint32_t base, const std::string& path) {
+    int chunks = (int)((pkg->firmwareSize + VERIFY_CHUNK_SIZE - 1) / VERIFY_CHUNK_SIZE);
+    std::vector<uint8_t> flash;
+    for (int i = 0; i < chunks; i++) {
+        size_t offset = (size_t)i * VERIFY_CHUNK_SIZE;
+        uint32_t len = (uint32_t)std::min((size_t)VERIFY_CHUNK_SIZE, pkg->firmwareSize - offset);
+        if (!readFlash(bl, base + (uint32_t)offset, len, path, flash)) {
+            logError("Failed to read flash at 0x%08X", base + (uint32_t)offset);
+            return false;
+        }
+        const uint8_t* data = image.read(offset, len);
+        if (!data) {
+            return false;
+        }
+        if (memcmp(flash.data(), data, len) != 0) {
+            size_t at = std::mismatch(flash.begin(), flash.end(), data).first - flash.begin();
+            logError("Verify failed: flash at 0x%08X differs from the image", base + (uint32_t)(offset + at));
+            return false;
+        }
+        displayProgress((i + 1) * 100 / chunks, i + 1, chunks);
+    }
+    logVerbose("Verified %zu bytes by read-back", pkg->firmwareSize);
+    return true;
+}
+
+bool verifyFlash(BootloaderOperations& bl, const FirmwarePackage* pkg, ImageStream& image) {
+    // Where the program put the image: every payload write is a slice of it
+    const FlashStep* write = nullptr;
+    for (size_t i = 0; i < pkg->program.steps.size() && !write; i++) {
+        if (pkg->program.steps[i].args.empty()) {
+            write = &pkg->program.steps[i];
+        }
+    }
+    if (!write) {
+        logVerbose("Nothing written, nothing to verify");
+        return true;
+    }
+    uint32_t base = write->address - (uint32_t)write->offset;
+
+    if (g_dryRun) {
+        logVerbose("[DRY RUN] Would verify %zu bytes at 0x%08X", pkg->firmwareSize, base);
+        return true;
+    }
+
+    std::string path = saveToTempFile(std::vector<uint8_t>(), ".bin");
+    if (path.empty()) {
+        logError("Failed to create temporary file");
+        return false;
+    }
+    const FlashDigest& digest = bl.flashDigest();
+    bool ok = digest.version && base >= FLASH_BASE && (base - FLASH_BASE) % digest.sectorSize == 0
+                  ? verifyDigests(bl, pkg, image, base, path)
+                  : verifyReadBack(bl, pkg, image, base, path);
+    remove(path.c_str());
+    return ok;
+}